@@ -29,6 +29,10 @@ extern "C"
 #include "ShaderData.hpp"
 #include "Texture.hpp"
 #include "Depth.hpp"
+#include "Memory.hpp"
+#include "FrameArena.hpp"
+#include "Staging.hpp"
+#include "HostAllocator.hpp"
 
 // グローバル変数や、アプリケーションの状態を管理するクラスのメンバーとして定義
 bool g_vulkanInitialized = false;
@@ -43,26 +47,26 @@ uint32_t queueFamilyIndex;
 std::vector<vk::QueueFamilyProperties> queueProps;
 std::shared_ptr<vk::UniqueDevice> device;
 vk::Queue graphicsQueue;
+std::optional<uint32_t> transferQueueFamilyIndex;
+uint32_t uploadQueueFamilyIndex;
+vk::Queue uploadQueue;
+std::shared_ptr<MemoryAllocator> memoryAllocator;
+std::shared_ptr<StagingRing> stagingRing;
+std::shared_ptr<UploadBatch> uploadBatch;
+vk::UniqueSemaphore uploadSemaphore;
+bool waitForUpload = false;
 std::shared_ptr<std::vector<vk::VertexInputBindingDescription>> vertexBindingDescription;
 std::shared_ptr<std::vector<vk::VertexInputAttributeDescription>> vertexInputDescription;
 std::shared_ptr<vk::UniqueBuffer> vertexBuf;
-std::shared_ptr<vk::UniqueDeviceMemory> vertexBufMem;
-std::shared_ptr<vk::UniqueBuffer> stagingVertexBuf;
-std::shared_ptr<vk::UniqueDeviceMemory> stagingVertexBufMem;
+std::shared_ptr<MemoryAllocation> vertexBufMem;
 std::shared_ptr<vk::UniqueBuffer> indexBuf;
-std::shared_ptr<vk::UniqueDeviceMemory> indexBufMem;
-std::shared_ptr<vk::UniqueBuffer> stagingIndexBuf;
-std::shared_ptr<vk::UniqueDeviceMemory> stagingIndexBufMem;
+std::shared_ptr<MemoryAllocation> indexBufMem;
 int imgWidth, imgHeight, imgCh;
 std::shared_ptr<vk::UniqueImage> texImage;
-std::shared_ptr<vk::UniqueDeviceMemory> imgBufMemory;
-std::shared_ptr<vk::UniqueBuffer> imgStagingBuf;
-std::shared_ptr<vk::UniqueDeviceMemory> imgStagingBufMemory;
+std::shared_ptr<MemoryAllocation> imgBufMemory;
 std::shared_ptr<vk::UniqueSampler> texSampler;
 std::shared_ptr<vk::UniqueImageView> texImageView;
-std::shared_ptr<vk::UniqueBuffer> uniformBuf;
-std::shared_ptr<vk::UniqueDeviceMemory> uniformBufMem;
-void* pUniformBufMem;
+std::shared_ptr<FrameArena> frameArena;
 std::shared_ptr<std::vector<vk::UniqueDescriptorSetLayout>> descSetLayouts;
 std::shared_ptr<std::vector<vk::DescriptorSetLayout>> unwrapedDescSetLayouts;
 std::shared_ptr<vk::UniqueDescriptorPool> descPool;
@@ -83,7 +87,7 @@ std::shared_ptr<vk::UniqueSwapchainKHR> swapchain;
 std::shared_ptr<std::vector<vk::Image>> swapchainImages;
 std::shared_ptr<std::vector<vk::UniqueImageView>> swapchainImageViews;
 std::shared_ptr<vk::UniqueImage> depthImage;
-std::shared_ptr<vk::UniqueDeviceMemory> depthImageMemory;
+std::shared_ptr<MemoryAllocation> depthImageMemory;
 std::shared_ptr<vk::UniqueImageView> depthImageView;
 std::shared_ptr<std::vector<vk::UniqueFramebuffer>> swapchainFramebufs;
 std::function<void(void)> recreateSwapchain;
@@ -94,8 +98,8 @@ vk::UniqueSemaphore swapchainImgSemaphore;
 vk::UniqueSemaphore imgRenderedSemaphore;
 vk::FenceCreateInfo fenceCreateInfo;
 vk::UniqueFence imgRenderedFence;
-std::chrono::system_clock::time_point sT;
-int deltaTime;
+std::chrono::steady_clock::time_point sT;
+float deltaTime;
 
 // Vulkanを初期化する関数
 void initVulkan(android_app* pApp) {
@@ -111,7 +115,7 @@ void initVulkan(android_app* pApp) {
     appInfo = getAppInfo();
     debugApplicationInfo(*appInfo);
 
-    instance = getInstance(*appInfo);
+    instance = getInstance(*appInfo, *getAndroidRequiredInstanceExtensions());
     surface = getSurface(*instance, pApp->window);
     physicalDevices = getPhysicalDevices(*instance);
     debugPhysicalDevices(*physicalDevices);
@@ -124,46 +128,55 @@ void initVulkan(android_app* pApp) {
     queueProps = physicalDevice.getQueueFamilyProperties();
     debugQueueFamilyProperties(queueProps);
 
-    device = getDevice(physicalDevice, queueFamilyIndex);
+    transferQueueFamilyIndex = findTransferQueueFamilyIndex(physicalDevice, queueFamilyIndex);
+    device = getDevice(physicalDevice, queueFamilyIndex, transferQueueFamilyIndex);
 
     graphicsQueue = device->get().getQueue(queueFamilyIndex, 0);
+    uploadQueueFamilyIndex = transferQueueFamilyIndex.value_or(queueFamilyIndex);
+    uploadQueue = device->get().getQueue(uploadQueueFamilyIndex, 0);
+
+    memoryAllocator = getMemoryAllocator(*device, physicalDevice);
+    stagingRing = getStagingRing(*device, uploadQueue, uploadQueueFamilyIndex, queueFamilyIndex, *memoryAllocator, 32 * 1024 * 1024);
 
     vertexBindingDescription = getVertexBindingDescription();
     vertexInputDescription = getVertexInputDescription();
 
+    // 所有権を移すアクワイアのバリアを最初のフレームで記録するまで残しておく
+    uploadBatch = std::make_shared<UploadBatch>(*stagingRing);
+
     vertexBuf = getVertexBuffer(*device);
-    vertexBufMem = getVertexBufferMemory(*device, physicalDevice, *vertexBuf);
-    stagingVertexBuf = getStagingVertexBuffer(*device, physicalDevice);
-    stagingVertexBufMem = getStagingVertexBufferMemory(*device, physicalDevice, *stagingVertexBuf);
-    writeStagingVertexBuffer(*device, *stagingVertexBufMem);
-    sendVertexBuffer(*device, queueFamilyIndex, graphicsQueue, *stagingVertexBuf, *vertexBuf);
+    vertexBufMem = getVertexBufferMemory(*device, *memoryAllocator, *vertexBuf);
+    if (vertexBufMem->pMapped != nullptr) {
+        writeVertexBuffer(*device, *vertexBufMem);
+    } else {
+        uploadVertexBuffer(*uploadBatch, *vertexBuf);
+    }
 
     indexBuf = getIndexBuffer(*device);
-    indexBufMem = getIndexBufferMemory(*device, physicalDevice, *indexBuf);
-    stagingIndexBuf = getStagingIndexBuffer(*device, physicalDevice);
-    stagingIndexBufMem = getStagingIndexBufferMemory(*device, physicalDevice, *stagingIndexBuf);
-    writeStagingIndexBuffer(*device, *stagingIndexBufMem);
-    sendIndexBuffer(*device, queueFamilyIndex, graphicsQueue, *stagingIndexBuf, *indexBuf);
+    indexBufMem = getIndexBufferMemory(*device, *memoryAllocator, *indexBuf);
+    if (indexBufMem->pMapped != nullptr) {
+        writeIndexBuffer(*device, *indexBufMem);
+    } else {
+        uploadIndexBuffer(*uploadBatch, *indexBuf);
+    }
 
     void *imgData = getImageData(pApp, &imgWidth, &imgHeight, &imgCh);
     texImage = getImage(*device, imgWidth, imgHeight, imgCh);
-    imgBufMemory = getImageMemory(*device, physicalDevice, *texImage);
-    imgStagingBuf = getStagingImageBuffer(*device, imgWidth, imgHeight, imgCh);
-    imgStagingBufMemory = getStagingImageMemory(*device, physicalDevice, *imgStagingBuf);
-    writeImageBuffer(*device, *imgStagingBufMemory, imgData, imgWidth, imgHeight, imgCh);
-    sendImageBuffer(*device, queueFamilyIndex, graphicsQueue, *imgStagingBuf, *texImage, imgWidth, imgHeight);
+    imgBufMemory = getImageMemory(*device, *memoryAllocator, *texImage);
+    uploadImageBuffer(*uploadBatch, imgData, *texImage, imgWidth, imgHeight, imgCh);
+    uploadSemaphore = device->get().createSemaphoreUnique(vk::SemaphoreCreateInfo(), getAllocationCallbacks(vk::ObjectType::eSemaphore));
+    uploadBatch->submit(uploadSemaphore.get());
+    waitForUpload = true;
     texSampler = getSampler(*device);
     texImageView = getImageView(*device, *texImage);
     releaseImageData(imgData);
 
-    uniformBuf = getUniformBuffer(*device);
-    uniformBufMem = getUniformBufferMemory(*device, physicalDevice, *uniformBuf);
-    pUniformBufMem = mapUniformBuffer(*device, *uniformBufMem);
+    frameArena = getFrameArena(*device, physicalDevice, *memoryAllocator, 1, 64 * 1024);
     descSetLayouts = getDiscriptorSetLayouts(*device);
     unwrapedDescSetLayouts = unwrapHandles<vk::DescriptorSetLayout, vk::UniqueDescriptorSetLayout>(*descSetLayouts);
     descPool = getDescriptorPool(*device);
     descSets = getDescprotorSets(*device, *descPool, *unwrapedDescSetLayouts);
-    writeDescriptorSets(*device, *descSets, *uniformBuf, *texImageView, *texSampler);
+    writeDescriptorSets(*device, *descSets, *frameArena, *texImageView, *texSampler);
     pushConstantRanges = getPushConstantRanges();
 
     descpriptorPipelineLayout = getDescpriptorPipelineLayout(*device, *unwrapedDescSetLayouts, *pushConstantRanges);
@@ -187,7 +200,7 @@ void initVulkan(android_app* pApp) {
             depthImageView->reset();
         }
         if (depthImageMemory) {
-            depthImageMemory->reset();
+            depthImageMemory.reset();
         }
         if (depthImage) {
             depthImage->reset();
@@ -205,8 +218,9 @@ void initVulkan(android_app* pApp) {
         swapchain = getSwapchain(*device, physicalDevice, *surface, *surfaceCapabilities,surfaceFormat, surfacePresentMode);
         swapchainImages = getSwapchainImages(*device, *swapchain);
         swapchainImageViews = getSwapchainImageViews(*device, *swapchain, *swapchainImages, surfaceFormat);
-        depthImage = getDepthImage(*device, physicalDevice, *surfaceCapabilities);
-        depthImageMemory = getDepthImageMemory(*device, physicalDevice, *depthImage);
+        depthImage = getDepthImage(*device, physicalDevice, *surfaceCapabilities, memoryAllocator->hasLazilyAllocatedMemory());
+        depthImageMemory = getDepthImageMemory(*device, *memoryAllocator, *depthImage);
+        debugTransientAttachmentMemory(*device, *depthImageMemory);
         depthImageView = getDepthImageView(*device, *renderPass, *depthImage);
         swapchainFramebufs = getFramebuffers(*device, *renderPass, *swapchainImageViews, *surfaceCapabilities, *depthImageView);
     };
@@ -216,14 +230,14 @@ void initVulkan(android_app* pApp) {
     cmdPool = getCommandPool(*device, queueFamilyIndex);
     cmdBufs = getCommandBuffer(*device, *cmdPool);
 
-    swapchainImgSemaphore = device->get().createSemaphoreUnique(semaphoreCreateInfo);
-    imgRenderedSemaphore = device->get().createSemaphoreUnique(semaphoreCreateInfo);
+    swapchainImgSemaphore = device->get().createSemaphoreUnique(semaphoreCreateInfo, getAllocationCallbacks(vk::ObjectType::eSemaphore));
+    imgRenderedSemaphore = device->get().createSemaphoreUnique(semaphoreCreateInfo, getAllocationCallbacks(vk::ObjectType::eSemaphore));
 
     fenceCreateInfo.flags = vk::FenceCreateFlagBits::eSignaled;
-    imgRenderedFence = device->get().createFenceUnique(fenceCreateInfo);
+    imgRenderedFence = device->get().createFenceUnique(fenceCreateInfo, getAllocationCallbacks(vk::ObjectType::eFence));
 
     deltaTime = 0;
-    sT = std::chrono::system_clock::time_point();
+    sT = std::chrono::steady_clock::time_point();
 
     g_vulkanInitialized = true; // 初期化完了フラグを立てる
 }
@@ -236,9 +250,8 @@ void terminateVulkan() {
 
     g_vulkanInitialized = false;
 
-    unmapUniformBuffer(*device, *uniformBufMem);
-
     graphicsQueue.waitIdle();
+    debugHostAllocator(hostAllocator);
 
     LOG("Vulkanを終了しました。");
 }
@@ -248,7 +261,7 @@ void drawFrame() {
     if (!g_vulkanInitialized) return;
     // ... acquireNextImageKHRからpresentKHRまで、描画ループの1回分の処理 ...
 
-    sT = std::chrono::system_clock::now();
+    sT = std::chrono::steady_clock::now();
 
     vk::Result waitForFencesResult = device->get().waitForFences({ imgRenderedFence.get() }, VK_TRUE, UINT64_MAX);
     if (waitForFencesResult != vk::Result::eSuccess)
@@ -257,6 +270,8 @@ void drawFrame() {
         exit(EXIT_FAILURE);
     }
 
+    frameArena->beginFrame(0);
+
     vk::ResultValue acquireImgResult = device->get().acquireNextImageKHR(swapchain->get(), UINT64_MAX, swapchainImgSemaphore.get());
 
     // 再作成処理
@@ -274,7 +289,7 @@ void drawFrame() {
 
     device->get().resetFences({ imgRenderedFence.get() });
 
-    writeUniformBuffer(pUniformBufMem, *device, *uniformBufMem, 1080, 2400, deltaTime);
+    uint32_t sceneDataOffset = writeUniformBuffer(*frameArena, 1080, 2400, deltaTime);
 
     uint32_t imgIndex = acquireImgResult.value;
 
@@ -283,6 +298,10 @@ void drawFrame() {
     vk::CommandBufferBeginInfo cmdBeginInfo;
     (*cmdBufs)[0]->begin(cmdBeginInfo);
 
+    if (waitForUpload) {
+        uploadBatch->recordAcquireBarriers((*cmdBufs)[0].get());
+    }
+
     vk::ClearValue clearVal[2];
     clearVal[0].color.float32[0] = 0.3f;
     clearVal[0].color.float32[1] = 0.3f;
@@ -306,7 +325,7 @@ void drawFrame() {
     (*cmdBufs)[0]->bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline->get());
     (*cmdBufs)[0]->bindVertexBuffers(0, { vertexBuf->get() }, { 0 });
     (*cmdBufs)[0]->bindIndexBuffer(indexBuf->get(), 0, vk::IndexType::eUint16);
-    (*cmdBufs)[0]->bindDescriptorSets(vk::PipelineBindPoint::eGraphics, descpriptorPipelineLayout->get(), 0, { (*descSets)[0].get() }, {});
+    (*cmdBufs)[0]->bindDescriptorSets(vk::PipelineBindPoint::eGraphics, descpriptorPipelineLayout->get(), 0, { (*descSets)[0].get() }, { sceneDataOffset });
 
     writePushConstant(0);
     (*cmdBufs)[0]->pushConstants(descpriptorPipelineLayout->get(), vk::ShaderStageFlagBits::eVertex, 0, sizeof(ObjectData), &objectData);
@@ -320,15 +339,17 @@ void drawFrame() {
 
     (*cmdBufs)[0]->end();
 
+    frameArena->flush();
+
     vk::CommandBuffer submitCmdBuf[1] = { (*cmdBufs)[0].get() };
     vk::SubmitInfo submitInfo;
     submitInfo.commandBufferCount = 1;
     submitInfo.pCommandBuffers = submitCmdBuf;
 
     // 待機するセマフォの指定
-    vk::Semaphore renderwaitSemaphores[] = { swapchainImgSemaphore.get() };
-    vk::PipelineStageFlags renderwaitStages[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
-    submitInfo.waitSemaphoreCount = 1;
+    vk::Semaphore renderwaitSemaphores[] = { swapchainImgSemaphore.get(), uploadSemaphore.get() };
+    vk::PipelineStageFlags renderwaitStages[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eFragmentShader };
+    submitInfo.waitSemaphoreCount = waitForUpload ? 2 : 1;
     submitInfo.pWaitSemaphores = renderwaitSemaphores;
     submitInfo.pWaitDstStageMask = renderwaitStages;
 
@@ -338,6 +359,7 @@ void drawFrame() {
     submitInfo.pSignalSemaphores = renderSignalSemaphores;
 
     graphicsQueue.submit({ submitInfo }, imgRenderedFence.get());
+    waitForUpload = false;
 
     vk::PresentInfoKHR presentInfo;
 
@@ -361,7 +383,7 @@ void drawFrame() {
         exit(EXIT_FAILURE);
     }
 
-    deltaTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - sT).count();
+    deltaTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - sT).count();
 }
 
 
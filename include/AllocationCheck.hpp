@@ -0,0 +1,171 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <new>
+#include <cstdlib>
+#include "Utility.hpp"
+#include "Debug.hpp"
+
+using namespace Vulkan_Test;
+
+// 毎フレームの処理(イメージの取得、記録、送信、表示)でヒープの確保が起きると、
+// 確保にかかる時間やロックの待ちがそのままフレームの時間のばらつきになる
+// 定常状態では1回も確保しないことを、VULKAN_TEST_ALLOCATION_CHECKを定義してビルドした時に実行中に確かめる
+//
+// 定義した場合はグローバルのoperator newとoperator deleteを置き換え、スレッドごとに確保の回数を数える
+// 数えるのはフレームのループを回しているスレッドだけで、アップロードなどの別のスレッドの確保は数えない
+// 置き換えはプログラム全体で1つだけなので、このヘッダはMain.cppからだけインクルードする
+// operator new[]とoperator delete[]は標準の実装がこれらを呼ぶので、置き換えなくても数えられる
+// アラインメントを指定するものは標準の実装のまま別に確保されるので数えない
+//
+// GLFWやドライバがmallocで直接確保するものは数えられない
+
+#if defined(VULKAN_TEST_ALLOCATION_CHECK)
+namespace Vulkan_Test
+{
+    thread_local uint64_t threadAllocationCount = 0;
+}
+
+void* operator new(std::size_t size)
+{
+    Vulkan_Test::threadAllocationCount++;
+    void* result = std::malloc(size != 0 ? size : 1);
+    if (result == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    Vulkan_Test::threadAllocationCount++;
+    return std::malloc(size != 0 ? size : 1);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+// このスレッドでこれまでにoperator newが呼ばれた回数
+// VULKAN_TEST_ALLOCATION_CHECKが定義されていなければ常に0
+uint64_t getThreadAllocationCount()
+{
+#if defined(VULKAN_TEST_ALLOCATION_CHECK)
+    return Vulkan_Test::threadAllocationCount;
+#else
+    return 0;
+#endif
+}
+
+struct FrameAllocationStats
+{
+    uint64_t checkedFrameCount = 0;
+    uint64_t skippedFrameCount = 0;
+    uint64_t warmupAllocationCount = 0;
+};
+
+class FrameAllocationCheck
+{
+public:
+    // 最初のwarmupFrameCountフレームは、コマンドバッファやvectorの容量などが揃うまでの確保を許す
+    FrameAllocationCheck(uint64_t warmupFrameCount)
+        : warmupFrameCount(warmupFrameCount)
+    {
+    }
+
+    FrameAllocationCheck(const FrameAllocationCheck&) = delete;
+    FrameAllocationCheck& operator=(const FrameAllocationCheck&) = delete;
+
+    bool isEnabled() const
+    {
+#if defined(VULKAN_TEST_ALLOCATION_CHECK)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void beginFrame()
+    {
+        beginCount = getThreadAllocationCount();
+        skipping = false;
+    }
+
+    // スワップチェーンの作り直しやデフラグの開始など、定常状態ではないことが起きたフレームは数えない
+    void skipFrame()
+    {
+        skipping = true;
+    }
+
+    // フレームの最後に呼ぶ
+    // ウォームアップの後で確保があれば、そのフレームと回数を出力して終了する
+    void endFrame(uint64_t frame)
+    {
+        if (!isEnabled())
+        {
+            return;
+        }
+
+        uint64_t allocationCount = getThreadAllocationCount() - beginCount;
+        if (frame <= warmupFrameCount)
+        {
+            stats.warmupAllocationCount += allocationCount;
+            return;
+        }
+        if (skipping)
+        {
+            stats.skippedFrameCount++;
+            return;
+        }
+
+        stats.checkedFrameCount++;
+        if (allocationCount > 0)
+        {
+            LOGERR("Frame " << frame << " made " << allocationCount << " heap allocations after warm-up.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    FrameAllocationStats getStats() const
+    {
+        return stats;
+    }
+
+private:
+    uint64_t warmupFrameCount;
+    uint64_t beginCount = 0;
+    bool skipping = false;
+    FrameAllocationStats stats;
+};
+
+std::shared_ptr<FrameAllocationCheck> getFrameAllocationCheck(uint64_t warmupFrameCount)
+{
+    return std::make_shared<FrameAllocationCheck>(warmupFrameCount);
+}
+
+void debugFrameAllocationCheck(FrameAllocationCheck& frameAllocationCheck)
+{
+    if (!frameAllocationCheck.isEnabled())
+    {
+        return;
+    }
+    FrameAllocationStats stats = frameAllocationCheck.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Frame Allocation Check");
+    LOG("allocations during warm-up: " << stats.warmupAllocationCount);
+    LOG("frames checked: " << stats.checkedFrameCount << " (no allocations), skipped: " << stats.skippedFrameCount);
+}
@@ -5,6 +5,7 @@
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 using namespace Vulkan_Test;
 
@@ -32,7 +33,7 @@ void WaitPrograms(vk::Device device, vk::Queue graphicsQueue, std::vector<vk::Su
     // シグナル状態になったフェンスは、resetFencesメソッドで非シグナル状態にリセットできる
     // 例えると、非シグナル状態は赤信号、シグナル状態は青信号
     vk::FenceCreateInfo fenceCreateInfo;
-    vk::UniqueFence fence = device.createFenceUnique(fenceCreateInfo);
+    vk::UniqueFence fence = device.createFenceUnique(fenceCreateInfo, getAllocationCallbacks(vk::ObjectType::eFence));
 
     // 特定の処理に対して「終わったらシグナル状態にするフェンス」を設定する方法
     // GPUを利用するほとんどの関数は引数としてフェンスを渡せる
@@ -64,7 +65,7 @@ void WaitPrograms(vk::Device device, vk::Queue graphicsQueue, std::vector<vk::Su
     // フェンスを初期状態でシグナル状態にしておきたい場合はvk::FenceCreateInfo::flagsにvk::FenceCreateFlagBits::eSignaledを設定する
     // vk::FenceCreateInfo fenceCreateInfo;
     fenceCreateInfo.flags = vk::FenceCreateFlagBits::eSignaled;
-    fence = device.createFenceUnique(fenceCreateInfo);
+    fence = device.createFenceUnique(fenceCreateInfo, getAllocationCallbacks(vk::ObjectType::eFence));
 
     //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // 
@@ -79,7 +80,7 @@ void WaitPrograms(vk::Device device, vk::Queue graphicsQueue, std::vector<vk::Su
     // 例としてコマンドバッファの送信時は、vk::SubmitInfo構造体のsignalSemaphoreCount、pSignalSemaphoresを用いる
     // ここに指定すると、送信したコマンドの処理が完了した時に指定したセマフォがシグナル状態になる
     vk::SemaphoreCreateInfo semaphoreCreateInfo;
-    vk::UniqueSemaphore semaphore = device.createSemaphoreUnique(semaphoreCreateInfo);
+    vk::UniqueSemaphore semaphore = device.createSemaphoreUnique(semaphoreCreateInfo, getAllocationCallbacks(vk::ObjectType::eSemaphore));
 
     vk::Semaphore signalSemaphores[] = { semaphore.get() };
     submitInfo.signalSemaphoreCount = std::size(signalSemaphores);
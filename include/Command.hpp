@@ -5,6 +5,7 @@
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 using namespace Vulkan_Test;
 
@@ -34,7 +35,7 @@ std::shared_ptr<vk::UniqueCommandPool> getCommandPool(vk::UniqueDevice& device,
     // コマンドプール作成時 vk::CommandPoolCreateInfo::flags に vk::CommandPoolCreateFlagBits::eResetCommandBuffer を指定すると、
     // そのコマンドプールから作成したコマンドバッファはリセット可能になる
     cmdPoolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
-    *result = device.get().createCommandPoolUnique(cmdPoolCreateInfo);
+    *result = device.get().createCommandPoolUnique(cmdPoolCreateInfo, getAllocationCallbacks(vk::ObjectType::eCommandPool));
     return result;
 }
 
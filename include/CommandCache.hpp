@@ -0,0 +1,153 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <cstdlib>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "HostAllocator.hpp"
+
+using namespace Vulkan_Test;
+
+// 毎フレームコマンドバッファをリセットして、レンダーパスの開始からパイプラインやバッファのバインド、描画までを記録し直していたが、
+// 静的なシーンでは毎フレーム変わるのはユニフォームの中身だけで、記録されるコマンドは全く同じになる
+// そこで記録したコマンドバッファを取っておき、次からはそのまま送信する
+//
+// フレームバッファはスワップチェーンのイメージごとに違い、ユニフォームのダイナミックオフセットはフレームごとに違うので、
+// (フレーム, イメージ)の組ごとに1つずつ持つ
+// 同じ組のコマンドバッファを前回送信したのは同じフレームなので、そのフレームのフェンスを待った後なら記録し直してもよい
+//
+// シーンの構成(バインドするバッファやデスクリプタセット)が変わった時はinvalidateを、
+// スワップチェーンを作り直した時はresetSwapchainImagesを呼ぶと、次に使う時に記録し直される
+
+// 環境変数VULKAN_TEST_STATIC_COMMANDSが0なら、今まで通り毎フレーム記録する
+bool isCommandCacheEnabled()
+{
+#if !defined(__ANDROID__)
+    const char* value = std::getenv("VULKAN_TEST_STATIC_COMMANDS");
+    if (value != nullptr)
+    {
+        return std::strtoul(value, nullptr, 10) != 0;
+    }
+#endif
+    return true;
+}
+
+struct CommandCacheStats
+{
+    uint64_t recordCount = 0;
+    uint64_t reuseCount = 0;
+};
+
+class CommandCache
+{
+public:
+    CommandCache(vk::Device device, vk::CommandPool cmdPool, uint32_t frameCount)
+        : device(device), cmdPool(cmdPool), frameCount(frameCount)
+    {
+    }
+
+    CommandCache(const CommandCache&) = delete;
+    CommandCache& operator=(const CommandCache&) = delete;
+
+    // 記録済みのものを全て古いものにする
+    void invalidate()
+    {
+        version++;
+    }
+
+    // スワップチェーンのイメージの数に合わせて作り直す
+    // 古いものがまだ実行中かもしれないので、呼ぶ前にキューが空になるのを待っておく
+    void resetSwapchainImages(uint32_t imageCount)
+    {
+        entries.clear();
+        entries.resize(frameCount * imageCount);
+
+        vk::CommandBufferAllocateInfo cmdBufAllocInfo;
+        cmdBufAllocInfo.commandPool = cmdPool;
+        cmdBufAllocInfo.commandBufferCount = frameCount * imageCount;
+        cmdBufAllocInfo.level = vk::CommandBufferLevel::ePrimary;
+        std::vector<vk::UniqueCommandBuffer> cmdBufs = device.allocateCommandBuffersUnique(cmdBufAllocInfo);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            entries[i].cmdBuf = std::move(cmdBufs[i]);
+        }
+        this->imageCount = imageCount;
+    }
+
+    // frameIndexのフレームでimageIndexのイメージに描画するコマンドバッファを返す
+    // keyはダイナミックオフセットなど、記録する内容を決める値で、前回と違えば記録し直す
+    // 記録し直す場合はrecord(vk::CommandBuffer)が呼ばれるので、beginとendの間のコマンドを記録する
+    // frameIndexのフレームのフェンスを待った後に呼ぶ
+    template <typename Record>
+    vk::CommandBuffer get(uint32_t frameIndex, uint32_t imageIndex, uint64_t key, Record&& record)
+    {
+        if (frameIndex >= frameCount || imageIndex >= imageCount)
+        {
+            LOGERR("Command cache entry (" << frameIndex << ", " << imageIndex << ") is out of range.");
+            exit(EXIT_FAILURE);
+        }
+
+        Entry& entry = entries[frameIndex * imageCount + imageIndex];
+        if (entry.recorded && entry.version == version && entry.key == key)
+        {
+            stats.reuseCount++;
+            return entry.cmdBuf.get();
+        }
+
+        entry.cmdBuf->reset();
+        vk::CommandBufferBeginInfo cmdBeginInfo;
+        entry.cmdBuf->begin(cmdBeginInfo);
+        record(entry.cmdBuf.get());
+        entry.cmdBuf->end();
+
+        entry.recorded = true;
+        entry.version = version;
+        entry.key = key;
+        stats.recordCount++;
+        return entry.cmdBuf.get();
+    }
+
+    uint32_t getEntryCount() const
+    {
+        return uint32_t(entries.size());
+    }
+
+    CommandCacheStats getStats() const
+    {
+        return stats;
+    }
+
+private:
+    struct Entry
+    {
+        vk::UniqueCommandBuffer cmdBuf;
+        bool recorded = false;
+        uint64_t version = 0;
+        uint64_t key = 0;
+    };
+
+    vk::Device device;
+    vk::CommandPool cmdPool;
+    uint32_t frameCount;
+    uint32_t imageCount = 0;
+    uint64_t version = 0;
+    std::vector<Entry> entries;
+    CommandCacheStats stats;
+};
+
+std::shared_ptr<CommandCache> getCommandCache(vk::UniqueDevice& device, vk::UniqueCommandPool& cmdPool, uint32_t frameCount)
+{
+    return std::make_shared<CommandCache>(device.get(), cmdPool.get(), frameCount);
+}
+
+void debugCommandCache(CommandCache& commandCache)
+{
+    CommandCacheStats stats = commandCache.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Command Cache");
+    LOG("entries: " << commandCache.getEntryCount());
+    LOG("recorded: " << stats.recordCount << ", reused: " << stats.reuseCount);
+}
@@ -4,10 +4,6 @@
 #include <memory>
 #include <vulkan/vulkan.hpp>
 
-#if !defined(__ANDROID__)
-#include <GLFW/glfw3.h>
-#endif
-
 namespace Vulkan_Test
 {
     void debugApplicationInfo(vk::ApplicationInfo &applicationInfo)
@@ -35,20 +31,6 @@ namespace Vulkan_Test
         SET_LOG_INDEX(0);
     }
 
-#if !defined(__ANDROID__)
-    void debugGlfwWindow(GLFWwindow &window)
-    {
-        LOG("----------------------------------------");
-        LOG("Debug GLFW Window");
-        int width;
-        int height;
-        glfwGetWindowSize(&window, &width, &height);
-        LOG("WindowSize: width " << width << ", height " << height);
-        glfwGetFramebufferSize(&window, &width, &height);
-        LOG("FramebufferSize: width " << width << ", height " << height);
-    }
-#endif
-
     // UUIDを16進数で表示する関数
     std::string getUUID(const uint8_t* uuid, size_t size)
     {
@@ -0,0 +1,608 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "Memory.hpp"
+
+using namespace Vulkan_Test;
+
+// アセットの読み込みと破棄を繰り返すと、ブロックの中に小さな空き区間が散らばっていく
+// 空きの合計は足りていても1つの区間に収まらなければ、大きなイメージを置くために新しいブロックを確保することになる
+// そこで最も空いているブロックに残っているリソースを他のブロックへGPUでコピーし、そのブロックを空にして返却する
+// 1フレームで全部やると止まって見えるので、時間とコピー量の予算の範囲で数フレームに分けて進める
+
+enum class DefragmentableResourceKind
+{
+    Buffer,
+    Image,
+};
+
+// デフラグで動かしてよいリソース
+// 持ち主の変数(shared_ptr)を直接差し替えるので、ポインタで覚えておく
+// CPUから毎フレーム書き込むものはコピー中に内容が変わってしまうので登録しない
+struct DefragmentableResource
+{
+    std::string name;
+    DefragmentableResourceKind kind = DefragmentableResourceKind::Buffer;
+    bool registered = false;
+
+    std::shared_ptr<vk::UniqueBuffer>* buffer = nullptr;
+    std::shared_ptr<vk::UniqueImage>* image = nullptr;
+    std::shared_ptr<MemoryAllocation>* memory = nullptr;
+
+    // 移動先を同じ内容で作り直すための情報
+    vk::BufferCreateInfo bufferCreateInfo;
+    vk::ImageCreateInfo imageCreateInfo;
+    // 描画中のイメージのレイアウト
+    vk::ImageLayout imageLayout = vk::ImageLayout::eUndefined;
+    vk::ImageAspectFlags imageAspect;
+
+    // 描画でどのステージからどう読まれるか
+    // コピーの前後のバリアに使う
+    vk::PipelineStageFlags stages;
+    vk::AccessFlags access;
+
+    // 移動が終わった後に呼ばれる
+    // イメージビューはここで作り直し、古いものはretireImageViewに渡す
+    // デスクリプタセットは処理中のフレームが使っているので、ここでは書き換えず、各フレームのフェンスを待った後で書き換える
+    std::function<void()> onMoved;
+};
+
+struct DefragmentationStats
+{
+    uint64_t passCount = 0;
+    uint64_t allocationsMoved = 0;
+    vk::DeviceSize bytesMoved = 0;
+    // デバイスメモリとして返却できた量
+    vk::DeviceSize bytesReclaimed = 0;
+    // CPU側で移動の準備とコマンドの記録にかかった時間
+    std::chrono::microseconds cpuTime{ 0 };
+};
+
+class Defragmenter
+{
+public:
+    // 1フレームあたりに使ってよいCPU時間
+    std::chrono::microseconds timeBudget{ 500 };
+    // 1フレームあたりにコピーしてよい量
+    vk::DeviceSize maxBytesPerFrame = 16ull * 1024 * 1024;
+    // メモリタイプの空き領域の細切れ具合(MemoryAllocator::getFragmentation)がこれを超えたら、そのメモリタイプのブロックを空にする
+    float fragmentationThreshold = 0.5f;
+
+    Defragmenter(vk::Device device, vk::Queue queue, uint32_t queueFamilyIndex, MemoryAllocator& allocator, uint32_t framesInFlight)
+        : device(device), queue(queue), allocator(allocator), framesInFlight(framesInFlight)
+    {
+        vk::CommandPoolCreateInfo cmdPoolCreateInfo;
+        cmdPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
+        cmdPoolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+        cmdPool = device.createCommandPoolUnique(cmdPoolCreateInfo, getAllocationCallbacks(vk::ObjectType::eCommandPool));
+
+        vk::CommandBufferAllocateInfo cmdBufAllocInfo;
+        cmdBufAllocInfo.commandPool = cmdPool.get();
+        cmdBufAllocInfo.commandBufferCount = 1;
+        cmdBufAllocInfo.level = vk::CommandBufferLevel::ePrimary;
+        cmdBuf = std::move(device.allocateCommandBuffersUnique(cmdBufAllocInfo)[0]);
+
+        vk::FenceCreateInfo fenceCreateInfo;
+        fence = device.createFenceUnique(fenceCreateInfo, getAllocationCallbacks(vk::ObjectType::eFence));
+    }
+
+    ~Defragmenter()
+    {
+        if (!inFlightMoves.empty())
+        {
+            vk::Result waitResult = device.waitForFences({ fence.get() }, VK_TRUE, UINT64_MAX);
+            if (waitResult != vk::Result::eSuccess)
+            {
+                LOGERR("Failed to wait for defragmentation copies.");
+            }
+        }
+    }
+
+    uint32_t registerBuffer(const std::string& name, std::shared_ptr<vk::UniqueBuffer>& buffer, std::shared_ptr<MemoryAllocation>& memory, const vk::BufferCreateInfo& createInfo, vk::PipelineStageFlags stages, vk::AccessFlags access, std::function<void()> onMoved)
+    {
+        uint32_t id = addResource();
+        DefragmentableResource& resource = resources[id];
+        resource.name = name;
+        resource.kind = DefragmentableResourceKind::Buffer;
+        resource.buffer = &buffer;
+        resource.memory = &memory;
+        resource.bufferCreateInfo = createInfo;
+        resource.stages = stages;
+        resource.access = access;
+        resource.onMoved = std::move(onMoved);
+        return id;
+    }
+
+    uint32_t registerImage(const std::string& name, std::shared_ptr<vk::UniqueImage>& image, std::shared_ptr<MemoryAllocation>& memory, const vk::ImageCreateInfo& createInfo, vk::ImageLayout layout, vk::ImageAspectFlags aspect, vk::PipelineStageFlags stages, vk::AccessFlags access, std::function<void()> onMoved)
+    {
+        uint32_t id = addResource();
+        DefragmentableResource& resource = resources[id];
+        resource.name = name;
+        resource.kind = DefragmentableResourceKind::Image;
+        resource.image = &image;
+        resource.memory = &memory;
+        resource.imageCreateInfo = createInfo;
+        resource.imageCreateInfo.pQueueFamilyIndices = nullptr;
+        resource.imageCreateInfo.queueFamilyIndexCount = 0;
+        resource.imageLayout = layout;
+        resource.imageAspect = aspect;
+        resource.stages = stages;
+        resource.access = access;
+        resource.onMoved = std::move(onMoved);
+        return id;
+    }
+
+    void unregisterResource(uint32_t id)
+    {
+        resources[id] = DefragmentableResource();
+        checkedAllocatorVersion = UINT64_MAX;
+    }
+
+    bool isRunning() const
+    {
+        return sourceBlock != nullptr;
+    }
+
+    const DefragmentationStats& getStats() const
+    {
+        return stats;
+    }
+
+    // onMovedの中で作り直したイメージビューの古い方を渡す
+    // 処理中のフレームのデスクリプタセットがまだ指しているので、移動前のイメージと同じく使い終わるまで破棄を待つ
+    void retireImageView(vk::UniqueImageView imageView)
+    {
+        RetiredResource retired;
+        retired.frame = currentFrame;
+        retired.imageView = std::move(imageView);
+        retiredResources.push_back(std::move(retired));
+    }
+
+    // 空にするブロックを1つ選んでデフラグを始める
+    // 細切れになっているメモリタイプのブロックだけを選び、
+    // 動かせないリソースが乗っているブロックや、他のブロックの空きに入りきらないブロックは選ばない
+    // 選べなかった場合は、確保か解放が起きるまで調べ直さない
+    bool begin()
+    {
+        if (isRunning() || allocator.getVersion() == checkedAllocatorVersion)
+        {
+            return false;
+        }
+        checkedAllocatorVersion = allocator.getVersion();
+
+        const MemoryBlock* bestBlock = nullptr;
+        for (uint32_t memoryTypeIndex = 0; memoryTypeIndex < allocator.getMemoryTypeCount(); memoryTypeIndex++)
+        {
+            const std::vector<std::unique_ptr<MemoryBlock>>& blocks = allocator.getBlocks(memoryTypeIndex);
+            if (blocks.size() < 2 || allocator.getFragmentation(memoryTypeIndex) <= fragmentationThreshold)
+            {
+                continue;
+            }
+
+            vk::DeviceSize totalFreeSize = 0;
+            for (const std::unique_ptr<MemoryBlock>& block : blocks)
+            {
+                totalFreeSize += block->size - block->usedSize;
+            }
+
+            for (const std::unique_ptr<MemoryBlock>& block : blocks)
+            {
+                if (block->dedicated || block->allocationCount == 0 || countMovable(*block) != block->allocationCount)
+                {
+                    continue;
+                }
+                if (block->usedSize > totalFreeSize - (block->size - block->usedSize))
+                {
+                    continue;
+                }
+                if (bestBlock == nullptr || block->usedSize < bestBlock->usedSize)
+                {
+                    bestBlock = block.get();
+                }
+            }
+        }
+
+        if (bestBlock == nullptr)
+        {
+            return false;
+        }
+
+        sourceBlock = bestBlock;
+        blockBytesAtBegin = allocator.getStats().blockBytes;
+        pendingMoves.clear();
+        for (uint32_t id = 0; id < resources.size(); id++)
+        {
+            if (isInBlock(resources[id], sourceBlock))
+            {
+                pendingMoves.push_back(id);
+            }
+        }
+        stats.passCount++;
+        LOG("Defragmentation started: " << pendingMoves.size() << " allocations, " << sourceBlock->usedSize << " bytes");
+        return true;
+    }
+
+    // フレームの最初、フェンスを待った後に呼ぶ
+    // コピーが終わった移動を反映し、予算の範囲で次の移動を記録して送信する
+    // 移動先のリソースを作ったか、持ち主のリソースを入れ替えた場合はtrueを返す
+    // それ以外のフレーム(コピーの完了待ちなど)ではヒープの確保は起きない
+    bool update(uint64_t frame)
+    {
+        currentFrame = frame;
+        releaseRetiredResources();
+
+        bool changed = false;
+        if (!inFlightMoves.empty())
+        {
+            if (device.getFenceStatus(fence.get()) != vk::Result::eSuccess)
+            {
+                return false;
+            }
+            finishMoves();
+            changed = true;
+        }
+
+        if (!isRunning())
+        {
+            return changed;
+        }
+
+        if (pendingMoves.empty())
+        {
+            if (retiredResources.empty())
+            {
+                finishPass();
+            }
+            return changed;
+        }
+
+        recordMoves();
+        return changed || !inFlightMoves.empty();
+    }
+
+private:
+    struct DefragmentationMove
+    {
+        uint32_t id = 0;
+        std::shared_ptr<MemoryAllocation> memory;
+        vk::UniqueBuffer buffer;
+        vk::UniqueImage image;
+    };
+
+    // 移動前のリソース
+    // 描画中のフレームが使い終わるまで破棄を待つ
+    // メモリより先にバッファやイメージが、イメージより先にイメージビューが破棄されるようにメンバの順番に注意
+    struct RetiredResource
+    {
+        std::shared_ptr<MemoryAllocation> memory;
+        vk::UniqueBuffer buffer;
+        vk::UniqueImage image;
+        vk::UniqueImageView imageView;
+        uint64_t frame = 0;
+    };
+
+    uint32_t addResource()
+    {
+        uint32_t id = 0;
+        while (id < resources.size() && resources[id].registered)
+        {
+            id++;
+        }
+        if (id == resources.size())
+        {
+            resources.push_back(DefragmentableResource());
+        }
+        resources[id].registered = true;
+        // 動かせるリソースが変わったので、次のbeginで調べ直す
+        checkedAllocatorVersion = UINT64_MAX;
+        return id;
+    }
+
+    static bool isInBlock(const DefragmentableResource& resource, const MemoryBlock* block)
+    {
+        return resource.registered && *resource.memory && (*resource.memory)->block == block;
+    }
+
+    size_t countMovable(const MemoryBlock& block) const
+    {
+        size_t result = 0;
+        for (const DefragmentableResource& resource : resources)
+        {
+            if (isInBlock(resource, &block))
+            {
+                result++;
+            }
+        }
+        return result;
+    }
+
+    // 移動先のリソースを作り、元のブロック以外から同じメモリタイプの領域を割り当てる
+    bool prepareMove(uint32_t id, DefragmentationMove& move)
+    {
+        DefragmentableResource& resource = resources[id];
+        MemoryAllocation& oldMemory = **resource.memory;
+
+        vk::MemoryRequirements memReq;
+        bool linear = true;
+        if (resource.kind == DefragmentableResourceKind::Buffer)
+        {
+            move.buffer = device.createBufferUnique(resource.bufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+            memReq = device.getBufferMemoryRequirements(move.buffer.get());
+        }
+        else
+        {
+            move.image = device.createImageUnique(resource.imageCreateInfo, getAllocationCallbacks(vk::ObjectType::eImage));
+            memReq = device.getImageMemoryRequirements(move.image.get());
+            linear = resource.imageCreateInfo.tiling == vk::ImageTiling::eLinear;
+        }
+
+        if (!(memReq.memoryTypeBits & (1 << oldMemory.memoryTypeIndex)))
+        {
+            return false;
+        }
+        move.memory = allocator.allocateInExistingBlock(memReq, oldMemory.memoryTypeIndex, linear, sourceBlock);
+        if (!move.memory)
+        {
+            return false;
+        }
+        move.memory->copyTagFrom(oldMemory);
+
+        if (resource.kind == DefragmentableResourceKind::Buffer)
+        {
+            device.bindBufferMemory(move.buffer.get(), move.memory->memory, move.memory->offset);
+        }
+        else
+        {
+            device.bindImageMemory(move.image.get(), move.memory->memory, move.memory->offset);
+        }
+        move.id = id;
+        return true;
+    }
+
+    void recordMoves()
+    {
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+        vk::DeviceSize recordedBytes = 0;
+
+        while (!pendingMoves.empty() && recordedBytes < maxBytesPerFrame && std::chrono::steady_clock::now() - startTime < timeBudget)
+        {
+            uint32_t id = pendingMoves.back();
+            pendingMoves.pop_back();
+            if (!isInBlock(resources[id], sourceBlock))
+            {
+                continue;
+            }
+
+            DefragmentationMove move;
+            if (!prepareMove(id, move))
+            {
+                // 入りきらなかったのでこのブロックは空にできない
+                LOGERR("Defragmentation aborted: no room for " << resources[id].name);
+                pendingMoves.clear();
+                break;
+            }
+            recordedBytes += move.memory->size;
+            inFlightMoves.push_back(std::move(move));
+        }
+
+        if (!inFlightMoves.empty())
+        {
+            submitMoves();
+        }
+
+        stats.cpuTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+    }
+
+    vk::ImageMemoryBarrier getImageBarrier(vk::Image image, const DefragmentableResource& resource, vk::ImageLayout oldLayout, vk::ImageLayout newLayout, vk::AccessFlags srcAccess, vk::AccessFlags dstAccess)
+    {
+        vk::ImageMemoryBarrier barrior;
+        barrior.oldLayout = oldLayout;
+        barrior.newLayout = newLayout;
+        barrior.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.image = image;
+        barrior.subresourceRange.aspectMask = resource.imageAspect;
+        barrior.subresourceRange.baseMipLevel = 0;
+        barrior.subresourceRange.levelCount = resource.imageCreateInfo.mipLevels;
+        barrior.subresourceRange.baseArrayLayer = 0;
+        barrior.subresourceRange.layerCount = resource.imageCreateInfo.arrayLayers;
+        barrior.srcAccessMask = srcAccess;
+        barrior.dstAccessMask = dstAccess;
+        return barrior;
+    }
+
+    // 描画用のコマンドと同じキューに送る
+    // バリアは送信順で前後のコマンドにも効くので、描画中の読み込みとコピーが正しく順序付けられる
+    void submitMoves()
+    {
+        vk::PipelineStageFlags usedStages;
+        vk::AccessFlags usedAccess;
+        beforeBarriers.clear();
+        afterBarriers.clear();
+
+        for (DefragmentationMove& move : inFlightMoves)
+        {
+            const DefragmentableResource& resource = resources[move.id];
+            usedStages |= resource.stages;
+            usedAccess |= resource.access;
+            if (resource.kind != DefragmentableResourceKind::Image)
+            {
+                continue;
+            }
+
+            vk::Image oldImage = (*resource.image)->get();
+            beforeBarriers.push_back(getImageBarrier(oldImage, resource, resource.imageLayout, vk::ImageLayout::eTransferSrcOptimal, resource.access, vk::AccessFlagBits::eTransferRead));
+            beforeBarriers.push_back(getImageBarrier(move.image.get(), resource, vk::ImageLayout::eUndefined, vk::ImageLayout::eTransferDstOptimal, {}, vk::AccessFlagBits::eTransferWrite));
+            // 移動が反映されるまでは元のイメージで描画を続けるので、元のレイアウトに戻しておく
+            afterBarriers.push_back(getImageBarrier(oldImage, resource, vk::ImageLayout::eTransferSrcOptimal, resource.imageLayout, vk::AccessFlagBits::eTransferRead, resource.access));
+            afterBarriers.push_back(getImageBarrier(move.image.get(), resource, vk::ImageLayout::eTransferDstOptimal, resource.imageLayout, vk::AccessFlagBits::eTransferWrite, resource.access));
+        }
+
+        cmdBuf->reset();
+        vk::CommandBufferBeginInfo cmdBeginInfo;
+        cmdBeginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+        cmdBuf->begin(cmdBeginInfo);
+
+        if (!beforeBarriers.empty())
+        {
+            cmdBuf->pipelineBarrier(usedStages, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, beforeBarriers);
+        }
+
+        for (DefragmentationMove& move : inFlightMoves)
+        {
+            const DefragmentableResource& resource = resources[move.id];
+            if (resource.kind == DefragmentableResourceKind::Buffer)
+            {
+                vk::BufferCopy bufCopy;
+                bufCopy.srcOffset = 0;
+                bufCopy.dstOffset = 0;
+                bufCopy.size = resource.bufferCreateInfo.size;
+                cmdBuf->copyBuffer((*resource.buffer)->get(), move.buffer.get(), { bufCopy });
+                continue;
+            }
+
+            imgCopyRegions.clear();
+            for (uint32_t mipLevel = 0; mipLevel < resource.imageCreateInfo.mipLevels; mipLevel++)
+            {
+                vk::ImageCopy imgCopyRegion;
+                imgCopyRegion.srcSubresource.aspectMask = resource.imageAspect;
+                imgCopyRegion.srcSubresource.mipLevel = mipLevel;
+                imgCopyRegion.srcSubresource.baseArrayLayer = 0;
+                imgCopyRegion.srcSubresource.layerCount = resource.imageCreateInfo.arrayLayers;
+                imgCopyRegion.dstSubresource = imgCopyRegion.srcSubresource;
+                imgCopyRegion.extent = vk::Extent3D{
+                    std::max(resource.imageCreateInfo.extent.width >> mipLevel, 1u),
+                    std::max(resource.imageCreateInfo.extent.height >> mipLevel, 1u),
+                    std::max(resource.imageCreateInfo.extent.depth >> mipLevel, 1u) };
+                imgCopyRegions.push_back(imgCopyRegion);
+            }
+            cmdBuf->copyImage((*resource.image)->get(), vk::ImageLayout::eTransferSrcOptimal, move.image.get(), vk::ImageLayout::eTransferDstOptimal, imgCopyRegions);
+        }
+
+        // バッファはレイアウトが無いので、書き込みの完了だけをまとめて待たせる
+        vk::MemoryBarrier memBarrier;
+        memBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        memBarrier.dstAccessMask = usedAccess;
+        cmdBuf->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, usedStages, {}, { memBarrier }, {}, afterBarriers);
+
+        cmdBuf->end();
+
+        vk::CommandBuffer submitCmdBuf[1] = { cmdBuf.get() };
+        vk::SubmitInfo submitInfo;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = submitCmdBuf;
+
+        device.resetFences({ fence.get() });
+        queue.submit({ submitInfo }, fence.get());
+    }
+
+    // 持ち主の変数が新しいリソースを指すように入れ替え、元のリソースは破棄待ちに回す
+    void finishMoves()
+    {
+        for (DefragmentationMove& move : inFlightMoves)
+        {
+            DefragmentableResource& resource = resources[move.id];
+            // コピー中に持ち主が手放した場合は移動先も要らない
+            if (!resource.registered || !*resource.memory)
+            {
+                continue;
+            }
+
+            RetiredResource retired;
+            retired.frame = currentFrame;
+            if (resource.kind == DefragmentableResourceKind::Buffer)
+            {
+                std::swap(**resource.buffer, move.buffer);
+                retired.buffer = std::move(move.buffer);
+            }
+            else
+            {
+                std::swap(**resource.image, move.image);
+                retired.image = std::move(move.image);
+            }
+            (*resource.memory)->swap(*move.memory);
+            retired.memory = std::move(move.memory);
+
+            stats.allocationsMoved++;
+            stats.bytesMoved += (*resource.memory)->size;
+
+            if (resource.onMoved)
+            {
+                resource.onMoved();
+            }
+            retiredResources.push_back(std::move(retired));
+        }
+        inFlightMoves.clear();
+    }
+
+    void releaseRetiredResources()
+    {
+        for (size_t i = 0; i < retiredResources.size();)
+        {
+            if (retiredResources[i].frame + framesInFlight > currentFrame)
+            {
+                i++;
+                continue;
+            }
+            retiredResources.erase(retiredResources.begin() + i);
+        }
+    }
+
+    void finishPass()
+    {
+        allocator.trimEmptyBlocks();
+        vk::DeviceSize blockBytes = allocator.getStats().blockBytes;
+        vk::DeviceSize reclaimed = blockBytesAtBegin > blockBytes ? blockBytesAtBegin - blockBytes : 0;
+        stats.bytesReclaimed += reclaimed;
+        sourceBlock = nullptr;
+        LOG("Defragmentation finished: " << reclaimed << " bytes reclaimed");
+    }
+
+    vk::Device device;
+    vk::Queue queue;
+    MemoryAllocator& allocator;
+    uint32_t framesInFlight;
+    uint64_t currentFrame = 0;
+
+    vk::UniqueCommandPool cmdPool;
+    vk::UniqueCommandBuffer cmdBuf;
+    vk::UniqueFence fence;
+
+    std::vector<DefragmentableResource> resources;
+    // 最後にbeginでブロックを探した時のMemoryAllocator::getVersion
+    uint64_t checkedAllocatorVersion = UINT64_MAX;
+    const MemoryBlock* sourceBlock = nullptr;
+    vk::DeviceSize blockBytesAtBegin = 0;
+    std::vector<uint32_t> pendingMoves;
+    std::vector<DefragmentationMove> inFlightMoves;
+    std::vector<RetiredResource> retiredResources;
+    // submitMovesで毎回作り直さないように使い回す
+    std::vector<vk::ImageMemoryBarrier> beforeBarriers;
+    std::vector<vk::ImageMemoryBarrier> afterBarriers;
+    std::vector<vk::ImageCopy> imgCopyRegions;
+    DefragmentationStats stats;
+};
+
+std::shared_ptr<Defragmenter> getDefragmenter(vk::UniqueDevice& device, vk::Queue& queue, uint32_t queueFamilyIndex, MemoryAllocator& allocator, uint32_t framesInFlight)
+{
+    return std::make_shared<Defragmenter>(device.get(), queue, queueFamilyIndex, allocator, framesInFlight);
+}
+
+void debugDefragmentationStats(Defragmenter& defragmenter)
+{
+    const DefragmentationStats& stats = defragmenter.getStats();
+
+    LOG("----------------------------------------");
+    LOG("Debug Defragmentation");
+    LOG("passes: " << stats.passCount);
+    LOG("allocations moved: " << stats.allocationsMoved);
+    LOG("bytes moved: " << stats.bytesMoved);
+    LOG("bytes reclaimed: " << stats.bytesReclaimed);
+    LOG("cpu time: " << stats.cpuTime.count() << " us");
+}
@@ -5,10 +5,14 @@
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "Memory.hpp"
 
 using namespace Vulkan_Test;
 
-std::shared_ptr<vk::UniqueImage> getDepthImage(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::SurfaceCapabilitiesKHR& surfaceCapabilities)
+// 深度バッファはレンダーパスの中でクリアして使い、storeOpもeDontCareなので中身を残す必要がない
+// transientがtrueならeTransientAttachmentを付け、LAZILY_ALLOCATEDなメモリに置けるようにする
+// タイルベースのGPUではタイルメモリの中だけで処理が済み、メモリも帯域もほとんど使わない
+std::shared_ptr<vk::UniqueImage> getDepthImage(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::SurfaceCapabilitiesKHR& surfaceCapabilities, bool transient)
 {
     std::shared_ptr<vk::UniqueImage> result = std::make_shared<vk::UniqueImage>();
     
@@ -23,41 +27,21 @@ std::shared_ptr<vk::UniqueImage> getDepthImage(vk::UniqueDevice& device, vk::Phy
     depthImgCreateInfo.tiling = vk::ImageTiling::eOptimal;
     depthImgCreateInfo.initialLayout = vk::ImageLayout::eUndefined;
     depthImgCreateInfo.usage = vk::ImageUsageFlagBits::eDepthStencilAttachment;
+    if (transient)
+    {
+        depthImgCreateInfo.usage |= vk::ImageUsageFlagBits::eTransientAttachment;
+    }
     depthImgCreateInfo.sharingMode = vk::SharingMode::eExclusive;
     depthImgCreateInfo.samples = vk::SampleCountFlagBits::e1;
 
-    *result = device->createImageUnique(depthImgCreateInfo);
+    *result = device->createImageUnique(depthImgCreateInfo, getAllocationCallbacks(vk::ObjectType::eImage));
     return result;
 }
 
-std::shared_ptr<vk::UniqueDeviceMemory> getDepthImageMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueImage& depthImage)
+std::shared_ptr<MemoryAllocation> getDepthImageMemory(vk::UniqueDevice& device, MemoryAllocator& allocator, vk::UniqueImage& depthImage)
 {
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
-
-    vk::MemoryRequirements depthImgMemReq = device->getImageMemoryRequirements(depthImage.get());
-    vk::MemoryAllocateInfo depthImgMemAllocInfo;
-    depthImgMemAllocInfo.allocationSize = depthImgMemReq.size;
-
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) 
-    {
-        if (depthImgMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal)) 
-        {
-            depthImgMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound) 
-    {
-        LOGERR("Suitable memory type not found.");
-        exit(EXIT_FAILURE);
-    }
-    
-    *result = device->allocateMemoryUnique(depthImgMemAllocInfo);
-    device->bindImageMemory(depthImage.get(), (*result).get(), 0);
+    std::shared_ptr<MemoryAllocation> result = getTransientAttachmentMemory(device, allocator, depthImage);
+    result->setUsage(MemoryUsage::Depth);
     return result;
 }
 
@@ -79,6 +63,6 @@ std::shared_ptr<vk::UniqueImageView> getDepthImageView(vk::UniqueDevice& device,
     depthImgViewCreateInfo.subresourceRange.baseArrayLayer = 0;
     depthImgViewCreateInfo.subresourceRange.layerCount = 1;
 
-    *result = device->createImageViewUnique(depthImgViewCreateInfo);
+    *result = device->createImageViewUnique(depthImgViewCreateInfo, getAllocationCallbacks(vk::ObjectType::eImageView));
     return result;
 }
\ No newline at end of file
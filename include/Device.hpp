@@ -2,9 +2,12 @@
 
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
+#include "PhysicalDevice.hpp"
 
 using namespace Vulkan_Test;
 
@@ -34,6 +37,22 @@ std::shared_ptr<std::vector<vk::DeviceQueueCreateInfo>> getDeviceQueueCreateInfo
     return result;
 }
 
+std::shared_ptr<std::vector<vk::DeviceQueueCreateInfo>> getDeviceQueueCreateInfos(std::vector<float>& queuePriorities, uint32_t queueFamilyIndex, std::optional<uint32_t> transferQueueFamilyIndex)
+{
+    // 転送専用のキューファミリがあれば、そこからもキューを1つ作る
+    // 同じキューファミリを2回指定することはできない
+    std::shared_ptr<std::vector<vk::DeviceQueueCreateInfo>> result = getDeviceQueueCreateInfos(queuePriorities, queueFamilyIndex);
+    if (transferQueueFamilyIndex && *transferQueueFamilyIndex != queueFamilyIndex)
+    {
+        vk::DeviceQueueCreateInfo transferQueueCreateInfo;
+        transferQueueCreateInfo.queueFamilyIndex = *transferQueueFamilyIndex;
+        transferQueueCreateInfo.queueCount = queuePriorities.size();
+        transferQueueCreateInfo.pQueuePriorities = queuePriorities.data();
+        result->push_back(transferQueueCreateInfo);
+    }
+    return result;
+}
+
 std::shared_ptr<std::vector<const char*>> getRequiredLayers()
 {
     // インスタンスを作成するときにvk::InstanceCreateInfo構造体を使ったのと同じように、
@@ -52,6 +71,44 @@ std::shared_ptr<std::vector<const char*>> getRequiredExtensions()
     return result;
 }
 
+std::shared_ptr<std::vector<const char*>> getOptionalExtensions(vk::PhysicalDevice& physicalDevice, bool presentation = true)
+{
+    // 無くても動くが、あれば使う拡張機能
+    // デバイスが対応しているものだけを有効化する
+    // presentationがfalseならスワップチェーンを使わないので、表示に関係するものは有効化しない
+    std::shared_ptr<std::vector<const char*>> result = std::make_shared<std::vector<const char*>>();
+
+    // VK_EXT_memory_budget: ヒープごとの予算と現在の使用量をドライバから取得できる
+    if (isDeviceExtensionSupported(physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME))
+    {
+        result->push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    }
+
+    // VK_EXT_external_memory_host: アプリが確保したホストメモリをデバイスメモリとして取り込める
+    if (isDeviceExtensionSupported(physicalDevice, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME))
+    {
+        result->push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+    }
+
+#if defined(VK_EXT_host_image_copy)
+    // VK_EXT_host_image_copy: CPUからイメージに直接書き込める
+    if (isHostImageCopySupported(physicalDevice))
+    {
+        result->push_back(VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME);
+    }
+#endif
+
+#if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+    // VK_KHR_present_id, VK_KHR_present_wait: 表示されるまで待つことで、表示待ちのフレームの数を抑えられる
+    if (presentation && isPresentWaitSupported(physicalDevice))
+    {
+        result->push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        result->push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+    }
+#endif
+    return result;
+}
+
 std::shared_ptr<vk::DeviceCreateInfo> getDeviceCreateInfo(std::vector<const char*>& deviceRequiredLayers, std::vector<const char*>& deviceRequiredExtensions, std::vector<vk::DeviceQueueCreateInfo>& queueCreateInfo)
 {
     std::shared_ptr<vk::DeviceCreateInfo> result = std::make_shared<vk::DeviceCreateInfo>();
@@ -81,19 +138,76 @@ std::shared_ptr<vk::UniqueDevice> getDevice(vk::PhysicalDevice& physicalDevice,
     // これならあるプロセスが他のプロセスの存在を意識することなくGPUの能力を使うことができる
 
     std::shared_ptr<vk::UniqueDevice> result = std::make_shared<vk::UniqueDevice>();
-    *result = physicalDevice.createDeviceUnique(deviceCreateInfo);
+    *result = physicalDevice.createDeviceUnique(deviceCreateInfo, getAllocationCallbacks(vk::ObjectType::eDevice));
     return result;
 }
 
-std::shared_ptr<vk::UniqueDevice> getDevice(vk::PhysicalDevice& physicalDevice, uint32_t queueFamilyIndex)
+// 有効化するレイヤーと拡張機能を指定して作成する
+// 対応していればタイムラインセマフォなどの機能も有効化する
+std::shared_ptr<vk::UniqueDevice> getDevice(vk::PhysicalDevice& physicalDevice, std::vector<const char*>& deviceLayers, std::vector<const char*>& deviceExtensions, std::vector<vk::DeviceQueueCreateInfo>& deviceQueueCreateInfos)
+{
+    std::shared_ptr<vk::DeviceCreateInfo> deviceCreateInfo = getDeviceCreateInfo(deviceLayers, deviceExtensions, deviceQueueCreateInfos);
+
+    // 拡張機能と違い、コアの機能もデバイスの作成時に有効化しておかないと使えない
+    // 有効化する機能の構造体はpNextに繋げていく
+    vk::PhysicalDeviceTimelineSemaphoreFeatures timelineSemaphoreFeatures;
+    if (isTimelineSemaphoreSupported(physicalDevice))
+    {
+        timelineSemaphoreFeatures.timelineSemaphore = VK_TRUE;
+        timelineSemaphoreFeatures.pNext = const_cast<void*>(deviceCreateInfo->pNext);
+        deviceCreateInfo->pNext = &timelineSemaphoreFeatures;
+    }
+#if defined(VK_EXT_host_image_copy)
+    // 拡張機能の機能も、拡張機能の有効化とは別に有効化する必要がある
+    vk::PhysicalDeviceHostImageCopyFeaturesEXT hostImageCopyFeatures;
+    if (isHostImageCopySupported(physicalDevice))
+    {
+        hostImageCopyFeatures.hostImageCopy = VK_TRUE;
+        hostImageCopyFeatures.pNext = const_cast<void*>(deviceCreateInfo->pNext);
+        deviceCreateInfo->pNext = &hostImageCopyFeatures;
+    }
+#endif
+#if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+    vk::PhysicalDevicePresentIdFeaturesKHR presentIdFeatures;
+    vk::PhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures;
+    // 拡張機能を有効化している場合だけ繋げる
+    bool presentWaitEnabled = std::any_of(deviceExtensions.begin(), deviceExtensions.end(),
+        [](const char* extensionName) { return std::string_view(extensionName) == VK_KHR_PRESENT_WAIT_EXTENSION_NAME; });
+    if (presentWaitEnabled && isPresentWaitSupported(physicalDevice))
+    {
+        presentIdFeatures.presentId = VK_TRUE;
+        presentWaitFeatures.presentWait = VK_TRUE;
+        presentIdFeatures.pNext = const_cast<void*>(deviceCreateInfo->pNext);
+        presentWaitFeatures.pNext = &presentIdFeatures;
+        deviceCreateInfo->pNext = &presentWaitFeatures;
+    }
+#endif
+
+    return getDevice(physicalDevice, *deviceCreateInfo);
+}
+
+std::shared_ptr<vk::UniqueDevice> getDevice(vk::PhysicalDevice& physicalDevice, uint32_t queueFamilyIndex, std::optional<uint32_t> transferQueueFamilyIndex = std::nullopt)
 {
     std::shared_ptr<std::vector<float>> queuePriorities = getQueuePriorities();
-    std::shared_ptr<std::vector<vk::DeviceQueueCreateInfo>> deviceQueueCreateInfos = getDeviceQueueCreateInfos(*queuePriorities, queueFamilyIndex);
+    std::shared_ptr<std::vector<vk::DeviceQueueCreateInfo>> deviceQueueCreateInfos = getDeviceQueueCreateInfos(*queuePriorities, queueFamilyIndex, transferQueueFamilyIndex);
 
     std::shared_ptr<std::vector<const char*>> deviceRequiredLayers = getRequiredLayers();
     std::shared_ptr<std::vector<const char*>> deviceRequiredExtensions = getRequiredExtensions();
+    std::shared_ptr<std::vector<const char*>> deviceOptionalExtensions = getOptionalExtensions(physicalDevice);
+    std::copy(deviceOptionalExtensions->begin(), deviceOptionalExtensions->end(), std::back_inserter(*deviceRequiredExtensions));
 
-    std::shared_ptr<vk::DeviceCreateInfo> deviceCreateInfo = getDeviceCreateInfo(*deviceRequiredLayers, *deviceRequiredExtensions, *deviceQueueCreateInfos);
+    return getDevice(physicalDevice, *deviceRequiredLayers, *deviceRequiredExtensions, *deviceQueueCreateInfos);
+}
 
-    return getDevice(physicalDevice, *deviceCreateInfo);
+// ベンチマークのようにウィンドウを作らないもの向け
+// スワップチェーンは使わず、検証レイヤーも計測の邪魔になるので有効化しない
+// アップロードやメモリに関係する拡張機能と機能はアプリと同じものを有効化する
+std::shared_ptr<vk::UniqueDevice> getHeadlessDevice(vk::PhysicalDevice& physicalDevice, uint32_t queueFamilyIndex, std::optional<uint32_t> transferQueueFamilyIndex)
+{
+    std::shared_ptr<std::vector<float>> queuePriorities = getQueuePriorities();
+    std::shared_ptr<std::vector<vk::DeviceQueueCreateInfo>> deviceQueueCreateInfos = getDeviceQueueCreateInfos(*queuePriorities, queueFamilyIndex, transferQueueFamilyIndex);
+
+    std::vector<const char*> deviceLayers;
+    std::shared_ptr<std::vector<const char*>> deviceExtensions = getOptionalExtensions(physicalDevice, false);
+    return getDevice(physicalDevice, deviceLayers, *deviceExtensions, *deviceQueueCreateInfos);
 }
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "Memory.hpp"
+#include "FrameArena.hpp"
+
+using namespace Vulkan_Test;
+
+// 頂点バッファやインデックスバッファは起動時に一度だけ丸ごと送っていたが、
+// アニメーションや手続き的に生成するメッシュでは、毎フレーム変わるのは全体のごく一部だけということが多い
+// それを毎フレーム丸ごと送り直すとバスの帯域を無駄にするので、CPU側の写しを書き換えた範囲だけを送る
+//
+// 書き換えた範囲は開始位置の順に並べて持ち、重なるものや近いものはその場で1つにまとめる
+// 送る時はまとめた範囲をフレームアリーナに詰めて書き込み、1回のcopyBufferに複数の領域として記録する
+// copyBufferはレンダーパスの中では記録できないので、beginRenderPassより前に記録する
+
+struct DynamicBufferStats
+{
+    // 送信した範囲の数と、実際に送ったバイト数
+    uint64_t updateCount = 0;
+    uint64_t regionCount = 0;
+    vk::DeviceSize uploadedBytes = 0;
+    // 丸ごと送っていた場合のバイト数
+    vk::DeviceSize fullBytes = 0;
+};
+
+class DynamicBuffer
+{
+public:
+    // 範囲の間がこれ以下しか空いていなければ1つにまとめる
+    // 領域が増えるとコピーのコマンドも増えるので、少しの余分なバイトは一緒に送った方が速い
+    static constexpr vk::DeviceSize mergeGap = 64;
+
+    // pInitialDataの内容で初期化し、最初のrecordUpdateで全体を送る
+    DynamicBuffer(vk::Device device, MemoryAllocator& allocator, vk::BufferUsageFlags usage, MemoryUsage memoryUsage, const void* pInitialData, vk::DeviceSize size)
+        : shadow(size)
+    {
+        vk::BufferCreateInfo bufferCreateInfo;
+        bufferCreateInfo.size = size;
+        bufferCreateInfo.usage = usage | vk::BufferUsageFlagBits::eTransferDst;
+        bufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+        buffer = device.createBufferUnique(bufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+
+        vk::MemoryRequirements memReq = device.getBufferMemoryRequirements(buffer.get());
+        memory = allocator.allocate(memReq, deviceLocalMemoryRequest(), true);
+        memory->setUsage(memoryUsage);
+        device.bindBufferMemory(buffer.get(), memory->memory, memory->offset);
+
+        if (pInitialData != nullptr)
+        {
+            std::memcpy(shadow.data(), pInitialData, size);
+        }
+        markDirty(0, size);
+    }
+
+    DynamicBuffer(const DynamicBuffer&) = delete;
+    DynamicBuffer& operator=(const DynamicBuffer&) = delete;
+
+    // CPU側の写しのoffsetにpDataを書き込み、その範囲を送る対象にする
+    void write(vk::DeviceSize offset, const void* pData, vk::DeviceSize size)
+    {
+        checkRange(offset, size);
+        std::memcpy(shadow.data() + offset, pData, size);
+        markDirty(offset, size);
+    }
+
+    // getDataで直接書き換えた場合は、書き換えた範囲をこれで知らせる
+    void markDirty(vk::DeviceSize offset, vk::DeviceSize size)
+    {
+        if (size == 0)
+        {
+            return;
+        }
+        checkRange(offset, size);
+
+        DirtyRange range{ offset, offset + size };
+        // 範囲は重ならず、間がmergeGapより空いた状態で並んでいるので、まとめる相手は連続した一部分になる
+        std::vector<DirtyRange>::iterator first = std::lower_bound(dirtyRanges.begin(), dirtyRanges.end(), range.begin,
+            [](const DirtyRange& dirtyRange, vk::DeviceSize begin) { return dirtyRange.end + mergeGap < begin; });
+        std::vector<DirtyRange>::iterator last = first;
+        while (last != dirtyRanges.end() && last->begin <= range.end + mergeGap)
+        {
+            range.begin = std::min(range.begin, last->begin);
+            range.end = std::max(range.end, last->end);
+            last++;
+        }
+        first = dirtyRanges.erase(first, last);
+        dirtyRanges.insert(first, range);
+    }
+
+    // 書き換えた範囲をコピーするコマンドを記録する
+    // dstStages, dstAccessはこのバッファを読む側のステージとアクセス
+    // レンダーパスの外、そのフレームで最初にこのバッファを使うより前に記録する
+    void recordUpdate(vk::CommandBuffer cmdBuf, FrameArena& frameArena, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        if (dirtyRanges.empty())
+        {
+            return;
+        }
+
+        vk::DeviceSize totalSize = 0;
+        for (const DirtyRange& range : dirtyRanges)
+        {
+            totalSize += range.end - range.begin;
+        }
+
+        // 全ての範囲をフレームアリーナの1つの領域に詰めて書き込む
+        // フレームアリーナの領域はそのフレームのフェンスを待つまで上書きされないので、コピーが終わるまで残っている
+        FrameArenaAllocation staging = frameArena.allocate(totalSize, FrameArena::vertexAlignment);
+        // 毎フレーム確保しないように、前のフレームの容量を使い回す
+        regions.clear();
+        vk::DeviceSize packedOffset = 0;
+        for (const DirtyRange& range : dirtyRanges)
+        {
+            vk::DeviceSize size = range.end - range.begin;
+            std::memcpy(static_cast<char*>(staging.pData) + packedOffset, shadow.data() + range.begin, size);
+            regions.push_back(vk::BufferCopy(staging.offset + packedOffset, range.begin, size));
+            packedOffset += size;
+        }
+
+        vk::DeviceSize spanBegin = dirtyRanges.front().begin;
+        vk::DeviceSize spanSize = dirtyRanges.back().end - spanBegin;
+
+        // 前のフレームのコマンドがまだこのバッファを読んでいるかもしれないので、それが終わるまで上書きしない
+        // 前のフレームのコピーとの書き込み同士の順序もここで守る
+        vk::BufferMemoryBarrier beforeCopyBarrier;
+        beforeCopyBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        beforeCopyBarrier.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+        beforeCopyBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        beforeCopyBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        beforeCopyBarrier.buffer = buffer.get();
+        beforeCopyBarrier.offset = spanBegin;
+        beforeCopyBarrier.size = spanSize;
+        cmdBuf.pipelineBarrier(dstStages | vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, {}, { beforeCopyBarrier }, {});
+
+        cmdBuf.copyBuffer(staging.buffer, buffer.get(), regions);
+
+        // コピーの書き込みを、このバッファを読むステージから見えるようにする
+        vk::BufferMemoryBarrier afterCopyBarrier;
+        afterCopyBarrier.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        afterCopyBarrier.dstAccessMask = dstAccess;
+        afterCopyBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        afterCopyBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        afterCopyBarrier.buffer = buffer.get();
+        afterCopyBarrier.offset = spanBegin;
+        afterCopyBarrier.size = spanSize;
+        cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, dstStages, {}, {}, { afterCopyBarrier }, {});
+
+        stats.updateCount++;
+        stats.regionCount += regions.size();
+        stats.uploadedBytes += totalSize;
+        stats.fullBytes += shadow.size();
+        dirtyRanges.clear();
+    }
+
+    // CPU側の写し
+    // 書き換えた場合はmarkDirtyを呼ぶ
+    void* getData()
+    {
+        return shadow.data();
+    }
+
+    vk::Buffer getBuffer() const
+    {
+        return buffer.get();
+    }
+
+    vk::DeviceSize getSize() const
+    {
+        return shadow.size();
+    }
+
+    size_t getDirtyRangeCount() const
+    {
+        return dirtyRanges.size();
+    }
+
+    DynamicBufferStats getStats() const
+    {
+        return stats;
+    }
+
+private:
+    struct DirtyRange
+    {
+        vk::DeviceSize begin;
+        vk::DeviceSize end;
+    };
+
+    void checkRange(vk::DeviceSize offset, vk::DeviceSize size) const
+    {
+        if (offset + size > shadow.size())
+        {
+            LOGERR("Dynamic buffer write is out of range. (offset: " << offset << ", size: " << size << ", buffer: " << shadow.size() << " bytes)");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // バッファより後に破棄されるように先に宣言する
+    std::shared_ptr<MemoryAllocation> memory;
+    vk::UniqueBuffer buffer;
+    std::vector<char> shadow;
+    std::vector<DirtyRange> dirtyRanges;
+    std::vector<vk::BufferCopy> regions;
+    DynamicBufferStats stats;
+};
+
+std::shared_ptr<DynamicBuffer> getDynamicBuffer(vk::UniqueDevice& device, MemoryAllocator& allocator, vk::BufferUsageFlags usage, MemoryUsage memoryUsage, const void* pInitialData, vk::DeviceSize size)
+{
+    return std::make_shared<DynamicBuffer>(device.get(), allocator, usage, memoryUsage, pInitialData, size);
+}
+
+void debugDynamicBuffer(DynamicBuffer& dynamicBuffer)
+{
+    DynamicBufferStats stats = dynamicBuffer.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Dynamic Buffer");
+    LOG("size: " << dynamicBuffer.getSize() << " bytes");
+    LOG("updates: " << stats.updateCount << ", regions: " << stats.regionCount);
+    LOG("uploaded: " << stats.uploadedBytes << " bytes (" << stats.fullBytes << " bytes if uploaded in full)");
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "HostAllocator.hpp"
+
+using namespace Vulkan_Test;
+
+// コマンドバッファ、フェンス、セマフォが1組しか無いと、フレームNのGPUでの処理が終わるまでフレームN+1の記録を始められない
+// CPUが記録している間GPUは暇になり、GPUが描画している間CPUは暇になる
+// そこでこれらをフレームの数だけ用意して順番に使い、CPUが次のフレームを記録している間に前のフレームをGPUに描画させる
+//
+// フレームごとに持つもの
+// コマンドバッファ: GPUが実行中のものは記録し直せない
+// フェンス: そのフレームのコマンドバッファやフレームアリーナの領域をもう一度使ってよいかをCPUが知るため
+// イメージの取得を待つセマフォ: 前回そのフレームで取得したイメージの描画が待ち終わるまでは再び使えない
+//
+// 描画の完了を表示に伝えるセマフォはフレームではなくスワップチェーンのイメージごとに持つ
+// 表示がいつそのセマフォを待ち終わるかはアプリからは分からないが、同じイメージがもう一度取得できた時には待ち終わっている
+
+// 同時に処理中にできるフレームの数の上限
+// 増やすほどCPUとGPUが重なりやすくなるが、その分入力から表示までの遅延が伸び、フレームごとのリソースも増える
+constexpr uint32_t maxFramesInFlight = 4;
+
+// 起動時に同時に処理中にできるフレームの数を決める
+// 環境変数VULKAN_TEST_FRAMES_IN_FLIGHTで1からmaxFramesInFlightまでを指定でき、無ければ2にする
+uint32_t getFramesInFlight()
+{
+    uint32_t result = 2;
+#if !defined(__ANDROID__)
+    const char* value = std::getenv("VULKAN_TEST_FRAMES_IN_FLIGHT");
+    if (value != nullptr)
+    {
+        result = uint32_t(std::strtoul(value, nullptr, 10));
+    }
+#endif
+    return std::clamp<uint32_t>(result, 1, maxFramesInFlight);
+}
+
+struct FrameResources
+{
+    vk::UniqueCommandBuffer cmdBuf;
+    vk::UniqueSemaphore imageAcquiredSemaphore;
+    // 作成時はシグナル状態にしておき、最初のフレームで待たないようにする
+    vk::UniqueFence inFlightFence;
+};
+
+struct FrameStats
+{
+    uint64_t frameCount = 0;
+    // フェンスがまだシグナルされておらず、CPUがGPUを待った回数と時間
+    uint64_t stallCount = 0;
+    double stallMs = 0.0;
+};
+
+class FrameManager
+{
+public:
+    FrameManager(vk::Device device, vk::CommandPool cmdPool, uint32_t frameCount)
+        : device(device)
+    {
+        vk::CommandBufferAllocateInfo cmdBufAllocInfo;
+        cmdBufAllocInfo.commandPool = cmdPool;
+        cmdBufAllocInfo.commandBufferCount = frameCount;
+        cmdBufAllocInfo.level = vk::CommandBufferLevel::ePrimary;
+        std::vector<vk::UniqueCommandBuffer> cmdBufs = device.allocateCommandBuffersUnique(cmdBufAllocInfo);
+
+        vk::SemaphoreCreateInfo semaphoreCreateInfo;
+        vk::FenceCreateInfo fenceCreateInfo;
+        fenceCreateInfo.flags = vk::FenceCreateFlagBits::eSignaled;
+
+        frames.resize(frameCount);
+        for (uint32_t i = 0; i < frameCount; i++)
+        {
+            frames[i].cmdBuf = std::move(cmdBufs[i]);
+            frames[i].imageAcquiredSemaphore = device.createSemaphoreUnique(semaphoreCreateInfo, getAllocationCallbacks(vk::ObjectType::eSemaphore));
+            frames[i].inFlightFence = device.createFenceUnique(fenceCreateInfo, getAllocationCallbacks(vk::ObjectType::eFence));
+        }
+    }
+
+    FrameManager(const FrameManager&) = delete;
+    FrameManager& operator=(const FrameManager&) = delete;
+
+    // 次のフレームに進み、前回同じフレームを使った時のGPUでの処理が終わるまで待つ
+    // 戻った後は、そのフレームのコマンドバッファやフレームアリーナの領域を書き換えてよい
+    FrameResources& beginFrame()
+    {
+        currentFrameIndex = (currentFrameIndex + 1) % frames.size();
+        FrameResources& frame = frames[currentFrameIndex];
+
+        if (device.getFenceStatus(frame.inFlightFence.get()) == vk::Result::eNotReady)
+        {
+            std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+            vk::Result waitResult = device.waitForFences({ frame.inFlightFence.get() }, VK_TRUE, UINT64_MAX);
+            if (waitResult != vk::Result::eSuccess)
+            {
+                LOGERR("Failed to wait for frame " << currentFrameIndex);
+                exit(EXIT_FAILURE);
+            }
+            stats.stallCount++;
+            stats.stallMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        }
+        stats.frameCount++;
+        return frame;
+    }
+
+    // イメージを取得した後に呼ぶ
+    // そのイメージを描画中の別のフレームがあれば、それが終わるまで待つ
+    // (フレームの数がスワップチェーンのイメージの数より多い場合や、イメージが順番通りに返ってこない場合に起こる)
+    // その後このフレームのフェンスをリセットするので、この後は必ずそのフェンスを指定して送信する
+    void beginImage(uint32_t imageIndex)
+    {
+        vk::Fence imageFence = imagesInFlight[imageIndex];
+        vk::Fence frameFence = frames[currentFrameIndex].inFlightFence.get();
+        if (imageFence && imageFence != frameFence)
+        {
+            vk::Result waitResult = device.waitForFences({ imageFence }, VK_TRUE, UINT64_MAX);
+            if (waitResult != vk::Result::eSuccess)
+            {
+                LOGERR("Failed to wait for swapchain image " << imageIndex);
+                exit(EXIT_FAILURE);
+            }
+        }
+        imagesInFlight[imageIndex] = frameFence;
+        device.resetFences({ frameFence });
+    }
+
+    // スワップチェーンを作り直した時に、イメージの数に合わせてイメージごとのセマフォを作り直す
+    // 古いセマフォを表示がまだ待っているかもしれないので、呼ぶ前にキューが空になるのを待っておく
+    void resetSwapchainImages(uint32_t imageCount)
+    {
+        renderFinishedSemaphores.clear();
+        vk::SemaphoreCreateInfo semaphoreCreateInfo;
+        for (uint32_t i = 0; i < imageCount; i++)
+        {
+            renderFinishedSemaphores.push_back(device.createSemaphoreUnique(semaphoreCreateInfo, getAllocationCallbacks(vk::ObjectType::eSemaphore)));
+        }
+        imagesInFlight.assign(imageCount, vk::Fence());
+    }
+
+    vk::Semaphore getRenderFinishedSemaphore(uint32_t imageIndex) const
+    {
+        return renderFinishedSemaphores[imageIndex].get();
+    }
+
+    FrameResources& getCurrentFrame()
+    {
+        return frames[currentFrameIndex];
+    }
+
+    // フレームアリーナの領域など、フレームごとのリソースを選ぶための番号
+    uint32_t getCurrentFrameIndex() const
+    {
+        return currentFrameIndex;
+    }
+
+    uint32_t getFrameCount() const
+    {
+        return uint32_t(frames.size());
+    }
+
+    FrameStats getStats() const
+    {
+        return stats;
+    }
+
+private:
+    vk::Device device;
+    std::vector<FrameResources> frames;
+    // 最初のbeginFrameで0になるように最後の番号から始める
+    uint32_t currentFrameIndex = UINT32_MAX;
+    std::vector<vk::UniqueSemaphore> renderFinishedSemaphores;
+    // イメージごとに、そのイメージを最後に描画したフレームのフェンス
+    std::vector<vk::Fence> imagesInFlight;
+    FrameStats stats;
+};
+
+std::shared_ptr<FrameManager> getFrameManager(vk::UniqueDevice& device, vk::UniqueCommandPool& cmdPool, uint32_t frameCount)
+{
+    return std::make_shared<FrameManager>(device.get(), cmdPool.get(), frameCount);
+}
+
+void debugFrameManager(FrameManager& frameManager)
+{
+    FrameStats stats = frameManager.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Frame Manager");
+    LOG("frames in flight: " << frameManager.getFrameCount());
+    LOG("frames: " << stats.frameCount << ", waited for the GPU: " << stats.stallCount << " times, " << stats.stallMs << " ms");
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <cstring>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "Memory.hpp"
+
+using namespace Vulkan_Test;
+
+// 毎フレーム書き換えるユニフォームや小さな頂点データのための線形アロケータ
+// ホスト可視のバッファを1つだけ作ってマップしたままにし、フレームごとの領域に分けておく
+// 各フレームの領域では先頭から順に切り出していくだけで、解放はそのフレームのフェンスを待った後にまとめて巻き戻す
+// 描画するオブジェクトの数が増えても、ホットパスでのメモリ確保やmap/unmapは一切発生しない
+
+// 切り出した範囲
+// offsetはバッファの先頭からの位置で、ダイナミックオフセットとしてそのまま渡せる
+struct FrameArenaAllocation
+{
+    vk::Buffer buffer;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    void* pData = nullptr;
+};
+
+class FrameArena
+{
+public:
+    // 頂点データの切り出しで揃える境界
+    static constexpr vk::DeviceSize vertexAlignment = 16;
+
+    FrameArena(vk::Device device, vk::PhysicalDevice physicalDevice, MemoryAllocator& allocator, uint32_t frameCount, vk::DeviceSize bytesPerFrame)
+        : allocator(allocator), frameCount(frameCount)
+    {
+        vk::PhysicalDeviceProperties props = physicalDevice.getProperties();
+        uniformAlignment = props.limits.minUniformBufferOffsetAlignment;
+        // 各フレームの先頭がどの用途の境界にも揃うようにする
+        regionSize = alignUp(bytesPerFrame, std::max(uniformAlignment, vertexAlignment));
+
+        vk::BufferCreateInfo bufferCreateInfo;
+        bufferCreateInfo.size = regionSize * frameCount;
+        // eTransferSrcはDynamicBufferが書き換えた範囲をここからコピーするため
+        bufferCreateInfo.usage = vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferSrc;
+        bufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+        buffer = device.createBufferUnique(bufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+
+        vk::MemoryRequirements memReq = device.getBufferMemoryRequirements(buffer.get());
+        memory = allocator.allocate(memReq, hostToDeviceMemoryRequest(), true);
+        memory->setUsage(MemoryUsage::Uniform);
+        device.bindBufferMemory(buffer.get(), memory->memory, memory->offset);
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // フレームの最初、そのフレームのフェンスを待った後に呼ぶ
+    // 前回同じ領域を使ったフレームはGPU側で完了しているので、丸ごと巻き戻してよい
+    void beginFrame(uint32_t frameIndex)
+    {
+        currentFrameIndex = frameIndex % frameCount;
+        regionBegin = regionSize * currentFrameIndex;
+        head = regionBegin;
+    }
+
+    FrameArenaAllocation allocate(vk::DeviceSize size, vk::DeviceSize alignment)
+    {
+        vk::DeviceSize offset = alignUp(head, alignment);
+        if (offset + size > regionBegin + regionSize)
+        {
+            LOGERR("Frame arena is out of space. (" << regionSize << " bytes per frame)");
+            exit(EXIT_FAILURE);
+        }
+        head = offset + size;
+        peakUsedBytes = std::max(peakUsedBytes, head - regionBegin);
+
+        FrameArenaAllocation result;
+        result.buffer = buffer.get();
+        result.offset = offset;
+        result.size = size;
+        result.pData = static_cast<char*>(memory->pMapped) + offset;
+        return result;
+    }
+
+    FrameArenaAllocation allocateUniform(vk::DeviceSize size)
+    {
+        return allocate(size, uniformAlignment);
+    }
+
+    FrameArenaAllocation allocateVertex(vk::DeviceSize size)
+    {
+        return allocate(size, vertexAlignment);
+    }
+
+    // データをコピーしてダイナミックオフセットを返す
+    template <typename T>
+    uint32_t pushUniform(const T& data)
+    {
+        FrameArenaAllocation allocation = allocateUniform(sizeof(T));
+        std::memcpy(allocation.pData, &data, sizeof(T));
+        return uint32_t(allocation.offset);
+    }
+
+    // 記録したコマンドを送信する前に呼ぶ
+    // コヒーレントなメモリなら何もしない
+    void flush()
+    {
+        if (head > regionBegin)
+        {
+            allocator.flush(*memory, regionBegin, head - regionBegin);
+        }
+    }
+
+    vk::Buffer getBuffer() const
+    {
+        return buffer.get();
+    }
+
+    vk::DeviceSize getBytesPerFrame() const
+    {
+        return regionSize;
+    }
+
+    vk::DeviceSize getUsedBytes() const
+    {
+        return head - regionBegin;
+    }
+
+    vk::DeviceSize getPeakUsedBytes() const
+    {
+        return peakUsedBytes;
+    }
+
+private:
+    MemoryAllocator& allocator;
+    // バッファより後に破棄されるように先に宣言する
+    std::shared_ptr<MemoryAllocation> memory;
+    vk::UniqueBuffer buffer;
+    uint32_t frameCount;
+    uint32_t currentFrameIndex = 0;
+    vk::DeviceSize uniformAlignment = 1;
+    vk::DeviceSize regionSize = 0;
+    vk::DeviceSize regionBegin = 0;
+    vk::DeviceSize head = 0;
+    vk::DeviceSize peakUsedBytes = 0;
+};
+
+std::shared_ptr<FrameArena> getFrameArena(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, MemoryAllocator& allocator, uint32_t frameCount, vk::DeviceSize bytesPerFrame)
+{
+    return std::make_shared<FrameArena>(device.get(), physicalDevice, allocator, frameCount, bytesPerFrame);
+}
+
+void debugFrameArena(FrameArena& frameArena)
+{
+    LOG("----------------------------------------");
+    LOG("Debug Frame Arena");
+    LOG("bytes per frame: " << frameArena.getBytesPerFrame());
+    LOG("peak used: " << frameArena.getPeakUsedBytes() << " bytes");
+}
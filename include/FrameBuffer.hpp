@@ -5,6 +5,7 @@
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 using namespace Vulkan_Test;
 
@@ -44,7 +45,7 @@ std::shared_ptr<std::vector<vk::UniqueFramebuffer>> getFramebuffers(vk::UniqueDe
         // パイプラインの作成処理でもレンダーパスの情報を渡しているが、ここにも同じ事情がある
         // フレームバッファとパイプラインは特定のレンダーパスに依存して作られるものであり、互換性のない他のレンダーパスのために働こうと思ってもそのようなことはできない
         // 結びつけを行っている訳ではないのにレンダーパスの情報を渡さなければならないのはそのため
-        (*result)[i] = device.get().createFramebufferUnique(framebufferCreateInfo);
+        (*result)[i] = device.get().createFramebufferUnique(framebufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eFramebuffer));
     }
 
     return result;
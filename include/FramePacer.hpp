@@ -0,0 +1,328 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <limits>
+#include <cstdlib>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "PhysicalDevice.hpp"
+
+using namespace Vulkan_Test;
+
+// フレームの時間はsystem_clockのミリ秒の整数で測っていたので、時計の補正で飛んだり、1ミリ秒未満が切り捨てられたりしていた
+// また、フレームレートを制限するものも、表示待ちのフレームの数を抑えるものも無かった
+// fifoでは表示がGPUより遅いと表示待ちのイメージが溜まっていき、入力から表示までの遅延がその分だけ伸びる
+//
+// そこでフレームの始めに次の2つを行ってから入力を読む
+// 1. 目標のフレームレートが指定されていれば、前のフレームの開始から1フレーム分の時間が経つまで待つ
+// 2. VK_KHR_present_waitが使えれば、表示待ちのフレームがmaxQueuedPresents個以下になるまで、前に送ったイメージの表示を待つ
+// 待ち終わってから入力を読むので、読んだ入力は待った分だけ新しくなる
+//
+// VK_KHR_present_idで送るイメージに番号を付けておくと、vkWaitForPresentKHRでその番号のイメージが表示されるまで待てる
+// 番号はスワップチェーンごとに増えていけばよく、古いスワップチェーンで使った番号から続けても問題ない
+
+// 目標のフレームレート
+// 環境変数VULKAN_TEST_TARGET_FPSで指定でき、無いか0なら制限しない
+double getTargetFrameRate()
+{
+#if !defined(__ANDROID__)
+    const char* value = std::getenv("VULKAN_TEST_TARGET_FPS");
+    if (value != nullptr)
+    {
+        return std::max(std::strtod(value, nullptr), 0.0);
+    }
+#endif
+    return 0.0;
+}
+
+// 表示待ちにしておけるフレームの数
+// 環境変数VULKAN_TEST_MAX_QUEUED_PRESENTSで0から3までを指定でき、無ければ1にする
+// 0なら前のフレームが表示されるまで次のフレームを始めず、遅延は最小になるがCPUとGPUは重ならなくなる
+uint32_t getMaxQueuedPresents()
+{
+    uint32_t result = 1;
+#if !defined(__ANDROID__)
+    const char* value = std::getenv("VULKAN_TEST_MAX_QUEUED_PRESENTS");
+    if (value != nullptr)
+    {
+        result = uint32_t(std::strtoul(value, nullptr, 10));
+    }
+#endif
+    return std::min<uint32_t>(result, 3);
+}
+
+struct LatencyStats
+{
+    uint64_t count = 0;
+    double totalMs = 0.0;
+    double minMs = std::numeric_limits<double>::max();
+    double maxMs = 0.0;
+
+    void add(double ms)
+    {
+        count++;
+        totalMs += ms;
+        minMs = std::min(minMs, ms);
+        maxMs = std::max(maxMs, ms);
+    }
+};
+
+struct FramePacerStats
+{
+    uint64_t frameCount = 0;
+    // フレームレートの制限で待った時間
+    double limiterMs = 0.0;
+    // 前のイメージの表示を待った回数と時間
+    uint64_t presentWaitCount = 0;
+    uint64_t presentWaitTimeoutCount = 0;
+    double presentWaitMs = 0.0;
+    // イメージを取得してからqueuePresentKHRが戻るまで
+    LatencyStats acquireToPresentCall;
+    // イメージを取得してから表示されるまで(present waitが使える場合だけ)
+    LatencyStats acquireToDisplay;
+};
+
+class FramePacer
+{
+public:
+    // 前のイメージの表示を待つ時の上限
+    // 表示されないまま待ち続けることがないように、これを過ぎたら諦めて次のフレームに進む
+    static constexpr uint64_t presentWaitTimeoutNs = 100 * 1000 * 1000;
+    // フレームレートの制限で、最後のこの時間はスリープせずに待つ
+    // スリープから戻るまでの時間はOS次第でばらつくので、その分を空回りで詰める
+    static constexpr std::chrono::microseconds spinDuration = std::chrono::microseconds(1000);
+
+    // presentWaitEnabledは、デバイスでVK_KHR_present_idとVK_KHR_present_waitを有効化しているか
+    FramePacer(vk::Device device, bool presentWaitEnabled, double targetFrameRate, uint32_t maxQueuedPresents)
+        : device(device), maxQueuedPresents(maxQueuedPresents), acquireTimes(acquireTimeCount)
+    {
+        if (targetFrameRate > 0.0)
+        {
+            framePeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / targetFrameRate));
+        }
+#if defined(VK_KHR_present_wait)
+        if (presentWaitEnabled)
+        {
+            // 拡張機能の関数はローダーから直接は呼べないので、デバイスから取得する
+            waitForPresent = reinterpret_cast<PFN_vkWaitForPresentKHR>(device.getProcAddr("vkWaitForPresentKHR"));
+        }
+#endif
+    }
+
+    FramePacer(const FramePacer&) = delete;
+    FramePacer& operator=(const FramePacer&) = delete;
+
+    // フレームの始め、入力を読む前に呼ぶ
+    // 戻り値は前のフレームの開始からの経過時間(秒)
+    float beginFrame()
+    {
+        limitFrameRate();
+        waitForQueuedPresents();
+
+        std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+        float deltaTime = 0.0f;
+        if (stats.frameCount > 0)
+        {
+            deltaTime = std::chrono::duration<float>(frameStart - lastFrameStart).count();
+        }
+        lastFrameStart = frameStart;
+        stats.frameCount++;
+        return deltaTime;
+    }
+
+    // イメージを取得できた直後に呼ぶ
+    void markAcquired()
+    {
+        acquireTime = std::chrono::steady_clock::now();
+    }
+
+    // present waitが使える場合は、送るイメージに番号を付ける
+    // presentInfoのpNextに繋ぐ構造体はこのクラスが持っているので、次にこれを呼ぶまでにqueuePresentKHRを呼ぶ
+    void setPresentId(vk::PresentInfoKHR& presentInfo)
+    {
+#if defined(VK_KHR_present_id)
+        if (!isPresentWaitEnabled())
+        {
+            return;
+        }
+        lastPresentId++;
+        acquireTimes[lastPresentId % acquireTimeCount] = acquireTime;
+
+        presentIdInfo = vk::PresentIdKHR();
+        presentIdInfo.swapchainCount = 1;
+        presentIdInfo.pPresentIds = &lastPresentId;
+        presentIdInfo.pNext = presentInfo.pNext;
+        presentInfo.pNext = &presentIdInfo;
+#endif
+    }
+
+    // queuePresentKHRが戻った後に呼ぶ
+    void markPresented()
+    {
+        stats.acquireToPresentCall.add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - acquireTime).count());
+    }
+
+    // スワップチェーンを作り直した時に呼ぶ
+    // 古いスワップチェーンで送った番号は、新しいスワップチェーンでは待てない
+    void resetSwapchain(vk::SwapchainKHR swapchain)
+    {
+        this->swapchain = swapchain;
+        firstPresentId = lastPresentId + 1;
+        completedPresentId = lastPresentId;
+    }
+
+    bool isPresentWaitEnabled() const
+    {
+        return waitForPresent != nullptr;
+    }
+
+    uint32_t getMaxQueuedPresents() const
+    {
+        return maxQueuedPresents;
+    }
+
+    double getTargetFrameRate() const
+    {
+        return framePeriod.count() > 0 ? 1.0 / std::chrono::duration<double>(framePeriod).count() : 0.0;
+    }
+
+    FramePacerStats getStats() const
+    {
+        return stats;
+    }
+
+private:
+    // 取得した時刻を番号ごとに覚えておく数
+    // 表示待ちのフレームはこれより多くならない
+    static constexpr uint64_t acquireTimeCount = 16;
+
+    void limitFrameRate()
+    {
+        if (framePeriod.count() == 0)
+        {
+            return;
+        }
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (nextFrameTime == std::chrono::steady_clock::time_point())
+        {
+            nextFrameTime = now;
+        }
+
+        if (now < nextFrameTime)
+        {
+            std::chrono::steady_clock::time_point sleepEnd = nextFrameTime - spinDuration;
+            if (now < sleepEnd)
+            {
+                std::this_thread::sleep_until(sleepEnd);
+            }
+            while (std::chrono::steady_clock::now() < nextFrameTime)
+            {
+                std::this_thread::yield();
+            }
+            stats.limiterMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - now).count();
+        }
+
+        // 目標より遅れている場合は取り戻そうとせず、今から1フレーム分後を次の目標にする
+        nextFrameTime += framePeriod;
+        if (nextFrameTime < now)
+        {
+            nextFrameTime = now + framePeriod;
+        }
+    }
+
+    void waitForQueuedPresents()
+    {
+#if defined(VK_KHR_present_wait)
+        if (!isPresentWaitEnabled() || !swapchain || lastPresentId < firstPresentId + maxQueuedPresents)
+        {
+            return;
+        }
+
+        // このスワップチェーンで送った番号のうち、表示待ちがmaxQueuedPresents個になるまで待つ
+        uint64_t waitPresentId = lastPresentId - maxQueuedPresents;
+        if (waitPresentId <= completedPresentId)
+        {
+            return;
+        }
+
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        VkResult result = waitForPresent(device, swapchain, waitPresentId, presentWaitTimeoutNs);
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        stats.presentWaitCount++;
+        stats.presentWaitMs += std::chrono::duration<double, std::milli>(end - begin).count();
+
+        if (result == VK_SUCCESS)
+        {
+            completedPresentId = waitPresentId;
+            // 表示された時刻そのものは分からないので、待ち終わった時刻で代わりにする
+            // 既に表示されていた場合は実際より長くなるが、溜まった表示待ちで伸びた遅延は捉えられる
+            stats.acquireToDisplay.add(std::chrono::duration<double, std::milli>(end - acquireTimes[waitPresentId % acquireTimeCount]).count());
+        }
+        else if (result == VK_TIMEOUT)
+        {
+            stats.presentWaitTimeoutCount++;
+        }
+        // eErrorOutOfDateKHRなどはイメージの取得の方で作り直すので、ここでは何もしない
+#endif
+    }
+
+    vk::Device device;
+    uint32_t maxQueuedPresents;
+#if defined(VK_KHR_present_wait)
+    PFN_vkWaitForPresentKHR waitForPresent = nullptr;
+#else
+    void* waitForPresent = nullptr;
+#endif
+    vk::SwapchainKHR swapchain;
+#if defined(VK_KHR_present_id)
+    vk::PresentIdKHR presentIdInfo;
+#endif
+
+    std::chrono::steady_clock::duration framePeriod = std::chrono::steady_clock::duration::zero();
+    std::chrono::steady_clock::time_point nextFrameTime;
+    std::chrono::steady_clock::time_point lastFrameStart;
+    std::chrono::steady_clock::time_point acquireTime;
+
+    // 最後に送ったイメージの番号と、今のスワップチェーンで最初に送った番号
+    uint64_t lastPresentId = 0;
+    uint64_t firstPresentId = 1;
+    // 表示されたことを確かめた最後の番号
+    uint64_t completedPresentId = 0;
+    std::vector<std::chrono::steady_clock::time_point> acquireTimes;
+    FramePacerStats stats;
+};
+
+std::shared_ptr<FramePacer> getFramePacer(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, double targetFrameRate, uint32_t maxQueuedPresents)
+{
+    // getDeviceは対応していればVK_KHR_present_idとVK_KHR_present_waitを有効化している
+    return std::make_shared<FramePacer>(device.get(), isPresentWaitSupported(physicalDevice), targetFrameRate, maxQueuedPresents);
+}
+
+void debugLatencyStats(const char* name, const LatencyStats& latencyStats)
+{
+    if (latencyStats.count == 0)
+    {
+        LOG(name << ": not measured");
+        return;
+    }
+    LOG(name << ": avg " << latencyStats.totalMs / latencyStats.count << " ms, min " << latencyStats.minMs << " ms, max " << latencyStats.maxMs << " ms");
+}
+
+void debugFramePacer(FramePacer& framePacer)
+{
+    FramePacerStats stats = framePacer.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Frame Pacer");
+    LOG("target frame rate: " << (framePacer.getTargetFrameRate() > 0.0 ? std::to_string(framePacer.getTargetFrameRate()) : std::string("unlimited")));
+    LOG("present wait: " << (framePacer.isPresentWaitEnabled() ? "enabled" : "not supported") << ", max queued presents: " << framePacer.getMaxQueuedPresents());
+    LOG("frames: " << stats.frameCount << ", limiter: " << stats.limiterMs << " ms");
+    LOG("present waits: " << stats.presentWaitCount << " (" << stats.presentWaitTimeoutCount << " timed out), " << stats.presentWaitMs << " ms");
+    debugLatencyStats("acquire to present call", stats.acquireToPresentCall);
+    debugLatencyStats("acquire to display", stats.acquireToDisplay);
+}
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <vector>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include "Utility.hpp"
+#include "Debug.hpp"
+
+using namespace Vulkan_Test;
+
+// フレームの時間は経過時間としてアニメーションに使うだけで、記録していなかった
+// 平均だけではたまに起こる引っかかりが見えないので、フレームごとの時間を区間ごとにマイクロ秒の精度で記録し、
+// 直近のフレームの平均、p50、p95、p99、最大を出せるようにする
+//
+// 記録は固定の数のリングバッファに上書きしていくので、毎フレームの記録でヒープの確保は起きない
+// 集計と書き出しは確保を伴うので、終了時かF9を押した時だけ行う
+
+enum class FrameTimeMetric
+{
+    // ループの1回分(フレームレートの制限や表示の待ちも含む)
+    Frame,
+    // そのフレームのフェンスを待った時間
+    FenceWait,
+    // acquireNextImageKHR
+    Acquire,
+    // キューへの送信
+    Submit,
+    // queuePresentKHR
+    Present,
+    // レンダーパスの記録 並列に記録する場合は、全てのスレッドの記録が終わるまでの時間
+    // 書き出した列の順番が変わらないように最後に置く
+    Record,
+};
+
+constexpr uint32_t frameTimeMetricCount = 6;
+
+inline const char* toString(FrameTimeMetric metric)
+{
+    switch (metric)
+    {
+    case FrameTimeMetric::Frame:
+        return "frame_time";
+    case FrameTimeMetric::FenceWait:
+        return "fence_wait";
+    case FrameTimeMetric::Acquire:
+        return "acquire";
+    case FrameTimeMetric::Submit:
+        return "submit";
+    case FrameTimeMetric::Present:
+        return "present";
+    case FrameTimeMetric::Record:
+        return "record";
+    }
+    return "unknown";
+}
+
+struct FrameTimeSample
+{
+    uint64_t frame = 0;
+    // マイクロ秒
+    std::array<float, frameTimeMetricCount> times = {};
+};
+
+struct FrameTimeSummary
+{
+    // マイクロ秒
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+class FrameTimeStats
+{
+public:
+    // 直近capacityフレームを残す
+    FrameTimeStats(uint32_t capacity)
+        : samples(std::max<uint32_t>(capacity, 1))
+    {
+    }
+
+    FrameTimeStats(const FrameTimeStats&) = delete;
+    FrameTimeStats& operator=(const FrameTimeStats&) = delete;
+
+    // ループの始めに呼ぶ
+    void beginFrame()
+    {
+        frameStart = std::chrono::steady_clock::now();
+        current = FrameTimeSample();
+    }
+
+    // beginからの時間を、このフレームのmetricに足す
+    void record(FrameTimeMetric metric, std::chrono::steady_clock::time_point begin)
+    {
+        current.times[uint32_t(metric)] += std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // ループの終わりに呼ぶ
+    // 途中でcontinueしたフレームは記録しない
+    void endFrame(uint64_t frame)
+    {
+        current.frame = frame;
+        record(FrameTimeMetric::Frame, frameStart);
+        samples[head] = current;
+        head = (head + 1) % samples.size();
+        sampleCount = std::min<uint64_t>(sampleCount + 1, samples.size());
+        totalFrameCount++;
+    }
+
+    // 残っているものを古い順に返す
+    std::vector<FrameTimeSample> getSamples() const
+    {
+        std::vector<FrameTimeSample> result;
+        result.reserve(sampleCount);
+        size_t first = (head + samples.size() - sampleCount) % samples.size();
+        for (size_t i = 0; i < sampleCount; i++)
+        {
+            result.push_back(samples[(first + i) % samples.size()]);
+        }
+        return result;
+    }
+
+    // 残っているフレームのmetricを集計する
+    // パーセンタイルは小さい順に並べてその割合の位置にあるもの(nearest-rank)
+    FrameTimeSummary getSummary(FrameTimeMetric metric) const
+    {
+        FrameTimeSummary result;
+        if (sampleCount == 0)
+        {
+            return result;
+        }
+
+        std::vector<float> times;
+        times.reserve(sampleCount);
+        double total = 0.0;
+        for (const FrameTimeSample& sample : getSamples())
+        {
+            times.push_back(sample.times[uint32_t(metric)]);
+            total += sample.times[uint32_t(metric)];
+        }
+        std::sort(times.begin(), times.end());
+
+        auto percentile = [&](double p)
+        {
+            size_t rank = size_t(std::ceil(p / 100.0 * times.size()));
+            return double(times[std::clamp<size_t>(rank, 1, times.size()) - 1]);
+        };
+        result.mean = total / times.size();
+        result.p50 = percentile(50.0);
+        result.p95 = percentile(95.0);
+        result.p99 = percentile(99.0);
+        result.max = times.back();
+        return result;
+    }
+
+    uint32_t getCapacity() const
+    {
+        return uint32_t(samples.size());
+    }
+
+    uint64_t getSampleCount() const
+    {
+        return sampleCount;
+    }
+
+    uint64_t getTotalFrameCount() const
+    {
+        return totalFrameCount;
+    }
+
+private:
+    std::vector<FrameTimeSample> samples;
+    size_t head = 0;
+    uint64_t sampleCount = 0;
+    uint64_t totalFrameCount = 0;
+    std::chrono::steady_clock::time_point frameStart;
+    FrameTimeSample current;
+};
+
+std::shared_ptr<FrameTimeStats> getFrameTimeStats(uint32_t capacity)
+{
+    return std::make_shared<FrameTimeStats>(capacity);
+}
+
+// 書き出す形式
+// 環境変数VULKAN_TEST_FRAME_STATS_FORMATにcsvかjsonを指定でき、無ければjsonにする
+// CSVはフレームごとの時間を1行ずつ、JSONは集計とフレームごとの時間を書き出す
+bool isFrameTimeStatsCsv()
+{
+#if !defined(__ANDROID__)
+    const char* value = std::getenv("VULKAN_TEST_FRAME_STATS_FORMAT");
+    if (value != nullptr)
+    {
+        return std::strcmp(value, "csv") == 0;
+    }
+#endif
+    return false;
+}
+
+void writeFrameTimeStatsCsv(FrameTimeStats& frameTimeStats, std::ostream& out)
+{
+    out << "frame";
+    for (uint32_t i = 0; i < frameTimeMetricCount; i++)
+    {
+        out << "," << toString(FrameTimeMetric(i)) << "_us";
+    }
+    out << "\n";
+
+    for (const FrameTimeSample& sample : frameTimeStats.getSamples())
+    {
+        out << sample.frame;
+        for (float time : sample.times)
+        {
+            out << "," << time;
+        }
+        out << "\n";
+    }
+}
+
+void writeFrameTimeStatsJson(FrameTimeStats& frameTimeStats, std::ostream& out)
+{
+    out << "{\n";
+    out << "  \"frames\": " << frameTimeStats.getTotalFrameCount() << ",\n";
+    out << "  \"samples\": " << frameTimeStats.getSampleCount() << ",\n";
+
+    out << "  \"summary_us\": {\n";
+    for (uint32_t i = 0; i < frameTimeMetricCount; i++)
+    {
+        FrameTimeSummary summary = frameTimeStats.getSummary(FrameTimeMetric(i));
+        out << "    \"" << toString(FrameTimeMetric(i)) << "\": {"
+            << " \"mean\": " << summary.mean
+            << ", \"p50\": " << summary.p50
+            << ", \"p95\": " << summary.p95
+            << ", \"p99\": " << summary.p99
+            << ", \"max\": " << summary.max
+            << " }" << (i + 1 < frameTimeMetricCount ? "," : "") << "\n";
+    }
+    out << "  },\n";
+
+    std::vector<FrameTimeSample> samples = frameTimeStats.getSamples();
+    out << "  \"frames_us\": [\n";
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        out << "    { \"frame\": " << samples[i].frame;
+        for (uint32_t j = 0; j < frameTimeMetricCount; j++)
+        {
+            out << ", \"" << toString(FrameTimeMetric(j)) << "\": " << samples[i].times[j];
+        }
+        out << " }" << (i + 1 < samples.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n";
+    out << "}\n";
+}
+
+// frame_times_<フレーム数>.csvかframe_times_<フレーム数>.jsonに書き出し、そのパスを返す
+std::string exportFrameTimeStats(FrameTimeStats& frameTimeStats, bool csv, const std::string& directory = ".")
+{
+    std::stringstream path;
+    path << directory << "/frame_times_" << frameTimeStats.getTotalFrameCount() << (csv ? ".csv" : ".json");
+
+    std::ofstream file(path.str());
+    if (!file)
+    {
+        LOGERR("Failed to open " << path.str());
+        return std::string();
+    }
+    if (csv)
+    {
+        writeFrameTimeStatsCsv(frameTimeStats, file);
+    }
+    else
+    {
+        writeFrameTimeStatsJson(frameTimeStats, file);
+    }
+    LOG("Frame time stats written to " << path.str());
+    return path.str();
+}
+
+void debugFrameTimeStats(FrameTimeStats& frameTimeStats)
+{
+    LOG("----------------------------------------");
+    LOG("Debug Frame Time Stats");
+    LOG("frames: " << frameTimeStats.getTotalFrameCount() << ", last " << frameTimeStats.getSampleCount() << " frames (us):");
+    for (uint32_t i = 0; i < frameTimeMetricCount; i++)
+    {
+        FrameTimeSummary summary = frameTimeStats.getSummary(FrameTimeMetric(i));
+        LOG(toString(FrameTimeMetric(i)) << ": mean " << summary.mean << ", p50 " << summary.p50 << ", p95 " << summary.p95 << ", p99 " << summary.p99 << ", max " << summary.max);
+    }
+}
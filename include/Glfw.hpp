@@ -2,6 +2,8 @@
 
 #include <iostream>
 #include <memory>
+#include <cstdlib>
+#include <cstring>
 #include <vulkan/vulkan.hpp>
 #include <GLFW/glfw3.h>
 #include "Utility.hpp"
@@ -17,6 +19,14 @@ std::shared_ptr<GLFWwindow> getGlfwWindow(int width, int height, const char *tit
     }
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    // 環境変数VULKAN_TEST_HIDDEN_WINDOWを指定すると、ウィンドウを画面に出さずに動かす
+    // CTestで決まったフレーム数だけ実行する時に使う
+#if !defined(__ANDROID__)
+    if (std::getenv("VULKAN_TEST_HIDDEN_WINDOW") != nullptr)
+    {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    }
+#endif
 
     GLFWwindow* window = glfwCreateWindow(width, height, title, NULL, NULL);
     std::shared_ptr<GLFWwindow> result(window, glfwDestroyWindow);
@@ -29,4 +39,28 @@ std::shared_ptr<GLFWwindow> getGlfwWindow(int width, int height, const char *tit
         exit(EXIT_FAILURE);
     }
     return result;
-}
\ No newline at end of file
+}
+
+// サーフェスを作るのに必要なインスタンスの拡張機能
+std::shared_ptr<std::vector<const char*>> getGlfwRequiredInstanceExtensions()
+{
+    uint32_t glfwExtensionsCount;
+    const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionsCount);
+
+    std::shared_ptr<std::vector<const char*>> result = std::make_shared<std::vector<const char*>>(glfwExtensionsCount);
+    std::memcpy(result->data(), glfwExtensions, sizeof(const char*) * glfwExtensionsCount);
+
+    return result;
+}
+
+void debugGlfwWindow(GLFWwindow &window)
+{
+    LOG("----------------------------------------");
+    LOG("Debug GLFW Window");
+    int width;
+    int height;
+    glfwGetWindowSize(&window, &width, &height);
+    LOG("WindowSize: width " << width << ", height " << height);
+    glfwGetFramebufferSize(&window, &width, &height);
+    LOG("FramebufferSize: width " << width << ", height " << height);
+}
@@ -0,0 +1,394 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <array>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+
+using namespace Vulkan_Test;
+
+// create*Uniqueなどの第2引数にはvk::AllocationCallbacksを渡すことができる
+// 渡さなければドライバは内部で使うホスト側のメモリを自分で(普通はmallocで)確保するので、どれだけ使っているのか外からは見えない
+// ここでは小さな確保をサイズごとのプールから返すアロケータを渡し、確保の量と回数をスコープとオブジェクトの種類ごとに数える
+// スワップチェーンの作り直しやアセットの読み込みで、ドライバがどれだけホストメモリを確保・解放しているかを調べるのに使う
+
+struct HostAllocationCounters
+{
+    size_t currentBytes = 0;
+    size_t peakBytes = 0;
+    uint64_t allocationCount = 0;
+    uint64_t reallocationCount = 0;
+    uint64_t freeCount = 0;
+};
+
+class HostAllocator
+{
+public:
+    // プールから返す大きさの区分
+    // 64, 128, ... 4096バイトで、これより大きいものはmallocに任せる
+    static constexpr size_t minSizeClass = 64;
+    static constexpr size_t sizeClassCount = 7;
+    // プールが足りなくなった時にまとめて確保する大きさ
+    static constexpr size_t chunkSize = 64 * 1024;
+
+    // falseにすると、以降に作るオブジェクトにはアロケーションコールバックを渡さない
+    bool enabled = true;
+
+    HostAllocator() = default;
+    HostAllocator(const HostAllocator&) = delete;
+    HostAllocator& operator=(const HostAllocator&) = delete;
+
+    ~HostAllocator()
+    {
+        for (void* chunk : chunks)
+        {
+            std::free(chunk);
+        }
+    }
+
+    // オブジェクトの種類ごとのコールバック
+    // pUserDataで種類を見分けるので、作成と破棄で同じものが使われる(vk::UniqueHandleは作成時のものを覚えている)
+    const vk::AllocationCallbacks* getCallbacks(vk::ObjectType objectType)
+    {
+        if (!enabled)
+        {
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<ObjectTag>& tag = objectTags[objectType];
+        if (!tag)
+        {
+            tag = std::make_unique<ObjectTag>();
+            tag->allocator = this;
+            tag->objectType = objectType;
+            tag->callbacks.pUserData = tag.get();
+            tag->callbacks.pfnAllocation = allocationFunction;
+            tag->callbacks.pfnReallocation = reallocationFunction;
+            tag->callbacks.pfnFree = freeFunction;
+            tag->callbacks.pfnInternalAllocation = internalAllocationNotification;
+            tag->callbacks.pfnInternalFree = internalFreeNotification;
+        }
+        return &tag->callbacks;
+    }
+
+    HostAllocationCounters getScopeCounters(vk::SystemAllocationScope scope)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return scopeCounters[size_t(scope)];
+    }
+
+    // 各オブジェクトの種類とその数値をfuncに渡す
+    void forEachObjectCounters(const std::function<void(vk::ObjectType, const HostAllocationCounters&)>& func)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::pair<const vk::ObjectType, std::unique_ptr<ObjectTag>>& tag : objectTags)
+        {
+            func(tag.first, tag.second->counters);
+        }
+    }
+
+    // 全体の確保回数
+    // 前後で比べれば、ある処理の間にドライバが何回確保したかが分かる
+    uint64_t getTotalAllocationCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pooledAllocationCount + heapAllocationCount;
+    }
+
+    uint64_t getPooledAllocationCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pooledAllocationCount;
+    }
+
+    uint64_t getHeapAllocationCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return heapAllocationCount;
+    }
+
+    size_t getChunkBytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return chunks.size() * chunkSize;
+    }
+
+    // ドライバが自分で確保したと通知してきた量(実行可能メモリなど)
+    size_t getInternalBytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return internalBytes;
+    }
+
+private:
+    static constexpr uint32_t heapSizeClass = UINT32_MAX;
+
+    struct ObjectTag
+    {
+        HostAllocator* allocator = nullptr;
+        vk::ObjectType objectType = vk::ObjectType::eUnknown;
+        vk::AllocationCallbacks callbacks;
+        HostAllocationCounters counters;
+    };
+
+    // 返したポインタの直前に置く
+    struct AllocationHeader
+    {
+        void* raw;
+        size_t size;
+        uint32_t sizeClass;
+        uint32_t scope;
+    };
+
+    // プールの空きスロットは中身を次の空きへのポインタとして使う
+    struct FreeSlot
+    {
+        FreeSlot* next;
+    };
+
+    static size_t getSlotSize(uint32_t sizeClass)
+    {
+        return minSizeClass << sizeClass;
+    }
+
+    static void addAllocation(HostAllocationCounters& counters, size_t size)
+    {
+        counters.currentBytes += size;
+        counters.peakBytes = std::max(counters.peakBytes, counters.currentBytes);
+        counters.allocationCount++;
+    }
+
+    static void removeAllocation(HostAllocationCounters& counters, size_t size)
+    {
+        counters.currentBytes -= size;
+        counters.freeCount++;
+    }
+
+    void* popSlot(uint32_t sizeClass)
+    {
+        if (freeSlots[sizeClass] == nullptr)
+        {
+            char* chunk = static_cast<char*>(std::malloc(chunkSize));
+            if (chunk == nullptr)
+            {
+                return nullptr;
+            }
+            chunks.push_back(chunk);
+
+            size_t slotSize = getSlotSize(sizeClass);
+            for (size_t offset = 0; offset + slotSize <= chunkSize; offset += slotSize)
+            {
+                FreeSlot* slot = reinterpret_cast<FreeSlot*>(chunk + offset);
+                slot->next = freeSlots[sizeClass];
+                freeSlots[sizeClass] = slot;
+            }
+        }
+
+        FreeSlot* slot = freeSlots[sizeClass];
+        freeSlots[sizeClass] = slot->next;
+        return slot;
+    }
+
+    void pushSlot(uint32_t sizeClass, void* raw)
+    {
+        FreeSlot* slot = static_cast<FreeSlot*>(raw);
+        slot->next = freeSlots[sizeClass];
+        freeSlots[sizeClass] = slot;
+    }
+
+    void* allocate(ObjectTag& tag, size_t size, size_t alignment, VkSystemAllocationScope scope)
+    {
+        alignment = std::max(alignment, alignof(AllocationHeader));
+        size_t requiredSize = sizeof(AllocationHeader) + alignment - 1 + size;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        uint32_t sizeClass = heapSizeClass;
+        for (uint32_t i = 0; i < sizeClassCount; i++)
+        {
+            if (requiredSize <= getSlotSize(i))
+            {
+                sizeClass = i;
+                break;
+            }
+        }
+
+        void* raw = nullptr;
+        if (sizeClass != heapSizeClass)
+        {
+            raw = popSlot(sizeClass);
+            pooledAllocationCount++;
+        }
+        else
+        {
+            raw = std::malloc(requiredSize);
+            heapAllocationCount++;
+        }
+        if (raw == nullptr)
+        {
+            return nullptr;
+        }
+
+        uintptr_t userAddress = (reinterpret_cast<uintptr_t>(raw) + sizeof(AllocationHeader) + alignment - 1) / alignment * alignment;
+        AllocationHeader* header = reinterpret_cast<AllocationHeader*>(userAddress) - 1;
+        header->raw = raw;
+        header->size = size;
+        header->sizeClass = sizeClass;
+        header->scope = uint32_t(scope);
+
+        addAllocation(tag.counters, size);
+        addAllocation(scopeCounters[scope], size);
+        return reinterpret_cast<void*>(userAddress);
+    }
+
+    void free(ObjectTag& tag, void* pMemory)
+    {
+        if (pMemory == nullptr)
+        {
+            return;
+        }
+
+        AllocationHeader* header = static_cast<AllocationHeader*>(pMemory) - 1;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        removeAllocation(tag.counters, header->size);
+        removeAllocation(scopeCounters[header->scope], header->size);
+
+        if (header->sizeClass != heapSizeClass)
+        {
+            pushSlot(header->sizeClass, header->raw);
+        }
+        else
+        {
+            std::free(header->raw);
+        }
+    }
+
+    void* reallocate(ObjectTag& tag, void* pOriginal, size_t size, size_t alignment, VkSystemAllocationScope scope)
+    {
+        if (pOriginal == nullptr)
+        {
+            return allocate(tag, size, alignment, scope);
+        }
+        if (size == 0)
+        {
+            free(tag, pOriginal);
+            return nullptr;
+        }
+
+        AllocationHeader* header = static_cast<AllocationHeader*>(pOriginal) - 1;
+        {
+            // 今のスロットに収まるならそのまま使う
+            std::lock_guard<std::mutex> lock(mutex);
+            size_t headerOffset = static_cast<char*>(pOriginal) - static_cast<char*>(header->raw);
+            if (header->sizeClass != heapSizeClass && headerOffset + size <= getSlotSize(header->sizeClass))
+            {
+                tag.counters.currentBytes = tag.counters.currentBytes - header->size + size;
+                tag.counters.peakBytes = std::max(tag.counters.peakBytes, tag.counters.currentBytes);
+                tag.counters.reallocationCount++;
+                HostAllocationCounters& counters = scopeCounters[header->scope];
+                counters.currentBytes = counters.currentBytes - header->size + size;
+                counters.peakBytes = std::max(counters.peakBytes, counters.currentBytes);
+                counters.reallocationCount++;
+                header->size = size;
+                return pOriginal;
+            }
+        }
+
+        void* result = allocate(tag, size, alignment, scope);
+        if (result == nullptr)
+        {
+            return nullptr;
+        }
+        std::memcpy(result, pOriginal, std::min(size, header->size));
+        free(tag, pOriginal);
+        return result;
+    }
+
+    static VKAPI_ATTR void* VKAPI_CALL allocationFunction(void* pUserData, size_t size, size_t alignment, VkSystemAllocationScope scope)
+    {
+        ObjectTag* tag = static_cast<ObjectTag*>(pUserData);
+        return tag->allocator->allocate(*tag, size, alignment, scope);
+    }
+
+    static VKAPI_ATTR void* VKAPI_CALL reallocationFunction(void* pUserData, void* pOriginal, size_t size, size_t alignment, VkSystemAllocationScope scope)
+    {
+        ObjectTag* tag = static_cast<ObjectTag*>(pUserData);
+        return tag->allocator->reallocate(*tag, pOriginal, size, alignment, scope);
+    }
+
+    static VKAPI_ATTR void VKAPI_CALL freeFunction(void* pUserData, void* pMemory)
+    {
+        ObjectTag* tag = static_cast<ObjectTag*>(pUserData);
+        tag->allocator->free(*tag, pMemory);
+    }
+
+    static VKAPI_ATTR void VKAPI_CALL internalAllocationNotification(void* pUserData, size_t size, VkInternalAllocationType allocationType, VkSystemAllocationScope scope)
+    {
+        ObjectTag* tag = static_cast<ObjectTag*>(pUserData);
+        std::lock_guard<std::mutex> lock(tag->allocator->mutex);
+        tag->allocator->internalBytes += size;
+    }
+
+    static VKAPI_ATTR void VKAPI_CALL internalFreeNotification(void* pUserData, size_t size, VkInternalAllocationType allocationType, VkSystemAllocationScope scope)
+    {
+        ObjectTag* tag = static_cast<ObjectTag*>(pUserData);
+        std::lock_guard<std::mutex> lock(tag->allocator->mutex);
+        tag->allocator->internalBytes -= size;
+    }
+
+    std::mutex mutex;
+    std::map<vk::ObjectType, std::unique_ptr<ObjectTag>> objectTags;
+    // VkSystemAllocationScopeの値(COMMAND〜INSTANCE)ごと
+    std::array<HostAllocationCounters, 5> scopeCounters;
+    std::array<FreeSlot*, sizeClassCount> freeSlots = {};
+    std::vector<void*> chunks;
+    uint64_t pooledAllocationCount = 0;
+    uint64_t heapAllocationCount = 0;
+    size_t internalBytes = 0;
+};
+
+// 全てのファクトリから使うので1つだけ作り、どのVulkanオブジェクトよりも長生きさせる
+HostAllocator hostAllocator;
+
+const vk::AllocationCallbacks* getAllocationCallbacks(vk::ObjectType objectType)
+{
+    return hostAllocator.getCallbacks(objectType);
+}
+
+void debugHostAllocator(HostAllocator& allocator)
+{
+    LOG("----------------------------------------");
+    LOG("Debug Host Allocator");
+    LOG("pooled allocations: " << allocator.getPooledAllocationCount() << ", heap allocations: " << allocator.getHeapAllocationCount());
+    LOG("pool chunks: " << allocator.getChunkBytes() << " bytes");
+    LOG("internal: " << allocator.getInternalBytes() << " bytes");
+
+    LOG("scopes");
+    SET_LOG_INDEX(1);
+    for (uint32_t i = 0; i < 5; i++)
+    {
+        vk::SystemAllocationScope scope = vk::SystemAllocationScope(i);
+        HostAllocationCounters counters = allocator.getScopeCounters(scope);
+        LOG(vk::to_string(scope) << ": current " << counters.currentBytes << ", peak " << counters.peakBytes << " bytes, " << counters.allocationCount << " allocs, " << counters.reallocationCount << " reallocs, " << counters.freeCount << " frees");
+    }
+    SET_LOG_INDEX(0);
+
+    LOG("objects");
+    SET_LOG_INDEX(1);
+    allocator.forEachObjectCounters([](vk::ObjectType objectType, const HostAllocationCounters& counters)
+    {
+        LOG(vk::to_string(objectType) << ": current " << counters.currentBytes << ", peak " << counters.peakBytes << " bytes, " << counters.allocationCount << " allocs, " << counters.reallocationCount << " reallocs, " << counters.freeCount << " frees");
+    });
+    SET_LOG_INDEX(0);
+}
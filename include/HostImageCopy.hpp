@@ -0,0 +1,202 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "PhysicalDevice.hpp"
+
+using namespace Vulkan_Test;
+
+// テクスチャを送るには、ステージングバッファに書き込み、コマンドバッファにバリアとcopyBufferToImageを記録してキューに送信する必要があった
+// VK_EXT_host_image_copyを使うと、CPUからOPTIMALタイリングのイメージに直接書き込める
+// ステージングバッファもコマンドバッファもキューへの送信も要らないので、描画とキューを取り合うことも無い
+// ソフトウェアのドライバや、CPUとGPUがメモリを共有しているデバイスでは特に有効
+//
+// CPUで行った書き込みは、その後に送信したコマンドからは見えるので、セマフォで待つ必要も無い
+// ただしイメージは作成時にeHostTransferEXTを付けておく必要がある
+
+class HostImageCopier
+{
+public:
+    // getDeviceは対応していればVK_EXT_host_image_copyとhostImageCopyの機能を有効化している
+    HostImageCopier(vk::Device device, vk::PhysicalDevice physicalDevice)
+        : device(device), physicalDevice(physicalDevice)
+    {
+#if defined(VK_EXT_host_image_copy)
+        if (!isHostImageCopySupported(physicalDevice))
+        {
+            return;
+        }
+
+        // CPUからコピーした後に置けるレイアウトの一覧は、数を取得してから中身を取得する
+        vk::PhysicalDeviceHostImageCopyPropertiesEXT hostImageCopyProps;
+        vk::PhysicalDeviceProperties2 props;
+        props.pNext = &hostImageCopyProps;
+        physicalDevice.getProperties2(&props);
+
+        std::vector<vk::ImageLayout> copyDstLayouts(hostImageCopyProps.copyDstLayoutCount);
+        hostImageCopyProps.pCopyDstLayouts = copyDstLayouts.data();
+        physicalDevice.getProperties2(&props);
+
+        // テクスチャはeShaderReadOnlyOptimalで使うので、そこに直接コピーできなければ使わない
+        if (std::find(copyDstLayouts.begin(), copyDstLayouts.end(), vk::ImageLayout::eShaderReadOnlyOptimal) == copyDstLayouts.end())
+        {
+            return;
+        }
+
+        // 拡張機能の関数はローダーから直接は呼べないので、デバイスから取得する
+        transitionImageLayout = reinterpret_cast<PFN_vkTransitionImageLayoutEXT>(device.getProcAddr("vkTransitionImageLayoutEXT"));
+        copyMemoryToImage = reinterpret_cast<PFN_vkCopyMemoryToImageEXT>(device.getProcAddr("vkCopyMemoryToImageEXT"));
+#endif
+    }
+
+    bool isAvailable() const
+    {
+#if defined(VK_EXT_host_image_copy)
+        return transitionImageLayout != nullptr && copyMemoryToImage != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    // このイメージをCPUから書き込んでよいかどうか
+    // eHostTransferEXTを付けると圧縮が効かなくなるなど、GPUから読む時に遅くなるデバイスもあるので、
+    // ドライバが遅くならないと答えた場合だけ使う
+    bool isSupported(const vk::ImageCreateInfo& imageCreateInfo)
+    {
+#if defined(VK_EXT_host_image_copy)
+        if (!isAvailable())
+        {
+            return false;
+        }
+
+        vk::PhysicalDeviceImageFormatInfo2 formatInfo;
+        formatInfo.format = imageCreateInfo.format;
+        formatInfo.type = imageCreateInfo.imageType;
+        formatInfo.tiling = imageCreateInfo.tiling;
+        formatInfo.usage = imageCreateInfo.usage | vk::ImageUsageFlagBits::eHostTransferEXT;
+        formatInfo.flags = imageCreateInfo.flags;
+
+        vk::HostImageCopyDevicePerformanceQueryEXT performanceQuery;
+        vk::ImageFormatProperties2 formatProps;
+        formatProps.pNext = &performanceQuery;
+        // 対応していない組み合わせはエラーで返ってくるので、例外を投げない版で呼ぶ
+        vk::Result result = physicalDevice.getImageFormatProperties2(&formatInfo, &formatProps);
+        return result == vk::Result::eSuccess && performanceQuery.optimalDeviceAccess == VK_TRUE;
+#else
+        return false;
+#endif
+    }
+
+    // イメージの作成時に追加するusage
+    vk::ImageUsageFlags getImageUsage() const
+    {
+#if defined(VK_EXT_host_image_copy)
+        return vk::ImageUsageFlagBits::eHostTransferEXT;
+#else
+        return vk::ImageUsageFlags();
+#endif
+    }
+
+    // pDataをイメージのミップレベル0全体に書き込み、finalLayoutにする
+    // イメージはメモリがバインドされていて、まだ一度も使われていない(eUndefinedの)ものとする
+    // 呼び出したスレッドで書き込みが終わってから戻るので、その後pDataはすぐに解放してよい
+    void copy(const void* pData, vk::DeviceSize size, vk::Image image, vk::Extent3D extent, vk::ImageAspectFlags aspect, vk::ImageLayout finalLayout)
+    {
+#if defined(VK_EXT_host_image_copy)
+        if (!isAvailable())
+        {
+            LOGERR("VK_EXT_host_image_copy is not available.");
+            exit(EXIT_FAILURE);
+        }
+
+        vk::ImageSubresourceRange subresourceRange;
+        subresourceRange.aspectMask = aspect;
+        subresourceRange.baseMipLevel = 0;
+        subresourceRange.levelCount = 1;
+        subresourceRange.baseArrayLayer = 0;
+        subresourceRange.layerCount = 1;
+
+        // レイアウトの変換もパイプラインバリアではなくCPUから行う
+        vk::HostImageLayoutTransitionInfoEXT transitionInfo;
+        transitionInfo.image = image;
+        transitionInfo.oldLayout = vk::ImageLayout::eUndefined;
+        transitionInfo.newLayout = finalLayout;
+        transitionInfo.subresourceRange = subresourceRange;
+        VkResult result = transitionImageLayout(device, 1, reinterpret_cast<const VkHostImageLayoutTransitionInfoEXT*>(&transitionInfo));
+        if (result != VK_SUCCESS)
+        {
+            LOGERR("Failed to transition image layout on the host.");
+            exit(EXIT_FAILURE);
+        }
+
+        // memoryRowLength, memoryImageHeightはcopyBufferToImageのbufferRowLength, bufferImageHeightと同じで、0ならimageExtentと同じ
+        vk::MemoryToImageCopyEXT region;
+        region.pHostPointer = pData;
+        region.memoryRowLength = 0;
+        region.memoryImageHeight = 0;
+        region.imageSubresource.aspectMask = aspect;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = vk::Offset3D{ 0, 0, 0 };
+        region.imageExtent = extent;
+
+        vk::CopyMemoryToImageInfoEXT copyInfo;
+        copyInfo.dstImage = image;
+        copyInfo.dstImageLayout = finalLayout;
+        copyInfo.regionCount = 1;
+        copyInfo.pRegions = &region;
+        result = copyMemoryToImage(device, reinterpret_cast<const VkCopyMemoryToImageInfoEXT*>(&copyInfo));
+        if (result != VK_SUCCESS)
+        {
+            LOGERR("Failed to copy memory to image on the host.");
+            exit(EXIT_FAILURE);
+        }
+
+        copyCount++;
+        copiedBytes += size;
+#endif
+    }
+
+    uint64_t getCopyCount() const
+    {
+        return copyCount;
+    }
+
+    vk::DeviceSize getCopiedBytes() const
+    {
+        return copiedBytes;
+    }
+
+private:
+    vk::Device device;
+    vk::PhysicalDevice physicalDevice;
+#if defined(VK_EXT_host_image_copy)
+    PFN_vkTransitionImageLayoutEXT transitionImageLayout = nullptr;
+    PFN_vkCopyMemoryToImageEXT copyMemoryToImage = nullptr;
+#endif
+    uint64_t copyCount = 0;
+    vk::DeviceSize copiedBytes = 0;
+};
+
+std::shared_ptr<HostImageCopier> getHostImageCopier(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice)
+{
+    return std::make_shared<HostImageCopier>(device.get(), physicalDevice);
+}
+
+void debugHostImageCopier(HostImageCopier& hostImageCopier)
+{
+    LOG("----------------------------------------");
+    LOG("Debug Host Image Copier");
+    if (!hostImageCopier.isAvailable())
+    {
+        LOG("VK_EXT_host_image_copy is not available. (uploading through the staging ring)");
+        return;
+    }
+    LOG("copies: " << hostImageCopier.getCopyCount() << ", copied: " << hostImageCopier.getCopiedBytes() << " bytes");
+}
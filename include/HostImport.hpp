@@ -0,0 +1,182 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <functional>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "HostAllocator.hpp"
+#include "PhysicalDevice.hpp"
+
+using namespace Vulkan_Test;
+
+// デコーダが作ったピクセルデータをステージングバッファにmemcpyすると、CPUは全てのテクセルを2回触ることになる
+// VK_EXT_external_memory_hostを使うと、アプリが確保したホストメモリをそのままデバイスメモリとして取り込み、
+// それをバッファにバインドしてGPUに直接コピーさせることができる
+//
+// 取り込めるのは、アドレスとサイズがminImportedHostPointerAlignment(多くの場合4096バイト)の倍数になっている領域だけ
+// また取り込んだメモリを使うコピーが完了するまで、元のホストメモリは解放してはいけない
+
+// 取り込んだホストメモリと、それをバインドしたバッファ
+// 破棄する時にバッファ、デバイスメモリの順で破棄し、最後にreleaseでホストメモリを解放する
+struct ImportedHostBuffer
+{
+    void* pHostData = nullptr;
+    vk::DeviceSize size = 0;
+    vk::UniqueDeviceMemory memory;
+    vk::UniqueBuffer buffer;
+    std::function<void(void*)> release;
+
+    ImportedHostBuffer() = default;
+    ImportedHostBuffer(const ImportedHostBuffer&) = delete;
+    ImportedHostBuffer& operator=(const ImportedHostBuffer&) = delete;
+
+    ~ImportedHostBuffer()
+    {
+        buffer.reset();
+        memory.reset();
+        if (release)
+        {
+            release(pHostData);
+        }
+    }
+};
+
+class HostMemoryImporter
+{
+public:
+    // getDeviceは対応していればVK_EXT_external_memory_hostを有効化している
+    HostMemoryImporter(vk::Device device, vk::PhysicalDevice physicalDevice)
+        : device(device)
+    {
+        if (!isDeviceExtensionSupported(physicalDevice, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME))
+        {
+            return;
+        }
+
+        vk::StructureChain<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceExternalMemoryHostPropertiesEXT> props =
+            physicalDevice.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>();
+        alignment = props.get<vk::PhysicalDeviceExternalMemoryHostPropertiesEXT>().minImportedHostPointerAlignment;
+
+        // 拡張機能の関数はローダーから直接は呼べないので、デバイスから取得する
+        getMemoryHostPointerProperties = reinterpret_cast<PFN_vkGetMemoryHostPointerPropertiesEXT>(device.getProcAddr("vkGetMemoryHostPointerPropertiesEXT"));
+    }
+
+    bool isAvailable() const
+    {
+        return getMemoryHostPointerProperties != nullptr;
+    }
+
+    // 取り込む領域のアドレスとサイズはこの倍数でなければならない
+    vk::DeviceSize getAlignment() const
+    {
+        return alignment;
+    }
+
+    // pHostDataからsizeバイトを取り込み、転送元として使えるバッファにする
+    // 取り込めなければnullptrを返すので、呼び出し側はmemcpyで送る方法に戻る
+    // 取り込めた場合はホストメモリの所有権も移り、戻り値が破棄された時にreleaseで解放される
+    std::shared_ptr<ImportedHostBuffer> import(void* pHostData, vk::DeviceSize size, std::function<void(void*)> release)
+    {
+        if (!isAvailable() || reinterpret_cast<uintptr_t>(pHostData) % alignment != 0 || size % alignment != 0)
+        {
+            return nullptr;
+        }
+
+        // そのアドレスをどのメモリタイプとして取り込めるかはドライバが決める
+        VkMemoryHostPointerPropertiesEXT hostPointerProps = {};
+        hostPointerProps.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+        VkResult result = getMemoryHostPointerProperties(device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, pHostData, &hostPointerProps);
+        if (result != VK_SUCCESS)
+        {
+            return nullptr;
+        }
+
+        // 外部のメモリをバインドするバッファは、作成時にハンドルの種類を指定しておく
+        vk::ExternalMemoryBufferCreateInfo externalBufferCreateInfo;
+        externalBufferCreateInfo.handleTypes = vk::ExternalMemoryHandleTypeFlagBits::eHostAllocationEXT;
+
+        vk::BufferCreateInfo bufferCreateInfo;
+        bufferCreateInfo.pNext = &externalBufferCreateInfo;
+        bufferCreateInfo.size = size;
+        bufferCreateInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
+        bufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+
+        std::shared_ptr<ImportedHostBuffer> imported = std::make_shared<ImportedHostBuffer>();
+        imported->buffer = device.createBufferUnique(bufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+
+        vk::MemoryRequirements memReq = device.getBufferMemoryRequirements(imported->buffer.get());
+        uint32_t memoryTypeBits = memReq.memoryTypeBits & hostPointerProps.memoryTypeBits;
+        if (memoryTypeBits == 0 || memReq.size > size)
+        {
+            return nullptr;
+        }
+
+        vk::ImportMemoryHostPointerInfoEXT importInfo;
+        importInfo.handleType = vk::ExternalMemoryHandleTypeFlagBits::eHostAllocationEXT;
+        importInfo.pHostPointer = pHostData;
+
+        vk::MemoryAllocateInfo memAllocInfo;
+        memAllocInfo.pNext = &importInfo;
+        memAllocInfo.allocationSize = size;
+        memAllocInfo.memoryTypeIndex = findLowestSetBit(memoryTypeBits);
+        imported->memory = device.allocateMemoryUnique(memAllocInfo, getAllocationCallbacks(vk::ObjectType::eDeviceMemory));
+        device.bindBufferMemory(imported->buffer.get(), imported->memory.get(), 0);
+
+        // ここまで成功したら所有権を受け取る
+        imported->pHostData = pHostData;
+        imported->size = size;
+        imported->release = release;
+
+        importCount++;
+        importedBytes += size;
+        return imported;
+    }
+
+    uint64_t getImportCount() const
+    {
+        return importCount;
+    }
+
+    vk::DeviceSize getImportedBytes() const
+    {
+        return importedBytes;
+    }
+
+private:
+    static uint32_t findLowestSetBit(uint32_t bits)
+    {
+        uint32_t index = 0;
+        while ((bits & 1) == 0)
+        {
+            bits >>= 1;
+            index++;
+        }
+        return index;
+    }
+
+    vk::Device device;
+    vk::DeviceSize alignment = 0;
+    PFN_vkGetMemoryHostPointerPropertiesEXT getMemoryHostPointerProperties = nullptr;
+    uint64_t importCount = 0;
+    vk::DeviceSize importedBytes = 0;
+};
+
+std::shared_ptr<HostMemoryImporter> getHostMemoryImporter(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice)
+{
+    return std::make_shared<HostMemoryImporter>(device.get(), physicalDevice);
+}
+
+void debugHostMemoryImporter(HostMemoryImporter& hostMemoryImporter)
+{
+    LOG("----------------------------------------");
+    LOG("Debug Host Memory Importer");
+    if (!hostMemoryImporter.isAvailable())
+    {
+        LOG("VK_EXT_external_memory_host is not available. (copying through the staging ring)");
+        return;
+    }
+    LOG("alignment: " << hostMemoryImporter.getAlignment() << " bytes");
+    LOG("imports: " << hostMemoryImporter.getImportCount() << ", imported: " << hostMemoryImporter.getImportedBytes() << " bytes");
+}
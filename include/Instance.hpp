@@ -3,11 +3,9 @@
 #include <iostream>
 #include <memory>
 #include <vulkan/vulkan.hpp>
-#if !defined(__ANDROID__)
-#include <GLFW/glfw3.h>
-#endif
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 using namespace Vulkan_Test;
 
@@ -36,15 +34,14 @@ std::shared_ptr<vk::InstanceCreateInfo> getInstanceCreateInfo(
     return instanceCreateInfo;
 }
 
-#if !defined(__ANDROID__)
-std::shared_ptr<std::vector<const char*>> getGlfwRequiredInstanceExtensions()
+#if defined(__ANDROID__)
+std::shared_ptr<std::vector<const char*>> getAndroidRequiredInstanceExtensions()
 {
-    uint32_t glfwExtensionsCount;
-    const char** glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionsCount);
-
-    std::shared_ptr<std::vector<const char*>> result = std::make_shared<std::vector<const char*>>(glfwExtensionsCount);
-    std::memcpy(result->data(), glfwExtensions, sizeof(const char*) * glfwExtensionsCount);
-
+    std::shared_ptr<std::vector<const char*>> result = std::make_shared<std::vector<const char*>>();
+    result->push_back(VK_KHR_SURFACE_EXTENSION_NAME);
+    result->push_back(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME);
+    // デバッグレポート
+    //result->push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
     return result;
 }
 #endif
@@ -63,29 +60,21 @@ std::shared_ptr<std::vector<const char*>> getAppleRequiredInstanceExtensions()
 // 利用可能な Vulkan 実装の列挙: システムにインストールされている Vulkan ドライバ (物理デバイス) を検出するために使用される
 // グローバルな操作の管理: Vulkan API 全体に関わる操作 (例えば、デバッグコールバックの設定など) を行う
 // 他の Vulkan オブジェクトの作成の基盤: vk::PhysicalDevice (物理デバイス)、vk::Device (論理デバイス)、vk::SurfaceKHR (サーフェス) などの他の主要な Vulkan オブジェクトは、vk::Instance を通して作成される
-std::shared_ptr<vk::UniqueInstance> getInstance(vk::ApplicationInfo& appInfo)
-{;
+// instanceRequiredExtensionsには、サーフェスを作るのに必要な拡張機能を渡す
+// デスクトップではGlfw.hppのgetGlfwRequiredInstanceExtensions、AndroidではgetAndroidRequiredInstanceExtensionsが返すものを渡し、
+// サーフェスを作らない場合は空でよい
+std::shared_ptr<vk::UniqueInstance> getInstance(vk::ApplicationInfo& appInfo, std::vector<const char*> instanceRequiredExtensions)
+{
     std::shared_ptr<vk::UniqueInstance> result = std::make_shared<vk::UniqueInstance>();
 
-#if !defined(__ANDROID__)
-    std::shared_ptr<std::vector<const char*>> instanceRequiredExtensions = getGlfwRequiredInstanceExtensions();
-#else
-
-    std::shared_ptr<std::vector<const char*>> instanceRequiredExtensions = std::make_shared<std::vector<const char*>>();
-    instanceRequiredExtensions->push_back(VK_KHR_SURFACE_EXTENSION_NAME);
-    instanceRequiredExtensions->push_back(VK_KHR_ANDROID_SURFACE_EXTENSION_NAME);
-    // デバッグレポート
-    //instanceRequiredExtensions->push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
-#endif
-
 #ifdef __APPLE__
     std::shared_ptr<std::vector<const char*>> appleRequiredInstanceExtensions = getAppleRequiredInstanceExtensions();
-    std::copy(appleRequiredInstanceExtensions->begin(), appleRequiredInstanceExtensions->end(), std::back_inserter(*instanceRequiredExtensions));
+    std::copy(appleRequiredInstanceExtensions->begin(), appleRequiredInstanceExtensions->end(), std::back_inserter(instanceRequiredExtensions));
 #endif
 
-    std::shared_ptr<vk::InstanceCreateInfo> instanceCreateInfo = getInstanceCreateInfo(appInfo, *instanceRequiredExtensions);
+    std::shared_ptr<vk::InstanceCreateInfo> instanceCreateInfo = getInstanceCreateInfo(appInfo, instanceRequiredExtensions);
     debugInstanceCreateInfo(*instanceCreateInfo);
 
-    *result = vk::createInstanceUnique(*instanceCreateInfo);
+    *result = vk::createInstanceUnique(*instanceCreateInfo, getAllocationCallbacks(vk::ObjectType::eInstance));
     return result;
 }
\ No newline at end of file
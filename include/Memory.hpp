@@ -0,0 +1,949 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <list>
+#include <array>
+#include <optional>
+#include <mutex>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "HostAllocator.hpp"
+
+using namespace Vulkan_Test;
+
+// allocateMemoryは1回ごとにドライバへの問い合わせが発生し、同時に存在できる数にも上限(maxMemoryAllocationCount)がある
+// 上限は4096程度のデバイスも多く、リソースごとにallocateMemoryしているとメッシュやテクスチャが増えた時点ですぐに足りなくなる
+// そこで大きなデバイスメモリ(ブロック)をメモリタイプごとにまとめて確保し、その中を切り分けて(サブアロケーション)各リソースに割り当てる
+//
+// 確保は描画のスレッドで行うが、MemoryAllocationを持つshared_ptrはステージングリングに預けられるなどして、
+// アップロードのスレッドで最後に手放されることがある(その時にfreeが呼ばれる)
+// そのため確保、解放、統計の取得はMemoryAllocatorの中のmutexで守る
+// getBlocksが返すブロックの中身は守られないので、デフラグやメモリレポートのようにブロックを直接見るものは描画のスレッドから呼ぶこと
+
+class MemoryAllocator;
+
+// 何に使っている確保なのか
+// メモリレポートで、どの種類のリソースがメモリを使っているかを調べるために持たせておく
+enum class MemoryUsage
+{
+    Unknown,
+    Vertex,
+    Index,
+    Staging,
+    Uniform,
+    Texture,
+    Depth,
+    RenderTarget,
+};
+
+inline const char* toString(MemoryUsage usage)
+{
+    switch (usage)
+    {
+    case MemoryUsage::Vertex: return "vertex";
+    case MemoryUsage::Index: return "index";
+    case MemoryUsage::Staging: return "staging";
+    case MemoryUsage::Uniform: return "uniform";
+    case MemoryUsage::Texture: return "texture";
+    case MemoryUsage::Depth: return "depth";
+    case MemoryUsage::RenderTarget: return "render_target";
+    default: return "unknown";
+    }
+}
+
+// ブロック内の1区間を表す
+// 空き区間と使用中の区間を offset 順に並べて管理する
+struct MemorySuballocation
+{
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    bool free = true;
+    // バッファ(とリニアタイリングのイメージ)ならtrue、最適タイリングのイメージならfalse
+    // 種類の違うリソースが隣り合う場合はbufferImageGranularityの境界を跨がないようにする必要がある
+    bool linear = true;
+    // 使用中の区間のみ意味を持つ
+    MemoryUsage usage = MemoryUsage::Unknown;
+    // 確保した時のフレーム番号
+    uint64_t createdFrame = 0;
+};
+
+struct MemoryBlock
+{
+    vk::UniqueDeviceMemory memory;
+    uint32_t memoryTypeIndex = 0;
+    vk::DeviceSize size = 0;
+    // ホスト可視のブロックは作成時に一度だけマップしたままにする
+    // 同じデバイスメモリを二重にmapMemoryすることはできないため、サブアロケーションごとのマップはできない
+    void* pMapped = nullptr;
+    vk::DeviceSize usedSize = 0;
+    size_t allocationCount = 0;
+    std::list<MemorySuballocation> suballocations;
+    // 1つのリソース専用にちょうどの大きさで確保したブロック
+    // 他のリソースは入れず、解放されたらすぐに返却する
+    bool dedicated = false;
+};
+
+// サブアロケーション1つ分
+// 破棄されるとブロックに領域を返却する
+struct MemoryAllocation
+{
+    MemoryAllocator* allocator = nullptr;
+    MemoryBlock* block = nullptr;
+    std::list<MemorySuballocation>::iterator suballocation;
+
+    // bindBufferMemory/bindImageMemoryにはmemoryとoffsetをそのまま渡す
+    vk::DeviceMemory memory;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    uint32_t memoryTypeIndex = 0;
+    // ホスト可視でなければnullptr
+    void* pMapped = nullptr;
+
+    MemoryAllocation() = default;
+    MemoryAllocation(const MemoryAllocation&) = delete;
+    MemoryAllocation& operator=(const MemoryAllocation&) = delete;
+    ~MemoryAllocation();
+
+    // 確保した後、何に使うのかを記録する
+    void setUsage(MemoryUsage usage)
+    {
+        suballocation->usage = usage;
+    }
+
+    MemoryUsage getUsage() const
+    {
+        return suballocation->usage;
+    }
+
+    uint64_t getCreatedFrame() const
+    {
+        return suballocation->createdFrame;
+    }
+
+    // 用途と確保したフレームを引き継ぐ
+    // デフラグで移動した先の領域が、移動前と同じリソースとして報告されるようにするために使う
+    void copyTagFrom(const MemoryAllocation& other)
+    {
+        suballocation->usage = other.suballocation->usage;
+        suballocation->createdFrame = other.suballocation->createdFrame;
+    }
+
+    // 中身(指している領域)だけを入れ替える
+    // デフラグでリソースを移動した後、持ち主のshared_ptrはそのままで新しい領域を指すようにするために使う
+    void swap(MemoryAllocation& other)
+    {
+        std::swap(allocator, other.allocator);
+        std::swap(block, other.block);
+        std::swap(suballocation, other.suballocation);
+        std::swap(memory, other.memory);
+        std::swap(offset, other.offset);
+        std::swap(size, other.size);
+        std::swap(memoryTypeIndex, other.memoryTypeIndex);
+        std::swap(pMapped, other.pMapped);
+    }
+};
+
+// ヒープごとの使用量
+// blockBytesはallocateMemoryで実際に確保した量、usedBytesはその中で割り当て済みの量
+struct MemoryHeapUsage
+{
+    vk::DeviceSize blockBytes = 0;
+    vk::DeviceSize usedBytes = 0;
+};
+
+struct MemoryAllocatorStats
+{
+    // allocateMemory/freeMemoryを実際に呼んだ累計回数
+    uint64_t deviceMemoryAllocationCount = 0;
+    uint64_t deviceMemoryFreeCount = 0;
+    // allocateが呼ばれた累計回数 (サブアロケーションを使わなければこれがそのままallocateMemoryの回数になる)
+    uint64_t allocationRequestCount = 0;
+    // 専用のブロックで確保した累計回数
+    uint64_t dedicatedAllocationCount = 0;
+
+    size_t blockCount = 0;
+    size_t allocationCount = 0;
+    vk::DeviceSize blockBytes = 0;
+    vk::DeviceSize usedBytes = 0;
+    vk::DeviceSize freeBytes = 0;
+    vk::DeviceSize largestFreeRange = 0;
+    size_t freeRangeCount = 0;
+    // 0なら空き領域が1つにまとまっている、1に近いほど細切れ
+    float fragmentation = 0.0f;
+};
+
+// メモリタイプの選び方
+// requiredFlagsは必須、preferredFlagsはあれば嬉しい、avoidedFlagsはできれば無い方がよい
+struct MemoryTypeRequest
+{
+    vk::MemoryPropertyFlags requiredFlags;
+    vk::MemoryPropertyFlags preferredFlags;
+    vk::MemoryPropertyFlags avoidedFlags;
+};
+
+// GPUからしか触らないリソース
+// 小さなBARヒープを無駄に使わないようにHOST_VISIBLEは避ける
+inline MemoryTypeRequest deviceLocalMemoryRequest()
+{
+    return MemoryTypeRequest{ vk::MemoryPropertyFlagBits::eDeviceLocal, {}, vk::MemoryPropertyFlagBits::eHostVisible };
+}
+
+// CPUから書き込んでGPUにコピーさせるステージングバッファ
+inline MemoryTypeRequest stagingMemoryRequest()
+{
+    return MemoryTypeRequest{ vk::MemoryPropertyFlagBits::eHostVisible, vk::MemoryPropertyFlagBits::eHostCoherent, vk::MemoryPropertyFlagBits::eDeviceLocal };
+}
+
+// CPUが毎フレーム書き込みGPUが読むもの(ユニフォームバッファなど)
+inline MemoryTypeRequest hostToDeviceMemoryRequest()
+{
+    return MemoryTypeRequest{ vk::MemoryPropertyFlagBits::eHostVisible, vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostCoherent, {} };
+}
+
+// ステージングを経由せずCPUから直接書き込むGPU用のリソース
+inline MemoryTypeRequest directUploadMemoryRequest()
+{
+    return MemoryTypeRequest{ vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eHostVisible, vk::MemoryPropertyFlagBits::eHostCoherent, {} };
+}
+
+// レンダーパスの中だけで使われ、中身を保存しないアタッチメント(深度やMSAAなど)
+// タイルベースのGPUではLAZILY_ALLOCATEDなメモリを使うとタイルメモリだけで済み、実際のメモリはほとんど確保されない
+inline MemoryTypeRequest transientAttachmentMemoryRequest()
+{
+    return MemoryTypeRequest{ vk::MemoryPropertyFlagBits::eLazilyAllocated, vk::MemoryPropertyFlagBits::eDeviceLocal, vk::MemoryPropertyFlagBits::eHostVisible };
+}
+
+inline vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+inline vk::DeviceSize alignDown(vk::DeviceSize value, vk::DeviceSize alignment)
+{
+    return value / alignment * alignment;
+}
+
+class MemoryAllocator
+{
+public:
+    // ブロックの既定サイズ
+    // ヒープが小さい場合はヒープサイズの1/8まで縮める
+    static constexpr vk::DeviceSize defaultBlockSize = 64ull * 1024 * 1024;
+
+    // この大きさ以上のイメージは専用のブロックに置く
+    // ブロックの半分を超えるようなものをサブアロケーションしても、残りの半分が使いにくい空き区間になるだけ
+    vk::DeviceSize dedicatedAllocationThreshold = defaultBlockSize / 2;
+
+    MemoryAllocator(vk::Device device, vk::PhysicalDevice physicalDevice)
+        : device(device)
+    {
+        memProps = physicalDevice.getMemoryProperties();
+        vk::PhysicalDeviceProperties props = physicalDevice.getProperties();
+        bufferImageGranularity = props.limits.bufferImageGranularity;
+        nonCoherentAtomSize = props.limits.nonCoherentAtomSize;
+        // VK_KHR_dedicated_allocationとVK_KHR_get_memory_requirements2はVulkan 1.1でコアに取り込まれている
+        dedicatedAllocationSupported = props.apiVersion >= VK_API_VERSION_1_1;
+    }
+
+    MemoryAllocator(const MemoryAllocator&) = delete;
+    MemoryAllocator& operator=(const MemoryAllocator&) = delete;
+
+    ~MemoryAllocator()
+    {
+        for (std::vector<std::unique_ptr<MemoryBlock>>& blocks : blocksPerType)
+        {
+            for (std::unique_ptr<MemoryBlock>& block : blocks)
+            {
+                if (block->allocationCount != 0)
+                {
+                    LOGERR("Memory block destroyed with " << block->allocationCount << " live allocations.");
+                }
+                releaseBlock(*block);
+            }
+        }
+    }
+
+    const vk::PhysicalDeviceMemoryProperties& getMemoryProperties() const
+    {
+        return memProps;
+    }
+
+    // フレームの最初に呼ぶ
+    // 以降の確保にはこのフレーム番号が記録される
+    void setCurrentFrame(uint64_t frame)
+    {
+        currentFrame = frame;
+    }
+
+    uint64_t getCurrentFrame() const
+    {
+        return currentFrame;
+    }
+
+    // requiredFlagsを全て持つメモリタイプの中から、preferredFlagsを多く持ちavoidedFlagsを持たないものを選ぶ
+    // 同点ならヒープの大きい方を選ぶ
+    std::optional<uint32_t> selectMemoryTypeIndex(uint32_t memoryTypeBits, const MemoryTypeRequest& request) const
+    {
+        std::optional<uint32_t> result;
+        int bestScore = 0;
+        vk::DeviceSize bestHeapSize = 0;
+
+        for (uint32_t i = 0; i < memProps.memoryTypeCount; i++)
+        {
+            vk::MemoryPropertyFlags flags = memProps.memoryTypes[i].propertyFlags;
+            if (!(memoryTypeBits & (1 << i)) || (flags & request.requiredFlags) != request.requiredFlags)
+            {
+                continue;
+            }
+
+            int score = countFlags(flags & request.preferredFlags) - countFlags(flags & request.avoidedFlags);
+            vk::DeviceSize heapSize = memProps.memoryHeaps[memProps.memoryTypes[i].heapIndex].size;
+            if (!result || score > bestScore || (score == bestScore && heapSize > bestHeapSize))
+            {
+                result = i;
+                bestScore = score;
+                bestHeapSize = heapSize;
+            }
+        }
+
+        return result;
+    }
+
+    uint32_t findMemoryTypeIndex(uint32_t memoryTypeBits, const MemoryTypeRequest& request) const
+    {
+        std::optional<uint32_t> result = selectMemoryTypeIndex(memoryTypeBits, request);
+        if (!result)
+        {
+            LOGERR("Suitable memory type not found. ");
+            exit(EXIT_FAILURE);
+        }
+        return *result;
+    }
+
+    // DEVICE_LOCALかつHOST_VISIBLEなメモリに直接書き込めるかどうか
+    // 統合GPUやソフトウェア実装ではVRAMとメインメモリの区別がなく、Resizable BARが有効なディスクリートGPUではVRAM全体がCPUから見える
+    // こうした環境ではステージングバッファを経由したコピーは無駄になる
+    // ReBARが無効なディスクリートGPUにも256MB程度の小さなDEVICE_LOCAL|HOST_VISIBLEヒープがあるが、
+    // そこを頂点データで埋めるべきではないので、最大のDEVICE_LOCALヒープと同じ大きさの場合に限る
+    bool canUploadDirectly(uint32_t memoryTypeBits) const
+    {
+        vk::DeviceSize largestDeviceLocalHeapSize = 0;
+        for (uint32_t i = 0; i < memProps.memoryHeapCount; i++)
+        {
+            if (memProps.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal)
+            {
+                largestDeviceLocalHeapSize = std::max(largestDeviceLocalHeapSize, memProps.memoryHeaps[i].size);
+            }
+        }
+
+        std::optional<uint32_t> memoryTypeIndex = selectMemoryTypeIndex(memoryTypeBits, directUploadMemoryRequest());
+        if (!memoryTypeIndex)
+        {
+            return false;
+        }
+        return memProps.memoryHeaps[memProps.memoryTypes[*memoryTypeIndex].heapIndex].size >= largestDeviceLocalHeapSize;
+    }
+
+    // linearはバッファならtrue、最適タイリングのイメージならfalseを指定する
+    std::shared_ptr<MemoryAllocation> allocate(const vk::MemoryRequirements& memReq, const MemoryTypeRequest& request, bool linear)
+    {
+        uint32_t memoryTypeIndex = findMemoryTypeIndex(memReq.memoryTypeBits, request);
+        return allocate(memReq, memoryTypeIndex, linear);
+    }
+
+    std::shared_ptr<MemoryAllocation> allocate(const vk::MemoryRequirements& memReq, uint32_t memoryTypeIndex, bool linear)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.allocationRequestCount++;
+
+        vk::DeviceSize alignment = getAlignment(memReq, memoryTypeIndex);
+        std::shared_ptr<MemoryAllocation> result = std::make_shared<MemoryAllocation>();
+
+        for (std::unique_ptr<MemoryBlock>& block : blocksPerType[memoryTypeIndex])
+        {
+            if (block->dedicated)
+            {
+                continue;
+            }
+            if (allocateFromBlock(*block, memReq.size, alignment, linear, *result))
+            {
+                return result;
+            }
+        }
+
+        vk::DeviceSize blockSize = std::max(getPreferredBlockSize(memoryTypeIndex), alignUp(memReq.size, alignment));
+        MemoryBlock& block = createBlock(memoryTypeIndex, blockSize);
+        if (!allocateFromBlock(block, memReq.size, alignment, linear, *result))
+        {
+            LOGERR("Failed to suballocate from a new memory block.");
+            exit(EXIT_FAILURE);
+        }
+        return result;
+    }
+
+    // イメージ用のメモリを確保する
+    // ドライバが専用の確保を望む(圧縮などが効くようになる)場合や、大きなイメージは専用のブロックに置き、それ以外はサブアロケーションする
+    std::shared_ptr<MemoryAllocation> allocateForImage(vk::Image image, const MemoryTypeRequest& request)
+    {
+        vk::MemoryRequirements memReq;
+        bool prefersDedicated = false;
+        if (dedicatedAllocationSupported)
+        {
+            vk::ImageMemoryRequirementsInfo2 memReqInfo;
+            memReqInfo.image = image;
+            vk::StructureChain<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements> memReq2 =
+                device.getImageMemoryRequirements2<vk::MemoryRequirements2, vk::MemoryDedicatedRequirements>(memReqInfo);
+            memReq = memReq2.get<vk::MemoryRequirements2>().memoryRequirements;
+            const vk::MemoryDedicatedRequirements& dedicatedReq = memReq2.get<vk::MemoryDedicatedRequirements>();
+            prefersDedicated = dedicatedReq.prefersDedicatedAllocation || dedicatedReq.requiresDedicatedAllocation;
+        }
+        else
+        {
+            memReq = device.getImageMemoryRequirements(image);
+        }
+
+        uint32_t memoryTypeIndex = findMemoryTypeIndex(memReq.memoryTypeBits, request);
+        if (prefersDedicated || memReq.size >= std::min(dedicatedAllocationThreshold, getPreferredBlockSize(memoryTypeIndex) / 2))
+        {
+            return allocateDedicated(memReq, memoryTypeIndex, false, image);
+        }
+        // 最適タイリングのイメージはバッファと同じページに置けないことがあるので、linearにはfalseを指定する
+        return allocate(memReq, memoryTypeIndex, false);
+    }
+
+    // 専用のブロックをちょうどの大きさで確保する
+    // LAZILY_ALLOCATEDなメモリは実際に使われた分だけが確保されるので、大きなブロックを共有させる意味が無い
+    // dedicatedImageを指定すると、そのイメージ専用であることをドライバに伝える
+    std::shared_ptr<MemoryAllocation> allocateDedicated(const vk::MemoryRequirements& memReq, uint32_t memoryTypeIndex, bool linear, vk::Image dedicatedImage = nullptr)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.allocationRequestCount++;
+        stats.dedicatedAllocationCount++;
+
+        vk::MemoryDedicatedAllocateInfo dedicatedAllocInfo;
+        dedicatedAllocInfo.image = dedicatedImage;
+        const void* pNext = dedicatedAllocationSupported && dedicatedImage ? &dedicatedAllocInfo : nullptr;
+
+        std::shared_ptr<MemoryAllocation> result = std::make_shared<MemoryAllocation>();
+        MemoryBlock& block = createBlock(memoryTypeIndex, memReq.size, pNext);
+        block.dedicated = true;
+        if (!allocateFromBlock(block, memReq.size, 1, linear, *result))
+        {
+            LOGERR("Failed to allocate a dedicated memory block.");
+            exit(EXIT_FAILURE);
+        }
+        return result;
+    }
+
+    // 既にあるブロックの中からだけ確保する(excludedBlockは除く)
+    // 入りきらなければ新しいブロックは作らずにnullptrを返す
+    // デフラグの移動先を探すのに使う
+    std::shared_ptr<MemoryAllocation> allocateInExistingBlock(const vk::MemoryRequirements& memReq, uint32_t memoryTypeIndex, bool linear, const MemoryBlock* excludedBlock)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.allocationRequestCount++;
+
+        vk::DeviceSize alignment = getAlignment(memReq, memoryTypeIndex);
+        std::shared_ptr<MemoryAllocation> result = std::make_shared<MemoryAllocation>();
+
+        for (std::unique_ptr<MemoryBlock>& block : blocksPerType[memoryTypeIndex])
+        {
+            if (block.get() == excludedBlock || block->dedicated)
+            {
+                continue;
+            }
+            if (allocateFromBlock(*block, memReq.size, alignment, linear, *result))
+            {
+                return result;
+            }
+        }
+        return nullptr;
+    }
+
+    void free(MemoryAllocation& allocation)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (allocation.block == nullptr)
+        {
+            return;
+        }
+
+        MemoryBlock& block = *allocation.block;
+        std::list<MemorySuballocation>::iterator it = allocation.suballocation;
+        it->free = true;
+        version++;
+        block.usedSize -= it->size;
+        block.allocationCount--;
+
+        // 前後の空き区間と結合する
+        if (it != block.suballocations.begin())
+        {
+            std::list<MemorySuballocation>::iterator prev = std::prev(it);
+            if (prev->free)
+            {
+                it->offset = prev->offset;
+                it->size += prev->size;
+                block.suballocations.erase(prev);
+            }
+        }
+        std::list<MemorySuballocation>::iterator next = std::next(it);
+        if (next != block.suballocations.end() && next->free)
+        {
+            it->size += next->size;
+            block.suballocations.erase(next);
+        }
+
+        allocation.block = nullptr;
+        allocation.memory = nullptr;
+        allocation.pMapped = nullptr;
+
+        if (block.dedicated)
+        {
+            releaseDedicatedBlock(block);
+        }
+        else if (block.allocationCount == 0)
+        {
+            releaseEmptyBlocks(block.memoryTypeIndex);
+        }
+    }
+
+    // コヒーレントでないメモリに書き込んだ後に呼ぶ
+    void flush(MemoryAllocation& allocation, vk::DeviceSize offset, vk::DeviceSize size)
+    {
+        if (isHostCoherent(allocation.memoryTypeIndex))
+        {
+            return;
+        }
+
+        vk::DeviceSize begin = alignDown(allocation.offset + offset, nonCoherentAtomSize);
+        vk::DeviceSize end = std::min(alignUp(allocation.offset + offset + size, nonCoherentAtomSize), allocation.block->size);
+
+        vk::MappedMemoryRange flushMemoryRange;
+        flushMemoryRange.memory = allocation.memory;
+        flushMemoryRange.offset = begin;
+        flushMemoryRange.size = end - begin;
+        device.flushMappedMemoryRanges({ flushMemoryRange });
+    }
+
+    bool isHostVisible(uint32_t memoryTypeIndex) const
+    {
+        return bool(memProps.memoryTypes[memoryTypeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible);
+    }
+
+    bool isHostCoherent(uint32_t memoryTypeIndex) const
+    {
+        return bool(memProps.memoryTypes[memoryTypeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent);
+    }
+
+    bool isLazilyAllocated(uint32_t memoryTypeIndex) const
+    {
+        return bool(memProps.memoryTypes[memoryTypeIndex].propertyFlags & vk::MemoryPropertyFlagBits::eLazilyAllocated);
+    }
+
+    // LAZILY_ALLOCATEDなメモリタイプがあるかどうか
+    // 主にタイルベースのモバイルGPUにあり、デスクトップGPUにはまず無い
+    bool hasLazilyAllocatedMemory() const
+    {
+        for (uint32_t i = 0; i < memProps.memoryTypeCount; i++)
+        {
+            if (isLazilyAllocated(i))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static int countFlags(vk::MemoryPropertyFlags flags)
+    {
+        int result = 0;
+        for (VkMemoryPropertyFlags bits = static_cast<VkMemoryPropertyFlags>(flags); bits != 0; bits &= bits - 1)
+        {
+            result++;
+        }
+        return result;
+    }
+
+    MemoryAllocatorStats getStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryAllocatorStats result = stats;
+        for (const std::vector<std::unique_ptr<MemoryBlock>>& blocks : blocksPerType)
+        {
+            for (const std::unique_ptr<MemoryBlock>& block : blocks)
+            {
+                result.blockCount++;
+                result.allocationCount += block->allocationCount;
+                result.blockBytes += block->size;
+                result.usedBytes += block->usedSize;
+                for (const MemorySuballocation& suballocation : block->suballocations)
+                {
+                    if (!suballocation.free)
+                    {
+                        continue;
+                    }
+                    result.freeRangeCount++;
+                    result.freeBytes += suballocation.size;
+                    result.largestFreeRange = std::max(result.largestFreeRange, suballocation.size);
+                }
+            }
+        }
+        if (result.freeBytes > 0)
+        {
+            result.fragmentation = 1.0f - float(result.largestFreeRange) / float(result.freeBytes);
+        }
+        return result;
+    }
+
+    // メモリタイプごとの細切れ具合
+    // 空き区間はブロックをまたいでまとめられないので、他のメモリタイプの空きと合わせても意味がない
+    // 専用のブロックは他のリソースを入れないので数えず、サブアロケーションするブロックが2つ以上無ければ0を返す
+    float getFragmentation(uint32_t memoryTypeIndex) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t blockCount = 0;
+        vk::DeviceSize freeBytes = 0;
+        vk::DeviceSize largestFreeRange = 0;
+        for (const std::unique_ptr<MemoryBlock>& block : blocksPerType[memoryTypeIndex])
+        {
+            if (block->dedicated)
+            {
+                continue;
+            }
+            blockCount++;
+            for (const MemorySuballocation& suballocation : block->suballocations)
+            {
+                if (suballocation.free)
+                {
+                    freeBytes += suballocation.size;
+                    largestFreeRange = std::max(largestFreeRange, suballocation.size);
+                }
+            }
+        }
+        if (blockCount < 2 || freeBytes == 0)
+        {
+            return 0.0f;
+        }
+        return 1.0f - float(largestFreeRange) / float(freeBytes);
+    }
+
+    // 確保か解放でブロックの中身が変わるたびに増える
+    // 前に調べた時から変わっていなければ、同じ結果になる調べ直しを省くのに使う
+    uint64_t getVersion() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return version;
+    }
+
+    uint32_t getMemoryTypeCount() const
+    {
+        return memProps.memoryTypeCount;
+    }
+
+    const std::vector<std::unique_ptr<MemoryBlock>>& getBlocks(uint32_t memoryTypeIndex) const
+    {
+        return blocksPerType[memoryTypeIndex];
+    }
+
+    // 空のブロックを1つも残さずに解放する
+    // 普段は確保と解放の繰り返しを避けるために1つ残しているが、デフラグの後などメモリを返したい時に呼ぶ
+    void trimEmptyBlocks()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::vector<std::unique_ptr<MemoryBlock>>& blocks : blocksPerType)
+        {
+            for (size_t i = 0; i < blocks.size();)
+            {
+                if (blocks[i]->allocationCount != 0)
+                {
+                    i++;
+                    continue;
+                }
+                releaseBlock(*blocks[i]);
+                blocks.erase(blocks.begin() + i);
+            }
+        }
+    }
+
+    uint32_t getHeapIndex(uint32_t memoryTypeIndex) const
+    {
+        return memProps.memoryTypes[memoryTypeIndex].heapIndex;
+    }
+
+    MemoryHeapUsage getHeapUsage(uint32_t heapIndex) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryHeapUsage result;
+        for (uint32_t i = 0; i < memProps.memoryTypeCount; i++)
+        {
+            if (memProps.memoryTypes[i].heapIndex != heapIndex)
+            {
+                continue;
+            }
+            for (const std::unique_ptr<MemoryBlock>& block : blocksPerType[i])
+            {
+                result.blockBytes += block->size;
+                result.usedBytes += block->usedSize;
+            }
+        }
+        return result;
+    }
+
+private:
+    vk::DeviceSize getAlignment(const vk::MemoryRequirements& memReq, uint32_t memoryTypeIndex) const
+    {
+        vk::DeviceSize result = memReq.alignment;
+        // コヒーレントでないメモリはflushの単位(nonCoherentAtomSize)で区切っておかないと隣の区間まで巻き込んでしまう
+        if (!isHostCoherent(memoryTypeIndex) && isHostVisible(memoryTypeIndex))
+        {
+            result = std::max(result, nonCoherentAtomSize);
+        }
+        return result;
+    }
+
+    vk::DeviceSize getPreferredBlockSize(uint32_t memoryTypeIndex) const
+    {
+        vk::DeviceSize heapSize = memProps.memoryHeaps[memProps.memoryTypes[memoryTypeIndex].heapIndex].size;
+        return heapSize <= 1024ull * 1024 * 1024 ? std::min(defaultBlockSize, heapSize / 8) : defaultBlockSize;
+    }
+
+    MemoryBlock& createBlock(uint32_t memoryTypeIndex, vk::DeviceSize size, const void* pNext = nullptr)
+    {
+        std::unique_ptr<MemoryBlock> block = std::make_unique<MemoryBlock>();
+
+        vk::MemoryAllocateInfo memAllocInfo;
+        memAllocInfo.pNext = pNext;
+        memAllocInfo.allocationSize = size;
+        memAllocInfo.memoryTypeIndex = memoryTypeIndex;
+
+        block->memory = device.allocateMemoryUnique(memAllocInfo, getAllocationCallbacks(vk::ObjectType::eDeviceMemory));
+        block->memoryTypeIndex = memoryTypeIndex;
+        block->size = size;
+        if (isHostVisible(memoryTypeIndex))
+        {
+            block->pMapped = device.mapMemory(block->memory.get(), 0, VK_WHOLE_SIZE);
+        }
+        block->suballocations.push_back(MemorySuballocation{ 0, size, true, true });
+        stats.deviceMemoryAllocationCount++;
+
+        blocksPerType[memoryTypeIndex].push_back(std::move(block));
+        return *blocksPerType[memoryTypeIndex].back();
+    }
+
+    void releaseBlock(MemoryBlock& block)
+    {
+        if (block.pMapped != nullptr)
+        {
+            device.unmapMemory(block.memory.get());
+            block.pMapped = nullptr;
+        }
+        block.memory.reset();
+        stats.deviceMemoryFreeCount++;
+    }
+
+    void releaseDedicatedBlock(MemoryBlock& block)
+    {
+        std::vector<std::unique_ptr<MemoryBlock>>& blocks = blocksPerType[block.memoryTypeIndex];
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            if (blocks[i].get() == &block)
+            {
+                releaseBlock(block);
+                blocks.erase(blocks.begin() + i);
+                return;
+            }
+        }
+    }
+
+    // 空になったブロックは解放するが、確保と解放を繰り返さないようにメモリタイプごとに1つだけは残しておく
+    void releaseEmptyBlocks(uint32_t memoryTypeIndex)
+    {
+        std::vector<std::unique_ptr<MemoryBlock>>& blocks = blocksPerType[memoryTypeIndex];
+        bool keptEmptyBlock = false;
+        for (size_t i = 0; i < blocks.size();)
+        {
+            if (blocks[i]->allocationCount != 0)
+            {
+                i++;
+                continue;
+            }
+            if (!keptEmptyBlock)
+            {
+                keptEmptyBlock = true;
+                i++;
+                continue;
+            }
+            releaseBlock(*blocks[i]);
+            blocks.erase(blocks.begin() + i);
+        }
+    }
+
+    // aとbが同じbufferImageGranularityのページに乗っているかどうか
+    bool isOnSamePage(vk::DeviceSize aOffset, vk::DeviceSize aSize, vk::DeviceSize bOffset) const
+    {
+        vk::DeviceSize aEndPage = alignDown(aOffset + aSize - 1, bufferImageGranularity);
+        vk::DeviceSize bStartPage = alignDown(bOffset, bufferImageGranularity);
+        return aEndPage == bStartPage;
+    }
+
+    // ベストフィットで空き区間を探す
+    bool allocateFromBlock(MemoryBlock& block, vk::DeviceSize size, vk::DeviceSize alignment, bool linear, MemoryAllocation& allocation)
+    {
+        std::list<MemorySuballocation>::iterator best = block.suballocations.end();
+        vk::DeviceSize bestOffset = 0;
+
+        for (std::list<MemorySuballocation>::iterator it = block.suballocations.begin(); it != block.suballocations.end(); it++)
+        {
+            if (!it->free || it->size < size)
+            {
+                continue;
+            }
+
+            vk::DeviceSize offset = alignUp(it->offset, alignment);
+
+            if (it != block.suballocations.begin())
+            {
+                std::list<MemorySuballocation>::iterator prev = std::prev(it);
+                if (!prev->free && prev->linear != linear && isOnSamePage(prev->offset, prev->size, offset))
+                {
+                    offset = alignUp(offset, bufferImageGranularity);
+                }
+            }
+
+            if (offset + size > it->offset + it->size)
+            {
+                continue;
+            }
+
+            std::list<MemorySuballocation>::iterator next = std::next(it);
+            if (next != block.suballocations.end() && !next->free && next->linear != linear && isOnSamePage(offset, size, next->offset))
+            {
+                continue;
+            }
+
+            if (best == block.suballocations.end() || it->size < best->size)
+            {
+                best = it;
+                bestOffset = offset;
+            }
+        }
+
+        if (best == block.suballocations.end())
+        {
+            return false;
+        }
+
+        // 空き区間を [前の余り][使用区間][後ろの余り] に分割する
+        vk::DeviceSize freeEnd = best->offset + best->size;
+        if (bestOffset > best->offset)
+        {
+            block.suballocations.insert(best, MemorySuballocation{ best->offset, bestOffset - best->offset, true, true });
+        }
+        if (bestOffset + size < freeEnd)
+        {
+            block.suballocations.insert(std::next(best), MemorySuballocation{ bestOffset + size, freeEnd - (bestOffset + size), true, true });
+        }
+        best->offset = bestOffset;
+        best->size = size;
+        best->free = false;
+        best->linear = linear;
+        best->usage = MemoryUsage::Unknown;
+        best->createdFrame = currentFrame;
+
+        block.usedSize += size;
+        block.allocationCount++;
+
+        allocation.allocator = this;
+        version++;
+        allocation.block = &block;
+        allocation.suballocation = best;
+        allocation.memory = block.memory.get();
+        allocation.offset = bestOffset;
+        allocation.size = size;
+        allocation.memoryTypeIndex = block.memoryTypeIndex;
+        allocation.pMapped = block.pMapped != nullptr ? static_cast<char*>(block.pMapped) + bestOffset : nullptr;
+        return true;
+    }
+
+    vk::Device device;
+    vk::PhysicalDeviceMemoryProperties memProps;
+    vk::DeviceSize bufferImageGranularity = 1;
+    vk::DeviceSize nonCoherentAtomSize = 1;
+    bool dedicatedAllocationSupported = false;
+    uint64_t currentFrame = 0;
+    uint64_t version = 0;
+    std::array<std::vector<std::unique_ptr<MemoryBlock>>, VK_MAX_MEMORY_TYPES> blocksPerType;
+    MemoryAllocatorStats stats;
+    // blocksPerType、stats、versionを守る
+    mutable std::mutex mutex;
+};
+
+inline MemoryAllocation::~MemoryAllocation()
+{
+    if (allocator != nullptr)
+    {
+        allocator->free(*this);
+    }
+}
+
+std::shared_ptr<MemoryAllocator> getMemoryAllocator(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice)
+{
+    return std::make_shared<MemoryAllocator>(device.get(), physicalDevice);
+}
+
+void flushMemoryAllocation(MemoryAllocation& allocation, vk::DeviceSize offset, vk::DeviceSize size)
+{
+    allocation.allocator->flush(allocation, offset, size);
+}
+
+// 描画の間だけ使われるアタッチメントのメモリを確保する
+// LAZILY_ALLOCATEDなメモリタイプが使えればそれを専用に確保し、無ければ普通のDEVICE_LOCALなメモリにする
+// イメージはeTransientAttachmentを付けて作っておく必要がある
+std::shared_ptr<MemoryAllocation> getTransientAttachmentMemory(vk::UniqueDevice& device, MemoryAllocator& allocator, vk::UniqueImage& image)
+{
+    vk::MemoryRequirements imgMemReq = device->getImageMemoryRequirements(image.get());
+
+    std::shared_ptr<MemoryAllocation> result;
+    std::optional<uint32_t> memoryTypeIndex = allocator.selectMemoryTypeIndex(imgMemReq.memoryTypeBits, transientAttachmentMemoryRequest());
+    if (memoryTypeIndex)
+    {
+        result = allocator.allocateDedicated(imgMemReq, *memoryTypeIndex, false, image.get());
+    }
+    else
+    {
+        result = allocator.allocateForImage(image.get(), deviceLocalMemoryRequest());
+    }
+    device->bindImageMemory(image.get(), result->memory, result->offset);
+    return result;
+}
+
+// 一時的なアタッチメントで実際に確保されたメモリの量と、それによって節約できた量を表示する
+void debugTransientAttachmentMemory(vk::UniqueDevice& device, MemoryAllocation& allocation)
+{
+    vk::DeviceSize committed = allocation.size;
+    if (allocation.allocator->isLazilyAllocated(allocation.memoryTypeIndex))
+    {
+        committed = device->getMemoryCommitment(allocation.memory);
+    }
+
+    LOG("transient attachment: " << allocation.size << " bytes required, " << committed << " bytes committed, " << allocation.size - committed << " bytes saved");
+}
+
+void debugMemoryAllocatorStats(MemoryAllocator& allocator)
+{
+    MemoryAllocatorStats stats = allocator.getStats();
+
+    LOG("----------------------------------------");
+    LOG("Debug Memory Allocator");
+    LOG("allocation requests: " << stats.allocationRequestCount);
+    LOG("dedicated allocations: " << stats.dedicatedAllocationCount);
+    LOG("allocateMemory calls: " << stats.deviceMemoryAllocationCount);
+    LOG("freeMemory calls: " << stats.deviceMemoryFreeCount);
+    LOG("blocks: " << stats.blockCount << " (" << stats.blockBytes << " bytes)");
+    LOG("live allocations: " << stats.allocationCount);
+    LOG("used: " << stats.usedBytes << " bytes, free: " << stats.freeBytes << " bytes");
+    LOG("free ranges: " << stats.freeRangeCount << ", largest: " << stats.largestFreeRange << " bytes");
+    LOG("fragmentation: " << stats.fragmentation);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <csignal>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "Memory.hpp"
+
+using namespace Vulkan_Test;
+
+// debugPhysicalMemoryなどのログは起動時のヒープの情報しか分からず、人が読むためのものでしかない
+// 実行中のある時点で生きている全てのデバイスメモリの確保を、メモリタイプ、ヒープ、ブロック内の位置、用途、確保したフレームと一緒にJSONで書き出す
+// 書き出したものを時間をおいて比べれば、GPUデバッガを使わなくても、どの種類のリソースが増え続けているか、どのブロックが細切れになっているかが分かる
+
+// シグナルハンドラの中ではフラグを立てることしかできないので、実際の書き出しはメインループで行う
+volatile std::sig_atomic_t memoryReportRequested = 0;
+
+extern "C" inline void onMemoryReportSignal(int)
+{
+    memoryReportRequested = 1;
+}
+
+// SIGUSR1を受け取ったらレポートを書き出すようにする
+// 例: kill -USR1 <pid>
+// SIGUSR1の無いプラットフォーム(Windows)では何もしない
+void requestMemoryReportOnSignal()
+{
+#if defined(SIGUSR1)
+    std::signal(SIGUSR1, onMemoryReportSignal);
+#endif
+}
+
+void requestMemoryReport()
+{
+    memoryReportRequested = 1;
+}
+
+// 要求されていればtrueを返し、要求を取り消す
+bool consumeMemoryReportRequest()
+{
+    if (!memoryReportRequested)
+    {
+        return false;
+    }
+    memoryReportRequested = 0;
+    return true;
+}
+
+void writeMemoryReport(MemoryAllocator& allocator, std::ostream& out)
+{
+    const vk::PhysicalDeviceMemoryProperties& memProps = allocator.getMemoryProperties();
+    MemoryAllocatorStats stats = allocator.getStats();
+
+    out << "{\n";
+    out << "  \"frame\": " << allocator.getCurrentFrame() << ",\n";
+
+    out << "  \"heaps\": [\n";
+    for (uint32_t i = 0; i < memProps.memoryHeapCount; i++)
+    {
+        MemoryHeapUsage usage = allocator.getHeapUsage(i);
+        out << "    { \"index\": " << i
+            << ", \"size\": " << memProps.memoryHeaps[i].size
+            << ", \"flags\": \"" << vk::to_string(memProps.memoryHeaps[i].flags) << "\""
+            << ", \"blockBytes\": " << usage.blockBytes
+            << ", \"usedBytes\": " << usage.usedBytes
+            << " }" << (i + 1 < memProps.memoryHeapCount ? "," : "") << "\n";
+    }
+    out << "  ],\n";
+
+    out << "  \"memoryTypes\": [\n";
+    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++)
+    {
+        out << "    { \"index\": " << i
+            << ", \"heap\": " << memProps.memoryTypes[i].heapIndex
+            << ", \"flags\": \"" << vk::to_string(memProps.memoryTypes[i].propertyFlags) << "\""
+            << " }" << (i + 1 < memProps.memoryTypeCount ? "," : "") << "\n";
+    }
+    out << "  ],\n";
+
+    // ブロックごとに、使用中の区間を全て並べる
+    // 空き区間は数と最大の大きさだけを出す
+    out << "  \"blocks\": [";
+    bool firstBlock = true;
+    for (uint32_t memoryTypeIndex = 0; memoryTypeIndex < memProps.memoryTypeCount; memoryTypeIndex++)
+    {
+        const std::vector<std::unique_ptr<MemoryBlock>>& blocks = allocator.getBlocks(memoryTypeIndex);
+        for (size_t blockIndex = 0; blockIndex < blocks.size(); blockIndex++)
+        {
+            const MemoryBlock& block = *blocks[blockIndex];
+
+            size_t freeRangeCount = 0;
+            vk::DeviceSize largestFreeRange = 0;
+            for (const MemorySuballocation& suballocation : block.suballocations)
+            {
+                if (suballocation.free)
+                {
+                    freeRangeCount++;
+                    largestFreeRange = std::max(largestFreeRange, suballocation.size);
+                }
+            }
+
+            out << (firstBlock ? "\n" : ",\n");
+            firstBlock = false;
+            out << "    {\n";
+            out << "      \"memoryType\": " << memoryTypeIndex << ",\n";
+            out << "      \"heap\": " << allocator.getHeapIndex(memoryTypeIndex) << ",\n";
+            out << "      \"index\": " << blockIndex << ",\n";
+            out << "      \"size\": " << block.size << ",\n";
+            out << "      \"usedBytes\": " << block.usedSize << ",\n";
+            out << "      \"dedicated\": " << (block.dedicated ? "true" : "false") << ",\n";
+            out << "      \"freeRangeCount\": " << freeRangeCount << ",\n";
+            out << "      \"largestFreeRange\": " << largestFreeRange << ",\n";
+            out << "      \"allocations\": [";
+
+            bool firstAllocation = true;
+            for (const MemorySuballocation& suballocation : block.suballocations)
+            {
+                if (suballocation.free)
+                {
+                    continue;
+                }
+                out << (firstAllocation ? "\n" : ",\n");
+                firstAllocation = false;
+                out << "        { \"offset\": " << suballocation.offset
+                    << ", \"size\": " << suballocation.size
+                    << ", \"usage\": \"" << toString(suballocation.usage) << "\""
+                    << ", \"linear\": " << (suballocation.linear ? "true" : "false")
+                    << ", \"createdFrame\": " << suballocation.createdFrame
+                    << " }";
+            }
+            out << (firstAllocation ? "]\n" : "\n      ]\n");
+            out << "    }";
+        }
+    }
+    out << (firstBlock ? "],\n" : "\n  ],\n");
+
+    out << "  \"totals\": {"
+        << " \"blockCount\": " << stats.blockCount
+        << ", \"allocationCount\": " << stats.allocationCount
+        << ", \"blockBytes\": " << stats.blockBytes
+        << ", \"usedBytes\": " << stats.usedBytes
+        << ", \"freeBytes\": " << stats.freeBytes
+        << ", \"largestFreeRange\": " << stats.largestFreeRange
+        << ", \"fragmentation\": " << stats.fragmentation
+        << " }\n";
+    out << "}\n";
+}
+
+// memory_report_<フレーム番号>.jsonに書き出し、そのパスを返す
+std::string exportMemoryReport(MemoryAllocator& allocator, const std::string& directory = ".")
+{
+    std::stringstream path;
+    path << directory << "/memory_report_" << allocator.getCurrentFrame() << ".json";
+
+    std::ofstream file(path.str());
+    if (!file)
+    {
+        LOGERR("Failed to open " << path.str());
+        return std::string();
+    }
+    writeMemoryReport(allocator, file);
+    LOG("Memory report written to " << path.str());
+    return path.str();
+}
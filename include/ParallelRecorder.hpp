@@ -0,0 +1,283 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <cstdlib>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "HostAllocator.hpp"
+
+using namespace Vulkan_Test;
+
+// コマンドプールとコマンドバッファは1つずつしか無かったので、コマンドの記録は1つのスレッドでしか行えなかった
+// コマンドプールは外部同期が必要なオブジェクトで、同じプールから確保したコマンドバッファを複数のスレッドで同時に記録することはできない
+// そこでスレッドごと、さらにフレームごとにコマンドプールを持たせ、描画の一覧を分割してそれぞれのスレッドでセカンダリコマンドバッファに記録する
+// メインのスレッドはレンダーパスを開始して、executeCommandsでそれらを順番に実行させるだけになる
+//
+// フレームごとにプールを分けるのは、前のフレームのコマンドバッファがまだGPUで実行中でも次のフレームの記録を始められるようにするため
+// そのフレームのフェンスを待った後なら、プールごとresetCommandPoolでまとめてリセットできる
+// コマンドバッファを1つずつリセットするより速く、eResetCommandBufferも要らない
+
+// 描画の数がこれより少ない場合はスレッドを減らす
+// 少ない描画をさらに分けても、スレッドを起こす時間の方が長くなる
+constexpr uint32_t minDrawsPerThread = 64;
+
+// 記録に使うスレッドの数
+// 環境変数VULKAN_TEST_RECORD_THREADSで指定でき、0なら並列に記録しない
+// 無ければ論理コアの数から1つ(メインのスレッドの分)を引いた数で、8までにする
+uint32_t getRecordThreadCount()
+{
+#if !defined(__ANDROID__)
+    const char* value = std::getenv("VULKAN_TEST_RECORD_THREADS");
+    if (value != nullptr)
+    {
+        return uint32_t(std::strtoul(value, nullptr, 10));
+    }
+#endif
+    uint32_t hardwareThreads = std::thread::hardware_concurrency();
+    return std::clamp<uint32_t>(hardwareThreads > 1 ? hardwareThreads - 1 : 1, 1, 8);
+}
+
+struct ParallelRecorderStats
+{
+    uint64_t recordCount = 0;
+    uint64_t secondaryCount = 0;
+    // recordを呼んでから全てのスレッドの記録が終わるまでの時間
+    double recordMs = 0.0;
+    double lastRecordMs = 0.0;
+};
+
+class ParallelRecorder
+{
+public:
+    // 描画の一覧のfirstからlastの手前までを、渡されたセカンダリコマンドバッファに記録する関数
+    // 複数のスレッドから同時に呼ばれるので、共有するものは読むだけにする
+    using RecordFunction = std::function<void(vk::CommandBuffer cmdBuf, uint32_t first, uint32_t last)>;
+
+    ParallelRecorder(vk::Device device, uint32_t queueFamilyIndex, uint32_t frameCount, uint32_t threadCount)
+        : device(device), frameCount(frameCount)
+    {
+        vk::CommandPoolCreateInfo cmdPoolCreateInfo;
+        cmdPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
+        // 毎フレームプールごとリセットするので、短命なコマンドバッファだとドライバに伝える
+        cmdPoolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eTransient;
+
+        workers.resize(threadCount);
+        for (Worker& worker : workers)
+        {
+            worker.cmdPools.resize(frameCount);
+            worker.cmdBufs.resize(frameCount);
+            for (uint32_t i = 0; i < frameCount; i++)
+            {
+                worker.cmdPools[i] = device.createCommandPoolUnique(cmdPoolCreateInfo, getAllocationCallbacks(vk::ObjectType::eCommandPool));
+
+                // セカンダリコマンドバッファは直接キューに送信できず、プライマリコマンドバッファから実行される
+                vk::CommandBufferAllocateInfo cmdBufAllocInfo;
+                cmdBufAllocInfo.commandPool = worker.cmdPools[i].get();
+                cmdBufAllocInfo.commandBufferCount = 1;
+                cmdBufAllocInfo.level = vk::CommandBufferLevel::eSecondary;
+                worker.cmdBufs[i] = std::move(device.allocateCommandBuffersUnique(cmdBufAllocInfo)[0]);
+            }
+        }
+        executeCmdBufs.reserve(threadCount);
+
+        // スレッドはworkersが揃ってから開始する
+        for (uint32_t i = 0; i < threadCount; i++)
+        {
+            workers[i].thread = std::thread(&ParallelRecorder::run, this, i);
+        }
+    }
+
+    ParallelRecorder(const ParallelRecorder&) = delete;
+    ParallelRecorder& operator=(const ParallelRecorder&) = delete;
+
+    ~ParallelRecorder()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        jobAdded.notify_all();
+        for (Worker& worker : workers)
+        {
+            worker.thread.join();
+        }
+    }
+
+    // drawCount個の描画をスレッドの数に分けて記録し、全て終わるまで待つ
+    // 戻り値はレンダーパスの中でexecuteCommandsに渡すセカンダリコマンドバッファで、描画の一覧の順に並んでいる
+    // inheritanceInfoには、実行されるレンダーパスとサブパス(分かればフレームバッファも)を指定する
+    // frameIndexのフレームのフェンスを待った後に呼ぶ
+    const std::vector<vk::CommandBuffer>& record(uint32_t frameIndex, const vk::CommandBufferInheritanceInfo& inheritanceInfo, uint32_t drawCount, const RecordFunction& recordFunction)
+    {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+        uint32_t activeCount = getActiveThreadCount(drawCount);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job.frameIndex = frameIndex % frameCount;
+            job.inheritanceInfo = inheritanceInfo;
+            job.drawCount = drawCount;
+            job.activeCount = activeCount;
+            job.recordFunction = &recordFunction;
+            pendingCount = activeCount;
+            generation++;
+        }
+        jobAdded.notify_all();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobDone.wait(lock, [this] { return pendingCount == 0; });
+        }
+
+        executeCmdBufs.clear();
+        for (uint32_t i = 0; i < activeCount; i++)
+        {
+            executeCmdBufs.push_back(workers[i].cmdBufs[frameIndex % frameCount].get());
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        stats.recordCount++;
+        stats.secondaryCount += activeCount;
+        stats.recordMs += ms;
+        stats.lastRecordMs = ms;
+        return executeCmdBufs;
+    }
+
+    uint32_t getThreadCount() const
+    {
+        return uint32_t(workers.size());
+    }
+
+    // drawCount個の描画を記録する時に使うスレッドの数
+    uint32_t getActiveThreadCount(uint32_t drawCount) const
+    {
+        return std::clamp<uint32_t>((drawCount + minDrawsPerThread - 1) / minDrawsPerThread, 1, uint32_t(workers.size()));
+    }
+
+    ParallelRecorderStats getStats() const
+    {
+        return stats;
+    }
+
+private:
+    struct Worker
+    {
+        // フレームごとのプールと、そこから確保したセカンダリコマンドバッファ
+        std::vector<vk::UniqueCommandPool> cmdPools;
+        std::vector<vk::UniqueCommandBuffer> cmdBufs;
+        std::thread thread;
+    };
+
+    struct Job
+    {
+        uint32_t frameIndex = 0;
+        vk::CommandBufferInheritanceInfo inheritanceInfo;
+        uint32_t drawCount = 0;
+        uint32_t activeCount = 0;
+        const RecordFunction* recordFunction = nullptr;
+    };
+
+    void run(uint32_t workerIndex)
+    {
+        uint64_t seenGeneration = 0;
+        while (true)
+        {
+            Job currentJob;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                jobAdded.wait(lock, [&] { return stopping || generation != seenGeneration; });
+                if (stopping)
+                {
+                    return;
+                }
+                seenGeneration = generation;
+                currentJob = job;
+            }
+            if (workerIndex >= currentJob.activeCount)
+            {
+                continue;
+            }
+
+            // 描画の一覧を均等に分ける
+            uint32_t first = uint32_t(uint64_t(currentJob.drawCount) * workerIndex / currentJob.activeCount);
+            uint32_t last = uint32_t(uint64_t(currentJob.drawCount) * (workerIndex + 1) / currentJob.activeCount);
+
+            Worker& worker = workers[workerIndex];
+            device.resetCommandPool(worker.cmdPools[currentJob.frameIndex].get());
+
+            // eRenderPassContinueは、このコマンドバッファがレンダーパスの中で実行されることを示す
+            // セカンダリコマンドバッファはプライマリのバインドなどの状態を引き継がないので、記録する関数の中でバインドし直す
+            vk::CommandBuffer cmdBuf = worker.cmdBufs[currentJob.frameIndex].get();
+            vk::CommandBufferBeginInfo cmdBeginInfo;
+            cmdBeginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit | vk::CommandBufferUsageFlagBits::eRenderPassContinue;
+            cmdBeginInfo.pInheritanceInfo = &currentJob.inheritanceInfo;
+            cmdBuf.begin(cmdBeginInfo);
+            (*currentJob.recordFunction)(cmdBuf, first, last);
+            cmdBuf.end();
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pendingCount--;
+                if (pendingCount == 0)
+                {
+                    jobDone.notify_one();
+                }
+            }
+        }
+    }
+
+    vk::Device device;
+    uint32_t frameCount;
+    std::vector<Worker> workers;
+    std::vector<vk::CommandBuffer> executeCmdBufs;
+
+    std::mutex mutex;
+    std::condition_variable jobAdded;
+    std::condition_variable jobDone;
+    Job job;
+    uint64_t generation = 0;
+    uint32_t pendingCount = 0;
+    bool stopping = false;
+    ParallelRecorderStats stats;
+};
+
+std::shared_ptr<ParallelRecorder> getParallelRecorder(vk::UniqueDevice& device, uint32_t queueFamilyIndex, uint32_t frameCount, uint32_t threadCount)
+{
+    return std::make_shared<ParallelRecorder>(device.get(), queueFamilyIndex, frameCount, threadCount);
+}
+
+void debugParallelRecorder(ParallelRecorder& parallelRecorder)
+{
+    ParallelRecorderStats stats = parallelRecorder.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Parallel Recorder");
+    LOG("threads: " << parallelRecorder.getThreadCount());
+    LOG("records: " << stats.recordCount << ", secondary command buffers: " << stats.secondaryCount);
+    if (stats.recordCount > 0)
+    {
+        LOG("average record time: " << stats.recordMs / stats.recordCount << " ms");
+        LOG("secondary command buffers per record: " << double(stats.secondaryCount) / stats.recordCount);
+    }
+}
+
+// 毎回drawCount個の描画を記録した場合に、描画の数に見合った数のスレッドに分けられていたかを確かめる
+// VULKAN_TEST_DRAW_REPEATで描画を増やして実行し、並列に記録する経路が実際に使われたことを確かめるのに使う
+bool checkParallelRecorder(ParallelRecorder& parallelRecorder, uint32_t drawCount)
+{
+    ParallelRecorderStats stats = parallelRecorder.getStats();
+    uint32_t expectedCount = parallelRecorder.getActiveThreadCount(drawCount);
+    if (stats.recordCount > 0 && stats.secondaryCount != stats.recordCount * expectedCount)
+    {
+        LOGERR("Parallel recorder used " << stats.secondaryCount << " secondary command buffers in " << stats.recordCount << " records. (expected " << expectedCount << " per record)");
+        return false;
+    }
+    return true;
+}
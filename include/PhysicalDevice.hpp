@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
@@ -20,6 +21,71 @@ std::shared_ptr<std::vector<vk::PhysicalDevice>> getPhysicalDevices(vk::UniqueIn
     return result;
 }
 
+bool isDeviceExtensionSupported(vk::PhysicalDevice& physicalDevice, const char* extensionName)
+{
+    std::vector<vk::ExtensionProperties> extProps = physicalDevice.enumerateDeviceExtensionProperties();
+    for (size_t i = 0; i < extProps.size(); i++)
+    {
+        if (std::string_view(extProps[i].extensionName.data()) == extensionName)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// タイムラインセマフォは、バイナリのセマフォと違って単調に増える64bitの値を持つ
+// 「この値に達したら」という待ち方ができ、CPUからも値の読み取りや待機ができる
+// Vulkan 1.2でコアに取り込まれているので、それ以降のデバイスだけを対象にする
+bool isTimelineSemaphoreSupported(vk::PhysicalDevice& physicalDevice)
+{
+    if (physicalDevice.getProperties().apiVersion < VK_API_VERSION_1_2)
+    {
+        return false;
+    }
+    vk::StructureChain<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceTimelineSemaphoreFeatures> features =
+        physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceTimelineSemaphoreFeatures>();
+    return features.get<vk::PhysicalDeviceTimelineSemaphoreFeatures>().timelineSemaphore == VK_TRUE;
+}
+
+// VK_EXT_host_image_copyはVK_KHR_copy_commands2などに依存していて、それらがコアになっているVulkan 1.3以降のデバイスだけを対象にする
+// 古いヘッダでは定義が無いので、その場合は常に使わない
+bool isHostImageCopySupported(vk::PhysicalDevice& physicalDevice)
+{
+#if defined(VK_EXT_host_image_copy)
+    if (physicalDevice.getProperties().apiVersion < VK_API_VERSION_1_3 || !isDeviceExtensionSupported(physicalDevice, VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME))
+    {
+        return false;
+    }
+    vk::StructureChain<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceHostImageCopyFeaturesEXT> features =
+        physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceHostImageCopyFeaturesEXT>();
+    return features.get<vk::PhysicalDeviceHostImageCopyFeaturesEXT>().hostImageCopy == VK_TRUE;
+#else
+    return false;
+#endif
+}
+
+// VK_KHR_present_idは表示するイメージに番号を付け、VK_KHR_present_waitはその番号のイメージが表示されるまでCPUで待てるようにする
+// 2つは組で使うので、両方の拡張機能と機能に対応している場合だけを対象にする
+// 機能の取得にgetFeatures2を使うので、Vulkan 1.1以降のデバイスに限る
+bool isPresentWaitSupported(vk::PhysicalDevice& physicalDevice)
+{
+#if defined(VK_KHR_present_id) && defined(VK_KHR_present_wait)
+    if (physicalDevice.getProperties().apiVersion < VK_API_VERSION_1_1 ||
+        !isDeviceExtensionSupported(physicalDevice, VK_KHR_PRESENT_ID_EXTENSION_NAME) ||
+        !isDeviceExtensionSupported(physicalDevice, VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+    {
+        return false;
+    }
+    vk::StructureChain<vk::PhysicalDeviceFeatures2, vk::PhysicalDevicePresentIdFeaturesKHR, vk::PhysicalDevicePresentWaitFeaturesKHR> features =
+        physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDevicePresentIdFeaturesKHR, vk::PhysicalDevicePresentWaitFeaturesKHR>();
+    return features.get<vk::PhysicalDevicePresentIdFeaturesKHR>().presentId == VK_TRUE &&
+        features.get<vk::PhysicalDevicePresentWaitFeaturesKHR>().presentWait == VK_TRUE;
+#else
+    return false;
+#endif
+}
+
 std::shared_ptr<std::pair<vk::PhysicalDevice, uint32_t>> selectPhysicalDeviceAndQueueFamilyIndex(vk::PhysicalDevice& physicalDevice, uint32_t queueFamilyIndex)
 {
     std::shared_ptr<std::pair<vk::PhysicalDevice, uint32_t>> result;
@@ -108,4 +174,55 @@ std::shared_ptr<std::pair<vk::PhysicalDevice, uint32_t>> selectPhysicalDeviceAnd
     }
 
     return result;
-}
\ No newline at end of file
+}
+
+// 転送に使うキューファミリを探す
+// グラフィックスやコンピュートの機能を持たない転送専用のファミリは、多くのディスクリートGPUでDMAエンジンに対応していて、
+// そこでコピーすれば描画と並行して実行されるので描画の邪魔をしない
+// 転送専用のものが無ければ、グラフィックス以外で転送できるファミリ(非同期コンピュートなど)を使う
+// どちらも無ければnulloptを返すので、グラフィックスのキューで転送する
+std::optional<uint32_t> findTransferQueueFamilyIndex(vk::PhysicalDevice& physicalDevice, uint32_t graphicsQueueFamilyIndex)
+{
+    std::vector<vk::QueueFamilyProperties> queueProps = physicalDevice.getQueueFamilyProperties();
+    std::optional<uint32_t> result;
+
+    for (uint32_t i = 0; i < queueProps.size(); i++)
+    {
+        vk::QueueFlags flags = queueProps[i].queueFlags;
+        if (i == graphicsQueueFamilyIndex || (flags & vk::QueueFlagBits::eGraphics))
+        {
+            continue;
+        }
+        // グラフィックスやコンピュートのキューは暗黙に転送もできるが、ここでは明示しているものだけを選ぶ
+        if (!(flags & vk::QueueFlagBits::eTransfer))
+        {
+            continue;
+        }
+
+        if (!(flags & vk::QueueFlagBits::eCompute))
+        {
+            return i;
+        }
+        if (!result)
+        {
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+// グラフィックスのキューを持つ最初のキューファミリ
+uint32_t findGraphicsQueueFamilyIndex(vk::PhysicalDevice& physicalDevice)
+{
+    std::vector<vk::QueueFamilyProperties> queueProps = physicalDevice.getQueueFamilyProperties();
+    for (uint32_t i = 0; i < queueProps.size(); i++)
+    {
+        if (queueProps[i].queueFlags & vk::QueueFlagBits::eGraphics)
+        {
+            return i;
+        }
+    }
+    LOGERR("No graphics queue family is available.");
+    exit(EXIT_FAILURE);
+}
@@ -7,6 +7,7 @@
 #include <filesystem>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 #if defined(__ANDROID__)
 #include <android/asset_manager.h>
@@ -25,7 +26,7 @@ std::shared_ptr<vk::UniquePipelineLayout> getDescpriptorPipelineLayout(vk::Uniqu
     layoutCreateInfo.pushConstantRangeCount = pushConstantRanges.size();
     layoutCreateInfo.pPushConstantRanges = pushConstantRanges.data();
 
-    *result = device->createPipelineLayoutUnique(layoutCreateInfo);
+    *result = device->createPipelineLayoutUnique(layoutCreateInfo, getAllocationCallbacks(vk::ObjectType::ePipelineLayout));
     return result;
 }
 
@@ -158,7 +159,7 @@ std::shared_ptr<vk::UniquePipeline> getPipeline(
         vk::ShaderModuleCreateInfo vertShaderCreateInfo;
         vertShaderCreateInfo.codeSize = vertSpvFileSz;
         vertShaderCreateInfo.pCode = reinterpret_cast<const uint32_t*>(vertSpvFileData.data());
-        vertShader = device.get().createShaderModuleUnique(vertShaderCreateInfo);
+        vertShader = device.get().createShaderModuleUnique(vertShaderCreateInfo, getAllocationCallbacks(vk::ObjectType::eShaderModule));
 
         // フラグメントシェーダーを読み込む
 #if __ANDROID__
@@ -178,7 +179,7 @@ std::shared_ptr<vk::UniquePipeline> getPipeline(
         vk::ShaderModuleCreateInfo fragShaderCreateInfo;
         fragShaderCreateInfo.codeSize = fragSpvFileSz;
         fragShaderCreateInfo.pCode = reinterpret_cast<const uint32_t*>(fragSpvFileData.data());
-        fragShader = device.get().createShaderModuleUnique(fragShaderCreateInfo);
+        fragShader = device.get().createShaderModuleUnique(fragShaderCreateInfo, getAllocationCallbacks(vk::ObjectType::eShaderModule));
     }
 
     vk::PipelineShaderStageCreateInfo shaderStage[2];
@@ -203,6 +204,6 @@ std::shared_ptr<vk::UniquePipeline> getPipeline(
     pipelineCreateInfo.stageCount = std::size(shaderStage);
     pipelineCreateInfo.pStages = shaderStage;
 
-    *result = device.get().createGraphicsPipelineUnique(nullptr, pipelineCreateInfo).value;
+    *result = device.get().createGraphicsPipelineUnique(nullptr, pipelineCreateInfo, getAllocationCallbacks(vk::ObjectType::ePipeline)).value;
     return result;
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 using namespace Vulkan_Test;
 
@@ -101,7 +102,7 @@ std::shared_ptr<vk::UniqueRenderPass> getRenderPass(vk::UniqueDevice &device, vk
     // という関係性を表す”枠組み”に過ぎず、それぞれの処理(＝サブパス)が具体的にどのような処理を行うかは関知しない
     // 実際にはいろいろなコマンドを任意の回数呼ぶことができる
     std::shared_ptr<vk::UniqueRenderPass> result = std::make_shared<vk::UniqueRenderPass>();
-    *result = device.get().createRenderPassUnique(renderpassCreateInfo);
+    *result = device.get().createRenderPassUnique(renderpassCreateInfo, getAllocationCallbacks(vk::ObjectType::eRenderPass));
     return result;
 }
 
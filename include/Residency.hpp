@@ -0,0 +1,496 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "Memory.hpp"
+#include "PhysicalDevice.hpp"
+
+using namespace Vulkan_Test;
+
+// デバイスメモリを使い過ぎると、確保に失敗したりドライバがメインメモリとの間でページングを始めて急に遅くなったりする
+// VK_EXT_memory_budgetを使うと、OSや他のプロセスの分も考慮した「このプロセスが使ってよい量(budget)」と
+// 「このプロセスが現在使っている量(usage)」をヒープごとに取得できる
+// 毎フレームこれを確認し、予算に近づいたらしばらく使われていないテクスチャやメッシュから追い出す
+
+enum class ResidentResourceKind
+{
+    Mesh,
+    Texture,
+};
+
+struct ResidentResource
+{
+    std::string name;
+    ResidentResourceKind kind = ResidentResourceKind::Mesh;
+    // 今メモリがあるヒープ
+    // 降格した場合は移った先のヒープになる
+    uint32_t heapIndex = 0;
+    // 読み込み直す先のヒープ
+    uint32_t homeHeapIndex = 0;
+    vk::DeviceSize size = 0;
+    uint64_t lastUsedFrame = 0;
+    // 描画したかったが、追い出されていて描画できなかったフレーム
+    uint64_t requestedFrame = 0;
+    uint64_t evictedFrame = 0;
+    bool registered = false;
+    bool resident = true;
+    // メモリを手放す処理
+    // 解放してしまう(追い出し)か、HOST_VISIBLEなヒープに移す(降格)かは持ち主が決める
+    // 降格した場合はdemoteを呼ぶ
+    // 追い出した場合は、描画に使わないようにするのも持ち主の仕事
+    // 最後に使われてからframesInFlightフレーム経ったものだけが対象なので、GPUが使い終わるのを待たずに破棄してよい
+    std::function<void()> evict;
+    // 元のヒープに読み込み直す処理
+    // 終わったらmakeResidentを呼ぶ
+    std::function<void()> restore;
+};
+
+struct ResidencyStats
+{
+    uint64_t evictionCount = 0;
+    uint64_t restoreCount = 0;
+};
+
+struct HeapBudget
+{
+    vk::DeviceSize heapSize = 0;
+    // VK_EXT_memory_budgetが無い場合はヒープサイズから見積もった値
+    vk::DeviceSize budget = 0;
+    vk::DeviceSize usage = 0;
+    // アロケータ経由で確保した分
+    MemoryHeapUsage allocated;
+};
+
+class ResidencyManager
+{
+public:
+    // 予算のこの割合を超えたら追い出しを始める
+    float evictionThreshold = 0.9f;
+    // 読み込み直してもこの割合に収まる場合だけ読み込み直す
+    // 追い出しと読み込み直しを毎フレーム繰り返さないように、evictionThresholdより低くしておく
+    float restoreThreshold = 0.8f;
+
+    ResidencyManager(vk::PhysicalDevice physicalDevice, MemoryAllocator& allocator, bool memoryBudgetSupported, uint32_t framesInFlight)
+        : physicalDevice(physicalDevice), allocator(allocator), memoryBudgetSupported(memoryBudgetSupported), framesInFlight(framesInFlight)
+    {
+        heapCount = allocator.getMemoryProperties().memoryHeapCount;
+    }
+
+    // フレームの最初に呼ぶ
+    // updateを呼ばないフレームでも、touchとrequestにはこのフレーム番号が記録される
+    void setCurrentFrame(uint64_t frame)
+    {
+        currentFrame = frame;
+    }
+
+    uint32_t registerResource(const std::string& name, ResidentResourceKind kind, MemoryAllocation& allocation, std::function<void()> evict, std::function<void()> restore = nullptr)
+    {
+        uint32_t id = 0;
+        while (id < resources.size() && resources[id].registered)
+        {
+            id++;
+        }
+        if (id == resources.size())
+        {
+            resources.push_back(ResidentResource());
+            evictionCandidates.reserve(resources.size());
+        }
+
+        ResidentResource& resource = resources[id];
+        resource.name = name;
+        resource.kind = kind;
+        resource.heapIndex = allocator.getHeapIndex(allocation.memoryTypeIndex);
+        resource.homeHeapIndex = resource.heapIndex;
+        resource.size = allocation.size;
+        resource.lastUsedFrame = currentFrame;
+        resource.registered = true;
+        resource.resident = true;
+        resource.evict = std::move(evict);
+        resource.restore = std::move(restore);
+        return id;
+    }
+
+    void unregisterResource(uint32_t id)
+    {
+        resources[id] = ResidentResource();
+    }
+
+    // 実際に描画に使ったフレームだけこれを呼ぶ
+    // 降格したリソースはそのまま描画に使えるので、これが読み込み直しを求めたことにもなる
+    void touch(uint32_t id)
+    {
+        resources[id].lastUsedFrame = currentFrame;
+    }
+
+    // 描画したかったが、追い出されていて描画できなかったリソースに呼ぶ
+    // 使ったことにはならないが、読み込み直しを求める
+    void request(uint32_t id)
+    {
+        resources[id].requestedFrame = currentFrame;
+    }
+
+    // evictの中で、HOST_VISIBLEなヒープに移した後に呼ぶ
+    // 移った先のヒープを記録し、そのヒープの使用量として数えられるようにする
+    void demote(uint32_t id, MemoryAllocation& allocation)
+    {
+        ResidentResource& resource = resources[id];
+        resource.heapIndex = allocator.getHeapIndex(allocation.memoryTypeIndex);
+        resource.size = allocation.size;
+    }
+
+    // 追い出したリソースを再び読み込んだ後に呼ぶ
+    void makeResident(uint32_t id, MemoryAllocation& allocation)
+    {
+        ResidentResource& resource = resources[id];
+        resource.heapIndex = allocator.getHeapIndex(allocation.memoryTypeIndex);
+        resource.homeHeapIndex = resource.heapIndex;
+        resource.size = allocation.size;
+        resource.lastUsedFrame = currentFrame;
+        resource.resident = true;
+    }
+
+    bool isResident(uint32_t id) const
+    {
+        return resources[id].resident;
+    }
+
+    // 登録されているリソースが全て元のヒープにあるかどうか
+    bool isAllResident() const
+    {
+        for (const ResidentResource& resource : resources)
+        {
+            if (resource.registered && !resource.resident)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 全てのヒープの予算をこの値までに制限する
+    // 予算の少ない環境での追い出しと読み込み直しを、どの環境でも同じように確かめるのに使う
+    // VK_WHOLE_SIZEで制限しなくなる
+    void setBudgetCap(vk::DeviceSize cap)
+    {
+        budgetCap = cap;
+    }
+
+    // 降格したリソースを読み込み直した時の古いバッファなど、処理中のフレームがまだ使っているものを渡す
+    // framesInFlightフレーム経ったら破棄する
+    void retire(std::shared_ptr<void> resource)
+    {
+        retiredResources.push_back(std::make_pair(currentFrame, std::move(resource)));
+    }
+
+    const HeapBudget& getHeapBudget(uint32_t heapIndex) const
+    {
+        return heapBudgets[heapIndex];
+    }
+
+    uint32_t getHeapCount() const
+    {
+        return heapCount;
+    }
+
+    ResidencyStats getStats() const
+    {
+        return stats;
+    }
+
+    // フレームの最初、フェンスを待った後に呼ぶ
+    // 予算を超えたヒープからは追い出し、余裕のあるヒープには求められているものを読み込み直す
+    // 追い出すか読み込み直したリソースがあればtrueを返す
+    bool update(uint64_t frame)
+    {
+        currentFrame = frame;
+        releaseRetiredResources();
+        pollBudget();
+
+        bool changed = false;
+        for (uint32_t heapIndex = 0; heapIndex < heapCount; heapIndex++)
+        {
+            const HeapBudget& heapBudget = heapBudgets[heapIndex];
+            vk::DeviceSize limit = vk::DeviceSize(heapBudget.budget * evictionThreshold);
+            vk::DeviceSize restoreLimit = vk::DeviceSize(heapBudget.budget * restoreThreshold);
+            bool heapChanged = false;
+            if (heapBudget.usage > limit)
+            {
+                heapChanged = evictLeastRecentlyUsed(heapIndex, heapBudget.usage - limit);
+            }
+            else if (heapBudget.usage < restoreLimit)
+            {
+                heapChanged = restoreRequested(heapIndex, restoreLimit - heapBudget.usage);
+            }
+
+            // サブアロケーションを解放してもブロックが空にならなければ使用量は減らず、
+            // 降格や読み込み直しでは他のヒープの使用量も変わるので、見積もらずに取得し直す
+            if (heapChanged)
+            {
+                pollBudget();
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+private:
+    void pollBudget()
+    {
+        const vk::PhysicalDeviceMemoryProperties& memProps = allocator.getMemoryProperties();
+
+        if (memoryBudgetSupported)
+        {
+            vk::StructureChain<vk::PhysicalDeviceMemoryProperties2, vk::PhysicalDeviceMemoryBudgetPropertiesEXT> memProps2 =
+                physicalDevice.getMemoryProperties2<vk::PhysicalDeviceMemoryProperties2, vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+            const vk::PhysicalDeviceMemoryBudgetPropertiesEXT& budgetProps = memProps2.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+
+            for (uint32_t i = 0; i < heapCount; i++)
+            {
+                heapBudgets[i].heapSize = memProps.memoryHeaps[i].size;
+                heapBudgets[i].budget = budgetProps.heapBudget[i];
+                heapBudgets[i].usage = budgetProps.heapUsage[i];
+                heapBudgets[i].allocated = allocator.getHeapUsage(i);
+                heapBudgets[i].budget = std::min(heapBudgets[i].budget, budgetCap);
+            }
+            return;
+        }
+
+        // 拡張機能が無い場合は、ヒープの8割を予算とみなし、自分で確保した量だけを使用量として数える
+        for (uint32_t i = 0; i < heapCount; i++)
+        {
+            heapBudgets[i].heapSize = memProps.memoryHeaps[i].size;
+            heapBudgets[i].budget = memProps.memoryHeaps[i].size / 10 * 8;
+            heapBudgets[i].allocated = allocator.getHeapUsage(i);
+            heapBudgets[i].usage = heapBudgets[i].allocated.blockBytes;
+            heapBudgets[i].budget = std::min(heapBudgets[i].budget, budgetCap);
+        }
+    }
+
+    // 直近framesInFlightフレームで使われたリソースはまだGPUが読んでいる可能性があるので対象外
+    // 解放できた量は、実際に手放したブロックの大きさで数える
+    // 追い出したリソースがあればtrueを返す
+    bool evictLeastRecentlyUsed(uint32_t heapIndex, vk::DeviceSize bytesToFree)
+    {
+        evictionCandidates.clear();
+        for (uint32_t id = 0; id < resources.size(); id++)
+        {
+            const ResidentResource& resource = resources[id];
+            if (!resource.registered || !resource.resident || resource.heapIndex != heapIndex)
+            {
+                continue;
+            }
+            if (resource.lastUsedFrame + framesInFlight >= currentFrame)
+            {
+                continue;
+            }
+            evictionCandidates.push_back(id);
+        }
+
+        std::sort(evictionCandidates.begin(), evictionCandidates.end(), [&](uint32_t a, uint32_t b)
+        {
+            return resources[a].lastUsedFrame < resources[b].lastUsedFrame;
+        });
+
+        vk::DeviceSize blockBytesBefore = allocator.getHeapUsage(heapIndex).blockBytes;
+        vk::DeviceSize freed = 0;
+        bool result = false;
+        for (uint32_t id : evictionCandidates)
+        {
+            if (freed >= bytesToFree)
+            {
+                break;
+            }
+
+            ResidentResource& resource = resources[id];
+            LOG("Evict " << resource.name << " (" << resource.size << " bytes, last used frame " << resource.lastUsedFrame << ")");
+            resource.evict();
+            resource.resident = false;
+            resource.evictedFrame = currentFrame;
+            stats.evictionCount++;
+            result = true;
+
+            // アロケータは空のブロックを1つ残しておくので、それも返す
+            allocator.trimEmptyBlocks();
+            vk::DeviceSize blockBytes = allocator.getHeapUsage(heapIndex).blockBytes;
+            freed = blockBytesBefore > blockBytes ? blockBytesBefore - blockBytes : 0;
+        }
+
+        if (freed < bytesToFree)
+        {
+            LOGERR("Memory heap " << heapIndex << " is over budget and nothing more can be evicted.");
+        }
+        return result;
+    }
+
+    // 追い出した後に使われたか求められた(touchかrequestされた)ものを、roomに収まるだけ元のヒープに読み込み直す
+    // 読み込み直したリソースがあればtrueを返す
+    bool restoreRequested(uint32_t heapIndex, vk::DeviceSize room)
+    {
+        vk::DeviceSize restored = 0;
+        for (uint32_t id = 0; id < resources.size(); id++)
+        {
+            ResidentResource& resource = resources[id];
+            if (!resource.registered || resource.resident || !resource.restore || resource.homeHeapIndex != heapIndex)
+            {
+                continue;
+            }
+            if (std::max(resource.lastUsedFrame, resource.requestedFrame) <= resource.evictedFrame || restored + resource.size > room)
+            {
+                continue;
+            }
+
+            LOG("Restore " << resource.name << " (" << resource.size << " bytes)");
+            resource.restore();
+            if (resource.resident)
+            {
+                restored += resource.size;
+                stats.restoreCount++;
+            }
+        }
+        return restored > 0;
+    }
+
+    void releaseRetiredResources()
+    {
+        for (size_t i = 0; i < retiredResources.size();)
+        {
+            if (retiredResources[i].first + framesInFlight > currentFrame)
+            {
+                i++;
+                continue;
+            }
+            retiredResources.erase(retiredResources.begin() + i);
+        }
+    }
+
+    vk::PhysicalDevice physicalDevice;
+    MemoryAllocator& allocator;
+    bool memoryBudgetSupported;
+    uint32_t framesInFlight;
+    uint32_t heapCount = 0;
+    uint64_t currentFrame = 0;
+    vk::DeviceSize budgetCap = VK_WHOLE_SIZE;
+    std::array<HeapBudget, VK_MAX_MEMORY_HEAPS> heapBudgets;
+    std::vector<ResidentResource> resources;
+    std::vector<uint32_t> evictionCandidates;
+    // 破棄を待っているものと、渡された時のフレーム
+    std::vector<std::pair<uint64_t, std::shared_ptr<void>>> retiredResources;
+    ResidencyStats stats;
+};
+
+// 予算を強制的に0にして、追い出しと読み込み直しが起きることを確かめる
+// 最初にupdateを呼んだフレームからforcedFrameCountフレームの間は予算を0にし、シーンも描画しない
+// 描画しないのでリソースは使われなくなり、framesInFlightフレーム経つと追い出される
+// その後は予算を元に戻してシーンを描画するので、追い出されたリソースが求められて読み込み直される
+class ResidencyCheck
+{
+public:
+    ResidencyCheck(ResidencyManager& residencyManager, uint64_t forcedFrameCount)
+        : residencyManager(residencyManager), forcedFrameCount(forcedFrameCount)
+    {
+    }
+
+    ResidencyCheck(const ResidencyCheck&) = delete;
+    ResidencyCheck& operator=(const ResidencyCheck&) = delete;
+
+    bool isEnabled() const
+    {
+        return forcedFrameCount != 0;
+    }
+
+    // リソースを登録した後のフレームごとに呼ぶ
+    // シーンを描画してよければtrueを返す
+    bool update(uint64_t frame)
+    {
+        if (!isEnabled())
+        {
+            return true;
+        }
+        if (startFrame == 0)
+        {
+            LOG("Residency check: force a zero budget for " << forcedFrameCount << " frames from frame " << frame);
+            startFrame = frame;
+            residencyManager.setBudgetCap(0);
+        }
+        if (frame < startFrame + forcedFrameCount)
+        {
+            return false;
+        }
+        if (!released)
+        {
+            LOG("Residency check: restore the budget at frame " << frame);
+            released = true;
+            residencyManager.setBudgetCap(VK_WHOLE_SIZE);
+        }
+        return true;
+    }
+
+    // 終了時に呼ぶ
+    // 追い出しと読み込み直しが起き、全てのリソースが元のヒープに戻っていればtrueを返す
+    bool check() const
+    {
+        if (!isEnabled())
+        {
+            return true;
+        }
+
+        ResidencyStats stats = residencyManager.getStats();
+        if (!released || stats.evictionCount == 0 || stats.restoreCount == 0 || !residencyManager.isAllResident())
+        {
+            LOGERR("Residency check failed: released " << released << ", evictions " << stats.evictionCount << ", restores " << stats.restoreCount << ", all resident " << residencyManager.isAllResident());
+            return false;
+        }
+        LOG("Residency check passed: evictions " << stats.evictionCount << ", restores " << stats.restoreCount);
+        return true;
+    }
+
+private:
+    ResidencyManager& residencyManager;
+    uint64_t forcedFrameCount;
+    uint64_t startFrame = 0;
+    bool released = false;
+};
+
+std::shared_ptr<ResidencyManager> getResidencyManager(vk::PhysicalDevice& physicalDevice, MemoryAllocator& allocator, uint32_t framesInFlight)
+{
+    bool memoryBudgetSupported = isDeviceExtensionSupported(physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    return std::make_shared<ResidencyManager>(physicalDevice, allocator, memoryBudgetSupported, framesInFlight);
+}
+
+// 環境変数VULKAN_TEST_RESIDENCY_CHECKに予算を0にしておくフレーム数を指定すると有効になる
+// VULKAN_TEST_MAX_FRAMESで、読み込み直しが終わるまで十分なフレーム数を指定して実行する
+std::shared_ptr<ResidencyCheck> getResidencyCheck(ResidencyManager& residencyManager)
+{
+    uint64_t forcedFrameCount = 0;
+#if !defined(__ANDROID__)
+    if (const char* value = std::getenv("VULKAN_TEST_RESIDENCY_CHECK"))
+    {
+        forcedFrameCount = std::strtoull(value, nullptr, 10);
+    }
+#endif
+    return std::make_shared<ResidencyCheck>(residencyManager, forcedFrameCount);
+}
+
+void debugResidency(ResidencyManager& residencyManager)
+{
+    ResidencyStats stats = residencyManager.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Residency");
+    LOG("evictions: " << stats.evictionCount << ", restores: " << stats.restoreCount);
+    SET_LOG_INDEX(1);
+    for (uint32_t i = 0; i < residencyManager.getHeapCount(); i++)
+    {
+        const HeapBudget& heapBudget = residencyManager.getHeapBudget(i);
+        LOG("----------------------------------------");
+        LOG("heap index: " << i);
+        LOG("size: " << heapBudget.heapSize << ", budget: " << heapBudget.budget << ", usage: " << heapBudget.usage);
+        LOG("allocated blocks: " << heapBudget.allocated.blockBytes << ", used: " << heapBudget.allocated.usedBytes);
+    }
+    SET_LOG_INDEX(0);
+}
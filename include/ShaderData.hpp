@@ -5,6 +5,13 @@
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "Memory.hpp"
+#include "FrameArena.hpp"
+#include "Staging.hpp"
+#include "UploadService.hpp"
+#include "HostImport.hpp"
+#include "Texture.hpp"
+#include "HostImageCopy.hpp"
 
 using namespace Vulkan_Test;
 
@@ -34,6 +41,13 @@ struct ObjectData {
     int id;
 };
 
+// 描画の一覧の1つ分
+// vertexBufferIndexはバインドする頂点バッファの番号、objectIdはプッシュ定数で渡すid
+struct DrawItem {
+    uint32_t vertexBufferIndex;
+    int objectId;
+};
+
 Mat4x4 operator*(const Mat4x4 &a, const Mat4x4 &b) {
     Mat4x4 c = {};
     for(int i = 0; i < 4; i++)
@@ -131,19 +145,8 @@ Mat4x4 projectionMatrix(float angle_y, float ratio, float near, float far)
     }};
 }
 
-std::shared_ptr<vk::UniqueBuffer> getVertexBuffer(vk::UniqueDevice& device)
+vk::BufferCreateInfo getVertexBufferCreateInfo()
 {
-    // バッファというのはデバイスメモリ上のデータ列を表すオブジェクト
-    // 何度も言うようにGPUから普通のメモリの内容は参照できない
-    // シェーダで使いたいデータがある場合、まずデバイスメモリに移す必要がある
-    // そしてそれはプログラムの上では「バッファに書き込む」「バッファに書き込んで転送する」という形になる
-    // 頂点座標のデータをシェーダに送るためのバッファを作成する
-    // いわゆる頂点バッファ
-    // size はバッファの大きさをバイト数で示すもの
-    // ここに例えば100という値を指定すれば、100バイトの大きさのバッファが作成できる
-    // ここでは前節で定義した構造体のバイト数をsizeof演算子で取得し、それにデータの数をかけている
-    std::shared_ptr<vk::UniqueBuffer> result = std::make_shared<vk::UniqueBuffer>();
-
     // 次は実際に使われる頂点バッファの作成
     // 今までと違い、メモリの確保時にvk::MemoryPropertyFlagBits::eDeviceLocalフラグを持ったメモリを使うようにする
     // 逆にeHostVisibleは要らない
@@ -155,165 +158,96 @@ std::shared_ptr<vk::UniqueBuffer> getVertexBuffer(vk::UniqueDevice& device)
     // usage は作成するバッファの使い道を示すためのもの
     // 今回のように頂点バッファを作る場合、上記のようにvk::BufferUsageFlagBits::eVertexBufferフラグを指定しなければならない
     // 他にも場合によって様々なフラグを指定する必要があり、複数のフラグを指定することもある
-    vertexBufferCreateInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst; // eTransferDstを追加
+    // eTransferSrcはデフラグで別の場所へコピーされる時のため
+    vertexBufferCreateInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc;
     // sharingModeについては今のところは無視
     // ここではvk::SharingMode::eExclusiveを指定
     vertexBufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
-    
-    *result = device.get().createBufferUnique(vertexBufferCreateInfo);
-    return result;
+    return vertexBufferCreateInfo;
 }
 
-std::shared_ptr<vk::UniqueDeviceMemory> getVertexBufferMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueBuffer& vertexBuf)
+std::shared_ptr<vk::UniqueBuffer> getVertexBuffer(vk::UniqueDevice& device)
 {
-    // 実際に使われる頂点バッファのデバイスメモリを確保する
-
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
+    // バッファというのはデバイスメモリ上のデータ列を表すオブジェクト
+    // 何度も言うようにGPUから普通のメモリの内容は参照できない
+    // シェーダで使いたいデータがある場合、まずデバイスメモリに移す必要がある
+    // そしてそれはプログラムの上では「バッファに書き込む」「バッファに書き込んで転送する」という形になる
+    // 頂点座標のデータをシェーダに送るためのバッファを作成する
+    // いわゆる頂点バッファ
+    // size はバッファの大きさをバイト数で示すもの
+    // ここに例えば100という値を指定すれば、100バイトの大きさのバッファが作成できる
+    // ここでは前節で定義した構造体のバイト数をsizeof演算子で取得し、それにデータの数をかけている
+    std::shared_ptr<vk::UniqueBuffer> result = std::make_shared<vk::UniqueBuffer>();
 
-    vk::MemoryRequirements vertexBufMemReq = device.get().getBufferMemoryRequirements(vertexBuf.get());
-    
-    vk::MemoryAllocateInfo vertexBufMemAllocInfo;
-    vertexBufMemAllocInfo.allocationSize = vertexBufMemReq.size;
-    
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) 
-    {
-        if (vertexBufMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal))
-        {
-            vertexBufMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound) 
-    {
-        LOGERR("Suitable memory type not found. ");
-        exit(EXIT_FAILURE);
-    }
-    
-    *result = device.get().allocateMemoryUnique(vertexBufMemAllocInfo);
-    // デバイスメモリが確保出来たら bindBufferMemoryで結び付ける
-    // 第1引数は結びつけるバッファ、第2引数は結びつけるデバイスメモリ
-    // 第3引数は、確保したデバイスメモリのどこを(先頭から何バイト目以降を)使用するかを指定するもの
-    device.get().bindBufferMemory(vertexBuf.get(), result->get(), 0);
+    *result = device.get().createBufferUnique(getVertexBufferCreateInfo(), getAllocationCallbacks(vk::ObjectType::eBuffer));
     return result;
 }
 
-std::shared_ptr<vk::UniqueBuffer> getStagingVertexBuffer(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice)
+std::shared_ptr<MemoryAllocation> getVertexBufferMemory(vk::UniqueDevice& device, MemoryAllocator& allocator, vk::UniqueBuffer& vertexBuf)
 {
-    std::shared_ptr<vk::UniqueBuffer> result = std::make_shared<vk::UniqueBuffer>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
+    // 実際に使われる頂点バッファのデバイスメモリを確保する
+    // allocateMemoryを直接呼ぶのではなく、アロケータがまとめて確保したブロックの一部を割り当ててもらう
 
-    vk::BufferCreateInfo stagingBufferCreateInfo;
-    stagingBufferCreateInfo.size = sizeof(Vertex) * vertices.size();
-    stagingBufferCreateInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
-    stagingBufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+    vk::MemoryRequirements vertexBufMemReq = device.get().getBufferMemoryRequirements(vertexBuf.get());
 
-    *result = device.get().createBufferUnique(stagingBufferCreateInfo);
+    // CPUから直接書き込めるDEVICE_LOCALなメモリがあれば、そこに置いてステージングバッファを省く
+    // その場合は返り値のpMappedがnullptrではなくなる
+    MemoryTypeRequest memRequest = allocator.canUploadDirectly(vertexBufMemReq.memoryTypeBits) ? directUploadMemoryRequest() : deviceLocalMemoryRequest();
+    std::shared_ptr<MemoryAllocation> result = allocator.allocate(vertexBufMemReq, memRequest, true);
+    result->setUsage(MemoryUsage::Vertex);
+    // デバイスメモリが確保出来たら bindBufferMemoryで結び付ける
+    // 第1引数は結びつけるバッファ、第2引数は結びつけるデバイスメモリ
+    // 第3引数は、確保したデバイスメモリのどこを(先頭から何バイト目以降を)使用するかを指定するもの
+    // ブロックを共有しているので、割り当てられた位置(offset)を指定する
+    device.get().bindBufferMemory(vertexBuf.get(), result->memory, result->offset);
     return result;
 }
 
-std::shared_ptr<vk::UniqueDeviceMemory> getStagingVertexBufferMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueBuffer& stagingVertexBuf)
+// デバイスメモリの予算が足りない時に、頂点バッファやインデックスバッファを追い出す代わりにメインメモリ側に置く(降格)
+// GPUからの読み込みは遅くなるが、CPUから直接書き込めるのでアップロードせずにそのまま描画に使える
+std::shared_ptr<MemoryAllocation> getHostBufferMemory(vk::UniqueDevice& device, MemoryAllocator& allocator, vk::UniqueBuffer& buf, MemoryUsage usage)
 {
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
+    vk::MemoryRequirements bufMemReq = device.get().getBufferMemoryRequirements(buf.get());
 
-    vk::MemoryRequirements vertexBufMemReq = device.get().getBufferMemoryRequirements(stagingVertexBuf.get());
-    
-    vk::MemoryAllocateInfo vertexBufMemAllocInfo;
-    vertexBufMemAllocInfo.allocationSize = vertexBufMemReq.size;
-    
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) 
-    {
-        if (vertexBufMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible))
-        {
-            vertexBufMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound) 
-    {
-        LOGERR("Suitable memory type not found. ");
-        exit(EXIT_FAILURE);
-    }
-    
-    *result = device.get().allocateMemoryUnique(vertexBufMemAllocInfo);
-    device.get().bindBufferMemory(stagingVertexBuf.get(), result->get(), 0);
+    std::shared_ptr<MemoryAllocation> result = allocator.allocate(bufMemReq, stagingMemoryRequest(), true);
+    result->setUsage(usage);
+    device.get().bindBufferMemory(buf.get(), result->memory, result->offset);
     return result;
 }
 
-void writeStagingVertexBuffer(vk::UniqueDevice& device, vk::UniqueDeviceMemory& stagingVertexBufMem)
+void writeVertexBuffer(vk::UniqueDevice& device, MemoryAllocation& vertexBufMem)
 {
     // デバイスメモリに書き込むために、メモリマッピングというものをする
     // これは操作したい対象のデバイスメモリを仮想的にアプリケーションのメモリ空間に対応付けることで操作出来るようにするもの
     // 対象のデバイスメモリを直接操作するわけにはいかないのでこういう形になっている
-    void* pStagingVertexBufMem = device.get().mapMemory(stagingVertexBufMem.get(), 0, sizeof(Vertex) * vertices.size());
-
-    std::memcpy(pStagingVertexBufMem, vertices.data(), sizeof(Vertex) * vertices.size());
+    // ホスト可視のブロックはアロケータが確保時にマップしたままにしているので、ここではpMappedに書き込むだけでよい
+    // 書き込み先はステージングバッファでも、直接書き込めるDEVICE_LOCALな頂点バッファでもよい
+    std::memcpy(vertexBufMem.pMapped, vertices.data(), sizeof(Vertex) * vertices.size());
 
-    vk::MappedMemoryRange flushMemoryRange;
-    flushMemoryRange.memory = stagingVertexBufMem.get();
-    flushMemoryRange.offset = 0;
-    flushMemoryRange.size = sizeof(Vertex) * vertices.size();
-    
     // 書き込んだら flushMappedMemoryRangesメソッドを呼ぶことで書き込んだ内容がデバイスメモリに反映される
     // マッピングされたメモリはあくまで仮想的にデバイスメモリと対応付けられているだけ
     // 「同期しておけよ」と念をおさないとデータが同期されない可能性がある
-    device.get().flushMappedMemoryRanges({ flushMemoryRange });
-    // 作業が終わった後はunmapMemoryできちんと後片付けをする
-    device.get().unmapMemory(stagingVertexBufMem.get());
+    // コヒーレントなメモリであればflushは不要なので、その判断はアロケータに任せる
+    flushMemoryAllocation(vertexBufMem, 0, sizeof(Vertex) * vertices.size());
 }
 
-void sendVertexBuffer(vk::UniqueDevice& device, uint32_t queueFamilyIndex, vk::Queue& graphicsQueue, vk::UniqueBuffer& stagingBuf, vk::UniqueBuffer& vertexBuf)
+void uploadVertexBuffer(UploadBatch& uploadBatch, vk::UniqueBuffer& vertexBuf)
 {
     // こちらはメモリマッピングではデータを入れられない ホスト可視でないため
     // ホスト可視でないメモリはCPUからは触れない
-    // GPUにコピーさせる訳だが、GPUに命令するということは例によってコマンドバッファとキューを使う
-    // データの転送用に、コマンドバッファを作成するコードを別途追加する
-    vk::CommandPoolCreateInfo tmpCmdPoolCreateInfo;
-    tmpCmdPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
-    // vk::CommandPoolCreateFlagBits::eTransientフラグを指定
-    // これは比較的すぐに使ってすぐに役目を終えるコマンドバッファ用であることを意味するフラグ
-    // 必須ではないが指定しておくと内部的に最適化が起きる可能性がある
-    tmpCmdPoolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eTransient;
-    vk::UniqueCommandPool tmpCmdPool = device->createCommandPoolUnique(tmpCmdPoolCreateInfo);
-    
-    vk::CommandBufferAllocateInfo tmpCmdBufAllocInfo;
-    tmpCmdBufAllocInfo.commandPool = tmpCmdPool.get();
-    tmpCmdBufAllocInfo.commandBufferCount = 1;
-    tmpCmdBufAllocInfo.level = vk::CommandBufferLevel::ePrimary;
-    std::vector<vk::UniqueCommandBuffer> tmpCmdBufs = device->allocateCommandBuffersUnique(tmpCmdBufAllocInfo);
-
-    // バッファ間でデータをコピーするには copyBuffer を使う
-    // そしてコピーするバッファやコピーする領域を指定するために vk::BufferCopy 構造体を使う
-    // srcOffsetは転送元バッファの先頭から何バイト目を読み込むというデータ位置、dstOffsetは転送先バッファの先頭から何バイト目に書き込むというデータ位置、sizeはデータサイズを表す
-    // memcpyの引数と似たような感じだと理解すると分かりやすい
-    // あとはキューに投げるだけ
-    vk::BufferCopy bufCopy;
-    bufCopy.srcOffset = 0;
-    bufCopy.dstOffset = 0;
-    bufCopy.size = sizeof(Vertex) * vertices.size();
-
-    vk::CommandBufferBeginInfo cmdBeginInfo;
-    cmdBeginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-
-    tmpCmdBufs[0]->begin(cmdBeginInfo);
-    tmpCmdBufs[0]->copyBuffer(stagingBuf.get(), vertexBuf.get(), {bufCopy});
-    tmpCmdBufs[0]->end();
-
-    vk::CommandBuffer submitCmdBuf[1] = {tmpCmdBufs[0].get()};
-    vk::SubmitInfo submitInfo;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = submitCmdBuf;
-
-    graphicsQueue.submit({submitInfo});
-    graphicsQueue.waitIdle();
+    // いったんステージングリングに書き込み、そこからGPUにコピーさせる
+    // コピーはバッチにまとめて記録され、送信されるまでGPUには届かない
+    // コピーが終わるまで頂点の読み込みが始まらないように、eVertexInputでのeVertexAttributeReadを待たせる
+    uploadBatch.addBufferCopy(vertices.data(), sizeof(Vertex) * vertices.size(), vertexBuf.get(), 0,
+        vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead);
+}
+
+// アップロードサービスに任せる場合
+// 返されたハンドルが送信済みになるまでは描画に使わない
+UploadHandle uploadVertexBuffer(UploadService& uploadService, vk::UniqueBuffer& vertexBuf)
+{
+    return uploadService.enqueueBuffer(vertices.data(), sizeof(Vertex) * vertices.size(), vertexBuf.get(), 0,
+        vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead);
 }
 
 std::shared_ptr<std::vector<vk::VertexInputBindingDescription>> getVertexBindingDescription()
@@ -406,202 +340,61 @@ std::shared_ptr<std::vector<vk::VertexInputAttributeDescription>> getVertexInput
     return result;
 }
 
-std::shared_ptr<vk::UniqueBuffer> getIndexBuffer(vk::UniqueDevice& device)
+vk::BufferCreateInfo getIndexBufferCreateInfo()
 {
-    std::shared_ptr<vk::UniqueBuffer> result = std::make_shared<vk::UniqueBuffer>();
-
     vk::BufferCreateInfo indexBufferCreateInfo;
     indexBufferCreateInfo.size = sizeof(uint16_t) * indices.size();
-    indexBufferCreateInfo.usage = vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst; 
+    indexBufferCreateInfo.usage = vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eTransferSrc;
     indexBufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
-    
-    *result = device.get().createBufferUnique(indexBufferCreateInfo);
-    return result;
+    return indexBufferCreateInfo;
 }
 
-std::shared_ptr<vk::UniqueDeviceMemory> getIndexBufferMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueBuffer& indexBuf)
-{
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
-
-    vk::MemoryRequirements indexBufMemReq = device.get().getBufferMemoryRequirements(indexBuf.get());
-    
-    vk::MemoryAllocateInfo indexBufMemAllocInfo;
-    indexBufMemAllocInfo.allocationSize = indexBufMemReq.size;
-    
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) 
-    {
-        if (indexBufMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal))
-        {
-            indexBufMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound) 
-    {
-        LOGERR("Suitable memory type not found. ");
-        exit(EXIT_FAILURE);
-    }
-    
-    *result = device.get().allocateMemoryUnique(indexBufMemAllocInfo);
-    device.get().bindBufferMemory(indexBuf.get(), result->get(), 0);
-    return result;
-}
-
-std::shared_ptr<vk::UniqueBuffer> getStagingIndexBuffer(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice)
+std::shared_ptr<vk::UniqueBuffer> getIndexBuffer(vk::UniqueDevice& device)
 {
     std::shared_ptr<vk::UniqueBuffer> result = std::make_shared<vk::UniqueBuffer>();
 
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
-
-    vk::BufferCreateInfo stagingBufferCreateInfo;
-    stagingBufferCreateInfo.size = sizeof(uint16_t) * indices.size();
-    stagingBufferCreateInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
-    stagingBufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
-
-    *result = device.get().createBufferUnique(stagingBufferCreateInfo);
+    *result = device.get().createBufferUnique(getIndexBufferCreateInfo(), getAllocationCallbacks(vk::ObjectType::eBuffer));
     return result;
 }
 
-std::shared_ptr<vk::UniqueDeviceMemory> getStagingIndexBufferMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueBuffer& stagingIndexBuf)
+std::shared_ptr<MemoryAllocation> getIndexBufferMemory(vk::UniqueDevice& device, MemoryAllocator& allocator, vk::UniqueBuffer& indexBuf)
 {
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
+    vk::MemoryRequirements indexBufMemReq = device.get().getBufferMemoryRequirements(indexBuf.get());
 
-    vk::MemoryRequirements indexBufMemReq = device.get().getBufferMemoryRequirements(stagingIndexBuf.get());
-    
-    vk::MemoryAllocateInfo indexBufMemAllocInfo;
-    indexBufMemAllocInfo.allocationSize = indexBufMemReq.size;
-    
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) 
-    {
-        if (indexBufMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible))
-        {
-            indexBufMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound) 
-    {
-        LOGERR("Suitable memory type not found. ");
-        exit(EXIT_FAILURE);
-    }
-    
-    *result = device.get().allocateMemoryUnique(indexBufMemAllocInfo);
-    device.get().bindBufferMemory(stagingIndexBuf.get(), result->get(), 0);
+    MemoryTypeRequest memRequest = allocator.canUploadDirectly(indexBufMemReq.memoryTypeBits) ? directUploadMemoryRequest() : deviceLocalMemoryRequest();
+    std::shared_ptr<MemoryAllocation> result = allocator.allocate(indexBufMemReq, memRequest, true);
+    result->setUsage(MemoryUsage::Index);
+    device.get().bindBufferMemory(indexBuf.get(), result->memory, result->offset);
     return result;
 }
 
-void writeStagingIndexBuffer(vk::UniqueDevice& device, vk::UniqueDeviceMemory& stagingIndexBufMem)
+void writeIndexBuffer(vk::UniqueDevice& device, MemoryAllocation& indexBufMem)
 {
-    void* pStagingIndexBufMem = device.get().mapMemory(stagingIndexBufMem.get(), 0, sizeof(uint16_t) * indices.size());
-
-    std::memcpy(pStagingIndexBufMem, indices.data(), sizeof(uint16_t) * indices.size());
-
-    vk::MappedMemoryRange flushMemoryRange;
-    flushMemoryRange.memory = stagingIndexBufMem.get();
-    flushMemoryRange.offset = 0;
-    flushMemoryRange.size = sizeof(uint16_t) * indices.size();
-    
-    device.get().flushMappedMemoryRanges({ flushMemoryRange });
-    device.get().unmapMemory(stagingIndexBufMem.get());
-}
+    std::memcpy(indexBufMem.pMapped, indices.data(), sizeof(uint16_t) * indices.size());
 
-void sendIndexBuffer(vk::UniqueDevice& device, uint32_t queueFamilyIndex, vk::Queue& graphicsQueue, vk::UniqueBuffer& stagingBuf, vk::UniqueBuffer& indexBuf)
-{
-    vk::CommandPoolCreateInfo tmpCmdPoolCreateInfo;
-    tmpCmdPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
-    tmpCmdPoolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eTransient;
-    vk::UniqueCommandPool tmpCmdPool = device->createCommandPoolUnique(tmpCmdPoolCreateInfo);
-    
-    vk::CommandBufferAllocateInfo tmpCmdBufAllocInfo;
-    tmpCmdBufAllocInfo.commandPool = tmpCmdPool.get();
-    tmpCmdBufAllocInfo.commandBufferCount = 1;
-    tmpCmdBufAllocInfo.level = vk::CommandBufferLevel::ePrimary;
-    std::vector<vk::UniqueCommandBuffer> tmpCmdBufs = device->allocateCommandBuffersUnique(tmpCmdBufAllocInfo);
-
-    vk::BufferCopy bufCopy;
-    bufCopy.srcOffset = 0;
-    bufCopy.dstOffset = 0;
-    bufCopy.size = sizeof(uint16_t) * indices.size();
-
-    vk::CommandBufferBeginInfo cmdBeginInfo;
-    cmdBeginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-
-    tmpCmdBufs[0]->begin(cmdBeginInfo);
-    tmpCmdBufs[0]->copyBuffer(stagingBuf.get(), indexBuf.get(), {bufCopy});
-    tmpCmdBufs[0]->end();
-
-    vk::CommandBuffer submitCmdBuf[1] = {tmpCmdBufs[0].get()};
-    vk::SubmitInfo submitInfo;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = submitCmdBuf;
-
-    graphicsQueue.submit({submitInfo});
-    graphicsQueue.waitIdle();
+    flushMemoryAllocation(indexBufMem, 0, sizeof(uint16_t) * indices.size());
 }
 
-std::shared_ptr<vk::UniqueBuffer> getUniformBuffer(vk::UniqueDevice& device)
+void uploadIndexBuffer(UploadBatch& uploadBatch, vk::UniqueBuffer& indexBuf)
 {
-    std::shared_ptr<vk::UniqueBuffer> result = std::make_shared<vk::UniqueBuffer>();
-    
-    vk::BufferCreateInfo uniformBufferCreateInfo;
-    uniformBufferCreateInfo.size = sizeof(SceneData);
-    // usageはvk::BufferUsageFlagBits::eUniformBufferを指定
-    uniformBufferCreateInfo.usage = vk::BufferUsageFlagBits::eUniformBuffer;
-    uniformBufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
-
-    *result = device.get().createBufferUnique(uniformBufferCreateInfo);
-    return result;
-}
-
-std::shared_ptr<vk::UniqueDeviceMemory> getUniformBufferMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueBuffer& uniformBuf)
-{    
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
-
-    vk::MemoryRequirements uniformBufMemReq = device->getBufferMemoryRequirements(uniformBuf.get());
-
-    vk::MemoryAllocateInfo uniformBufMemAllocInfo;
-    uniformBufMemAllocInfo.allocationSize = uniformBufMemReq.size;
-
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) 
-    {
-        if (uniformBufMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)) 
-        {
-            uniformBufMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound) 
-    {
-        LOGERR("Suitable memory type not found. ");
-        exit(EXIT_FAILURE);
-    }
-
-    *result = device.get().allocateMemoryUnique(uniformBufMemAllocInfo);
-    device->bindBufferMemory(uniformBuf.get(), result->get(), 0);
-    return result;
+    uploadBatch.addBufferCopy(indices.data(), sizeof(uint16_t) * indices.size(), indexBuf.get(), 0,
+        vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eIndexRead);
 }
 
-void* mapUniformBuffer(vk::UniqueDevice& device, vk::UniqueDeviceMemory& uniformBufMem)
+UploadHandle uploadIndexBuffer(UploadService& uploadService, vk::UniqueBuffer& indexBuf)
 {
-    return device.get().mapMemory(uniformBufMem.get(), 0, sizeof(SceneData));
+    return uploadService.enqueueBuffer(indices.data(), sizeof(uint16_t) * indices.size(), indexBuf.get(), 0,
+        vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eIndexRead);
 }
 
-void writeUniformBuffer(void* pUniformBufMem, vk::UniqueDevice& device, vk::UniqueDeviceMemory& uniformBufMem, uint32_t screenWidth, uint32_t screenHeight, int deltaTime)
+// ユニフォームバッファはフレームアリーナから毎フレーム切り出す
+// 戻り値はbindDescriptorSetsに渡すダイナミックオフセット
+// deltaTimeは前のフレームからの経過時間(秒)
+uint32_t writeUniformBuffer(FrameArena& frameArena, uint32_t screenWidth, uint32_t screenHeight, float deltaTime)
 {
     static float time = 0;
 
-    time += deltaTime / 1000.0f;
+    time += deltaTime;
 
     float rotation = (time / 10) * 2 * 3.14f;
 
@@ -616,20 +409,7 @@ void writeUniformBuffer(void* pUniformBufMem, vk::UniqueDevice& device, vk::Uniq
 
     // sceneData.rectCenter = Vec2{ 0.3f * std::cos(time), 0.3f * std::sin(time) };
 
-    std::memcpy(pUniformBufMem, &sceneData, sizeof(SceneData));
-
-    vk::MappedMemoryRange flushMemoryRange;
-    flushMemoryRange.memory = uniformBufMem.get();
-    flushMemoryRange.offset = 0;
-    flushMemoryRange.size = sizeof(SceneData);
-
-    device.get().flushMappedMemoryRanges({ flushMemoryRange });
-    // device.get().unmapMemory(uniformBufMem.get());
-}
-
-void unmapUniformBuffer(vk::UniqueDevice& device, vk::UniqueDeviceMemory& uniformBufMem)
-{
-    device.get().unmapMemory(uniformBufMem.get());
+    return frameArena.pushUniform(sceneData);
 }
 
 std::shared_ptr<std::vector<vk::UniqueDescriptorSetLayout>> getDiscriptorSetLayouts(vk::UniqueDevice& device)
@@ -643,6 +423,7 @@ std::shared_ptr<std::vector<vk::UniqueDescriptorSetLayout>> getDiscriptorSetLayo
     //    頂点シェーダにlayout(set = 0, binding = 0)などと指定したが、このときのbindingの数字と揃えてあることに注意
     // descriptorType はデスクリプタの種別を示す
     //    今回シェーダに渡すものはバッファなのでvk::DescriptorType::eUniformBufferを指定
+    //    ただしフレームアリーナの中の位置が毎フレーム変わるので、bindDescriptorSetsの時にオフセットを指定できるeUniformBufferDynamicを使う
     // descriptorCount はデスクリプタの個数を表す
     //    デスクリプタは配列として複数のデータを持てるが、ここにその要素数を指定する 今回は1個だけなので1を指定
     // stageFlags はデータを渡す対象となるシェーダを示す 
@@ -650,7 +431,7 @@ std::shared_ptr<std::vector<vk::UniqueDescriptorSetLayout>> getDiscriptorSetLayo
 
     vk::DescriptorSetLayoutBinding descSetLayoutBinding[2];
     descSetLayoutBinding[0].binding = 0;
-    descSetLayoutBinding[0].descriptorType = vk::DescriptorType::eUniformBuffer;
+    descSetLayoutBinding[0].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
     descSetLayoutBinding[0].descriptorCount = 1;
     descSetLayoutBinding[0].stageFlags = vk::ShaderStageFlagBits::eVertex;
     // 画像のサンプラーを追加
@@ -666,11 +447,13 @@ std::shared_ptr<std::vector<vk::UniqueDescriptorSetLayout>> getDiscriptorSetLayo
     // デスクリプタセットレイアウトを作成したあとはそれをパイプラインレイアウトに設定する必要がある
     // パイプラインは描画の手順を表すオブジェクト
     // 頂点入力デスクリプションなどと同様、シェーダへのデータの読み込ませ方はここで設定する
-    (*result).push_back(device->createDescriptorSetLayoutUnique(descSetLayoutCreateInfo));
+    (*result).push_back(device->createDescriptorSetLayoutUnique(descSetLayoutCreateInfo, getAllocationCallbacks(vk::ObjectType::eDescriptorSetLayout)));
     return result;
 }
 
-std::shared_ptr<vk::UniqueDescriptorPool> getDescriptorPool(vk::UniqueDevice& device)
+// setCountはこのプールから確保するデスクリプタセットの数
+// 処理中のフレームが使っているデスクリプタセットは書き換えられないので、フレームごとに持たせる場合はその数を指定する
+std::shared_ptr<vk::UniqueDescriptorPool> getDescriptorPool(vk::UniqueDevice& device, uint32_t setCount = 1)
 {
     std::shared_ptr<vk::UniqueDescriptorPool> result = std::make_shared<vk::UniqueDescriptorPool>();
 
@@ -679,14 +462,14 @@ std::shared_ptr<vk::UniqueDescriptorPool> getDescriptorPool(vk::UniqueDevice& de
     // そのためデスクリプタプールも、「この種類のデスクリプタをこの数」と指定して作成する必要がある
     // 必要な種類と数をきちんと指定する
     vk::DescriptorPoolSize descPoolSize[2];
-    descPoolSize[0].type = vk::DescriptorType::eUniformBuffer;
-    descPoolSize[0].descriptorCount = 1;
+    descPoolSize[0].type = vk::DescriptorType::eUniformBufferDynamic;
+    descPoolSize[0].descriptorCount = setCount;
     // 画像のサンプラーを追加
     // eCombinedImageSamplerというタイプのデスクリプタを使用
     // これはイメージとサンプラーを束ねた情報のデスクリプタ
     // シェーダからテクスチャを利用できるようにする場合、イメージとサンプラーをセットで渡すのが一般的
     descPoolSize[1].type = vk::DescriptorType::eCombinedImageSampler;
-    descPoolSize[1].descriptorCount = 1;
+    descPoolSize[1].descriptorCount = setCount;
 
     // vk::DescriptorPoolSizeの配列を poolSizeCountとpPoolSizes に指定
     // vk::DescriptorPoolSizeはtypeがデスクリプタの種類でdescriptorCountがデスクリプタの数
@@ -694,13 +477,15 @@ std::shared_ptr<vk::UniqueDescriptorPool> getDescriptorPool(vk::UniqueDevice& de
     vk::DescriptorPoolCreateInfo descPoolCreateInfo;
     descPoolCreateInfo.poolSizeCount = std::size(descPoolSize);
     descPoolCreateInfo.pPoolSizes = descPoolSize;
-    descPoolCreateInfo.maxSets = 1;
+    descPoolCreateInfo.maxSets = setCount;
 
-    *result = device->createDescriptorPoolUnique(descPoolCreateInfo);
+    *result = device->createDescriptorPoolUnique(descPoolCreateInfo, getAllocationCallbacks(vk::ObjectType::eDescriptorPool));
     return result;
 }
 
-std::shared_ptr<std::vector<vk::UniqueDescriptorSet>> getDescprotorSets(vk::UniqueDevice& device, vk::UniqueDescriptorPool& descPool, std::vector<vk::DescriptorSetLayout>& descSetLayouts)
+// copyCountを指定すると、descSetLayoutsの組をその数だけ確保する
+// copy番目の組のi番目のデスクリプタセットは、結果の copy * descSetLayouts.size() + i 番目になる
+std::shared_ptr<std::vector<vk::UniqueDescriptorSet>> getDescprotorSets(vk::UniqueDevice& device, vk::UniqueDescriptorPool& descPool, std::vector<vk::DescriptorSetLayout>& descSetLayouts, uint32_t copyCount = 1)
 {
     std::shared_ptr<std::vector<vk::UniqueDescriptorSet>> result = std::make_shared<std::vector<vk::UniqueDescriptorSet>>();
 
@@ -716,17 +501,26 @@ std::shared_ptr<std::vector<vk::UniqueDescriptorSet>> getDescprotorSets(vk::Uniq
     // 1つのデスクリプタを表すvk::Descriptorなどというオブジェクトは存在しないということ
     // デスクリプタは常に「あるデスクリプタセットの何番目のデスクリプタ」という形でしか触ることができない
     
+    std::vector<vk::DescriptorSetLayout> allocLayouts;
+    allocLayouts.reserve(descSetLayouts.size() * copyCount);
+    for (uint32_t i = 0; i < copyCount; i++)
+    {
+        allocLayouts.insert(allocLayouts.end(), descSetLayouts.begin(), descSetLayouts.end());
+    }
+
     vk::DescriptorSetAllocateInfo descSetAllocInfo;
     
     descSetAllocInfo.descriptorPool = descPool.get();
-    descSetAllocInfo.descriptorSetCount = descSetLayouts.size();
-    descSetAllocInfo.pSetLayouts = descSetLayouts.data();
+    descSetAllocInfo.descriptorSetCount = allocLayouts.size();
+    descSetAllocInfo.pSetLayouts = allocLayouts.data();
     
     *result = device->allocateDescriptorSetsUnique(descSetAllocInfo);
     return result;
 }
 
-void writeDescriptorSets(vk::UniqueDevice& device, std::vector<vk::UniqueDescriptorSet>& descSets, vk::UniqueBuffer& uniformBuf, vk::UniqueImageView& texImageView, vk::UniqueSampler& texSampler)
+// descSetの中身を設定する
+// 処理中のコマンドバッファが使っているデスクリプタセットを書き換えることはできないので、使い終わったことを確かめてから呼ぶ
+void writeDescriptorSet(vk::UniqueDevice& device, vk::DescriptorSet descSet, FrameArena& frameArena, vk::UniqueImageView& texImageView, vk::UniqueSampler& texSampler)
 {
     // 今はまだデスクリプタセットを作っただけでその中身は何もないので、updateDescriptorSetsで中身を設定する必要がある
     // デスクリプタへの書き込み情報はvk::WriteDescriptorSet構造体で表される
@@ -739,7 +533,7 @@ void writeDescriptorSets(vk::UniqueDevice& device, std::vector<vk::UniqueDescrip
     // デスクリプタは配列であって複数のデータが持てる、という話をしたが、その配列上の何番からの要素に書き込むかをここに指定する
     
     // descriptorType は書き込みの対象となるデスクリプタの種別
-    // ここではvk::DescriptorType::eUniformBufferを指定
+    // ここではvk::DescriptorType::eUniformBufferDynamicを指定
 
     // バッファタイプのデスクリプタに書き込む場合、vk::DescriptorBufferInfo の配列を pBufferInfoとdescriptorCount に指定
     // vk::DescriptorBufferInfoのメンバについて解説すると、buffer が用いるバッファ、offset がバッファ上の先頭から何バイト目からをデータとして用いるか、range がデータの大きさ(バイト数)になる
@@ -750,13 +544,14 @@ void writeDescriptorSets(vk::UniqueDevice& device, std::vector<vk::UniqueDescrip
     // 途中で別のバッファや別の領域を使うといったことをしない限り、updateDescriptorSetsによる設定は最初の1回だけで十分です。
 
     vk::WriteDescriptorSet writeDescSet;
-    writeDescSet.dstSet = descSets[0].get();
+    writeDescSet.dstSet = descSet;
     writeDescSet.dstBinding = 0;
     writeDescSet.dstArrayElement = 0;
-    writeDescSet.descriptorType = vk::DescriptorType::eUniformBuffer;
+    writeDescSet.descriptorType = vk::DescriptorType::eUniformBufferDynamic;
     
+    // ダイナミックユニフォームバッファの場合、実際の位置はここでのoffsetにbindDescriptorSetsで渡すオフセットを足したものになる
     vk::DescriptorBufferInfo descBufInfo[1];
-    descBufInfo[0].buffer = uniformBuf.get();
+    descBufInfo[0].buffer = frameArena.getBuffer();
     descBufInfo[0].offset = 0;
     descBufInfo[0].range = sizeof(SceneData);
     
@@ -772,7 +567,7 @@ void writeDescriptorSets(vk::UniqueDevice& device, std::vector<vk::UniqueDescrip
     // 作成したvk::DescriptorImageInfo構造体へのポインタは、vk::WriteDescriptorSetの pImageInfo に設定します。
 
     vk::WriteDescriptorSet writeTexDescSet;
-    writeTexDescSet.dstSet = descSets[0].get();
+    writeTexDescSet.dstSet = descSet;
     writeTexDescSet.dstBinding = 1;
     writeTexDescSet.dstArrayElement = 0;
     writeTexDescSet.descriptorType = vk::DescriptorType::eCombinedImageSampler;
@@ -788,6 +583,15 @@ void writeDescriptorSets(vk::UniqueDevice& device, std::vector<vk::UniqueDescrip
     device->updateDescriptorSets({ writeTexDescSet }, {});
 }
 
+// 全てのデスクリプタセットに同じ中身を設定する
+void writeDescriptorSets(vk::UniqueDevice& device, std::vector<vk::UniqueDescriptorSet>& descSets, FrameArena& frameArena, vk::UniqueImageView& texImageView, vk::UniqueSampler& texSampler)
+{
+    for (vk::UniqueDescriptorSet& descSet : descSets)
+    {
+        writeDescriptorSet(device, descSet.get(), frameArena, texImageView, texSampler);
+    }
+}
+
 std::shared_ptr<std::vector<vk::PushConstantRange>> getPushConstantRanges()
 {
     // 小さい数値データはプッシュ定数、大きなバッファやテクスチャ画像などのデータはデスクリプタを使う
@@ -811,10 +615,8 @@ void writePushConstant(int id)
 
 
 
-std::shared_ptr<vk::UniqueImage> getImage(vk::UniqueDevice& device, int imgWidth, int imgHeight, int imgCh)
+vk::ImageCreateInfo getImageCreateInfo(int imgWidth, int imgHeight, int imgCh, vk::ImageUsageFlags additionalUsage = vk::ImageUsageFlags())
 {
-    std::shared_ptr<vk::UniqueImage> result = std::make_shared<vk::UniqueImage>();
-
     vk::ImageCreateInfo texImgCreateInfo;
     texImgCreateInfo.imageType = vk::ImageType::e2D;
     texImgCreateInfo.extent = vk::Extent3D(imgWidth, imgHeight, 1);
@@ -826,127 +628,34 @@ std::shared_ptr<vk::UniqueImage> getImage(vk::UniqueDevice& device, int imgWidth
     // vk::ImageUsageFlagBits::eSampledフラグを立ている
     // これはイメージをテクスチャサンプリングに使うことを示している
     // vk::ImageUsageFlagBits::eTransferDstが指定してあるのは、後でステージングバッファからデータを転送するから
-    texImgCreateInfo.usage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst;
+    // eTransferSrcはデフラグで別の場所へコピーされる時のため
+    // additionalUsageには、CPUから直接書き込む場合のeHostTransferEXTなどを指定する
+    texImgCreateInfo.usage = vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eTransferSrc | additionalUsage;
     texImgCreateInfo.sharingMode = vk::SharingMode::eExclusive;
     texImgCreateInfo.samples = vk::SampleCountFlagBits::e1;
-    
-    *result = device->createImageUnique(texImgCreateInfo);
-    return result;
+    return texImgCreateInfo;
 }
 
-std::shared_ptr<vk::UniqueDeviceMemory> getImageMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueImage& texImage)
+std::shared_ptr<vk::UniqueImage> getImage(vk::UniqueDevice& device, int imgWidth, int imgHeight, int imgCh, vk::ImageUsageFlags additionalUsage = vk::ImageUsageFlags())
 {
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
-    vk::MemoryRequirements imgBufMemReq = device->getImageMemoryRequirements(texImage.get());
-
-    vk::MemoryAllocateInfo imgBufMemAllocInfo;
-    imgBufMemAllocInfo.allocationSize = imgBufMemReq.size;
-
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) 
-    {
-        if (imgBufMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eDeviceLocal))
-        {
-            imgBufMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound)
-    {
-        LOGERR("Suitable memory type not found for image.");
-        exit(EXIT_FAILURE);
-    }
+    std::shared_ptr<vk::UniqueImage> result = std::make_shared<vk::UniqueImage>();
 
-    *result = device.get().allocateMemoryUnique(imgBufMemAllocInfo);
-    device.get().bindImageMemory(texImage.get(), result->get(), 0);
+    *result = device->createImageUnique(getImageCreateInfo(imgWidth, imgHeight, imgCh, additionalUsage), getAllocationCallbacks(vk::ObjectType::eImage));
     return result;
 }
 
-std::shared_ptr<vk::UniqueBuffer> getStagingImageBuffer(vk::UniqueDevice& device, int imgWidth, int imgHeight, int imgCh)
+std::shared_ptr<MemoryAllocation> getImageMemory(vk::UniqueDevice& device, MemoryAllocator& allocator, vk::UniqueImage& texImage)
 {
-    std::shared_ptr<vk::UniqueBuffer> result = std::make_shared<vk::UniqueBuffer>();
-    size_t imgDataSize = imgCh * imgWidth * imgHeight;
-
-    vk::BufferCreateInfo imgStagingBufferCreateInfo;
-    imgStagingBufferCreateInfo.size = imgDataSize;
-    imgStagingBufferCreateInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
-    imgStagingBufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
-
-    *result = device->createBufferUnique(imgStagingBufferCreateInfo);
+    // 大きなテクスチャやドライバが望む場合は専用のブロックになる
+    std::shared_ptr<MemoryAllocation> result = allocator.allocateForImage(texImage.get(), deviceLocalMemoryRequest());
+    result->setUsage(MemoryUsage::Texture);
+    device.get().bindImageMemory(texImage.get(), result->memory, result->offset);
     return result;
 }
 
-std::shared_ptr<vk::UniqueDeviceMemory> getStagingImageMemory(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueBuffer& imgStagingBuf)
+void uploadImageBuffer(UploadBatch& uploadBatch, void* pImgData, vk::UniqueImage& texImage, int imgWidth, int imgHeight, int imgCh)
 {
-    std::shared_ptr<vk::UniqueDeviceMemory> result = std::make_shared<vk::UniqueDeviceMemory>();
-
-    vk::PhysicalDeviceMemoryProperties memProps = physicalDevice.getMemoryProperties();
-    vk::MemoryRequirements imgStagingBufMemReq = device->getBufferMemoryRequirements(imgStagingBuf.get());
-
-    vk::MemoryAllocateInfo imgStagingBufMemAllocInfo;
-    imgStagingBufMemAllocInfo.allocationSize = imgStagingBufMemReq.size;
-
-    bool suitableMemoryTypeFound = false;
-    for (uint32_t i = 0; i < memProps.memoryTypeCount; i++)
-    {
-        if (imgStagingBufMemReq.memoryTypeBits & (1 << i) && (memProps.memoryTypes[i].propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible))
-        {
-            imgStagingBufMemAllocInfo.memoryTypeIndex = i;
-            suitableMemoryTypeFound = true;
-            break;
-        }
-    }
-    if (!suitableMemoryTypeFound)
-    {
-        LOGERR("Suitable memory type not found for image.");
-        exit(EXIT_FAILURE);
-    }
-
-    *result = device.get().allocateMemoryUnique(imgStagingBufMemAllocInfo);
-    device.get().bindBufferMemory(imgStagingBuf.get(), result->get(), 0);
-    return result;
-}
-
-void writeImageBuffer(vk::UniqueDevice& device, vk::UniqueDeviceMemory& imgStagingBufMemory, void* pImgData, int imgWidth, int imgHeight, int imgCh)
-{
-    size_t imgDataSize = imgCh * imgWidth * imgHeight;
-    void *pImgStagingBufMem = device->mapMemory(imgStagingBufMemory.get(), 0, imgDataSize);
-
-    std::memcpy(pImgStagingBufMem, pImgData, imgDataSize);
-
-    vk::MappedMemoryRange flushMemoryRange;
-    flushMemoryRange.memory = imgStagingBufMemory.get();
-    flushMemoryRange.offset = 0;
-    flushMemoryRange.size = imgDataSize;
-
-    device->flushMappedMemoryRanges({flushMemoryRange});
-
-    device->unmapMemory(imgStagingBufMemory.get());
-}
-
-void sendImageBuffer(vk::UniqueDevice& device, uint32_t queueFamilyIndex, vk::Queue& graphicsQueue, vk::UniqueBuffer& imgStagingBuf, vk::UniqueImage& texImage, int imgWidth, int imgHeight)
-{
-    vk::CommandPoolCreateInfo tmpCmdPoolCreateInfo;
-    tmpCmdPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
-    tmpCmdPoolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eTransient;
-    vk::UniqueCommandPool tmpCmdPool = device->createCommandPoolUnique(tmpCmdPoolCreateInfo);
-
-    vk::CommandBufferAllocateInfo tmpCmdBufAllocInfo;
-    tmpCmdBufAllocInfo.commandPool = tmpCmdPool.get();
-    tmpCmdBufAllocInfo.commandBufferCount = 1;
-    tmpCmdBufAllocInfo.level = vk::CommandBufferLevel::ePrimary;
-    std::vector<vk::UniqueCommandBuffer> tmpCmdBufs = device->allocateCommandBuffersUnique(tmpCmdBufAllocInfo);
-
-    vk::CommandBufferBeginInfo cmdBeginInfo;
-    cmdBeginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
-
-    tmpCmdBufs[0]->begin(cmdBeginInfo);
-    // 以前にバッファからバッファへデータをコピーしたときはvk::CommandBuffer::copyBuffer()を使用した
-    // 今回はバッファからイメージにデータをコピーするので、vk::CommandBuffer::copyBufferToImage()という別のコマンドを使用する
-    
+    // コピーとレイアウトの変換はまとめて記録され、バッチを送信した時に他のアップロードと一緒に転送される
     // データをコピーするためにイメージレイアウトを適切に変換する
     // 1. texImageのレイアウトをeTransferDstOptimalに変換
     //     eTransferDstOptimalはデータのコピー先となるためのレイアウト
@@ -954,108 +663,63 @@ void sendImageBuffer(vk::UniqueDevice& device, uint32_t queueFamilyIndex, vk::Qu
     // 3. texImageのレイアウトをeShaderReadOnlyOptimalに変換 
     //     eShaderReadOnlyOptimalは、シェーダからの読み込みアクセスのためのレイアウト
     //     今回のようにテクスチャとして扱う場合にはこれを指定するのが最適
+    size_t imgDataSize = imgCh * imgWidth * imgHeight;
+    vk::Extent3D imgExtent{ uint32_t(imgWidth), uint32_t(imgHeight), 1 };
+    uploadBatch.addImageCopy(pImgData, imgDataSize, texImage.get(), imgExtent, uint32_t(imgCh), vk::ImageAspectFlagBits::eColor,
+        vk::ImageLayout::eShaderReadOnlyOptimal, vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead);
+}
 
-    // 今回はパイプラインバリアを用いる
-    // 本来パイプラインバリアはフェンスやセマフォのように同期処理のための道具
-    // だがイメージのレイアウト変換という機能も副次的に付いているため、これを使う
-    // (レンダーパスも、主目的としてはGPUにおける処理の依存関係を表すものなのに、イメージレイアウトの変換処理も行っていた
-    // ある処理の中ではイメージをこう扱ってこちらの処理ではイメージをこう利用する...といったケースを考えると、処理の切れ目に変換が入るのは自然なのかも知れない
-
-    // 1
-    {
-        // vk::ImageMemoryBarrier構造体でイメージのメモリ保護および変換に関する情報を設定し、pipelineBarrier()の引数に渡す
-        vk::ImageMemoryBarrier barrior;
-        // oldLayoutとnewLayoutがレイアウトの変換を示している
-        // createImage()のところで指定しているように、イメージ作成時点ではeUndefinedなのでoldLayoutにはeUndefinedを指定
-        // なお、createImage()の時点でeTransferDstOptimalを指定することはできない
-        // createImage()で初期状態として指定できるのはeUndefinedもしくはePreinitialized
-        barrior.oldLayout = vk::ImageLayout::eUndefined;
-        barrior.newLayout = vk::ImageLayout::eTransferDstOptimal;
-        barrior.image = texImage.get();
-        // 他の引数はイメージのレイアウト変換ではなく、「同期処理」というパイプラインバリア本来の機能のための様々な指定
-        // srcQueueFamilyIndex / dstQueueFamilyIndexは、バリアの前と後で別のキューからイメージを扱う場合に使うも
-        // 今回は使わないのでVK_QUEUE_FAMILY_IGNOREDを指定
-        barrior.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrior.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrior.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-        barrior.subresourceRange.baseMipLevel = 0;
-        barrior.subresourceRange.levelCount = 1;
-        barrior.subresourceRange.baseArrayLayer = 0;
-        barrior.subresourceRange.layerCount = 1;
-        // srcAccessMask / dstAccessMaskにはそれぞれパイプラインバリアの前と後で対象のリソースに行うアクセス処理を示す
-        // これで処理の依存関係を示すことができる
-        // srcAccessMaskに指定した処理が終わるまで、dstAccessMaskに指定した処理は行われない
-        // ここでは終わるまで待つ必要のある処理は存在しないのでsrcAccessMaskは0
-        // 画像データのコピー処理はレイアウト変換が終わってから行われないと困るので、dstAccessMaskにeTransferWriteを指定する
-        barrior.srcAccessMask = vk::AccessFlagBits::eNone;
-        barrior.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
-        // pipelineBarrierの第1,第2引数にはそれぞれパイプラインバリアの前と後で待たれるパイプラインステージを指定
-        // ここでも処理の依存関係を示すことができる
-        // 第1引数(バリアの前側)にeTopOfPipeを指定しているが、これは何も待たれないという意味
-        // 第2引数(バリアの後側)にeTransferを指定していますが、こちらはデータ転送処理の意味
-        //     データ転送はグラフィックスパイプラインのステージではないが、ここでは処理段階の一種としてこのように指定する
-        tmpCmdBufs[0]->pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, {barrior});
-    }
+// 画像データはサービスにコピーされるので、戻った後すぐに解放してよい
+UploadHandle uploadImageBuffer(UploadService& uploadService, void* pImgData, vk::UniqueImage& texImage, int imgWidth, int imgHeight, int imgCh)
+{
+    size_t imgDataSize = imgCh * imgWidth * imgHeight;
+    vk::Extent3D imgExtent{ uint32_t(imgWidth), uint32_t(imgHeight), 1 };
+    return uploadService.enqueueImage(pImgData, imgDataSize, texImage.get(), imgExtent, uint32_t(imgCh), vk::ImageAspectFlagBits::eColor,
+        vk::ImageLayout::eShaderReadOnlyOptimal, vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead);
+}
 
-    // 2
+// 画像データを取り込めればGPUが直接読み、コピーの完了後に解放される
+// 取り込めなければステージングリングにコピーしてすぐに解放する
+// どちらの場合も、呼び出し側はpImgDataを解放しない
+void uploadImageData(UploadBatch& uploadBatch, HostMemoryImporter& hostMemoryImporter, void* pImgData, vk::UniqueImage& texImage, int imgWidth, int imgHeight, int imgCh)
+{
+    size_t imgDataSize = imgCh * imgWidth * imgHeight;
+    std::shared_ptr<ImportedHostBuffer> imported = importImageData(hostMemoryImporter, pImgData, imgDataSize);
+    if (!imported)
     {
-        // コピー処理
-        vk::BufferImageCopy imgCopyRegion;
-        // bufferOffsetは、「バッファの何バイト目からのデータを使う」という情報を示す
-        imgCopyRegion.bufferOffset = 0;
-        imgCopyRegion.imageSubresource.aspectMask = vk::ImageAspectFlagBits::eColor;
-        imgCopyRegion.imageSubresource.mipLevel = 0;
-        imgCopyRegion.imageSubresource.baseArrayLayer = 0;
-        imgCopyRegion.imageSubresource.layerCount = 1;
-        // imageSubresource, imageOffset, imageExtentは画像のコピー先の位置を示すもの
-        // 見た通りなので詳細な説明は割愛
-        imgCopyRegion.imageOffset = vk::Offset3D{0, 0, 0};
-        imgCopyRegion.imageExtent = vk::Extent3D{uint32_t(imgWidth), uint32_t(imgHeight), 1};
-        
-        // bufferRowLength, bufferImageHeightは「バッファ上における」イメージの横・縦ピクセル数を示す
-        // 例えば転送先の大きさは100x100だけど、バッファ上には200x200の画像データがあるというケースも可能
-        // この場合はバッファ上のイメージの一部が切り取られてコピーされる
-        // 0を指定した場合は自動的にimageExtentと同じサイズという扱いになる
-        imgCopyRegion.bufferRowLength = 0;
-        imgCopyRegion.bufferImageHeight = 0;
-        
-        // copyBufferToImage()の第1引数がコピー元のバッファ、第2引数がコピー先のイメージ、第3引数がコピー先のイメージのレイアウト
-        // 第4引数にはvk:BufferImageCopy構造体を指定する
-        //     これは複数指定でき、いくつもの領域を同時にコピーできるようになっている
-        tmpCmdBufs[0]->copyBufferToImage(imgStagingBuf.get(), texImage.get(), vk::ImageLayout::eTransferDstOptimal, { imgCopyRegion });
+        uploadImageBuffer(uploadBatch, pImgData, texImage, imgWidth, imgHeight, imgCh);
+        releaseImageData(pImgData);
+        return;
     }
+    vk::Extent3D imgExtent{ uint32_t(imgWidth), uint32_t(imgHeight), 1 };
+    uploadBatch.addImageCopy(imported->buffer.get(), 0, imgDataSize, imported, texImage.get(), imgExtent, vk::ImageAspectFlagBits::eColor,
+        vk::ImageLayout::eShaderReadOnlyOptimal, vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead);
+}
 
-    // 3
+UploadHandle uploadImageData(UploadService& uploadService, HostMemoryImporter& hostMemoryImporter, void* pImgData, vk::UniqueImage& texImage, int imgWidth, int imgHeight, int imgCh)
+{
+    size_t imgDataSize = imgCh * imgWidth * imgHeight;
+    std::shared_ptr<ImportedHostBuffer> imported = importImageData(hostMemoryImporter, pImgData, imgDataSize);
+    if (!imported)
     {
-        vk::ImageMemoryBarrier barrior;
-        barrior.oldLayout = vk::ImageLayout::eTransferDstOptimal;
-        barrior.newLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-        barrior.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrior.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        barrior.image = texImage.get();
-        barrior.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-        barrior.subresourceRange.baseMipLevel = 0;
-        barrior.subresourceRange.levelCount = 1;
-        barrior.subresourceRange.baseArrayLayer = 0;
-        barrior.subresourceRange.layerCount = 1;
-        // 同期処理のパラメータとしてsrcAccessMask、dstAccessMask、pipelineBarrier()の第1,第2引数も変えている
-        // データのコピーが終わるまでシェーダからアクセスするわけには行かない
-        // dstAccessMaskにeShaderReadを指定し、pipelineBarrier()の第2引数にはeFragmentShaderを指定
-        // ここではwaitIdleで丁寧に待っているので意味が薄いが、無駄な待ちを入れずどんどんコマンドを飛ばしていくのであれば意味が出テクス
-        barrior.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
-        barrior.dstAccessMask = vk::AccessFlagBits::eShaderRead;
-        tmpCmdBufs[0]->pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eFragmentShader, {}, {}, {}, {barrior});
+        UploadHandle result = uploadImageBuffer(uploadService, pImgData, texImage, imgWidth, imgHeight, imgCh);
+        releaseImageData(pImgData);
+        return result;
     }
+    vk::Extent3D imgExtent{ uint32_t(imgWidth), uint32_t(imgHeight), 1 };
+    return uploadService.enqueueImage(imported->buffer.get(), 0, imgDataSize, imported, texImage.get(), imgExtent, vk::ImageAspectFlagBits::eColor,
+        vk::ImageLayout::eShaderReadOnlyOptimal, vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead);
+}
 
-    tmpCmdBufs[0]->end();
-
-    vk::CommandBuffer submitCmdBuf[1] = {tmpCmdBufs[0].get()};
-    vk::SubmitInfo submitInfo;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = submitCmdBuf;
-
-    graphicsQueue.submit({submitInfo});
-    graphicsQueue.waitIdle();
+// VK_EXT_host_image_copyでCPUから直接書き込む
+// イメージはgetHostImageCopierのgetImageUsageを付けて作っておく
+// 書き込みが終わってから戻るので、キューへの送信もセマフォも要らない
+void copyImageData(HostImageCopier& hostImageCopier, void* pImgData, vk::UniqueImage& texImage, int imgWidth, int imgHeight, int imgCh)
+{
+    size_t imgDataSize = imgCh * imgWidth * imgHeight;
+    vk::Extent3D imgExtent{ uint32_t(imgWidth), uint32_t(imgHeight), 1 };
+    hostImageCopier.copy(pImgData, imgDataSize, texImage.get(), imgExtent, vk::ImageAspectFlagBits::eColor, vk::ImageLayout::eShaderReadOnlyOptimal);
+    releaseImageData(pImgData);
 }
 
 std::shared_ptr<vk::UniqueSampler> getSampler(vk::UniqueDevice& device)
@@ -1085,7 +749,7 @@ std::shared_ptr<vk::UniqueSampler> getSampler(vk::UniqueDevice& device)
     samplerCreateInfo.minLod = 0.0f;
     samplerCreateInfo.maxLod = 0.0f;
 
-    *result = device->createSamplerUnique(samplerCreateInfo);
+    *result = device->createSamplerUnique(samplerCreateInfo, getAllocationCallbacks(vk::ObjectType::eSampler));
     return result;
 }
 
@@ -1107,6 +771,6 @@ std::shared_ptr<vk::UniqueImageView> getImageView(vk::UniqueDevice& device, vk::
     texImgViewCreateInfo.subresourceRange.baseArrayLayer = 0;
     texImgViewCreateInfo.subresourceRange.layerCount = 1;
 
-    *result = device->createImageViewUnique(texImgViewCreateInfo);
+    *result = device->createImageViewUnique(texImgViewCreateInfo, getAllocationCallbacks(vk::ObjectType::eImageView));
     return result;
 }
\ No newline at end of file
@@ -0,0 +1,811 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <cstring>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "Memory.hpp"
+
+using namespace Vulkan_Test;
+
+// アップロードのたびにステージングバッファとメモリ、コマンドプールを作り、waitIdleでキューが空になるまで待っていると
+// アセットが数百個あれば数百回のオブジェクトの作成・破棄と、数百回のキューの完全な停止が発生する
+// そこでマップしたままのステージングバッファを1つだけ作り、リングバッファとして先頭から順に切り出して使う
+// 書き込んだ領域はコピーコマンドと一緒に送信し、そのフェンスが完了したら再び使えるようになる
+// 空きが足りない時だけ、一番古い送信のフェンスを待つ
+
+// 切り出した範囲
+// pDataに書き込み、bufferのoffsetからコピーするコマンドを記録する
+struct StagingRegion
+{
+    vk::Buffer buffer;
+    vk::DeviceSize offset = 0;
+    vk::DeviceSize size = 0;
+    void* pData = nullptr;
+};
+
+struct StagingStats
+{
+    uint64_t submitCount = 0;
+    uint64_t regionCount = 0;
+    vk::DeviceSize uploadedBytes = 0;
+    // 空きが無くてフェンスを待った回数
+    uint64_t stallCount = 0;
+};
+
+class StagingRing
+{
+public:
+    // 同時に送信中にできる数
+    static constexpr uint32_t maxSubmissions = 8;
+
+    // queueはコピーを実行するキューで、dstQueueFamilyIndexはコピーしたリソースを使うキュー(グラフィックス)のファミリ
+    // 両者が違う場合、リソースの所有権をコピーの後にdstQueueFamilyIndexへ移す必要がある
+    StagingRing(vk::Device device, vk::Queue queue, uint32_t queueFamilyIndex, uint32_t dstQueueFamilyIndex, MemoryAllocator& allocator, vk::DeviceSize capacity)
+        : device(device), queue(queue), queueFamilyIndex(queueFamilyIndex), dstQueueFamilyIndex(dstQueueFamilyIndex), allocator(allocator), capacity(capacity)
+    {
+        vk::BufferCreateInfo bufferCreateInfo;
+        bufferCreateInfo.size = capacity;
+        bufferCreateInfo.usage = vk::BufferUsageFlagBits::eTransferSrc;
+        bufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+        buffer = device.createBufferUnique(bufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+
+        vk::MemoryRequirements memReq = device.getBufferMemoryRequirements(buffer.get());
+        memory = allocator.allocate(memReq, stagingMemoryRequest(), true);
+        memory->setUsage(MemoryUsage::Staging);
+        device.bindBufferMemory(buffer.get(), memory->memory, memory->offset);
+
+        vk::CommandPoolCreateInfo cmdPoolCreateInfo;
+        cmdPoolCreateInfo.queueFamilyIndex = queueFamilyIndex;
+        cmdPoolCreateInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer | vk::CommandPoolCreateFlagBits::eTransient;
+        cmdPool = device.createCommandPoolUnique(cmdPoolCreateInfo, getAllocationCallbacks(vk::ObjectType::eCommandPool));
+
+        vk::CommandBufferAllocateInfo cmdBufAllocInfo;
+        cmdBufAllocInfo.commandPool = cmdPool.get();
+        cmdBufAllocInfo.commandBufferCount = maxSubmissions;
+        cmdBufAllocInfo.level = vk::CommandBufferLevel::ePrimary;
+        std::vector<vk::UniqueCommandBuffer> cmdBufs = device.allocateCommandBuffersUnique(cmdBufAllocInfo);
+
+        vk::FenceCreateInfo fenceCreateInfo;
+        for (uint32_t i = 0; i < maxSubmissions; i++)
+        {
+            submissions[i].cmdBuf = std::move(cmdBufs[i]);
+            submissions[i].fence = device.createFenceUnique(fenceCreateInfo, getAllocationCallbacks(vk::ObjectType::eFence));
+            freeSubmissions.push_back(i);
+        }
+    }
+
+    StagingRing(const StagingRing&) = delete;
+    StagingRing& operator=(const StagingRing&) = delete;
+
+    ~StagingRing()
+    {
+        if (recording)
+        {
+            submit();
+        }
+        wait();
+    }
+
+    // 書き込み先を切り出す
+    // 空きが無ければ古い送信の完了を待ち、それでも足りなければ記録中のコマンドを送信してから待つ
+    StagingRegion allocate(vk::DeviceSize size, vk::DeviceSize alignment)
+    {
+        if (size == 0 || size > capacity)
+        {
+            LOGERR("Staging upload of " << size << " bytes does not fit in the staging ring. (" << capacity << " bytes)");
+            exit(EXIT_FAILURE);
+        }
+
+        collect();
+        // 記録を始めるためのコマンドバッファを先に空けておく
+        if (!recording && freeSubmissions.empty())
+        {
+            waitOldest();
+        }
+
+        vk::DeviceSize offset = 0;
+        while (!findSpace(size, alignment, offset))
+        {
+            stats.stallCount++;
+            if (!inFlight.empty())
+            {
+                waitOldest();
+            }
+            else
+            {
+                // 記録中のコマンドが使っている領域しか残っていない
+                submit();
+            }
+        }
+
+        if (!recording)
+        {
+            beginRecording(offset);
+        }
+        else if (!pendingRegions)
+        {
+            // recordCommandsで記録を始めていた場合は、ここから範囲が始まる
+            pendingBegin = offset;
+        }
+        else if (offset < head)
+        {
+            pendingWrapped = true;
+        }
+        if (!live)
+        {
+            tail = offset;
+            live = true;
+        }
+        head = offset + size;
+        pendingRegions = true;
+
+        stats.regionCount++;
+        stats.uploadedBytes += size;
+
+        StagingRegion result;
+        result.buffer = buffer.get();
+        result.offset = offset;
+        result.size = size;
+        result.pData = static_cast<char*>(memory->pMapped) + offset;
+        return result;
+    }
+
+    // 切り出しをせずに、コマンドだけを記録する
+    // ステージングリング以外のバッファ(取り込んだホストメモリなど)からコピーする時に使う
+    vk::CommandBuffer recordCommands()
+    {
+        if (!recording)
+        {
+            collect();
+            if (freeSubmissions.empty())
+            {
+                waitOldest();
+            }
+            beginRecording(head);
+        }
+        return submissions[currentSubmission].cmdBuf.get();
+    }
+
+    // 記録中の送信が完了するまでresourceを破棄しない
+    // コピー元のバッファとメモリのように、GPUが読み終わるまで残しておく必要があるものを渡す
+    void retainUntilComplete(std::shared_ptr<void> resource)
+    {
+        if (!recording)
+        {
+            LOGERR("Staging ring has no commands to retain resources for.");
+            exit(EXIT_FAILURE);
+        }
+        submissions[currentSubmission].retained.push_back(resource);
+    }
+
+    // コピーなどのコマンドを記録するコマンドバッファ
+    // allocateで切り出した後、submitするまでの間だけ使える
+    vk::CommandBuffer getCommandBuffer()
+    {
+        if (!recording)
+        {
+            LOGERR("Staging ring has no region to record commands for.");
+            exit(EXIT_FAILURE);
+        }
+        return submissions[currentSubmission].cmdBuf.get();
+    }
+
+    // 記録したコマンドを送信し、その送信の番号を返す
+    // 同じキューに後から送信した描画は、記録したバリアによってコピーの完了を待つので、ここでキューを止める必要は無い
+    // 転送専用のキューで送信した場合はバリアがキューを跨がないので、signalSemaphoreを指定して使う側のキューにそれを待たせる
+    // signalValueを指定した場合、signalSemaphoreはタイムラインセマフォとして扱い、その値をシグナルする
+    uint64_t submit(vk::Semaphore signalSemaphore = nullptr, uint64_t signalValue = 0)
+    {
+        vk::TimelineSemaphoreSubmitInfo timelineSubmitInfo;
+        timelineSubmitInfo.signalSemaphoreValueCount = 1;
+        timelineSubmitInfo.pSignalSemaphoreValues = &signalValue;
+
+        if (!recording)
+        {
+            if (signalSemaphore)
+            {
+                // 記録したものが無くてもセマフォは必ずシグナルする
+                vk::SubmitInfo submitInfo;
+                submitInfo.signalSemaphoreCount = 1;
+                submitInfo.pSignalSemaphores = &signalSemaphore;
+                if (signalValue != 0)
+                {
+                    submitInfo.pNext = &timelineSubmitInfo;
+                }
+                submitToQueue(submitInfo, nullptr);
+            }
+            return lastSubmittedSerial;
+        }
+
+        // recordCommandsだけで書き込んだ範囲が無ければ、フラッシュは要らない
+        if (pendingRegions && pendingWrapped)
+        {
+            allocator.flush(*memory, pendingBegin, capacity - pendingBegin);
+            allocator.flush(*memory, 0, head);
+        }
+        else if (pendingRegions)
+        {
+            allocator.flush(*memory, pendingBegin, head - pendingBegin);
+        }
+
+        Submission& submission = submissions[currentSubmission];
+        submission.cmdBuf->end();
+        submission.end = head;
+        submission.serial = ++lastSubmittedSerial;
+
+        vk::CommandBuffer submitCmdBuf[1] = { submission.cmdBuf.get() };
+        vk::SubmitInfo submitInfo;
+        submitInfo.commandBufferCount = 1;
+        submitInfo.pCommandBuffers = submitCmdBuf;
+        if (signalSemaphore)
+        {
+            submitInfo.signalSemaphoreCount = 1;
+            submitInfo.pSignalSemaphores = &signalSemaphore;
+            if (signalValue != 0)
+            {
+                submitInfo.pNext = &timelineSubmitInfo;
+            }
+        }
+        submitToQueue(submitInfo, submission.fence.get());
+
+        inFlight.push_back(currentSubmission);
+        recording = false;
+        stats.submitCount++;
+        return submission.serial;
+    }
+
+    // submitが返した番号の送信が完了しているかどうか
+    bool isComplete(uint64_t serial)
+    {
+        collect();
+        return completedSerial >= serial;
+    }
+
+    // submitが返した番号の送信が完了するまで待つ
+    // それより後の送信は待たない
+    void wait(uint64_t serial)
+    {
+        while (completedSerial < serial && !inFlight.empty())
+        {
+            waitOldest();
+        }
+    }
+
+    // 完了した送信の領域を返却する
+    // 待たないので毎フレーム呼んでもよい
+    void collect()
+    {
+        while (!inFlight.empty() && device.getFenceStatus(submissions[inFlight.front()].fence.get()) == vk::Result::eSuccess)
+        {
+            releaseOldest();
+        }
+    }
+
+    // 送信中のものがあるかどうか
+    bool isBusy() const
+    {
+        return !inFlight.empty();
+    }
+
+    // 送信した全てのコピーの完了を待つ
+    void wait()
+    {
+        while (!inFlight.empty())
+        {
+            waitOldest();
+        }
+    }
+
+    vk::DeviceSize getCapacity() const
+    {
+        return capacity;
+    }
+
+    uint32_t getQueueFamilyIndex() const
+    {
+        return queueFamilyIndex;
+    }
+
+    uint32_t getDstQueueFamilyIndex() const
+    {
+        return dstQueueFamilyIndex;
+    }
+
+    // 転送用のキューが使う側のキューと別のファミリなら、所有権の移動が必要になる
+    bool requiresOwnershipTransfer() const
+    {
+        return queueFamilyIndex != dstQueueFamilyIndex;
+    }
+
+    // キューへの送信は外部で同期する必要がある
+    // 別のスレッドからも同じキューに送信する場合は、そちらと共有するミューテックスを指定する
+    // ステージングリング自体はスレッドセーフではないので、1つのスレッドからだけ使う
+    void setQueueMutex(std::mutex* mutex)
+    {
+        queueMutex = mutex;
+    }
+
+    const StagingStats& getStats() const
+    {
+        return stats;
+    }
+
+private:
+    struct Submission
+    {
+        vk::UniqueCommandBuffer cmdBuf;
+        vk::UniqueFence fence;
+        // この送信が使っていた領域の終わり
+        vk::DeviceSize end = 0;
+        uint64_t serial = 0;
+        // 完了するまで残しておくもの
+        std::vector<std::shared_ptr<void>> retained;
+    };
+
+    // [tail, head) が使用中(送信中か記録中)の領域で、末尾を越えたら先頭に戻る
+    bool findSpace(vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize& offset) const
+    {
+        if (!live)
+        {
+            offset = 0;
+            return true;
+        }
+        if (head == tail)
+        {
+            // ちょうど一周して埋まっている
+            return false;
+        }
+
+        vk::DeviceSize candidate = alignUp(head, alignment);
+        if (head > tail)
+        {
+            if (candidate + size <= capacity)
+            {
+                offset = candidate;
+                return true;
+            }
+            // 末尾の余りは捨てて先頭に戻る
+            if (size <= tail)
+            {
+                offset = 0;
+                return true;
+            }
+            return false;
+        }
+
+        if (candidate + size <= tail)
+        {
+            offset = candidate;
+            return true;
+        }
+        return false;
+    }
+
+    void submitToQueue(const vk::SubmitInfo& submitInfo, vk::Fence fence)
+    {
+        if (queueMutex != nullptr)
+        {
+            std::lock_guard<std::mutex> lock(*queueMutex);
+            queue.submit({ submitInfo }, fence);
+        }
+        else
+        {
+            queue.submit({ submitInfo }, fence);
+        }
+    }
+
+    void beginRecording(vk::DeviceSize offset)
+    {
+        currentSubmission = freeSubmissions.front();
+        freeSubmissions.pop_front();
+
+        Submission& submission = submissions[currentSubmission];
+        device.resetFences({ submission.fence.get() });
+        submission.cmdBuf->reset();
+
+        vk::CommandBufferBeginInfo cmdBeginInfo;
+        cmdBeginInfo.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit;
+        submission.cmdBuf->begin(cmdBeginInfo);
+
+        recording = true;
+        pendingBegin = offset;
+        pendingWrapped = false;
+        pendingRegions = false;
+    }
+
+    void waitOldest()
+    {
+        vk::Result waitResult = device.waitForFences({ submissions[inFlight.front()].fence.get() }, VK_TRUE, UINT64_MAX);
+        if (waitResult != vk::Result::eSuccess)
+        {
+            LOGERR("Failed to wait for staging uploads.");
+            exit(EXIT_FAILURE);
+        }
+        releaseOldest();
+    }
+
+    void releaseOldest()
+    {
+        uint32_t index = inFlight.front();
+        inFlight.pop_front();
+        freeSubmissions.push_back(index);
+        // 送信は順番に完了するので、番号は単調に増える
+        completedSerial = submissions[index].serial;
+        submissions[index].retained.clear();
+
+        if (!inFlight.empty())
+        {
+            tail = submissions[index].end;
+        }
+        else if (recording && pendingRegions)
+        {
+            tail = pendingBegin;
+        }
+        else
+        {
+            // 全て完了したので先頭から使い直す
+            live = false;
+            head = 0;
+            tail = 0;
+            pendingBegin = 0;
+        }
+    }
+
+    vk::Device device;
+    vk::Queue queue;
+    uint32_t queueFamilyIndex;
+    uint32_t dstQueueFamilyIndex;
+    std::mutex* queueMutex = nullptr;
+    MemoryAllocator& allocator;
+    vk::DeviceSize capacity;
+    // バッファより後に破棄されるように先に宣言する
+    std::shared_ptr<MemoryAllocation> memory;
+    vk::UniqueBuffer buffer;
+    vk::UniqueCommandPool cmdPool;
+    std::array<Submission, maxSubmissions> submissions;
+    std::deque<uint32_t> freeSubmissions;
+    std::deque<uint32_t> inFlight;
+
+    vk::DeviceSize head = 0;
+    vk::DeviceSize tail = 0;
+    bool live = false;
+
+    bool recording = false;
+    uint32_t currentSubmission = 0;
+    vk::DeviceSize pendingBegin = 0;
+    bool pendingWrapped = false;
+    // 記録中の送信がリングの領域を使っているかどうか
+    bool pendingRegions = false;
+
+    uint64_t lastSubmittedSerial = 0;
+    uint64_t completedSerial = 0;
+
+    StagingStats stats;
+};
+
+// UploadBatch::submitの戻り値
+// 待ちたい時だけwaitを呼ぶ
+struct UploadTicket
+{
+    StagingRing* stagingRing = nullptr;
+    uint64_t serial = 0;
+
+    bool isComplete() const
+    {
+        return stagingRing == nullptr || stagingRing->isComplete(serial);
+    }
+
+    void wait() const
+    {
+        if (stagingRing != nullptr)
+        {
+            stagingRing->wait(serial);
+        }
+    }
+};
+
+// 起動時の頂点バッファ、インデックスバッファ、テクスチャのように、まとめて転送したいものを集めて1回で送信する
+// コピーとレイアウトの変換はステージングリングの1つのコマンドバッファに記録され、submitで1回だけ送信される
+// (ステージングリングに入りきらない量を追加した場合は途中で送信されることがある)
+//
+// ステージングリングが転送専用のキューを使っている場合、EXCLUSIVEなリソースはコピーしたキューファミリが所有したままになる
+// そこで転送側でリリースのバリアを、使う側でアクワイアのバリアを記録して所有権を移す
+// アクワイアのバリアはsubmitで指定したセマフォを待つコマンドバッファにrecordAcquireBarriersで記録する
+class UploadBatch
+{
+public:
+    explicit UploadBatch(StagingRing& stagingRing)
+        : stagingRing(stagingRing)
+    {
+    }
+
+    // dstのdstOffsetにコピーし、dstStagesでのdstAccessがコピーの完了を待つようにする
+    void addBufferCopy(const void* pData, vk::DeviceSize size, vk::Buffer dst, vk::DeviceSize dstOffset, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        StagingRegion region = stagingRing.allocate(size, 4);
+        std::memcpy(region.pData, pData, size);
+
+        // バッファ間でデータをコピーするには copyBuffer を使う
+        // srcOffsetは転送元バッファの先頭から何バイト目を読み込むというデータ位置、dstOffsetは転送先バッファの先頭から何バイト目に書き込むというデータ位置、sizeはデータサイズを表す
+        // memcpyの引数と似たような感じだと理解すると分かりやすい
+        vk::BufferCopy bufCopy;
+        bufCopy.srcOffset = region.offset;
+        bufCopy.dstOffset = dstOffset;
+        bufCopy.size = size;
+
+        vk::CommandBuffer cmdBuf = stagingRing.getCommandBuffer();
+        cmdBuf.copyBuffer(region.buffer, dst, { bufCopy });
+
+        vk::BufferMemoryBarrier barrior;
+        barrior.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrior.dstAccessMask = dstAccess;
+        barrior.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.buffer = dst;
+        barrior.offset = dstOffset;
+        barrior.size = size;
+
+        if (stagingRing.requiresOwnershipTransfer())
+        {
+            // リリース側では使う側のアクセスは意味を持たないので0にし、後ろのステージも待たない
+            barrior.srcQueueFamilyIndex = stagingRing.getQueueFamilyIndex();
+            barrior.dstQueueFamilyIndex = stagingRing.getDstQueueFamilyIndex();
+            barrior.dstAccessMask = vk::AccessFlags();
+            cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, { barrior }, {});
+
+            // アクワイア側では、転送側の書き込みはセマフォで見えるようになっているのでsrcAccessMaskは0
+            barrior.srcAccessMask = vk::AccessFlags();
+            barrior.dstAccessMask = dstAccess;
+            acquireBufferBarriers.push_back(barrior);
+        }
+        else
+        {
+            cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, dstStages, {}, {}, { barrior }, {});
+        }
+        acquireStages |= dstStages;
+
+        copyCount++;
+        bytes += size;
+    }
+
+    // イメージのミップレベル0全体にコピーする
+    // レイアウトはeUndefinedからeTransferDstOptimalに変換してコピーし、その後finalLayoutに変換する
+    // texelSizeは1ピクセルのバイト数で、転送元の位置はこれと4バイトの両方の倍数に揃える
+    // ステージングリングの半分より大きいイメージは行ごとに分けてコピーするので、リングの容量より大きくてもよい
+    void addImageCopy(const void* pData, vk::DeviceSize size, vk::Image dst, vk::Extent3D extent, uint32_t texelSize, vk::ImageAspectFlags aspect, vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        vk::DeviceSize rowSize = vk::DeviceSize(extent.width) * texelSize;
+        vk::DeviceSize sliceSize = rowSize * extent.height;
+        vk::DeviceSize maxChunkSize = stagingRing.getCapacity() / 2;
+        if (size <= maxChunkSize || extent.depth != 1 || size != sliceSize || rowSize > maxChunkSize)
+        {
+            StagingRegion region = stagingRing.allocate(size, 4 * texelSize);
+            std::memcpy(region.pData, pData, size);
+
+            recordImageCopy(stagingRing.getCommandBuffer(), region.buffer, region.offset, dst, extent, aspect, finalLayout, dstStages, dstAccess);
+        }
+        else
+        {
+            // 1回で切り出すとリングの空きを全て待つことになるので、半分ずつ書き込んで前の分のコピーと重ねる
+            // 途中でリングが送信されても、同じキューに後から送信したコピーはレイアウト変換のバリアを待つ
+            uint32_t rowsPerChunk = static_cast<uint32_t>(maxChunkSize / rowSize);
+            const char* pSrc = static_cast<const char*>(pData);
+            for (uint32_t row = 0; row < extent.height; row += rowsPerChunk)
+            {
+                uint32_t rowCount = std::min(rowsPerChunk, extent.height - row);
+                vk::DeviceSize chunkSize = rowSize * rowCount;
+                StagingRegion region = stagingRing.allocate(chunkSize, 4 * texelSize);
+                std::memcpy(region.pData, pSrc + rowSize * row, chunkSize);
+
+                vk::CommandBuffer cmdBuf = stagingRing.getCommandBuffer();
+                if (row == 0)
+                {
+                    recordImageLayoutToTransferDst(cmdBuf, dst, aspect);
+                }
+                recordImageCopyRegion(cmdBuf, region.buffer, region.offset, dst, vk::Offset3D{ 0, int32_t(row), 0 }, vk::Extent3D{ extent.width, rowCount, 1 }, aspect);
+                if (row + rowCount == extent.height)
+                {
+                    recordImageLayoutToFinal(cmdBuf, dst, aspect, finalLayout, dstStages, dstAccess);
+                }
+            }
+        }
+
+        copyCount++;
+        bytes += size;
+    }
+
+    // ステージングリングを通さず、srcのsrcOffsetから直接コピーする
+    // srcOwnerはコピーが完了するまで破棄されないように、ステージングリングが預かる
+    void addImageCopy(vk::Buffer src, vk::DeviceSize srcOffset, vk::DeviceSize size, std::shared_ptr<void> srcOwner, vk::Image dst, vk::Extent3D extent, vk::ImageAspectFlags aspect, vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        vk::CommandBuffer cmdBuf = stagingRing.recordCommands();
+        stagingRing.retainUntilComplete(srcOwner);
+
+        recordImageCopy(cmdBuf, src, srcOffset, dst, extent, aspect, finalLayout, dstStages, dstAccess);
+
+        copyCount++;
+        bytes += size;
+    }
+
+    // 集めたものを1回で送信する
+    // signalSemaphoreを指定すると、最初のフレームの描画などにそれを待たせることができ、CPU側では一切待たずに済む
+    // signalValueを指定するとsignalSemaphoreをタイムラインセマフォとしてその値までシグナルする
+    UploadTicket submit(vk::Semaphore signalSemaphore = nullptr, uint64_t signalValue = 0)
+    {
+        UploadTicket result;
+        result.stagingRing = &stagingRing;
+        result.serial = stagingRing.submit(signalSemaphore, signalValue);
+        return result;
+    }
+
+    // submitで指定したセマフォを待つ、使う側のキューのコマンドバッファの先頭に記録する
+    // 所有権の移動が必要無ければ何もしない
+    // セマフォを待つステージ(pWaitDstStageMask)にはgetAcquireStagesを指定する
+    void recordAcquireBarriers(vk::CommandBuffer cmdBuf)
+    {
+        if (acquireBufferBarriers.empty() && acquireImageBarriers.empty())
+        {
+            return;
+        }
+        // セマフォの待ちと依存関係が繋がるように、前側にも同じステージを指定する
+        cmdBuf.pipelineBarrier(acquireStages, acquireStages, {}, {}, acquireBufferBarriers, acquireImageBarriers);
+        acquireBufferBarriers.clear();
+        acquireImageBarriers.clear();
+    }
+
+    // 追加したコピーを使うステージ
+    // セマフォを待つ時はこのステージで待てばよい
+    vk::PipelineStageFlags getAcquireStages() const
+    {
+        return acquireStages ? acquireStages : vk::PipelineStageFlags(vk::PipelineStageFlagBits::eTopOfPipe);
+    }
+
+    uint32_t getCopyCount() const
+    {
+        return copyCount;
+    }
+
+    vk::DeviceSize getBytes() const
+    {
+        return bytes;
+    }
+
+private:
+    void recordImageCopy(vk::CommandBuffer cmdBuf, vk::Buffer src, vk::DeviceSize srcOffset, vk::Image dst, vk::Extent3D extent, vk::ImageAspectFlags aspect, vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        recordImageLayoutToTransferDst(cmdBuf, dst, aspect);
+        recordImageCopyRegion(cmdBuf, src, srcOffset, dst, vk::Offset3D{ 0, 0, 0 }, extent, aspect);
+        recordImageLayoutToFinal(cmdBuf, dst, aspect, finalLayout, dstStages, dstAccess);
+    }
+
+    void recordImageLayoutToTransferDst(vk::CommandBuffer cmdBuf, vk::Image dst, vk::ImageAspectFlags aspect)
+    {
+        // バッファからバッファへデータをコピーするときはvk::CommandBuffer::copyBuffer()を使用した
+        // バッファからイメージにデータをコピーするので、vk::CommandBuffer::copyBufferToImage()という別のコマンドを使用する
+
+        // レイアウトの変換にはパイプラインバリアを用いる
+        // 本来パイプラインバリアはフェンスやセマフォのように同期処理のための道具
+        // だがイメージのレイアウト変換という機能も副次的に付いているため、これを使う
+        // (レンダーパスも、主目的としてはGPUにおける処理の依存関係を表すものなのに、イメージレイアウトの変換処理も行っていた
+        // ある処理の中ではイメージをこう扱ってこちらの処理ではイメージをこう利用する...といったケースを考えると、処理の切れ目に変換が入るのは自然なのかも知れない
+
+        // vk::ImageMemoryBarrier構造体でイメージのメモリ保護および変換に関する情報を設定し、pipelineBarrier()の引数に渡す
+        vk::ImageMemoryBarrier barrior;
+        // oldLayoutとnewLayoutがレイアウトの変換を示している
+        // イメージ作成時点ではeUndefinedなのでoldLayoutにはeUndefinedを指定
+        // なお、createImage()の時点でeTransferDstOptimalを指定することはできない
+        // createImage()で初期状態として指定できるのはeUndefinedもしくはePreinitialized
+        barrior.oldLayout = vk::ImageLayout::eUndefined;
+        barrior.newLayout = vk::ImageLayout::eTransferDstOptimal;
+        barrior.image = dst;
+        // 他の引数はイメージのレイアウト変換ではなく、「同期処理」というパイプラインバリア本来の機能のための様々な指定
+        // srcQueueFamilyIndex / dstQueueFamilyIndexは、バリアの前と後で別のキューからイメージを扱う場合に使うもの
+        // ここでは使わないのでVK_QUEUE_FAMILY_IGNOREDを指定
+        barrior.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.subresourceRange.aspectMask = aspect;
+        barrior.subresourceRange.baseMipLevel = 0;
+        barrior.subresourceRange.levelCount = 1;
+        barrior.subresourceRange.baseArrayLayer = 0;
+        barrior.subresourceRange.layerCount = 1;
+        // srcAccessMask / dstAccessMaskにはそれぞれパイプラインバリアの前と後で対象のリソースに行うアクセス処理を示す
+        // srcAccessMaskに指定した処理が終わるまで、dstAccessMaskに指定した処理は行われない
+        // ここでは終わるまで待つ必要のある処理は存在しないのでsrcAccessMaskは0
+        // 画像データのコピー処理はレイアウト変換が終わってから行われないと困るので、dstAccessMaskにeTransferWriteを指定する
+        barrior.srcAccessMask = vk::AccessFlags();
+        barrior.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+        // pipelineBarrierの第1,第2引数にはそれぞれパイプラインバリアの前と後で待たれるパイプラインステージを指定
+        // 第1引数(バリアの前側)のeTopOfPipeは何も待たれないという意味
+        // 第2引数(バリアの後側)のeTransferはデータ転送処理の意味
+        //     データ転送はグラフィックスパイプラインのステージではないが、ここでは処理段階の一種としてこのように指定する
+        cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTopOfPipe, vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, { barrior });
+    }
+
+    // imageOffsetからimageExtentの範囲に、srcのsrcOffsetから詰めて並んでいるデータをコピーする
+    void recordImageCopyRegion(vk::CommandBuffer cmdBuf, vk::Buffer src, vk::DeviceSize srcOffset, vk::Image dst, vk::Offset3D imageOffset, vk::Extent3D extent, vk::ImageAspectFlags aspect)
+    {
+        vk::BufferImageCopy imgCopyRegion;
+        // bufferOffsetは、「バッファの何バイト目からのデータを使う」という情報を示す
+        // ステージングリングを通す場合は、そこから切り出した位置になる
+        imgCopyRegion.bufferOffset = srcOffset;
+        // bufferRowLength, bufferImageHeightは「バッファ上における」イメージの横・縦ピクセル数を示す
+        // 0を指定した場合は自動的にimageExtentと同じサイズという扱いになる
+        imgCopyRegion.bufferRowLength = 0;
+        imgCopyRegion.bufferImageHeight = 0;
+        // imageSubresource, imageOffset, imageExtentは画像のコピー先の位置を示すもの
+        imgCopyRegion.imageSubresource.aspectMask = aspect;
+        imgCopyRegion.imageSubresource.mipLevel = 0;
+        imgCopyRegion.imageSubresource.baseArrayLayer = 0;
+        imgCopyRegion.imageSubresource.layerCount = 1;
+        imgCopyRegion.imageOffset = imageOffset;
+        imgCopyRegion.imageExtent = extent;
+        cmdBuf.copyBufferToImage(src, dst, vk::ImageLayout::eTransferDstOptimal, { imgCopyRegion });
+    }
+
+    void recordImageLayoutToFinal(vk::CommandBuffer cmdBuf, vk::Image dst, vk::ImageAspectFlags aspect, vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        vk::ImageMemoryBarrier barrior;
+        barrior.image = dst;
+        barrior.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrior.subresourceRange.aspectMask = aspect;
+        barrior.subresourceRange.baseMipLevel = 0;
+        barrior.subresourceRange.levelCount = 1;
+        barrior.subresourceRange.baseArrayLayer = 0;
+        barrior.subresourceRange.layerCount = 1;
+
+        // コピーが終わるまで使う側からアクセスするわけには行かない
+        // waitIdleで待たずにどんどんコマンドを飛ばしていくので、これが無いとコピーの途中のイメージを読んでしまう
+        barrior.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+        barrior.newLayout = finalLayout;
+        barrior.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+        barrior.dstAccessMask = dstAccess;
+
+        if (stagingRing.requiresOwnershipTransfer())
+        {
+            // キューファミリを跨ぐ場合、レイアウトの変換はリリースとアクワイアの両方に同じものを指定する
+            barrior.srcQueueFamilyIndex = stagingRing.getQueueFamilyIndex();
+            barrior.dstQueueFamilyIndex = stagingRing.getDstQueueFamilyIndex();
+            barrior.dstAccessMask = vk::AccessFlags();
+            cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, {}, {}, { barrior });
+
+            barrior.srcAccessMask = vk::AccessFlags();
+            barrior.dstAccessMask = dstAccess;
+            acquireImageBarriers.push_back(barrior);
+        }
+        else
+        {
+            cmdBuf.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, dstStages, {}, {}, {}, { barrior });
+        }
+        acquireStages |= dstStages;
+    }
+
+    StagingRing& stagingRing;
+    uint32_t copyCount = 0;
+    vk::DeviceSize bytes = 0;
+    std::vector<vk::BufferMemoryBarrier> acquireBufferBarriers;
+    std::vector<vk::ImageMemoryBarrier> acquireImageBarriers;
+    vk::PipelineStageFlags acquireStages;
+};
+
+std::shared_ptr<StagingRing> getStagingRing(vk::UniqueDevice& device, vk::Queue& queue, uint32_t queueFamilyIndex, uint32_t dstQueueFamilyIndex, MemoryAllocator& allocator, vk::DeviceSize capacity)
+{
+    return std::make_shared<StagingRing>(device.get(), queue, queueFamilyIndex, dstQueueFamilyIndex, allocator, capacity);
+}
+
+void debugStagingRing(StagingRing& stagingRing)
+{
+    const StagingStats& stats = stagingRing.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Staging Ring");
+    LOG("capacity: " << stagingRing.getCapacity() << " bytes");
+    LOG("queue family: " << stagingRing.getQueueFamilyIndex() << (stagingRing.requiresOwnershipTransfer() ? " (transfer only)" : " (shared with graphics)"));
+    LOG("submits: " << stats.submitCount << ", regions: " << stats.regionCount << ", uploaded: " << stats.uploadedBytes << " bytes");
+    LOG("stalls: " << stats.stallCount);
+}
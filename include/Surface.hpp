@@ -8,6 +8,7 @@
 #endif
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 using namespace Vulkan_Test;
 
@@ -24,14 +25,15 @@ std::shared_ptr<vk::UniqueSurfaceKHR> getSurface(vk::UniqueInstance& instance, A
 {
     std::shared_ptr<vk::UniqueSurfaceKHR> result = std::make_shared<vk::UniqueSurfaceKHR>();
     vk::AndroidSurfaceCreateInfoKHR surfaceCreateInfo(vk::AndroidSurfaceCreateFlagsKHR(), window);
-    *result = instance->createAndroidSurfaceKHRUnique(surfaceCreateInfo);
+    *result = instance->createAndroidSurfaceKHRUnique(surfaceCreateInfo, getAllocationCallbacks(vk::ObjectType::eSurfaceKHR));
     return result;
 }
 #else
 std::shared_ptr<vk::UniqueSurfaceKHR> getSurface(vk::UniqueInstance& instance, GLFWwindow& window)
 {
     VkSurfaceKHR c_surface;
-    VkResult result = glfwCreateWindowSurface(*instance, &window, nullptr, &c_surface);
+    const vk::AllocationCallbacks* allocationCallbacks = getAllocationCallbacks(vk::ObjectType::eSurfaceKHR);
+    VkResult result = glfwCreateWindowSurface(*instance, &window, reinterpret_cast<const VkAllocationCallbacks*>(allocationCallbacks), &c_surface);
     if (result != VK_SUCCESS) 
     {
         const char* err;
@@ -41,7 +43,8 @@ std::shared_ptr<vk::UniqueSurfaceKHR> getSurface(vk::UniqueInstance& instance, G
         exit(EXIT_FAILURE);
     }
 
-    return std::make_shared<vk::UniqueSurfaceKHR>(c_surface, *instance);
+    // 破棄する時も作成時と同じコールバックを使う
+    return std::make_shared<vk::UniqueSurfaceKHR>(c_surface, vk::ObjectDestroy<vk::Instance, VULKAN_HPP_DEFAULT_DISPATCHER_TYPE>(*instance, allocationCallbacks));
 }
 #endif
 
@@ -5,6 +5,7 @@
 #include <vulkan/vulkan.hpp>
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostAllocator.hpp"
 
 using namespace Vulkan_Test;
 
@@ -46,7 +47,7 @@ std::shared_ptr<vk::SwapchainCreateInfoKHR> getSwapchainCreateInfo(
 std::shared_ptr<vk::UniqueSwapchainKHR> getSwapchain(vk::UniqueDevice& device, vk::SwapchainCreateInfoKHR& swapchainCreateInfo)
 {
     std::shared_ptr<vk::UniqueSwapchainKHR> result = std::make_shared<vk::UniqueSwapchainKHR>();
-    *result = device.get().createSwapchainKHRUnique(swapchainCreateInfo);
+    *result = device.get().createSwapchainKHRUnique(swapchainCreateInfo, getAllocationCallbacks(vk::ObjectType::eSwapchainKHR));
     return result;
 }
 
@@ -101,7 +102,7 @@ std::shared_ptr<std::vector<vk::UniqueImageView>> getSwapchainImageViews(
         imgViewCreateInfo.subresourceRange.baseArrayLayer = 0;
         imgViewCreateInfo.subresourceRange.layerCount = 1;
 
-        (*result)[i] = device.get().createImageViewUnique(imgViewCreateInfo);
+        (*result)[i] = device.get().createImageViewUnique(imgViewCreateInfo, getAllocationCallbacks(vk::ObjectType::eImageView));
     }
 
     return result;
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "HostAllocator.hpp"
+#include "Swapchain.hpp"
+
+using namespace Vulkan_Test;
+
+// 表示モードとサーフェスのフォーマットは、getSurfacePresentModesKHRとgetSurfaceFormatsKHRが返した配列の先頭をそのまま使い、
+// イメージの数は最小値+1に決め打ちしていた
+// 配列の順番に意味は無いので、先頭が何になるかは環境次第で、垂直同期の有無さえ決まっていなかった
+// そこで目的ごとのプリセットを用意し、サーフェスが対応しているものの中から選ぶ
+//
+// 低遅延: 表示を待たずに最新のイメージを表示するmailboxを使い、無ければティアリングが起こるimmediateを使う
+// 省電力: 垂直同期に合わせるfifoを使い、イメージの数も最小にしてGPUが先走らないようにする
+// スループット: 表示を待たないimmediateかmailboxを使い、イメージを多めにしてイメージの取得で止まらないようにする
+// fifoは全ての環境で対応しているので、どのプリセットでも最後はfifoにする
+//
+// サーフェスのフォーマットはレンダーパスとパイプラインが依存しているので起動時に決めたら変えない
+// 表示モードとイメージの数はスワップチェーンを作り直せば変えられる
+
+enum class SwapchainPolicy
+{
+    LowLatency,
+    PowerSaving,
+    Throughput,
+};
+
+constexpr uint32_t swapchainPolicyCount = 3;
+
+inline const char* toString(SwapchainPolicy policy)
+{
+    switch (policy)
+    {
+    case SwapchainPolicy::LowLatency:
+        return "low latency";
+    case SwapchainPolicy::PowerSaving:
+        return "power saving";
+    case SwapchainPolicy::Throughput:
+        return "throughput";
+    }
+    return "unknown";
+}
+
+// 起動時のプリセット
+// 環境変数VULKAN_TEST_SWAPCHAIN_POLICYにlatency, power, throughputのどれかを指定でき、無ければ省電力にする
+SwapchainPolicy getSwapchainPolicy()
+{
+#if !defined(__ANDROID__)
+    const char* value = std::getenv("VULKAN_TEST_SWAPCHAIN_POLICY");
+    if (value != nullptr)
+    {
+        if (std::strcmp(value, "latency") == 0)
+        {
+            return SwapchainPolicy::LowLatency;
+        }
+        if (std::strcmp(value, "throughput") == 0)
+        {
+            return SwapchainPolicy::Throughput;
+        }
+        if (std::strcmp(value, "power") != 0)
+        {
+            LOGERR("Unknown swapchain policy " << value << ", using power.");
+        }
+    }
+#endif
+    return SwapchainPolicy::PowerSaving;
+}
+
+SwapchainPolicy getNextSwapchainPolicy(SwapchainPolicy policy)
+{
+    return SwapchainPolicy((uint32_t(policy) + 1) % swapchainPolicyCount);
+}
+
+struct SwapchainConfig
+{
+    SwapchainPolicy policy;
+    vk::SurfaceFormatKHR surfaceFormat;
+    vk::PresentModeKHR presentMode;
+    uint32_t imageCount;
+};
+
+// 色はシェーダーが書いた値をそのまま表示するUNORMの8ビットのフォーマットを優先する
+// SRGBのフォーマットにすると書き込み時にガンマ補正がかかり、今までと見た目が変わってしまう
+vk::SurfaceFormatKHR chooseSurfaceFormat(const std::vector<vk::SurfaceFormatKHR>& surfaceFormats)
+{
+    if (surfaceFormats.empty())
+    {
+        LOGERR("The surface reports no formats.");
+        exit(EXIT_FAILURE);
+    }
+
+    // eUndefinedが1つだけ返ってきた場合は、どのフォーマットでも使える
+    if (surfaceFormats.size() == 1 && surfaceFormats[0].format == vk::Format::eUndefined)
+    {
+        return vk::SurfaceFormatKHR(vk::Format::eB8G8R8A8Unorm, vk::ColorSpaceKHR::eSrgbNonlinear);
+    }
+
+    const vk::Format preferredFormats[] = { vk::Format::eB8G8R8A8Unorm, vk::Format::eR8G8B8A8Unorm };
+    for (vk::Format preferredFormat : preferredFormats)
+    {
+        for (const vk::SurfaceFormatKHR& surfaceFormat : surfaceFormats)
+        {
+            if (surfaceFormat.format == preferredFormat && surfaceFormat.colorSpace == vk::ColorSpaceKHR::eSrgbNonlinear)
+            {
+                return surfaceFormat;
+            }
+        }
+    }
+    return surfaceFormats[0];
+}
+
+vk::PresentModeKHR choosePresentMode(SwapchainPolicy policy, const std::vector<vk::PresentModeKHR>& surfacePresentModes)
+{
+    std::vector<vk::PresentModeKHR> preferredModes;
+    switch (policy)
+    {
+    case SwapchainPolicy::LowLatency:
+        preferredModes = { vk::PresentModeKHR::eMailbox, vk::PresentModeKHR::eImmediate };
+        break;
+    case SwapchainPolicy::PowerSaving:
+        break;
+    case SwapchainPolicy::Throughput:
+        // fifoRelaxedは垂直同期に間に合わなかった時だけ待たずに表示する
+        preferredModes = { vk::PresentModeKHR::eImmediate, vk::PresentModeKHR::eMailbox, vk::PresentModeKHR::eFifoRelaxed };
+        break;
+    }
+
+    for (vk::PresentModeKHR preferredMode : preferredModes)
+    {
+        if (std::find(surfacePresentModes.begin(), surfacePresentModes.end(), preferredMode) != surfacePresentModes.end())
+        {
+            return preferredMode;
+        }
+    }
+    return vk::PresentModeKHR::eFifo;
+}
+
+// イメージの数はminImageCountからmaxImageCountの間にする(maxImageCountが0なら上限は無い)
+uint32_t chooseSwapchainImageCount(SwapchainPolicy policy, vk::PresentModeKHR presentMode, const vk::SurfaceCapabilitiesKHR& surfaceCapabilities)
+{
+    uint32_t imageCount = surfaceCapabilities.minImageCount;
+    switch (policy)
+    {
+    case SwapchainPolicy::LowLatency:
+        // mailboxは表示中、表示待ち、描画中の3枚があれば止まらない
+        // それより多くても表示待ちのイメージが置き換えられるだけなので、遅延は伸びない
+        imageCount = presentMode == vk::PresentModeKHR::eMailbox ? std::max<uint32_t>(imageCount + 1, 3) : imageCount;
+        break;
+    case SwapchainPolicy::PowerSaving:
+        // 表示待ちのイメージが少ないほど、GPUは表示に合わせて早く休む
+        break;
+    case SwapchainPolicy::Throughput:
+        imageCount += 2;
+        break;
+    }
+
+    if (surfaceCapabilities.maxImageCount > 0)
+    {
+        imageCount = std::min(imageCount, surfaceCapabilities.maxImageCount);
+    }
+    return imageCount;
+}
+
+// サーフェスが対応しているものの中からプリセットに合うものを選ぶ
+SwapchainConfig chooseSwapchainConfig(SwapchainPolicy policy, const vk::SurfaceCapabilitiesKHR& surfaceCapabilities,
+    const std::vector<vk::SurfaceFormatKHR>& surfaceFormats, const std::vector<vk::PresentModeKHR>& surfacePresentModes)
+{
+    SwapchainConfig result;
+    result.policy = policy;
+    result.surfaceFormat = chooseSurfaceFormat(surfaceFormats);
+    result.presentMode = choosePresentMode(policy, surfacePresentModes);
+    result.imageCount = chooseSwapchainImageCount(policy, result.presentMode, surfaceCapabilities);
+    return result;
+}
+
+std::shared_ptr<vk::UniqueSwapchainKHR> getSwapchain(
+    vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, vk::UniqueSurfaceKHR& surface,
+    vk::SurfaceCapabilitiesKHR& surfaceCapabilities, SwapchainConfig& swapchainConfig)
+{
+    std::shared_ptr<vk::SwapchainCreateInfoKHR> swapchainCreateInfo = getSwapchainCreateInfo(physicalDevice, surface, surfaceCapabilities, swapchainConfig.surfaceFormat, swapchainConfig.presentMode);
+    swapchainCreateInfo->minImageCount = swapchainConfig.imageCount;
+    debugSwapchainCreateInfo(*swapchainCreateInfo);
+    return getSwapchain(device, *swapchainCreateInfo);
+}
+
+void debugSwapchainConfig(SwapchainConfig& swapchainConfig, uint32_t actualImageCount)
+{
+    LOG("----------------------------------------");
+    LOG("Debug Swapchain Config");
+    LOG("policy: " << toString(swapchainConfig.policy));
+    LOG("surface format: " << vk::to_string(swapchainConfig.surfaceFormat.format) << ", " << vk::to_string(swapchainConfig.surfaceFormat.colorSpace));
+    LOG("present mode: " << vk::to_string(swapchainConfig.presentMode));
+    // 実際のイメージの数は、ドライバが指定より多く作ることがある
+    LOG("images: " << swapchainConfig.imageCount << " requested, " << actualImageCount << " created");
+}
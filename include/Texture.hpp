@@ -2,11 +2,78 @@
 
 #include <iostream>
 #include <memory>
+#include <cstdlib>
+#include <cstring>
 #include <vulkan/vulkan.hpp>
-#define STB_IMAGE_IMPLEMENTATION
-#include "../include/stb/stb_image.h"
 #include "Utility.hpp"
 #include "Debug.hpp"
+#include "HostImport.hpp"
+
+// デコードしたピクセルデータをそのままVK_EXT_external_memory_hostで取り込めるように、
+// stb_imageが確保するメモリはページの境界に揃え、サイズもページの倍数に切り上げておく
+// minImportedHostPointerAlignmentがこれより大きいデバイスでは取り込めないので、memcpyで送る
+constexpr size_t imageDataAlignment = 4096;
+
+// 揃えたアドレスの直前に、元のアドレスと確保した大きさを置く
+struct ImageDataHeader
+{
+    void* raw;
+    size_t capacity;
+};
+
+void* allocateImageData(size_t size)
+{
+    size_t capacity = (size + imageDataAlignment - 1) / imageDataAlignment * imageDataAlignment;
+    void* raw = std::malloc(capacity + imageDataAlignment + sizeof(ImageDataHeader));
+    if (raw == nullptr)
+    {
+        return nullptr;
+    }
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(ImageDataHeader) + imageDataAlignment - 1) / imageDataAlignment * imageDataAlignment;
+    ImageDataHeader* header = reinterpret_cast<ImageDataHeader*>(aligned) - 1;
+    header->raw = raw;
+    header->capacity = capacity;
+    return reinterpret_cast<void*>(aligned);
+}
+
+// 取り込める大きさ
+size_t getImageDataCapacity(void* pImgData)
+{
+    return (reinterpret_cast<ImageDataHeader*>(pImgData) - 1)->capacity;
+}
+
+void freeImageData(void* pImgData)
+{
+    if (pImgData != nullptr)
+    {
+        std::free((reinterpret_cast<ImageDataHeader*>(pImgData) - 1)->raw);
+    }
+}
+
+void* reallocateImageData(void* pImgData, size_t size)
+{
+    if (pImgData == nullptr)
+    {
+        return allocateImageData(size);
+    }
+    if (size <= getImageDataCapacity(pImgData))
+    {
+        return pImgData;
+    }
+    void* result = allocateImageData(size);
+    if (result != nullptr)
+    {
+        std::memcpy(result, pImgData, getImageDataCapacity(pImgData));
+        freeImageData(pImgData);
+    }
+    return result;
+}
+
+#define STBI_MALLOC(size) allocateImageData(size)
+#define STBI_REALLOC(p, size) reallocateImageData(p, size)
+#define STBI_FREE(p) freeImageData(p)
+#define STB_IMAGE_IMPLEMENTATION
+#include "../include/stb/stb_image.h"
 
 #if defined(__ANDROID__)
 #include <android/asset_manager.h>
@@ -97,3 +164,20 @@ void releaseImageData(void* pImgData)
 {
     stbi_image_free(pImgData);
 }
+
+// デコードしたデータをデバイスメモリとして取り込む
+// 取り込めた場合はpImgDataの所有権が移り、コピーが完了して戻り値が破棄された時に解放される
+// 取り込めなければnullptrを返すので、今まで通りコピーしてからreleaseImageDataで解放する
+std::shared_ptr<ImportedHostBuffer> importImageData(HostMemoryImporter& hostMemoryImporter, void* pImgData, size_t imgDataSize)
+{
+    if (!hostMemoryImporter.isAvailable() || imageDataAlignment % hostMemoryImporter.getAlignment() != 0)
+    {
+        return nullptr;
+    }
+    vk::DeviceSize importSize = (imgDataSize + hostMemoryImporter.getAlignment() - 1) / hostMemoryImporter.getAlignment() * hostMemoryImporter.getAlignment();
+    if (importSize > getImageDataCapacity(pImgData))
+    {
+        return nullptr;
+    }
+    return hostMemoryImporter.import(pImgData, importSize, releaseImageData);
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "Memory.hpp"
+
+using namespace Vulkan_Test;
+
+// ポストプロセスや影などのパスを増やすと、パスの間だけ使う中間イメージが増えていく
+// これらはフレームの中で使われる期間が決まっていて、期間が重ならないもの同士は同じメモリを使い回せる(エイリアシング)
+// 各イメージを最初と最後に使うパスの番号と一緒に宣言しておき、期間が重ならないものを同じメモリの同じ場所に重ねて配置する
+// 重ねたメモリの中身は前の持ち主のものなので、最初に使うパスでは必ずクリアするか全体を書き込むこと
+
+struct TransientImageDesc
+{
+    std::string name;
+    vk::ImageCreateInfo createInfo;
+    // このイメージを使う最初と最後のパスの番号(両端を含む)
+    uint32_t firstPass = 0;
+    uint32_t lastPass = 0;
+    // 最初に使うパスでのレイアウトと、使われ方
+    // 同じ場所を前に使っていたイメージとの間のバリアに使う
+    vk::ImageLayout initialLayout = vk::ImageLayout::eUndefined;
+    vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eColor;
+    vk::PipelineStageFlags stages;
+    vk::AccessFlags access;
+};
+
+// 配置の結果
+struct TransientImagePlacement
+{
+    vk::UniqueImage image;
+    vk::MemoryRequirements memReq;
+    uint32_t memoryTypeIndex = 0;
+    vk::DeviceSize offset = 0;
+};
+
+struct TransientResourceStats
+{
+    // エイリアシングしなかった場合に必要な量
+    vk::DeviceSize unaliasedBytes = 0;
+    // 実際に確保した量
+    vk::DeviceSize aliasedBytes = 0;
+};
+
+class TransientResourcePool
+{
+public:
+    TransientResourcePool(vk::Device device, MemoryAllocator& allocator)
+        : device(device), allocator(allocator)
+    {
+    }
+
+    // buildの前に、そのフレームで使う中間イメージを全て宣言する
+    uint32_t declareImage(const TransientImageDesc& desc)
+    {
+        descs.push_back(desc);
+        return uint32_t(descs.size() - 1);
+    }
+
+    // 宣言されたイメージを作り、期間の重ならないもの同士が重なるようにメモリ上の位置を決めて確保する
+    // スワップチェーンの作り直しなどで大きさが変わった場合は、reset()してから宣言し直す
+    void build()
+    {
+        placements.clear();
+        placements.resize(descs.size());
+        memories.clear();
+        stats = TransientResourceStats();
+
+        for (size_t i = 0; i < descs.size(); i++)
+        {
+            TransientImagePlacement& placement = placements[i];
+            placement.image = device.createImageUnique(descs[i].createInfo, getAllocationCallbacks(vk::ObjectType::eImage));
+            placement.memReq = device.getImageMemoryRequirements(placement.image.get());
+            placement.memoryTypeIndex = allocator.findMemoryTypeIndex(placement.memReq.memoryTypeBits, deviceLocalMemoryRequest());
+            stats.unaliasedBytes += alignUp(placement.memReq.size, placement.memReq.alignment);
+        }
+
+        // メモリタイプごとに1つの確保にまとめる
+        for (uint32_t memoryTypeIndex = 0; memoryTypeIndex < allocator.getMemoryTypeCount(); memoryTypeIndex++)
+        {
+            std::vector<uint32_t> ids;
+            for (uint32_t id = 0; id < placements.size(); id++)
+            {
+                if (placements[id].memoryTypeIndex == memoryTypeIndex)
+                {
+                    ids.push_back(id);
+                }
+            }
+            if (ids.empty())
+            {
+                continue;
+            }
+
+            vk::MemoryRequirements memReq = placeImages(ids);
+            memReq.memoryTypeBits = 1 << memoryTypeIndex;
+            std::shared_ptr<MemoryAllocation> memory = allocator.allocateDedicated(memReq, memoryTypeIndex, false);
+            memory->setUsage(MemoryUsage::RenderTarget);
+            for (uint32_t id : ids)
+            {
+                device.bindImageMemory(placements[id].image.get(), memory->memory, memory->offset + placements[id].offset);
+            }
+            stats.aliasedBytes += memReq.size;
+            memories.push_back(memory);
+        }
+    }
+
+    // イメージを破棄してから宣言も消す
+    void reset()
+    {
+        placements.clear();
+        memories.clear();
+        descs.clear();
+    }
+
+    vk::Image getImage(uint32_t id) const
+    {
+        return placements[id].image.get();
+    }
+
+    const TransientImageDesc& getDesc(uint32_t id) const
+    {
+        return descs[id];
+    }
+
+    const TransientImagePlacement& getPlacement(uint32_t id) const
+    {
+        return placements[id];
+    }
+
+    size_t getImageCount() const
+    {
+        return descs.size();
+    }
+
+    const TransientResourceStats& getStats() const
+    {
+        return stats;
+    }
+
+    // passの最初に呼ぶ
+    // このパスから使い始めるイメージについて、同じ場所を使っていたイメージの処理が終わるのを待ってからレイアウトを初期化する
+    // 前の持ち主がこのフレームにいなければ、前のフレームで最後に使っていたイメージを待つ
+    void recordAliasingBarriers(vk::CommandBuffer cmdBuf, uint32_t pass)
+    {
+        std::vector<vk::ImageMemoryBarrier> barriers;
+        vk::PipelineStageFlags srcStages;
+        vk::PipelineStageFlags dstStages;
+
+        for (uint32_t id = 0; id < descs.size(); id++)
+        {
+            const TransientImageDesc& desc = descs[id];
+            if (desc.firstPass != pass)
+            {
+                continue;
+            }
+
+            // 同じ場所を使うイメージは期間が重ならないので、このフレームで前に使われたものか後に使われるもののどちらか
+            // 後に使われるものは前のフレームでの最後の持ち主になる
+            vk::PipelineStageFlags earlierStages, laterStages;
+            vk::AccessFlags earlierAccess, laterAccess;
+            for (uint32_t other = 0; other < descs.size(); other++)
+            {
+                if (other == id || !isSharingMemory(id, other))
+                {
+                    continue;
+                }
+                if (descs[other].lastPass < pass)
+                {
+                    earlierStages |= descs[other].stages;
+                    earlierAccess |= descs[other].access;
+                }
+                else
+                {
+                    laterStages |= descs[other].stages;
+                    laterAccess |= descs[other].access;
+                }
+            }
+
+            vk::PipelineStageFlags previousStages = earlierStages ? earlierStages : laterStages;
+            vk::AccessFlags previousAccess = earlierStages ? earlierAccess : laterAccess;
+            if (!previousStages)
+            {
+                previousStages = vk::PipelineStageFlagBits::eTopOfPipe;
+            }
+
+            vk::ImageMemoryBarrier barrior;
+            barrior.oldLayout = vk::ImageLayout::eUndefined;
+            barrior.newLayout = desc.initialLayout;
+            barrior.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrior.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrior.image = placements[id].image.get();
+            barrior.subresourceRange.aspectMask = desc.aspect;
+            barrior.subresourceRange.baseMipLevel = 0;
+            barrior.subresourceRange.levelCount = desc.createInfo.mipLevels;
+            barrior.subresourceRange.baseArrayLayer = 0;
+            barrior.subresourceRange.layerCount = desc.createInfo.arrayLayers;
+            barrior.srcAccessMask = previousAccess;
+            barrior.dstAccessMask = desc.access;
+            barriers.push_back(barrior);
+
+            srcStages |= previousStages;
+            dstStages |= desc.stages;
+        }
+
+        if (!barriers.empty())
+        {
+            cmdBuf.pipelineBarrier(srcStages, dstStages, {}, {}, {}, barriers);
+        }
+    }
+
+    // 2つのイメージがメモリ上で重なっているかどうか
+    bool isSharingMemory(uint32_t a, uint32_t b) const
+    {
+        const TransientImagePlacement& pa = placements[a];
+        const TransientImagePlacement& pb = placements[b];
+        if (pa.memoryTypeIndex != pb.memoryTypeIndex)
+        {
+            return false;
+        }
+        return pa.offset < pb.offset + pb.memReq.size && pb.offset < pa.offset + pa.memReq.size;
+    }
+
+private:
+    bool isOverlappingInTime(uint32_t a, uint32_t b) const
+    {
+        return descs[a].firstPass <= descs[b].lastPass && descs[b].firstPass <= descs[a].lastPass;
+    }
+
+    // 大きいものから順に、期間の重なるイメージと被らない一番低い位置に置いていく
+    // 戻り値は全体の大きさとアライメント
+    vk::MemoryRequirements placeImages(std::vector<uint32_t>& ids)
+    {
+        std::sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b)
+        {
+            return placements[a].memReq.size > placements[b].memReq.size;
+        });
+
+        vk::MemoryRequirements result;
+        result.size = 0;
+        result.alignment = 1;
+
+        std::vector<uint32_t> placed;
+        for (uint32_t id : ids)
+        {
+            TransientImagePlacement& placement = placements[id];
+            vk::DeviceSize offset = 0;
+
+            // 置いた位置が他と被っていたら、その後ろにずらして最初から確かめ直す
+            bool moved = true;
+            while (moved)
+            {
+                moved = false;
+                offset = alignUp(offset, placement.memReq.alignment);
+                for (uint32_t other : placed)
+                {
+                    const TransientImagePlacement& otherPlacement = placements[other];
+                    if (!isOverlappingInTime(id, other))
+                    {
+                        continue;
+                    }
+                    if (offset < otherPlacement.offset + otherPlacement.memReq.size && otherPlacement.offset < offset + placement.memReq.size)
+                    {
+                        offset = otherPlacement.offset + otherPlacement.memReq.size;
+                        moved = true;
+                    }
+                }
+            }
+
+            placement.offset = offset;
+            placed.push_back(id);
+            result.size = std::max(result.size, offset + placement.memReq.size);
+            result.alignment = std::max(result.alignment, placement.memReq.alignment);
+        }
+        return result;
+    }
+
+    vk::Device device;
+    MemoryAllocator& allocator;
+    std::vector<TransientImageDesc> descs;
+    // イメージより後に破棄されるように先に宣言する
+    std::vector<std::shared_ptr<MemoryAllocation>> memories;
+    std::vector<TransientImagePlacement> placements;
+    TransientResourceStats stats;
+};
+
+std::shared_ptr<TransientResourcePool> getTransientResourcePool(vk::UniqueDevice& device, MemoryAllocator& allocator)
+{
+    return std::make_shared<TransientResourcePool>(device.get(), allocator);
+}
+
+// 配置の計画を表示する
+// 右側はパスごとの使用期間で、#が使っているパス
+void debugTransientResourcePool(TransientResourcePool& pool)
+{
+    uint32_t passCount = 0;
+    for (uint32_t id = 0; id < pool.getImageCount(); id++)
+    {
+        passCount = std::max(passCount, pool.getDesc(id).lastPass + 1);
+    }
+
+    LOG("----------------------------------------");
+    LOG("Debug Transient Resources");
+    SET_LOG_INDEX(1);
+    for (uint32_t id = 0; id < pool.getImageCount(); id++)
+    {
+        const TransientImageDesc& desc = pool.getDesc(id);
+        const TransientImagePlacement& placement = pool.getPlacement(id);
+
+        std::stringstream timeline;
+        for (uint32_t pass = 0; pass < passCount; pass++)
+        {
+            timeline << (desc.firstPass <= pass && pass <= desc.lastPass ? '#' : '.');
+        }
+
+        LOG(desc.name << ": type " << placement.memoryTypeIndex << ", [" << placement.offset << ", " << placement.offset + placement.memReq.size << ") |" << timeline.str() << "|");
+    }
+    SET_LOG_INDEX(0);
+
+    const TransientResourceStats& stats = pool.getStats();
+    LOG("unaliased: " << stats.unaliasedBytes << " bytes, aliased: " << stats.aliasedBytes << " bytes");
+}
@@ -0,0 +1,321 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <vulkan/vulkan.hpp>
+#include "Utility.hpp"
+#include "Debug.hpp"
+#include "HostAllocator.hpp"
+#include "Staging.hpp"
+
+using namespace Vulkan_Test;
+
+// UploadBatchは呼び出したスレッドでステージングリングに書き込み、コマンドを記録して送信する
+// 起動時にまとめて送るならそれで十分だが、実行中にコンテンツを読み込みながら描画を続けたい場合、
+// ステージングリングの空きを待ったりコピーを記録したりする時間がそのままフレームの時間に乗ってしまう
+//
+// そこでアップロード専用のスレッドを立て、呼び出し側は要求を積むだけにする
+// 要求にはタイムラインセマフォの値が1つずつ割り当てられ、その値がハンドルになる
+// コピーが完了するとGPUがタイムラインセマフォをその値までシグナルするので、
+// 描画側はCPUで待たずに、送信するコマンドバッファにその値を待たせればよい
+
+// 要求を積んだ時に返される
+// 値はタイムラインセマフォがこの値に達したらコピーが完了しているという意味
+struct UploadHandle
+{
+    uint64_t value = 0;
+};
+
+struct UploadServiceStats
+{
+    uint64_t requestCount = 0;
+    // 積まれていた要求をまとめて送信するので、requestCountより少なくなる
+    uint64_t submitCount = 0;
+    vk::DeviceSize uploadedBytes = 0;
+};
+
+class UploadService
+{
+public:
+    // ステージングリングはこのサービスのスレッドだけが使うようになる
+    // 他のスレッドと同じキューに送信する場合は、先にsetQueueMutexでミューテックスを共有しておく
+    UploadService(vk::Device device, std::shared_ptr<StagingRing> stagingRing)
+        : device(device), stagingRing(stagingRing)
+    {
+        // タイムラインセマフォは作成時に種類と初期値を指定する
+        vk::SemaphoreTypeCreateInfo semaphoreTypeCreateInfo;
+        semaphoreTypeCreateInfo.semaphoreType = vk::SemaphoreType::eTimeline;
+        semaphoreTypeCreateInfo.initialValue = 0;
+
+        vk::SemaphoreCreateInfo semaphoreCreateInfo;
+        semaphoreCreateInfo.pNext = &semaphoreTypeCreateInfo;
+        timelineSemaphore = device.createSemaphoreUnique(semaphoreCreateInfo, getAllocationCallbacks(vk::ObjectType::eSemaphore));
+
+        worker = std::thread(&UploadService::run, this);
+    }
+
+    UploadService(const UploadService&) = delete;
+    UploadService& operator=(const UploadService&) = delete;
+
+    // 積まれている要求を全て送信してから終了し、GPUでのコピーの完了も待つ
+    ~UploadService()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        requestAdded.notify_all();
+        worker.join();
+        stagingRing->wait();
+    }
+
+    // dstのdstOffsetにコピーする
+    // pDataの内容はここでコピーされるので、呼び出し側はすぐに解放してよい
+    UploadHandle enqueueBuffer(const void* pData, vk::DeviceSize size, vk::Buffer dst, vk::DeviceSize dstOffset, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        Request request;
+        request.data.resize(size);
+        std::memcpy(request.data.data(), pData, size);
+        request.buffer = dst;
+        request.dstOffset = dstOffset;
+        request.dstStages = dstStages;
+        request.dstAccess = dstAccess;
+        return push(std::move(request));
+    }
+
+    // イメージのミップレベル0全体にコピーし、finalLayoutに変換する
+    // 引数の意味はUploadBatch::addImageCopyと同じ
+    UploadHandle enqueueImage(const void* pData, vk::DeviceSize size, vk::Image dst, vk::Extent3D extent, uint32_t texelSize, vk::ImageAspectFlags aspect, vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        Request request;
+        request.data.resize(size);
+        std::memcpy(request.data.data(), pData, size);
+        request.image = dst;
+        request.extent = extent;
+        request.texelSize = texelSize;
+        request.aspect = aspect;
+        request.finalLayout = finalLayout;
+        request.dstStages = dstStages;
+        request.dstAccess = dstAccess;
+        return push(std::move(request));
+    }
+
+    // ステージングリングを通さず、srcのsrcOffsetから直接コピーする
+    // データはコピーされず、srcOwnerがコピーの完了まで保持される
+    UploadHandle enqueueImage(vk::Buffer src, vk::DeviceSize srcOffset, vk::DeviceSize size, std::shared_ptr<void> srcOwner, vk::Image dst, vk::Extent3D extent, vk::ImageAspectFlags aspect, vk::ImageLayout finalLayout, vk::PipelineStageFlags dstStages, vk::AccessFlags dstAccess)
+    {
+        Request request;
+        request.src = src;
+        request.srcOffset = srcOffset;
+        request.srcSize = size;
+        request.srcOwner = srcOwner;
+        request.image = dst;
+        request.extent = extent;
+        request.aspect = aspect;
+        request.finalLayout = finalLayout;
+        request.dstStages = dstStages;
+        request.dstAccess = dstAccess;
+        return push(std::move(request));
+    }
+
+    // キューに送信されたかどうか
+    // 送信される前のものを待つコマンドバッファを送ることはできないので、描画に使ってよいかはこれで判断する
+    bool isSubmitted(UploadHandle handle)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return submittedValue >= handle.value;
+    }
+
+    // GPUでのコピーが完了したかどうか
+    // タイムラインセマフォの現在の値を読むだけなので待たない
+    bool isComplete(UploadHandle handle)
+    {
+        return device.getSemaphoreCounterValue(timelineSemaphore.get()) >= handle.value;
+    }
+
+    // GPUでのコピーの完了をCPUで待つ
+    // 描画のためならacquireを使い、GPU上で待たせる方がよい
+    void wait(UploadHandle handle)
+    {
+        vk::Semaphore semaphore = timelineSemaphore.get();
+        vk::SemaphoreWaitInfo waitInfo;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &semaphore;
+        waitInfo.pValues = &handle.value;
+        vk::Result waitResult = device.waitSemaphores(waitInfo, UINT64_MAX);
+        if (waitResult != vk::Result::eSuccess)
+        {
+            LOGERR("Failed to wait for upload " << handle.value);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // 描画側のコマンドバッファの先頭で呼ぶ
+    // 前回から新しく送信されたアップロードのアクワイアのバリアを記録し、そのコマンドバッファが待つべきタイムラインの値を返す
+    // 新しいものが無ければ0を返すので、その場合は待たなくてよい
+    // waitStagesには、タイムラインセマフォを待つステージが追加される
+    uint64_t acquire(vk::CommandBuffer cmdBuf, vk::PipelineStageFlags& waitStages)
+    {
+        std::vector<std::shared_ptr<UploadBatch>> batches;
+        uint64_t value;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batches.swap(submittedBatches);
+            value = submittedValue;
+        }
+        if (batches.empty())
+        {
+            return 0;
+        }
+
+        for (std::shared_ptr<UploadBatch>& batch : batches)
+        {
+            batch->recordAcquireBarriers(cmdBuf);
+            waitStages |= batch->getAcquireStages();
+        }
+        return value;
+    }
+
+    vk::Semaphore getTimelineSemaphore() const
+    {
+        return timelineSemaphore.get();
+    }
+
+    StagingRing& getStagingRing()
+    {
+        return *stagingRing;
+    }
+
+    UploadServiceStats getStats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+private:
+    struct Request
+    {
+        std::vector<char> data;
+        // srcを指定した場合はdataを使わず、srcから直接コピーする
+        vk::Buffer src;
+        vk::DeviceSize srcOffset = 0;
+        vk::DeviceSize srcSize = 0;
+        std::shared_ptr<void> srcOwner;
+        uint64_t value = 0;
+        // bufferかimageのどちらか一方だけを指定する
+        vk::Buffer buffer;
+        vk::DeviceSize dstOffset = 0;
+        vk::Image image;
+        vk::Extent3D extent;
+        uint32_t texelSize = 0;
+        vk::ImageAspectFlags aspect;
+        vk::ImageLayout finalLayout = vk::ImageLayout::eUndefined;
+        vk::PipelineStageFlags dstStages;
+        vk::AccessFlags dstAccess;
+    };
+
+    UploadHandle push(Request&& request)
+    {
+        UploadHandle result;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            request.value = ++enqueuedValue;
+            result.value = request.value;
+            requests.push_back(std::move(request));
+            stats.requestCount++;
+        }
+        requestAdded.notify_one();
+        return result;
+    }
+
+    // アップロード用のスレッド
+    // 積まれている要求を全て取り出し、1つのバッチにして送信する
+    void run()
+    {
+        while (true)
+        {
+            std::deque<Request> pending;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // 送信中のものがあれば、完了したものが預かっているコピー元を解放できるように時々起きる
+                while (!stopping && requests.empty() && stagingRing->isBusy())
+                {
+                    requestAdded.wait_for(lock, std::chrono::milliseconds(16));
+                    lock.unlock();
+                    stagingRing->collect();
+                    lock.lock();
+                }
+                requestAdded.wait(lock, [this] { return stopping || !requests.empty(); });
+                if (requests.empty())
+                {
+                    return;
+                }
+                pending.swap(requests);
+            }
+
+            std::shared_ptr<UploadBatch> batch = std::make_shared<UploadBatch>(*stagingRing);
+            for (Request& request : pending)
+            {
+                if (request.src)
+                {
+                    batch->addImageCopy(request.src, request.srcOffset, request.srcSize, request.srcOwner, request.image, request.extent, request.aspect, request.finalLayout, request.dstStages, request.dstAccess);
+                }
+                else if (request.image)
+                {
+                    batch->addImageCopy(request.data.data(), request.data.size(), request.image, request.extent, request.texelSize, request.aspect, request.finalLayout, request.dstStages, request.dstAccess);
+                }
+                else
+                {
+                    batch->addBufferCopy(request.data.data(), request.data.size(), request.buffer, request.dstOffset, request.dstStages, request.dstAccess);
+                }
+            }
+
+            // 値は積まれた順に増えるので、最後の要求の値までシグナルすればそれ以前の要求も全て完了したことになる
+            uint64_t value = pending.back().value;
+            batch->submit(timelineSemaphore.get(), value);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            submittedValue = value;
+            submittedBatches.push_back(batch);
+            stats.submitCount++;
+            stats.uploadedBytes += batch->getBytes();
+        }
+    }
+
+    vk::Device device;
+    std::shared_ptr<StagingRing> stagingRing;
+    vk::UniqueSemaphore timelineSemaphore;
+
+    std::mutex mutex;
+    std::condition_variable requestAdded;
+    std::deque<Request> requests;
+    // 送信済みで、まだ描画側でアクワイアしていないもの
+    std::vector<std::shared_ptr<UploadBatch>> submittedBatches;
+    uint64_t enqueuedValue = 0;
+    uint64_t submittedValue = 0;
+    bool stopping = false;
+    UploadServiceStats stats;
+
+    // 他のメンバが揃ってから開始されるように最後に宣言する
+    std::thread worker;
+};
+
+std::shared_ptr<UploadService> getUploadService(vk::UniqueDevice& device, std::shared_ptr<StagingRing> stagingRing)
+{
+    return std::make_shared<UploadService>(device.get(), stagingRing);
+}
+
+void debugUploadService(UploadService& uploadService)
+{
+    UploadServiceStats stats = uploadService.getStats();
+    LOG("----------------------------------------");
+    LOG("Debug Upload Service");
+    LOG("requests: " << stats.requestCount << ", submits: " << stats.submitCount << ", uploaded: " << stats.uploadedBytes << " bytes");
+}
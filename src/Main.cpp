@@ -1,7 +1,10 @@
 #include <iostream>
 #include <memory>
 #include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <functional>
+#include <mutex>
 #include <vulkan/vulkan.hpp>
 #include <GLFW/glfw3.h>
 #include "../include/Utility.hpp"
@@ -11,15 +14,33 @@
 #include "../include/PhysicalDevice.hpp"
 #include "../include/Surface.hpp"
 #include "../include/Swapchain.hpp"
+#include "../include/SwapchainPolicy.hpp"
 #include "../include/FrameBuffer.hpp"
 #include "../include/Pipeline.hpp"
 #include "../include/RenderPass.hpp"
 #include "../include/Subpass.hpp"
 #include "../include/Command.hpp"
+#include "../include/Frame.hpp"
+#include "../include/FramePacer.hpp"
+#include "../include/FrameTimeStats.hpp"
+#include "../include/CommandCache.hpp"
+#include "../include/ParallelRecorder.hpp"
 #include "../include/Instance.hpp"
 #include "../include/ShaderData.hpp"
 #include "../include/Texture.hpp"
 #include "../include/Depth.hpp"
+#include "../include/Memory.hpp"
+#include "../include/Residency.hpp"
+#include "../include/Defragment.hpp"
+#include "../include/FrameArena.hpp"
+#include "../include/DynamicBuffer.hpp"
+#include "../include/Staging.hpp"
+#include "../include/UploadService.hpp"
+#include "../include/HostImport.hpp"
+#include "../include/HostImageCopy.hpp"
+#include "../include/HostAllocator.hpp"
+#include "../include/MemoryReport.hpp"
+#include "../include/AllocationCheck.hpp"
 
 using namespace Vulkan_Test;
 
@@ -35,7 +56,7 @@ int main()
     std::shared_ptr<vk::ApplicationInfo> appInfo = getAppInfo();
     debugApplicationInfo(*appInfo);
     
-    std::shared_ptr<vk::UniqueInstance> instance = getInstance(*appInfo);
+    std::shared_ptr<vk::UniqueInstance> instance = getInstance(*appInfo, *getGlfwRequiredInstanceExtensions());
     std::shared_ptr<vk::UniqueSurfaceKHR> surface = getSurface(*instance, *window);
 
     std::shared_ptr<std::vector<vk::PhysicalDevice>> physicalDevices = getPhysicalDevices(*instance);
@@ -51,55 +72,300 @@ int main()
     std::vector<vk::QueueFamilyProperties> queueProps = physicalDevice.getQueueFamilyProperties();
     debugQueueFamilyProperties(queueProps);
     
-    std::shared_ptr<vk::UniqueDevice> device = getDevice(physicalDevice, queueFamilyIndex);
+    // 転送専用のキューファミリがあれば、アップロードはそちらで行い描画と並行させる
+    std::optional<uint32_t> transferQueueFamilyIndex = findTransferQueueFamilyIndex(physicalDevice, queueFamilyIndex);
+    std::shared_ptr<vk::UniqueDevice> device = getDevice(physicalDevice, queueFamilyIndex, transferQueueFamilyIndex);
     
     vk::Queue graphicsQueue = device->get().getQueue(queueFamilyIndex, 0);
+    // 無ければグラフィックスのキューでアップロードする
+    uint32_t uploadQueueFamilyIndex = transferQueueFamilyIndex.value_or(queueFamilyIndex);
+    vk::Queue uploadQueue = device->get().getQueue(uploadQueueFamilyIndex, 0);
+
+    std::shared_ptr<MemoryAllocator> memoryAllocator = getMemoryAllocator(*device, physicalDevice);
+    // 全てのアップロードはこのステージングリングを通す
+    std::shared_ptr<StagingRing> stagingRing = getStagingRing(*device, uploadQueue, uploadQueueFamilyIndex, queueFamilyIndex, *memoryAllocator, 32 * 1024 * 1024);
+    // キューへの送信はアップロードサービスのスレッドとこのスレッドの間で同期する
+    std::mutex queueMutex;
+    stagingRing->setQueueMutex(&queueMutex);
+    // タイムラインセマフォが使えれば、アップロードは別スレッドのサービスに任せ、描画にGPU上でその完了を待たせる
+    // その場合ステージングリングはサービスのスレッドだけが使う
+    std::shared_ptr<UploadService> uploadService;
+    if (isTimelineSemaphoreSupported(physicalDevice))
+    {
+        uploadService = getUploadService(*device, stagingRing);
+    }
+    // デコードした画像データは、可能ならコピーせずにデバイスメモリとして取り込む
+    std::shared_ptr<HostMemoryImporter> hostMemoryImporter = getHostMemoryImporter(*device, physicalDevice);
+    // テクスチャはCPUから直接書き込めればそうする
+    std::shared_ptr<HostImageCopier> hostImageCopier = getHostImageCopier(*device, physicalDevice);
 
     std::shared_ptr<std::vector<vk::VertexInputBindingDescription>> vertexBindingDescription = getVertexBindingDescription();
     std::shared_ptr<std::vector<vk::VertexInputAttributeDescription>> vertexInputDescription = getVertexInputDescription();
 
+    // 起動時のアップロードは全てこのバッチに集めて1回で送信する
+    // アップロードサービスがあればそちらに積み、リソースごとのハンドルが全て送信済みになるまで描画しない
+    // 読み込み直しで1つだけ積み直すこともあるので、ハンドルはリソースごとに持つ
+    UploadBatch uploadBatch(*stagingRing);
+    UploadHandle vertexBufUpload;
+    UploadHandle indexBufUpload;
+    UploadHandle texImageUpload;
+
     std::shared_ptr<vk::UniqueBuffer> vertexBuf = getVertexBuffer(*device);
-    std::shared_ptr<vk::UniqueDeviceMemory> vertexBufMem = getVertexBufferMemory(*device, physicalDevice, *vertexBuf);
-    std::shared_ptr<vk::UniqueBuffer> stagingVertexBuf = getStagingVertexBuffer(*device, physicalDevice);
-    std::shared_ptr<vk::UniqueDeviceMemory> stagingVertexBufMem = getStagingVertexBufferMemory(*device, physicalDevice, *stagingVertexBuf);
-    writeStagingVertexBuffer(*device, *stagingVertexBufMem);
-    sendVertexBuffer(*device, queueFamilyIndex, graphicsQueue, *stagingVertexBuf, *vertexBuf);
+    std::shared_ptr<MemoryAllocation> vertexBufMem = getVertexBufferMemory(*device, *memoryAllocator, *vertexBuf);
+    if (vertexBufMem->pMapped != nullptr)
+    {
+        writeVertexBuffer(*device, *vertexBufMem);
+    }
+    else if (uploadService)
+    {
+        vertexBufUpload = uploadVertexBuffer(*uploadService, *vertexBuf);
+    }
+    else
+    {
+        uploadVertexBuffer(uploadBatch, *vertexBuf);
+    }
 
     std::shared_ptr<vk::UniqueBuffer> indexBuf = getIndexBuffer(*device);
-    std::shared_ptr<vk::UniqueDeviceMemory> indexBufMem = getIndexBufferMemory(*device, physicalDevice, *indexBuf);
-    std::shared_ptr<vk::UniqueBuffer> stagingIndexBuf = getStagingIndexBuffer(*device, physicalDevice);
-    std::shared_ptr<vk::UniqueDeviceMemory> stagingIndexBufMem = getStagingIndexBufferMemory(*device, physicalDevice, *stagingIndexBuf);
-    writeStagingIndexBuffer(*device, *stagingIndexBufMem);
-    sendIndexBuffer(*device, queueFamilyIndex, graphicsQueue, *stagingIndexBuf, *indexBuf);
+    std::shared_ptr<MemoryAllocation> indexBufMem = getIndexBufferMemory(*device, *memoryAllocator, *indexBuf);
+    if (indexBufMem->pMapped != nullptr)
+    {
+        writeIndexBuffer(*device, *indexBufMem);
+    }
+    else if (uploadService)
+    {
+        indexBufUpload = uploadIndexBuffer(*uploadService, *indexBuf);
+    }
+    else
+    {
+        uploadIndexBuffer(uploadBatch, *indexBuf);
+    }
 
     int imgWidth, imgHeight, imgCh;
     void* imgData = getImageData(&imgWidth, &imgHeight, &imgCh);
-    std::shared_ptr<vk::UniqueImage> texImage = getImage(*device, imgWidth, imgHeight, imgCh);
-    std::shared_ptr<vk::UniqueDeviceMemory> imgBufMemory = getImageMemory(*device, physicalDevice, *texImage);
-    std::shared_ptr<vk::UniqueBuffer> imgStagingBuf = getStagingImageBuffer(*device, imgWidth, imgHeight, imgCh);
-    std::shared_ptr<vk::UniqueDeviceMemory> imgStagingBufMemory = getStagingImageMemory(*device, physicalDevice, *imgStagingBuf);
-    writeImageBuffer(*device, *imgStagingBufMemory, imgData, imgWidth, imgHeight, imgCh);
-    sendImageBuffer(*device, queueFamilyIndex, graphicsQueue, *imgStagingBuf, *texImage, imgWidth, imgHeight);
+    // VK_EXT_host_image_copyを使う場合は、イメージの作成時にeHostTransferEXTを付けておく
+    bool useHostImageCopy = hostImageCopier->isSupported(getImageCreateInfo(imgWidth, imgHeight, imgCh));
+    vk::ImageUsageFlags texImageUsage = useHostImageCopy ? hostImageCopier->getImageUsage() : vk::ImageUsageFlags();
+    std::shared_ptr<vk::UniqueImage> texImage = getImage(*device, imgWidth, imgHeight, imgCh, texImageUsage);
+    std::shared_ptr<MemoryAllocation> imgBufMemory = getImageMemory(*device, *memoryAllocator, *texImage);
+    if (useHostImageCopy)
+    {
+        // ステージングバッファもキューへの送信も使わない
+        copyImageData(*hostImageCopier, imgData, *texImage, imgWidth, imgHeight, imgCh);
+    }
+    else if (uploadService)
+    {
+        texImageUpload = uploadImageData(*uploadService, *hostMemoryImporter, imgData, *texImage, imgWidth, imgHeight, imgCh);
+    }
+    else
+    {
+        uploadImageData(uploadBatch, *hostMemoryImporter, imgData, *texImage, imgWidth, imgHeight, imgCh);
+    }
+    // ここまでに集めたアップロードをまとめて送信する
+    // CPU側では待たず、最初のフレームの描画にuploadSemaphoreを待たせる
+    vk::UniqueSemaphore uploadSemaphore = device->get().createSemaphoreUnique(vk::SemaphoreCreateInfo(), getAllocationCallbacks(vk::ObjectType::eSemaphore));
+    bool waitForUpload = false;
+    if (!uploadService)
+    {
+        uploadBatch.submit(uploadSemaphore.get());
+        waitForUpload = true;
+        LOG("startup upload: " << uploadBatch.getCopyCount() << " copies, " << uploadBatch.getBytes() << " bytes in one submit");
+    }
     std::shared_ptr<vk::UniqueSampler> texSampler = getSampler(*device);
     std::shared_ptr<vk::UniqueImageView> texImageView = getImageView(*device, *texImage);
-    releaseImageData(imgData);
+    // imgDataはuploadImageDataかcopyImageDataが解放する
+
+    // 同時に処理中になり得るフレームの数
+    // フレームアリーナの領域や、リソースを破棄してよくなるまでのフレーム数もこれに合わせる
+    uint32_t framesInFlight = getFramesInFlight();
+    std::shared_ptr<FrameArena> frameArena = getFrameArena(*device, physicalDevice, *memoryAllocator, framesInFlight, 64 * 1024);
+    // 2つ目の立方体は頂点の色を毎フレーム書き換えるので、書き換えた範囲だけを送る頂点バッファを使う
+    std::shared_ptr<DynamicBuffer> dynamicVertexBuf = getDynamicBuffer(*device, *memoryAllocator, vk::BufferUsageFlagBits::eVertexBuffer, MemoryUsage::Vertex, vertices.data(), sizeof(Vertex) * vertices.size());
+    debugMemoryAllocatorStats(*memoryAllocator);
+    debugHostAllocator(hostAllocator);
+
+    // 毎フレーム描画に使うので普段は追い出されることはないが、
+    // 追い出された場合はメモリを手放し、再び使う前に読み込み直す必要がある
+    // リソースの登録は、デフラグと同じくアップロードが終わった後で行う
+    std::shared_ptr<ResidencyManager> residencyManager = getResidencyManager(physicalDevice, *memoryAllocator, framesInFlight);
+    uint32_t vertexBufResidency = 0;
+    uint32_t indexBufResidency = 0;
+    uint32_t texImageResidency = 0;
+    residencyManager->update(0);
+    debugResidency(*residencyManager);
+    // VULKAN_TEST_RESIDENCY_CHECKを指定した場合は、しばらく予算を0にしてシーンを隠し、追い出しと読み込み直しを起こす
+    std::shared_ptr<ResidencyCheck> residencyCheck = getResidencyCheck(*residencyManager);
 
-    std::shared_ptr<vk::UniqueBuffer> uniformBuf = getUniformBuffer(*device);
-    std::shared_ptr<vk::UniqueDeviceMemory> uniformBufMem = getUniformBufferMemory(*device, physicalDevice, *uniformBuf);
-    void* pUniformBufMem = mapUniformBuffer(*device, *uniformBufMem);
     std::shared_ptr<std::vector<vk::UniqueDescriptorSetLayout>> descSetLayouts = getDiscriptorSetLayouts(*device);
     std::shared_ptr<std::vector<vk::DescriptorSetLayout>> unwrapedDescSetLayouts = unwrapHandles<vk::DescriptorSetLayout, vk::UniqueDescriptorSetLayout>(*descSetLayouts);
-    std::shared_ptr<vk::UniqueDescriptorPool> descPool = getDescriptorPool(*device);
-    std::shared_ptr<std::vector<vk::UniqueDescriptorSet>> descSets = getDescprotorSets(*device, *descPool, *unwrapedDescSetLayouts);
-    writeDescriptorSets(*device, *descSets, *uniformBuf, *texImageView, *texSampler);
+    // デスクリプタセットはフレームごとに持ち、フレームの番号で選ぶ
+    // 処理中のフレームが使っている間は書き換えられないので、テクスチャを作り直した時はフェンスを待ったフレームのものから順に書き換える
+    std::shared_ptr<vk::UniqueDescriptorPool> descPool = getDescriptorPool(*device, framesInFlight);
+    std::shared_ptr<std::vector<vk::UniqueDescriptorSet>> descSets = getDescprotorSets(*device, *descPool, *unwrapedDescSetLayouts, framesInFlight);
+    writeDescriptorSets(*device, *descSets, *frameArena, *texImageView, *texSampler);
+    // テクスチャのイメージビューを作り直すたびに増やし、フレームごとのデスクリプタセットに書き込んだ時の値と比べる
+    uint64_t texImageViewVersion = 0;
+    std::vector<uint64_t> descSetVersions(framesInFlight, 0);
+
+    // 記録済みのコマンドバッファを使い回す場合に使う
+    // 無効な場合は今まで通り毎フレーム記録する
+    std::shared_ptr<CommandCache> commandCache;
+
+    // デフラグで移動した頂点バッファとインデックスバッファは毎フレームのコマンド記録でバインドし直されるが、
+    // 記録済みのコマンドバッファは古いバッファを指したままなので記録し直させる
+    // テクスチャはイメージビューを作り直し、デスクリプタセットは各フレームの番が来た時に書き換える
+    std::function<void()> invalidateCommands = [&]()
+    {
+        if (commandCache)
+        {
+            commandCache->invalidate();
+        }
+    };
+    std::shared_ptr<Defragmenter> defragmenter = getDefragmenter(*device, graphicsQueue, queueFamilyIndex, *memoryAllocator, framesInFlight);
+
+    // 頂点バッファとインデックスバッファは、追い出す代わりにHOST_VISIBLEなヒープに移して(降格)そのまま描画に使う
+    // データはCPU側にもあるので直接書き込めばよく、アップロードは要らない
+    // テクスチャは移す先が無いので破棄し、読み込み直すまで描画しない
+    // どちらも最後に描画に使ってからframesInFlightフレーム経っているので、元のリソースはすぐに破棄してよい
+    // 予算に余裕ができたら元のヒープに読み込み直す
+    bool texImageEvicted = false;
+    // 読み込み直しをステージングリング経由で行う場合に、フレームの送信の前にまとめて送信する
+    bool restoreBatchPending = false;
+    // 起動時と読み込み直しのアップロードが送信され、描画のキューが所有権を受け取ったらtrueになる
+    // それまではデフラグも追い出しも行わない
+    // まだ書き込まれていないか、レイアウトがeUndefinedのままか、転送のキューが所有しているリソースをコピーしたり破棄したりしてしまうため
+    bool assetsSettled = false;
+    bool assetsRegistered = false;
+
+    auto demoteVertexBuffer = [&]()
+    {
+        vertexBuf = getVertexBuffer(*device);
+        vertexBufMem = getHostBufferMemory(*device, *memoryAllocator, *vertexBuf, MemoryUsage::Vertex);
+        writeVertexBuffer(*device, *vertexBufMem);
+        residencyManager->demote(vertexBufResidency, *vertexBufMem);
+        invalidateCommands();
+    };
+    auto demoteIndexBuffer = [&]()
+    {
+        indexBuf = getIndexBuffer(*device);
+        indexBufMem = getHostBufferMemory(*device, *memoryAllocator, *indexBuf, MemoryUsage::Index);
+        writeIndexBuffer(*device, *indexBufMem);
+        residencyManager->demote(indexBufResidency, *indexBufMem);
+        invalidateCommands();
+    };
+    auto evictTexture = [&]()
+    {
+        // デスクリプタセットは破棄したイメージビューを指したままになるが、読み込み直すまでバインドしない
+        texImageView->reset();
+        texImage->reset();
+        imgBufMemory.reset();
+        texImageEvicted = true;
+        invalidateCommands();
+    };
+
+    // 起動時と同じ方法でアップロードする
+    // 降格していたバッファは処理中のフレームがまだ読んでいるので、使い終わるまで破棄を待つ
+    auto restoreVertexBuffer = [&]()
+    {
+        residencyManager->retire(vertexBuf);
+        residencyManager->retire(vertexBufMem);
+        vertexBuf = getVertexBuffer(*device);
+        vertexBufMem = getVertexBufferMemory(*device, *memoryAllocator, *vertexBuf);
+        if (vertexBufMem->pMapped != nullptr)
+        {
+            writeVertexBuffer(*device, *vertexBufMem);
+        }
+        else if (uploadService)
+        {
+            vertexBufUpload = uploadVertexBuffer(*uploadService, *vertexBuf);
+            assetsSettled = false;
+        }
+        else
+        {
+            uploadVertexBuffer(uploadBatch, *vertexBuf);
+            restoreBatchPending = true;
+        }
+        residencyManager->makeResident(vertexBufResidency, *vertexBufMem);
+        invalidateCommands();
+    };
+    auto restoreIndexBuffer = [&]()
+    {
+        residencyManager->retire(indexBuf);
+        residencyManager->retire(indexBufMem);
+        indexBuf = getIndexBuffer(*device);
+        indexBufMem = getIndexBufferMemory(*device, *memoryAllocator, *indexBuf);
+        if (indexBufMem->pMapped != nullptr)
+        {
+            writeIndexBuffer(*device, *indexBufMem);
+        }
+        else if (uploadService)
+        {
+            indexBufUpload = uploadIndexBuffer(*uploadService, *indexBuf);
+            assetsSettled = false;
+        }
+        else
+        {
+            uploadIndexBuffer(uploadBatch, *indexBuf);
+            restoreBatchPending = true;
+        }
+        residencyManager->makeResident(indexBufResidency, *indexBufMem);
+        invalidateCommands();
+    };
+    auto restoreTexture = [&]()
+    {
+        texImage = getImage(*device, imgWidth, imgHeight, imgCh, texImageUsage);
+        imgBufMemory = getImageMemory(*device, *memoryAllocator, *texImage);
+        void* restoreImgData = getImageData(&imgWidth, &imgHeight, &imgCh);
+        if (useHostImageCopy)
+        {
+            copyImageData(*hostImageCopier, restoreImgData, *texImage, imgWidth, imgHeight, imgCh);
+        }
+        else if (uploadService)
+        {
+            texImageUpload = uploadImageData(*uploadService, *hostMemoryImporter, restoreImgData, *texImage, imgWidth, imgHeight, imgCh);
+            assetsSettled = false;
+        }
+        else
+        {
+            uploadImageData(uploadBatch, *hostMemoryImporter, restoreImgData, *texImage, imgWidth, imgHeight, imgCh);
+            restoreBatchPending = true;
+        }
+        // デスクリプタセットは各フレームの番が来た時に書き換える
+        texImageView = getImageView(*device, *texImage);
+        texImageViewVersion++;
+        texImageEvicted = false;
+        residencyManager->makeResident(texImageResidency, *imgBufMemory);
+        invalidateCommands();
+    };
+
+    // デフラグは持ち主の変数を指しているので、追い出しや読み込み直しで中身が変わってもそのまま追いかける
+    // 追い出されてメモリが無い間は動かさない
+    auto registerAssets = [&]()
+    {
+        vertexBufResidency = residencyManager->registerResource("vertex buffer", ResidentResourceKind::Mesh, *vertexBufMem, demoteVertexBuffer, restoreVertexBuffer);
+        indexBufResidency = residencyManager->registerResource("index buffer", ResidentResourceKind::Mesh, *indexBufMem, demoteIndexBuffer, restoreIndexBuffer);
+        texImageResidency = residencyManager->registerResource("texture", ResidentResourceKind::Texture, *imgBufMemory, evictTexture, restoreTexture);
+
+        defragmenter->registerBuffer("vertex buffer", vertexBuf, vertexBufMem, getVertexBufferCreateInfo(), vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead, invalidateCommands);
+        defragmenter->registerBuffer("index buffer", indexBuf, indexBufMem, getIndexBufferCreateInfo(), vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eIndexRead, invalidateCommands);
+        defragmenter->registerImage("texture", texImage, imgBufMemory, getImageCreateInfo(imgWidth, imgHeight, imgCh, texImageUsage), vk::ImageLayout::eShaderReadOnlyOptimal, vk::ImageAspectFlagBits::eColor, vk::PipelineStageFlagBits::eFragmentShader, vk::AccessFlagBits::eShaderRead, [&]()
+        {
+            defragmenter->retireImageView(std::move(*texImageView));
+            texImageView = getImageView(*device, *texImage);
+            texImageViewVersion++;
+            invalidateCommands();
+        });
+        assetsRegistered = true;
+    };
     std::shared_ptr<std::vector<vk::PushConstantRange>> pushConstantRanges = getPushConstantRanges();
 
     std::shared_ptr<vk::UniquePipelineLayout> descpriptorPipelineLayout = getDescpriptorPipelineLayout(*device, *unwrapedDescSetLayouts, *pushConstantRanges);
     std::shared_ptr<vk::SurfaceCapabilitiesKHR> surfaceCapabilities = getSurfaceCapabilities(physicalDevice, *surface);
     std::shared_ptr<std::vector<vk::SurfaceFormatKHR>> surfaceFormats = getSurfaceFormats(physicalDevice, *surface);
     std::shared_ptr<std::vector<vk::PresentModeKHR>> surfacePresentModes = getSurfacePresentModes(physicalDevice, *surface);
-    vk::SurfaceFormatKHR& surfaceFormat = (*surfaceFormats)[0];
-    vk::PresentModeKHR& surfacePresentMode = (*surfacePresentModes)[0];
+    // 表示モードとイメージの数はプリセットから選び、実行中にF10で切り替えられる
+    SwapchainPolicy swapchainPolicy = getSwapchainPolicy();
+    SwapchainConfig swapchainConfig = chooseSwapchainConfig(swapchainPolicy, *surfaceCapabilities, *surfaceFormats, *surfacePresentModes);
+    vk::SurfaceFormatKHR& surfaceFormat = swapchainConfig.surfaceFormat;
 
     std::shared_ptr<std::vector<vk::AttachmentReference>> subpass0_attachmentRefs = getAttachmentReferences();
     std::shared_ptr<vk::AttachmentReference> subpass0_depthStencilAttachmentRef = getDepthStencilAttachmentReference();
@@ -108,16 +374,53 @@ int main()
     std::shared_ptr<vk::UniqueRenderPass> renderPass = getRenderPass(*device, surfaceFormat, *subpasses);
     std::shared_ptr<vk::UniquePipeline> pipeline = getPipeline(*device, *renderPass, *surfaceCapabilities, *vertexBindingDescription, *vertexInputDescription, *descpriptorPipelineLayout);
 
+    // コマンドバッファ、フェンス、イメージの取得を待つセマフォはフレームごとに持ち、順番に使う
+    std::shared_ptr<vk::UniqueCommandPool> cmdPool = getCommandPool(*device, queueFamilyIndex);
+    std::shared_ptr<FrameManager> frameManager = getFrameManager(*device, *cmdPool, framesInFlight);
+    LOG("frames in flight: " << framesInFlight);
+    // フレームレートの制限と、表示待ちのフレームの数の制限を行う
+    std::shared_ptr<FramePacer> framePacer = getFramePacer(*device, physicalDevice, getTargetFrameRate(), getMaxQueuedPresents());
+    // VULKAN_TEST_ALLOCATION_CHECKを定義してビルドした場合は、最初の120フレームの後にフレームのループでヒープの確保が起きたら終了する
+    std::shared_ptr<FrameAllocationCheck> frameAllocationCheck = getFrameAllocationCheck(120);
+    // 直近4096フレームの区間ごとの時間を記録し、終了時とF9で書き出す
+    std::shared_ptr<FrameTimeStats> frameTimeStats = getFrameTimeStats(4096);
+    bool frameTimeStatsCsv = isFrameTimeStatsCsv();
+    // 静的なシーンでは、レンダーパスの部分を(フレーム, イメージ)ごとに一度だけ記録して使い回す
+    if (isCommandCacheEnabled())
+    {
+        commandCache = getCommandCache(*device, *cmdPool, framesInFlight);
+    }
+    // 毎フレーム記録する場合は、描画の一覧を複数のスレッドでセカンダリコマンドバッファに分けて記録する
+    std::shared_ptr<ParallelRecorder> parallelRecorder;
+    uint32_t recordThreadCount = getRecordThreadCount();
+    if (!commandCache && recordThreadCount > 0)
+    {
+        parallelRecorder = getParallelRecorder(*device, queueFamilyIndex, framesInFlight, recordThreadCount);
+        LOG("record threads: " << recordThreadCount);
+    }
+
     std::shared_ptr<vk::UniqueSwapchainKHR> swapchain;
     std::shared_ptr<std::vector<vk::Image>> swapchainImages;
     std::shared_ptr<std::vector<vk::UniqueImageView>> swapchainImageViews;
     std::shared_ptr<vk::UniqueImage> depthImage;
-    std::shared_ptr<vk::UniqueDeviceMemory> depthImageMemory;
+    std::shared_ptr<MemoryAllocation> depthImageMemory;
     std::shared_ptr<vk::UniqueImageView> depthImageView;
     std::shared_ptr<std::vector<vk::UniqueFramebuffer>> swapchainFramebufs;
 
     std::function recreateSwapchain = [&]()
     {
+        // 作り直しの間にドライバがホスト側で何回確保したかを数える
+        uint64_t hostAllocationCount = hostAllocator.getTotalAllocationCount();
+
+        // 作り直しは定常状態ではないので、このフレームの確保は数えない
+        frameAllocationCheck->skipFrame();
+
+        // 処理中のフレームが古いスワップチェーンのイメージやイメージごとのセマフォを使い終わるまで待つ
+        {
+            std::lock_guard<std::mutex> queueLock(queueMutex);
+            graphicsQueue.waitIdle();
+        }
+
         if (swapchainFramebufs)
         {
             swapchainFramebufs->clear();
@@ -128,7 +431,7 @@ int main()
         }
         if (depthImageMemory)
         {
-            depthImageMemory->reset();
+            depthImageMemory.reset();
         }
         if (depthImage)
         {
@@ -147,156 +450,505 @@ int main()
             swapchain->reset();
         }
 
-        swapchain = getSwapchain(*device, physicalDevice, *surface, *surfaceCapabilities, surfaceFormat, surfacePresentMode);
+        // サーフェスのフォーマットは同じものが選ばれるので、レンダーパスを作り直す必要はない
+        swapchainConfig = chooseSwapchainConfig(swapchainPolicy, *surfaceCapabilities, *surfaceFormats, *surfacePresentModes);
+        swapchain = getSwapchain(*device, physicalDevice, *surface, *surfaceCapabilities, swapchainConfig);
         swapchainImages = getSwapchainImages(*device, *swapchain);
+        debugSwapchainConfig(swapchainConfig, uint32_t(swapchainImages->size()));
+        framePacer->resetSwapchain(swapchain->get());
         swapchainImageViews = getSwapchainImageViews(*device, *swapchain, *swapchainImages, surfaceFormat);
-        depthImage = getDepthImage(*device, physicalDevice, *surfaceCapabilities);
-        depthImageMemory = getDepthImageMemory(*device, physicalDevice, *depthImage);
+        depthImage = getDepthImage(*device, physicalDevice, *surfaceCapabilities, memoryAllocator->hasLazilyAllocatedMemory());
+        depthImageMemory = getDepthImageMemory(*device, *memoryAllocator, *depthImage);
+        debugTransientAttachmentMemory(*device, *depthImageMemory);
         depthImageView = getDepthImageView(*device, *renderPass, *depthImage);
         swapchainFramebufs = getFramebuffers(*device, *renderPass, *swapchainImageViews, *surfaceCapabilities, *depthImageView);
+        frameManager->resetSwapchainImages(uint32_t(swapchainImages->size()));
+        if (commandCache)
+        {
+            commandCache->resetSwapchainImages(uint32_t(swapchainImages->size()));
+        }
+
+        LOG("swapchain recreation: " << hostAllocator.getTotalAllocationCount() - hostAllocationCount << " host allocations");
     };
 
     recreateSwapchain();
 
-    std::shared_ptr<vk::UniqueCommandPool> cmdPool = getCommandPool(*device, queueFamilyIndex);
-    std::shared_ptr<std::vector<vk::UniqueCommandBuffer>> cmdBufs = getCommandBuffer(*device, *cmdPool);
+    // 描画の一覧
+    // 0番の頂点バッファは静的な頂点バッファ、1番は毎フレーム色を書き換える頂点バッファ
+    // 環境変数VULKAN_TEST_DRAW_REPEATで2つの立方体を繰り返し描画させ、描画が多い場合のコマンドの記録の負荷を確かめられる
+    uint32_t drawRepeat = 1;
+#if !defined(__ANDROID__)
+    if (const char* value = std::getenv("VULKAN_TEST_DRAW_REPEAT"))
+    {
+        drawRepeat = std::max<uint32_t>(uint32_t(std::strtoul(value, nullptr, 10)), 1);
+    }
+#endif
+    std::vector<DrawItem> drawList;
+    drawList.reserve(drawRepeat * 2);
+    for (uint32_t i = 0; i < drawRepeat; i++)
+    {
+        drawList.push_back(DrawItem{ 0, 0 });
+        drawList.push_back(DrawItem{ 1, 1 });
+    }
+    LOG("draws: " << drawList.size());
+
+    // 描画の一覧のfirstからlastの手前までを記録する
+    // セカンダリコマンドバッファに記録する場合は複数のスレッドから同時に呼ばれるので、
+    // プッシュ定数はグローバルのobjectDataではなくローカルの値から送る
+    auto recordDraws = [&](vk::CommandBuffer recordCmdBuf, uint32_t first, uint32_t last, uint32_t sceneDataOffset)
+    {
+        vk::Buffer drawVertexBufs[2] = { vertexBuf->get(), dynamicVertexBuf->getBuffer() };
+
+        recordCmdBuf.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline->get());
+        recordCmdBuf.bindIndexBuffer(indexBuf->get(), 0, vk::IndexType::eUint16);
+        // コマンドキャッシュもセカンダリコマンドバッファもフレームごとなので、そのフレームのデスクリプタセットを使う
+        vk::DescriptorSet descSet = (*descSets)[frameManager->getCurrentFrameIndex()].get();
+        recordCmdBuf.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, descpriptorPipelineLayout->get(), 0, { descSet }, { sceneDataOffset });
+
+        // 頂点バッファは前の描画と違う場合だけバインドし直す
+        uint32_t boundVertexBufferIndex = UINT32_MAX;
+        for (uint32_t i = first; i < last; i++)
+        {
+            const DrawItem& drawItem = drawList[i];
+            if (drawItem.vertexBufferIndex != boundVertexBufferIndex)
+            {
+                recordCmdBuf.bindVertexBuffers(0, { drawVertexBufs[drawItem.vertexBufferIndex] }, { 0 });
+                boundVertexBufferIndex = drawItem.vertexBufferIndex;
+            }
+
+            ObjectData drawObjectData;
+            drawObjectData.id = drawItem.objectId;
+            recordCmdBuf.pushConstants(descpriptorPipelineLayout->get(), vk::ShaderStageFlagBits::eVertex, 0, sizeof(ObjectData), &drawObjectData);
+            recordCmdBuf.drawIndexed(indices.size(), 1, 0, 0, 0);
+        }
+    };
+
+    // レンダーパスの開始から描画までを記録する
+    // 静的なシーンではこの内容はフレームごとに変わらないので、コマンドキャッシュが有効なら記録したものを使い回す
+    // parallelがtrueなら、描画は複数のスレッドでセカンダリコマンドバッファに記録し、レンダーパスの中でそれらを実行する
+    auto recordScene = [&](vk::CommandBuffer recordCmdBuf, uint32_t imgIndex, uint32_t sceneDataOffset, bool assetsReady, bool parallel)
+    {
+        vk::ClearValue clearVal[2];
+        clearVal[0].color.float32[0] = 0.0f;
+        clearVal[0].color.float32[1] = 0.0f;
+        clearVal[0].color.float32[2] = 0.0f;
+        clearVal[0].color.float32[3] = 1.0f;
+
+        // 深度バッファの値は最初は1.0fにクリアされている必要がある
+        // 手前かどうかを判定するためのものなので、初期値は何よりも遠くになっていなければならない
+        // クリッピングにより1.0より遠くは描画されないので、1.0より大きい値でクリアする必要はない
+        clearVal[1].depthStencil.depth = 1.0f;
+
+        vk::RenderPassBeginInfo renderpassBeginInfo;
+        renderpassBeginInfo.renderPass = renderPass->get();
+        renderpassBeginInfo.framebuffer = (*swapchainFramebufs)[imgIndex].get();
+        renderpassBeginInfo.renderArea = vk::Rect2D({ 0,0 }, surfaceCapabilities->currentExtent);
+        renderpassBeginInfo.clearValueCount = 2;
+        renderpassBeginInfo.pClearValues = clearVal;
 
-    vk::SemaphoreCreateInfo semaphoreCreateInfo;
+        // eSecondaryCommandBuffersで開始したサブパスの中では、executeCommands以外のコマンドは記録できない
+        bool executeSecondaries = parallel && assetsReady && !drawList.empty();
+        recordCmdBuf.beginRenderPass(renderpassBeginInfo, executeSecondaries ? vk::SubpassContents::eSecondaryCommandBuffers : vk::SubpassContents::eInline);
 
-    vk::UniqueSemaphore swapchainImgSemaphore = device->get().createSemaphoreUnique(semaphoreCreateInfo);
-    vk::UniqueSemaphore imgRenderedSemaphore = device->get().createSemaphoreUnique(semaphoreCreateInfo);
+        if (executeSecondaries)
+        {
+            vk::CommandBufferInheritanceInfo inheritanceInfo;
+            inheritanceInfo.renderPass = renderPass->get();
+            inheritanceInfo.subpass = 0;
+            inheritanceInfo.framebuffer = (*swapchainFramebufs)[imgIndex].get();
+
+            const std::vector<vk::CommandBuffer>& secondaryCmdBufs = parallelRecorder->record(frameManager->getCurrentFrameIndex(), inheritanceInfo, uint32_t(drawList.size()),
+                [&](vk::CommandBuffer secondaryCmdBuf, uint32_t first, uint32_t last)
+                {
+                    recordDraws(secondaryCmdBuf, first, last, sceneDataOffset);
+                });
+            recordCmdBuf.executeCommands(secondaryCmdBufs);
+        }
+        else if (assetsReady)
+        {
+            recordDraws(recordCmdBuf, 0, uint32_t(drawList.size()), sceneDataOffset);
+        }
 
-    vk::FenceCreateInfo fenceCreateInfo;
-    fenceCreateInfo.flags = vk::FenceCreateFlagBits::eSignaled;
-    vk::UniqueFence imgRenderedFence = device->get().createFenceUnique(fenceCreateInfo);
+        recordCmdBuf.endRenderPass();
+    };
 
-    int deltaTime = 0;
-    std::chrono::system_clock::time_point sT;
+    uint64_t frameCount = 0;
+    // F12かSIGUSR1でメモリレポートを書き出す
+    requestMemoryReportOnSignal();
+    bool reportKeyWasPressed = false;
+    bool policyKeyWasPressed = false;
+    bool frameStatsKeyWasPressed = false;
+    // 環境変数VULKAN_TEST_MAX_FRAMESを指定すると、そのフレーム数で終了する
+    // VULKAN_TEST_ALLOCATION_CHECKと合わせて、確保が無いことを自動で確かめるのに使う
+    uint64_t maxFrames = 0;
+#if !defined(__ANDROID__)
+    if (const char* value = std::getenv("VULKAN_TEST_MAX_FRAMES"))
+    {
+        maxFrames = std::strtoull(value, nullptr, 10);
+    }
+#endif
 
     while (!glfwWindowShouldClose(window.get()))
     {
-        sT = std::chrono::system_clock::now();
-        
+        frameAllocationCheck->beginFrame();
+        frameTimeStats->beginFrame();
+
+        // 入力を読む前に、フレームレートの制限と前のフレームの表示を待つ
+        float deltaTime = framePacer->beginFrame();
+
         glfwPollEvents();
 
-        vk::Result waitForFencesResult = device->get().waitForFences({ imgRenderedFence.get() }, VK_TRUE, UINT64_MAX);
-        if (waitForFencesResult != vk::Result::eSuccess)
+        // 前回このフレームを使った時のGPUでの処理が終わるまで待つ
+        // 他のフレームはGPUで処理中のままでよいので、その間にこのフレームを記録できる
+        std::chrono::steady_clock::time_point fenceWaitBegin = std::chrono::steady_clock::now();
+        FrameResources& frame = frameManager->beginFrame();
+        frameTimeStats->record(FrameTimeMetric::FenceWait, fenceWaitBegin);
+        vk::CommandBuffer cmdBuf = frame.cmdBuf.get();
+
+        frameCount++;
+        memoryAllocator->setCurrentFrame(frameCount);
+        residencyManager->setCurrentFrame(frameCount);
+        frameArena->beginFrame(frameManager->getCurrentFrameIndex());
+        if (!uploadService)
         {
-            LOGERR("Failed to get next frame");
-            return EXIT_FAILURE;
+            // 完了したアップロードのコピー元を解放する
+            stagingRing->collect();
+        }
+
+        // デフラグ中は移動中のリソースを破棄できないので、追い出しと読み込み直しはデフラグが終わってから行う
+        // 前のセマフォがまだ待たれていない間は、ステージングリングでの読み込み直しを送信できない
+        if (assetsSettled && !waitForUpload && !defragmenter->isRunning())
+        {
+            if (residencyManager->update(frameCount))
+            {
+                frameAllocationCheck->skipFrame();
+            }
+            if (restoreBatchPending)
+            {
+                // 起動時と同じく、このフレームの描画にセマフォを待たせて所有権を受け取る
+                uploadBatch.submit(uploadSemaphore.get());
+                waitForUpload = true;
+                restoreBatchPending = false;
+                assetsSettled = false;
+            }
+        }
+
+        // 空き領域が細切れになってきたメモリタイプがあればデフラグを始める
+        // 始めるフレームは移動するリソースの一覧を作るので確保が起きる
+        if (assetsSettled && !defragmenter->isRunning() && defragmenter->begin())
+        {
+            frameAllocationCheck->skipFrame();
+        }
+        {
+            // デフラグのコピーもキューに送信する
+            // 移動先のリソースを作るか入れ替えたフレームは、リソースの作り直しなので数えない
+            // コピーの完了を待っているだけのフレームは数える
+            std::lock_guard<std::mutex> queueLock(queueMutex);
+            if (defragmenter->update(frameCount))
+            {
+                frameAllocationCheck->skipFrame();
+            }
+        }
+        // このフレームのフェンスは待ったので、このフレームのデスクリプタセットを使うコマンドはもう無い
+        // 古いイメージビューを指していれば書き換える
+        uint32_t frameIndex = frameManager->getCurrentFrameIndex();
+        if (descSetVersions[frameIndex] != texImageViewVersion && !texImageEvicted)
+        {
+            writeDescriptorSet(*device, (*descSets)[frameIndex].get(), *frameArena, *texImageView, *texSampler);
+            descSetVersions[frameIndex] = texImageViewVersion;
         }
 
-        vk::ResultValue acquireImgResult = device->get().acquireNextImageKHR(swapchain->get(), UINT64_MAX, swapchainImgSemaphore.get());
+        bool reportKeyPressed = glfwGetKey(window.get(), GLFW_KEY_F12) == GLFW_PRESS;
+        if (reportKeyPressed && !reportKeyWasPressed)
+        {
+            requestMemoryReport();
+        }
+        reportKeyWasPressed = reportKeyPressed;
+
+        // F10でスワップチェーンのプリセットを切り替える
+        bool policyKeyPressed = glfwGetKey(window.get(), GLFW_KEY_F10) == GLFW_PRESS;
+        if (policyKeyPressed && !policyKeyWasPressed)
+        {
+            swapchainPolicy = getNextSwapchainPolicy(swapchainPolicy);
+            LOG("swapchain policy: " << toString(swapchainPolicy));
+            recreateSwapchain();
+        }
+        policyKeyWasPressed = policyKeyPressed;
+        if (consumeMemoryReportRequest())
+        {
+            frameAllocationCheck->skipFrame();
+            exportMemoryReport(*memoryAllocator);
+        }
+
+        // F9でフレームの時間の統計を書き出す
+        bool frameStatsKeyPressed = glfwGetKey(window.get(), GLFW_KEY_F9) == GLFW_PRESS;
+        if (frameStatsKeyPressed && !frameStatsKeyWasPressed)
+        {
+            frameAllocationCheck->skipFrame();
+            exportFrameTimeStats(*frameTimeStats, frameTimeStatsCsv);
+        }
+        frameStatsKeyWasPressed = frameStatsKeyPressed;
+
+        // eErrorOutOfDateKHRはvulkan.hppでは例外になるので、戻り値に直して同じように扱う
+        std::chrono::steady_clock::time_point acquireBegin = std::chrono::steady_clock::now();
+        vk::Result acquireResult;
+        uint32_t imgIndex = 0;
+        try
+        {
+            vk::ResultValue acquireImgResult = device->get().acquireNextImageKHR(swapchain->get(), UINT64_MAX, frame.imageAcquiredSemaphore.get());
+            acquireResult = acquireImgResult.result;
+            imgIndex = acquireImgResult.value;
+        }
+        catch (const vk::OutOfDateKHRError&)
+        {
+            acquireResult = vk::Result::eErrorOutOfDateKHR;
+        }
+        frameTimeStats->record(FrameTimeMetric::Acquire, acquireBegin);
 
         // 再作成処理
-        if(acquireImgResult.result == vk::Result::eSuboptimalKHR || acquireImgResult.result == vk::Result::eErrorOutOfDateKHR) 
+        // eErrorOutOfDateKHRではイメージは取得されず、セマフォもシグナルされないので、このフレームは描画せずにやり直す
+        if (acquireResult == vk::Result::eErrorOutOfDateKHR)
         {
-            LOGERR("Recreate swapchain : " << to_string(acquireImgResult.result));
+            LOGERR("Recreate swapchain : " << to_string(acquireResult));
             recreateSwapchain();
             continue;
         }
-        if (acquireImgResult.result != vk::Result::eSuccess)
+        // eSuboptimalKHRではイメージは取得されていて、セマフォもシグナルされる
+        // ここでやり直すと誰も待たないセマフォが残り、次にこのフレームを使う時のイメージの取得が不正になるので、
+        // 描画して表示してから作り直す
+        bool recreateAfterPresent = acquireResult == vk::Result::eSuboptimalKHR;
+        if (acquireResult != vk::Result::eSuccess && !recreateAfterPresent)
         {
             LOGERR("Failed to get next frame");
             return EXIT_FAILURE;
         }
 
-        device->get().resetFences({ imgRenderedFence.get() });
-        
-        writeUniformBuffer(pUniformBufMem, *device, *uniformBufMem, screenWidth, screenHeight, deltaTime);
-        
-        uint32_t imgIndex = acquireImgResult.value;
+        framePacer->markAcquired();
+        // 送信するまでフェンスはリセットしない
+        // 上でcontinueした場合に、次にこのフレームを使う時に永遠に待つことになるため
+        frameManager->beginImage(imgIndex);
+
+        uint32_t sceneDataOffset = writeUniformBuffer(*frameArena, screenWidth, screenHeight, deltaTime);
     
-        (*cmdBufs)[0]->reset();
+        cmdBuf.reset();
     
         vk::CommandBufferBeginInfo cmdBeginInfo;
-        (*cmdBufs)[0]->begin(cmdBeginInfo);
-        
-        vk::ClearValue clearVal[2];
-        clearVal[0].color.float32[0] = 0.0f;
-        clearVal[0].color.float32[1] = 0.0f;
-        clearVal[0].color.float32[2] = 0.0f;
-        clearVal[0].color.float32[3] = 1.0f;
-
-        // 深度バッファの値は最初は1.0fにクリアされている必要がある
-        // 手前かどうかを判定するためのものなので、初期値は何よりも遠くになっていなければならない
-        // クリッピングにより1.0より遠くは描画されないので、1.0より大きい値でクリアする必要はない
-        clearVal[1].depthStencil.depth = 1.0f;
+        cmdBuf.begin(cmdBeginInfo);
 
-        vk::RenderPassBeginInfo renderpassBeginInfo;
-        renderpassBeginInfo.renderPass = renderPass->get();
-        renderpassBeginInfo.framebuffer = (*swapchainFramebufs)[imgIndex].get();
-        renderpassBeginInfo.renderArea = vk::Rect2D({ 0,0 }, surfaceCapabilities->currentExtent);
-        renderpassBeginInfo.clearValueCount = 2;
-        renderpassBeginInfo.pClearValues = clearVal;
-
-        (*cmdBufs)[0]->beginRenderPass(renderpassBeginInfo, vk::SubpassContents::eInline);
+        // 転送専用のキューでアップロードした場合、最初のフレームで所有権をグラフィックスのキューに移す
+        if (waitForUpload)
+        {
+            uploadBatch.recordAcquireBarriers(cmdBuf);
+        }
 
-        (*cmdBufs)[0]->bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline->get());
-        (*cmdBufs)[0]->bindVertexBuffers(0, { vertexBuf->get() }, { 0 }); 
-        (*cmdBufs)[0]->bindIndexBuffer(indexBuf->get(), 0, vk::IndexType::eUint16);
-        (*cmdBufs)[0]->bindDescriptorSets(vk::PipelineBindPoint::eGraphics, descpriptorPipelineLayout->get(), 0, { (*descSets)[0].get() }, {});
+        // アップロードサービスが送信済みのものは、所有権を移してタイムラインセマフォの値を待つ
+        // 先に送信済みかどうかを調べてからacquireすることで、描画に使うものは必ずアクワイアされている
+        bool assetsReady = !uploadService || (uploadService->isSubmitted(vertexBufUpload) && uploadService->isSubmitted(indexBufUpload) && uploadService->isSubmitted(texImageUpload));
+        // テクスチャが追い出されている間や、確認のためにシーンを隠している間も描画しない
+        bool sceneVisible = !assetsRegistered || residencyCheck->update(frameCount);
+        bool drawReady = assetsReady && !texImageEvicted && sceneVisible;
+        vk::PipelineStageFlags uploadWaitStages;
+        uint64_t uploadWaitValue = 0;
+        if (uploadService)
+        {
+            uploadWaitValue = uploadService->acquire(cmdBuf, uploadWaitStages);
+        }
 
-        writePushConstant(0);
-        (*cmdBufs)[0]->pushConstants(descpriptorPipelineLayout->get(), vk::ShaderStageFlagBits::eVertex, 0, sizeof(ObjectData), &objectData);
-        (*cmdBufs)[0]->drawIndexed(indices.size(), 1, 0, 0, 0);
+        // 手前の面の2つの頂点の色だけを明滅させる
+        // 書き換えるのは色の部分だけなので、送るのは頂点バッファ全体のごく一部になる
+        float pulse = 0.5f + 0.5f * std::sin(frameCount * 0.05f);
+        Vec3 pulseColor{ pulse, pulse, 1.0f };
+        dynamicVertexBuf->write(sizeof(Vertex) * 0 + offsetof(Vertex, color), &pulseColor, sizeof(Vec3));
+        dynamicVertexBuf->write(sizeof(Vertex) * 1 + offsetof(Vertex, color), &pulseColor, sizeof(Vec3));
+        dynamicVertexBuf->recordUpdate(cmdBuf, *frameArena, vk::PipelineStageFlagBits::eVertexInput, vk::AccessFlagBits::eVertexAttributeRead);
         
-        writePushConstant(1);
-        (*cmdBufs)[0]->pushConstants(descpriptorPipelineLayout->get(), vk::ShaderStageFlagBits::eVertex, 0, sizeof(ObjectData), &objectData);
-        (*cmdBufs)[0]->drawIndexed(indices.size(), 1, 0, 0, 0);
-    
-        (*cmdBufs)[0]->endRenderPass();
+        // まだ送信されていなければクリアだけして、描画はループを止めずに次のフレームに回す
+        // 実際に描画するフレームだけ触れ、描画したいのに追い出されていて描画できなければ読み込み直しを求める
+        // シーンを隠している間はどちらもしないので、使われていないリソースとして追い出される
+        if (assetsRegistered && drawReady)
+        {
+            residencyManager->touch(vertexBufResidency);
+            residencyManager->touch(indexBufResidency);
+            residencyManager->touch(texImageResidency);
+        }
+        else if (assetsRegistered && sceneVisible)
+        {
+            residencyManager->request(vertexBufResidency);
+            residencyManager->request(indexBufResidency);
+            residencyManager->request(texImageResidency);
+        }
 
-        (*cmdBufs)[0]->end();
+        // ここまでのバリアやコピーは毎フレーム記録し、レンダーパスの部分はキャッシュしたものを後ろに続けて送信する
+        // 同じ送信の中のコマンドバッファは順番に実行されるので、バリアはそのままレンダーパスの描画にも効く
+        vk::CommandBuffer sceneCmdBuf;
+        if (commandCache)
+        {
+            cmdBuf.end();
+            // 記録する内容が変わるのは、ダイナミックオフセットと描画するかどうかだけ
+            uint64_t sceneKey = (uint64_t(sceneDataOffset) << 1) | (drawReady ? 1 : 0);
+            sceneCmdBuf = commandCache->get(frameManager->getCurrentFrameIndex(), imgIndex, sceneKey, [&](vk::CommandBuffer recordCmdBuf)
+            {
+                recordScene(recordCmdBuf, imgIndex, sceneDataOffset, drawReady, false);
+            });
+        }
+        else
+        {
+            // 並列に記録した場合とVULKAN_TEST_RECORD_THREADS=0で1つのスレッドで記録した場合とを、この区間で比べる
+            std::chrono::steady_clock::time_point recordBegin = std::chrono::steady_clock::now();
+            recordScene(cmdBuf, imgIndex, sceneDataOffset, drawReady, parallelRecorder != nullptr);
+            frameTimeStats->record(FrameTimeMetric::Record, recordBegin);
+            cmdBuf.end();
+        }
+
+        frameArena->flush();
         
-        vk::CommandBuffer submitCmdBuf[1] = { (*cmdBufs)[0].get() };
+        vk::CommandBuffer submitCmdBuf[2] = { cmdBuf, sceneCmdBuf };
         vk::SubmitInfo submitInfo;
-        submitInfo.commandBufferCount = 1;
+        submitInfo.commandBufferCount = sceneCmdBuf ? 2 : 1;
         submitInfo.pCommandBuffers = submitCmdBuf;
 
         // 待機するセマフォの指定
-        vk::Semaphore renderwaitSemaphores[] = { swapchainImgSemaphore.get() };
-        vk::PipelineStageFlags renderwaitStages[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
+        // 最初のフレームだけは起動時のアップロードの完了も待つ
+        // アップロードサービスを使っている場合は、新しく送信されたもののタイムラインの値を待つ
+        vk::Semaphore renderwaitSemaphores[2] = { frame.imageAcquiredSemaphore.get() };
+        vk::PipelineStageFlags renderwaitStages[2] = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
+        // バイナリのセマフォの値は無視される
+        uint64_t renderwaitValues[2] = { 0 };
         submitInfo.waitSemaphoreCount = 1;
+        if (waitForUpload)
+        {
+            renderwaitSemaphores[1] = uploadSemaphore.get();
+            renderwaitStages[1] = vk::PipelineStageFlagBits::eVertexInput | vk::PipelineStageFlagBits::eFragmentShader;
+            submitInfo.waitSemaphoreCount = 2;
+        }
+        vk::TimelineSemaphoreSubmitInfo timelineSubmitInfo;
+        if (uploadWaitValue != 0)
+        {
+            renderwaitSemaphores[1] = uploadService->getTimelineSemaphore();
+            renderwaitStages[1] = uploadWaitStages;
+            renderwaitValues[1] = uploadWaitValue;
+            submitInfo.waitSemaphoreCount = 2;
+            timelineSubmitInfo.waitSemaphoreValueCount = 2;
+            timelineSubmitInfo.pWaitSemaphoreValues = renderwaitValues;
+            submitInfo.pNext = &timelineSubmitInfo;
+        }
         submitInfo.pWaitSemaphores = renderwaitSemaphores;
         submitInfo.pWaitDstStageMask = renderwaitStages;
 
         // 完了時にシグナル状態にするセマフォを指定
-        vk::Semaphore renderSignalSemaphores[] = { imgRenderedSemaphore.get() };
+        // 表示がこのセマフォを待ち終わるのは同じイメージが次に取得できた時なので、イメージごとのものを使う
+        vk::Semaphore renderSignalSemaphores[] = { frameManager->getRenderFinishedSemaphore(imgIndex) };
         submitInfo.signalSemaphoreCount = 1;
         submitInfo.pSignalSemaphores = renderSignalSemaphores;
 
-        graphicsQueue.submit({ submitInfo }, imgRenderedFence.get());
+        std::chrono::steady_clock::time_point submitBegin = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> queueLock(queueMutex);
+        graphicsQueue.submit({ submitInfo }, frame.inFlightFence.get());
+        frameTimeStats->record(FrameTimeMetric::Submit, submitBegin);
+        waitForUpload = false;
     
         vk::PresentInfoKHR presentInfo;
 
-        std::vector<vk::SwapchainKHR> presentSwapchains = { swapchain->get() };
-        std::vector<uint32_t> imgIndices = { imgIndex };
+        // 毎フレームvectorを作ると確保が起きるので、配列を使う
+        vk::SwapchainKHR presentSwapchains[] = { swapchain->get() };
+        uint32_t imgIndices[] = { imgIndex };
         
-        presentInfo.swapchainCount = presentSwapchains.size();
-        presentInfo.pSwapchains = presentSwapchains.data();
-        presentInfo.pImageIndices = imgIndices.data();
+        presentInfo.swapchainCount = 1;
+        presentInfo.pSwapchains = presentSwapchains;
+        presentInfo.pImageIndices = imgIndices;
 
         // 待機するセマフォの指定
-        vk::Semaphore presenWaitSemaphores[] = { imgRenderedSemaphore.get() };
+        vk::Semaphore presenWaitSemaphores[] = { frameManager->getRenderFinishedSemaphore(imgIndex) };
         presentInfo.waitSemaphoreCount = 1;
         presentInfo.pWaitSemaphores = presenWaitSemaphores;
+
+        // 表示を待てるように番号を付ける
+        framePacer->setPresentId(presentInfo);
         
-        vk::Result presentResult = graphicsQueue.presentKHR(presentInfo);
+        std::chrono::steady_clock::time_point presentBegin = std::chrono::steady_clock::now();
+        vk::Result presentResult;
+        try
+        {
+            presentResult = graphicsQueue.presentKHR(presentInfo);
+        }
+        catch (const vk::OutOfDateKHRError&)
+        {
+            presentResult = vk::Result::eErrorOutOfDateKHR;
+        }
+        queueLock.unlock();
+        frameTimeStats->record(FrameTimeMetric::Present, presentBegin);
+        framePacer->markPresented();
 
-        if (presentResult != vk::Result::eSuccess)
+        // 表示モードを切り替えた直後などはeSuboptimalKHRやeErrorOutOfDateKHRが返るので、終了せずに作り直す
+        if (presentResult == vk::Result::eSuboptimalKHR || presentResult == vk::Result::eErrorOutOfDateKHR)
+        {
+            recreateAfterPresent = true;
+        }
+        else if (presentResult != vk::Result::eSuccess)
         {
             LOGERR("Failed to get next frame");
             return EXIT_FAILURE;
         }
 
-        deltaTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - sT).count();
-    }
+        // 起動時と読み込み直しのアップロードの所有権を受け取るコマンドを送信した後で、デフラグで動かしたり追い出したりできるようにする
+        // 次のフレームからのデフラグのコピーは、送信順でこのフレームのバリアの後になる
+        if (assetsReady && !assetsSettled)
+        {
+            assetsSettled = true;
+            if (!assetsRegistered)
+            {
+                frameAllocationCheck->skipFrame();
+                registerAssets();
+            }
+        }
 
-    unmapUniformBuffer(*device, *uniformBufMem);
+        if (recreateAfterPresent)
+        {
+            LOGERR("Recreate swapchain : " << to_string(acquireResult != vk::Result::eSuccess ? acquireResult : presentResult));
+            recreateSwapchain();
+        }
+
+        frameTimeStats->endFrame(frameCount);
+        frameAllocationCheck->endFrame(frameCount);
+        if (maxFrames != 0 && frameCount >= maxFrames)
+        {
+            glfwSetWindowShouldClose(window.get(), GLFW_TRUE);
+        }
+    }
 
+    // サービスのスレッドを止めてからキューを待つ
+    if (uploadService)
+    {
+        debugUploadService(*uploadService);
+        uploadService.reset();
+    }
     graphicsQueue.waitIdle();
+    debugMemoryAllocatorStats(*memoryAllocator);
+    debugDefragmentationStats(*defragmenter);
+    debugFrameManager(*frameManager);
+    debugFramePacer(*framePacer);
+    debugResidency(*residencyManager);
+    bool residencyCheckPassed = residencyCheck->check();
+    debugFrameAllocationCheck(*frameAllocationCheck);
+    debugFrameTimeStats(*frameTimeStats);
+    exportFrameTimeStats(*frameTimeStats, frameTimeStatsCsv);
+    if (commandCache)
+    {
+        debugCommandCache(*commandCache);
+    }
+    bool parallelRecordCheckPassed = true;
+    if (parallelRecorder)
+    {
+        debugParallelRecorder(*parallelRecorder);
+        parallelRecordCheckPassed = checkParallelRecorder(*parallelRecorder, uint32_t(drawList.size()));
+    }
+    debugFrameArena(*frameArena);
+    debugDynamicBuffer(*dynamicVertexBuf);
+    debugHostAllocator(hostAllocator);
+    debugStagingRing(*stagingRing);
+    debugHostMemoryImporter(*hostMemoryImporter);
+    debugHostImageCopier(*hostImageCopier);
     glfwTerminate();
 
-    return EXIT_SUCCESS;
+    return residencyCheckPassed && parallelRecordCheckPassed ? EXIT_SUCCESS : EXIT_FAILURE;
 }
\ No newline at end of file
@@ -0,0 +1,329 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vulkan/vulkan.hpp>
+#include "../include/Utility.hpp"
+#include "../include/Debug.hpp"
+#include "../include/Instance.hpp"
+#include "../include/PhysicalDevice.hpp"
+#include "../include/Device.hpp"
+#include "../include/Memory.hpp"
+#include "../include/TransientResources.hpp"
+
+using namespace Vulkan_Test;
+
+// メモリの確保の仕方を変えた時に、どれだけデバイスメモリが減ったかを確かめる
+// ウィンドウもサーフェスも作らないので、lavapipeのようなCPUで動く実装でも動き、GPUの無いCIでも実行できる
+//
+// 使い方: memory_benchmark [--width <幅>] [--height <高さ>] [--buffers <数>] [--device <番号>]
+//
+// バッファのサブアロケーション: 256バイトから64KBまでの小さなバッファを(既定では)10000個MemoryAllocatorで確保し、
+// allocateMemoryを呼んだ回数をバッファの数と比べる リソースごとにallocateMemoryしていれば、多くのデバイスの上限(4096程度)を超える数
+// 続けて、半分をアップロードのスレッドのように別のスレッドで解放しながら、同じ数をもう一度確保する
+// allocateMemoryの回数がmaxMemoryAllocationCountに達したり、生きている確保の数が合わなかったりしたら失敗にする
+//
+// 中間イメージのエイリアシング: 影、Gバッファ、ライティング、ブルーム、トーンマップのパスを持つフレームの中間イメージを
+// TransientResourcePoolに置き、期間の重ならないものを重ねた場合と、全て別の場所に置いた場合とで確保した量を比べる
+// 重ねた場所を期間の重なるイメージが使っていたり、重ねた方が多く確保していたりしたら失敗にする
+
+struct BenchmarkOptions
+{
+    uint32_t width = 1920;
+    uint32_t height = 1080;
+    uint32_t bufferCount = 10000;
+    uint32_t deviceIndex = 0;
+};
+
+bool parseBenchmarkOptions(int argc, char** argv, BenchmarkOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--width" && i + 1 < argc)
+        {
+            options.width = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--height" && i + 1 < argc)
+        {
+            options.height = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--buffers" && i + 1 < argc)
+        {
+            options.bufferCount = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--device" && i + 1 < argc)
+        {
+            options.deviceIndex = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else
+        {
+            LOGERR("Unknown argument: " << arg);
+            return false;
+        }
+    }
+    if (options.width < 4 || options.height < 4)
+    {
+        LOGERR("--width and --height must be at least 4.");
+        return false;
+    }
+    return true;
+}
+
+vk::ImageCreateInfo getTransientImageCreateInfo(uint32_t width, uint32_t height, vk::Format format, vk::ImageUsageFlags usage)
+{
+    vk::ImageCreateInfo imgCreateInfo;
+    imgCreateInfo.imageType = vk::ImageType::e2D;
+    imgCreateInfo.extent = vk::Extent3D(width, height, 1);
+    imgCreateInfo.mipLevels = 1;
+    imgCreateInfo.arrayLayers = 1;
+    imgCreateInfo.format = format;
+    imgCreateInfo.tiling = vk::ImageTiling::eOptimal;
+    imgCreateInfo.initialLayout = vk::ImageLayout::eUndefined;
+    imgCreateInfo.usage = usage;
+    imgCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+    imgCreateInfo.samples = vk::SampleCountFlagBits::e1;
+    return imgCreateInfo;
+}
+
+void declareColorImage(TransientResourcePool& pool, const std::string& name, uint32_t width, uint32_t height, vk::Format format, uint32_t firstPass, uint32_t lastPass)
+{
+    TransientImageDesc desc;
+    desc.name = name;
+    desc.createInfo = getTransientImageCreateInfo(width, height, format, vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eSampled);
+    desc.firstPass = firstPass;
+    desc.lastPass = lastPass;
+    desc.initialLayout = vk::ImageLayout::eColorAttachmentOptimal;
+    desc.aspect = vk::ImageAspectFlagBits::eColor;
+    desc.stages = vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eFragmentShader;
+    desc.access = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eShaderRead;
+    pool.declareImage(desc);
+}
+
+void declareDepthImage(TransientResourcePool& pool, const std::string& name, uint32_t width, uint32_t height, uint32_t firstPass, uint32_t lastPass)
+{
+    TransientImageDesc desc;
+    desc.name = name;
+    desc.createInfo = getTransientImageCreateInfo(width, height, vk::Format::eD32Sfloat, vk::ImageUsageFlagBits::eDepthStencilAttachment | vk::ImageUsageFlagBits::eSampled);
+    desc.firstPass = firstPass;
+    desc.lastPass = lastPass;
+    desc.initialLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+    desc.aspect = vk::ImageAspectFlagBits::eDepth;
+    desc.stages = vk::PipelineStageFlagBits::eEarlyFragmentTests | vk::PipelineStageFlagBits::eLateFragmentTests | vk::PipelineStageFlagBits::eFragmentShader;
+    desc.access = vk::AccessFlagBits::eDepthStencilAttachmentWrite | vk::AccessFlagBits::eShaderRead;
+    pool.declareImage(desc);
+}
+
+// パスの番号
+// 0: 影 1: Gバッファ 2: ライティング 3: ブルームの縮小 4: ブルームのぼかし 5: トーンマップ
+// aliasingがfalseなら全てのイメージを全てのパスで使うことにして、どれも重ならないようにする
+void declareFrameImages(TransientResourcePool& pool, uint32_t width, uint32_t height, bool aliasing)
+{
+    const uint32_t lastPass = 5;
+    auto first = [&](uint32_t pass) { return aliasing ? pass : 0; };
+    auto last = [&](uint32_t pass) { return aliasing ? pass : lastPass; };
+
+    declareDepthImage(pool, "shadow map", 2048, 2048, first(0), last(2));
+    declareColorImage(pool, "gbuffer albedo", width, height, vk::Format::eR8G8B8A8Unorm, first(1), last(2));
+    declareColorImage(pool, "gbuffer normal", width, height, vk::Format::eR16G16B16A16Sfloat, first(1), last(2));
+    declareDepthImage(pool, "gbuffer depth", width, height, first(1), last(2));
+    declareColorImage(pool, "hdr color", width, height, vk::Format::eR16G16B16A16Sfloat, first(2), last(5));
+    declareColorImage(pool, "bloom half", width / 2, height / 2, vk::Format::eR16G16B16A16Sfloat, first(3), last(4));
+    declareColorImage(pool, "bloom blur", width / 2, height / 2, vk::Format::eR16G16B16A16Sfloat, first(4), last(5));
+    declareColorImage(pool, "ldr color", width, height, vk::Format::eR8G8B8A8Unorm, first(5), last(5));
+}
+
+// 期間の重なるイメージ同士がメモリを共有していないこと
+bool isValidPlacement(const TransientResourcePool& pool)
+{
+    bool result = true;
+    for (uint32_t a = 0; a < pool.getImageCount(); a++)
+    {
+        for (uint32_t b = a + 1; b < pool.getImageCount(); b++)
+        {
+            const TransientImageDesc& descA = pool.getDesc(a);
+            const TransientImageDesc& descB = pool.getDesc(b);
+            bool overlappingInTime = descA.firstPass <= descB.lastPass && descB.firstPass <= descA.lastPass;
+            if (overlappingInTime && pool.isSharingMemory(a, b))
+            {
+                LOGERR(descA.name << " and " << descB.name << " share memory while both are in use.");
+                result = false;
+            }
+        }
+    }
+    return result;
+}
+
+// 宣言したイメージを配置して、アロケータが実際に確保したデバイスメモリの量を返す
+vk::DeviceSize buildTransientResources(TransientResourcePool& pool, MemoryAllocator& allocator)
+{
+    vk::DeviceSize blockBytes = allocator.getStats().blockBytes;
+    pool.build();
+    return allocator.getStats().blockBytes - blockBytes;
+}
+
+bool runTransientAliasingBenchmark(vk::UniqueDevice& device, MemoryAllocator& allocator, const BenchmarkOptions& options)
+{
+    std::shared_ptr<TransientResourcePool> pool = getTransientResourcePool(device, allocator);
+
+    declareFrameImages(*pool, options.width, options.height, false);
+    vk::DeviceSize unaliasedBytes = buildTransientResources(*pool, allocator);
+    debugTransientResourcePool(*pool);
+    debugMemoryAllocatorStats(allocator);
+    pool->reset();
+
+    declareFrameImages(*pool, options.width, options.height, true);
+    vk::DeviceSize aliasedBytes = buildTransientResources(*pool, allocator);
+    debugTransientResourcePool(*pool);
+    debugMemoryAllocatorStats(allocator);
+    bool valid = isValidPlacement(*pool);
+    pool->reset();
+
+    LOG("----------------------------------------");
+    LOG("Transient Aliasing (" << options.width << "x" << options.height << ")");
+    LOG("peak without aliasing: " << unaliasedBytes << " bytes");
+    LOG("peak with aliasing: " << aliasedBytes << " bytes");
+    if (unaliasedBytes > 0)
+    {
+        LOG("saved: " << unaliasedBytes - std::min(aliasedBytes, unaliasedBytes) << " bytes (" << 100.0 * (1.0 - double(aliasedBytes) / double(unaliasedBytes)) << "%)");
+    }
+
+    if (aliasedBytes > unaliasedBytes)
+    {
+        LOGERR("Aliasing allocated more memory than separate placement.");
+        valid = false;
+    }
+    return valid;
+}
+
+struct BenchmarkBuffer
+{
+    // バッファより後に解放されるように先に宣言する
+    std::shared_ptr<MemoryAllocation> memory;
+    vk::UniqueBuffer buffer;
+};
+
+// 頂点バッファやユニフォームバッファのような小さなバッファ
+// 大きさは256バイトから64KBまでを順に繰り返す
+BenchmarkBuffer createBenchmarkBuffer(vk::UniqueDevice& device, MemoryAllocator& allocator, uint32_t index)
+{
+    vk::BufferCreateInfo bufferCreateInfo;
+    bufferCreateInfo.size = vk::DeviceSize(256) << (index % 9);
+    bufferCreateInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst;
+    bufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+
+    BenchmarkBuffer result;
+    result.buffer = device->createBufferUnique(bufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+    result.memory = allocator.allocate(device->getBufferMemoryRequirements(result.buffer.get()), deviceLocalMemoryRequest(), true);
+    result.memory->setUsage(MemoryUsage::Vertex);
+    device->bindBufferMemory(result.buffer.get(), result.memory->memory, result.memory->offset);
+    return result;
+}
+
+bool runBufferAllocationBenchmark(vk::UniqueDevice& device, vk::PhysicalDevice& physicalDevice, MemoryAllocator& allocator, const BenchmarkOptions& options)
+{
+    uint32_t maxMemoryAllocationCount = physicalDevice.getProperties().limits.maxMemoryAllocationCount;
+    MemoryAllocatorStats statsBefore = allocator.getStats();
+    bool valid = true;
+
+    std::vector<BenchmarkBuffer> buffers(options.bufferCount);
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < options.bufferCount; i++)
+    {
+        buffers[i] = createBenchmarkBuffer(device, allocator, i);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    MemoryAllocatorStats stats = allocator.getStats();
+    uint64_t allocateMemoryCalls = stats.deviceMemoryAllocationCount - statsBefore.deviceMemoryAllocationCount;
+    debugMemoryAllocatorStats(allocator);
+
+    LOG("----------------------------------------");
+    LOG("Buffer Suballocation");
+    LOG("buffers: " << options.bufferCount);
+    LOG("allocateMemory calls: " << allocateMemoryCalls << " (maxMemoryAllocationCount " << maxMemoryAllocationCount << ")");
+    LOG("buffers per allocateMemory: " << (allocateMemoryCalls > 0 ? double(options.bufferCount) / double(allocateMemoryCalls) : 0.0));
+    LOG("create time: " << std::chrono::duration<double, std::milli>(end - begin).count() << " ms");
+
+    if (stats.blockCount >= maxMemoryAllocationCount)
+    {
+        LOGERR("The allocator holds " << stats.blockCount << " device memory allocations, which reaches maxMemoryAllocationCount.");
+        valid = false;
+    }
+
+    // 前半を別のスレッドで解放しながら、同じ数を描画のスレッドで確保する
+    uint32_t releasedCount = options.bufferCount / 2;
+    std::thread releaser([&]()
+    {
+        for (uint32_t i = 0; i < releasedCount; i++)
+        {
+            buffers[i] = BenchmarkBuffer();
+        }
+    });
+    std::vector<BenchmarkBuffer> moreBuffers(releasedCount);
+    for (uint32_t i = 0; i < releasedCount; i++)
+    {
+        moreBuffers[i] = createBenchmarkBuffer(device, allocator, i);
+    }
+    releaser.join();
+
+    size_t liveAllocations = allocator.getStats().allocationCount - statsBefore.allocationCount;
+    LOG("live allocations after concurrent release: " << liveAllocations << " (expected " << options.bufferCount << ")");
+    if (liveAllocations != options.bufferCount)
+    {
+        LOGERR("Live allocation count does not match the number of live buffers.");
+        valid = false;
+    }
+
+    buffers.clear();
+    moreBuffers.clear();
+    if (allocator.getStats().allocationCount != statsBefore.allocationCount)
+    {
+        LOGERR("Allocations are left after releasing every buffer.");
+        valid = false;
+    }
+    return valid;
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkOptions options;
+    if (!parseBenchmarkOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    std::shared_ptr<vk::ApplicationInfo> appInfo = getAppInfo();
+    // サーフェスを作らないので、インスタンスの拡張機能は有効化しない
+    std::shared_ptr<vk::UniqueInstance> instance = getInstance(*appInfo, {});
+
+    std::shared_ptr<std::vector<vk::PhysicalDevice>> physicalDevices = getPhysicalDevices(*instance);
+    if (options.deviceIndex >= physicalDevices->size())
+    {
+        LOGERR("Physical device " << options.deviceIndex << " is not available. (" << physicalDevices->size() << " devices)");
+        return EXIT_FAILURE;
+    }
+    vk::PhysicalDevice physicalDevice = (*physicalDevices)[options.deviceIndex];
+    uint32_t queueFamilyIndex = findGraphicsQueueFamilyIndex(physicalDevice);
+    LOG("device: " << physicalDevice.getProperties().deviceName.data());
+
+    // 影とGバッファの深度はサンプリングもするので、その両方に対応している必要がある
+    vk::FormatFeatureFlags depthFeatures = vk::FormatFeatureFlagBits::eDepthStencilAttachment | vk::FormatFeatureFlagBits::eSampledImage;
+    if ((physicalDevice.getFormatProperties(vk::Format::eD32Sfloat).optimalTilingFeatures & depthFeatures) != depthFeatures)
+    {
+        LOGERR("D32_SFLOAT is not supported as a sampled depth attachment.");
+        return EXIT_FAILURE;
+    }
+
+    std::shared_ptr<vk::UniqueDevice> device = getHeadlessDevice(physicalDevice, queueFamilyIndex, std::nullopt);
+    std::shared_ptr<MemoryAllocator> memoryAllocator = getMemoryAllocator(*device, physicalDevice);
+
+    bool passed = runTransientAliasingBenchmark(*device, *memoryAllocator, options);
+    passed = runBufferAllocationBenchmark(*device, physicalDevice, *memoryAllocator, options) && passed;
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
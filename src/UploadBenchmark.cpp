@@ -0,0 +1,424 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <vulkan/vulkan.hpp>
+#include "../include/Utility.hpp"
+#include "../include/Debug.hpp"
+#include "../include/Instance.hpp"
+#include "../include/PhysicalDevice.hpp"
+#include "../include/Device.hpp"
+#include "../include/Memory.hpp"
+#include "../include/Staging.hpp"
+#include "../include/UploadService.hpp"
+#include "../include/HostImport.hpp"
+#include "../include/HostImageCopy.hpp"
+#include "../include/Texture.hpp"
+#include "../include/HostAllocator.hpp"
+
+using namespace Vulkan_Test;
+
+// アップロードの経路ごとに、4KBから512MBまでの大きさのデータを送る速さを測る
+// ウィンドウもサーフェスも作らないので、lavapipeのようなCPUで動く実装でも動き、GPUの無いCIで性能の低下を見つけられる
+//
+// 使い方: upload_benchmark [--max-size <MB>] [--iterations <回数>] [--device <番号>] [--csv]
+// lavapipeを使う場合はVK_ICD_FILENAMESでそのICDを指定するか、--deviceで選ぶ
+//
+// 表示するのは以下の値
+// MB/s: 1回あたりの平均の所要時間から求めた転送速度
+// latency: 送り始めてからGPUでのコピーが完了するまでの時間(平均、最小、最大)
+// cpu: 呼び出したスレッドが使ったCPU時間の平均 描画のスレッドから送る場合、これがそのままフレームの時間に乗る
+
+const vk::DeviceSize minPayloadSize = 4 * 1024;
+const vk::DeviceSize defaultMaxPayloadSize = 512 * 1024 * 1024;
+const vk::DeviceSize stagingCapacity = 64 * 1024 * 1024;
+// ステージングリングに入りきらない大きさは、この大きさに分けて1つのバッチに追加する
+const vk::DeviceSize stagingChunkSize = 16 * 1024 * 1024;
+// 1つの大きさで送るバイト数の目安
+// 小さいものは回数を増やして計測の誤差を減らす
+const vk::DeviceSize targetBytesPerPayload = 256 * 1024 * 1024;
+const uint32_t minIterations = 3;
+const uint32_t maxIterations = 200;
+
+struct BenchmarkOptions
+{
+    vk::DeviceSize maxPayloadSize = defaultMaxPayloadSize;
+    // 0なら大きさに応じて決める
+    uint32_t iterations = 0;
+    uint32_t deviceIndex = 0;
+    bool csv = false;
+};
+
+struct BenchmarkResult
+{
+    std::string path;
+    vk::DeviceSize payloadSize = 0;
+    uint32_t iterations = 0;
+    double averageMs = 0.0;
+    double minMs = 0.0;
+    double maxMs = 0.0;
+    double cpuMs = 0.0;
+};
+
+bool parseBenchmarkOptions(int argc, char** argv, BenchmarkOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--csv")
+        {
+            options.csv = true;
+        }
+        else if (arg == "--max-size" && i + 1 < argc)
+        {
+            options.maxPayloadSize = vk::DeviceSize(std::strtoull(argv[++i], nullptr, 10)) * 1024 * 1024;
+        }
+        else if (arg == "--iterations" && i + 1 < argc)
+        {
+            options.iterations = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--device" && i + 1 < argc)
+        {
+            options.deviceIndex = uint32_t(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else
+        {
+            LOGERR("Unknown argument: " << arg);
+            return false;
+        }
+    }
+    if (options.maxPayloadSize < minPayloadSize)
+    {
+        LOGERR("--max-size must be at least 1 MB.");
+        return false;
+    }
+    return true;
+}
+
+// 呼び出したスレッドが使ったCPU時間(ミリ秒)
+// 待っている間の時間は含まれない
+double getThreadCpuTimeMs()
+{
+#if defined(_WIN32)
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+    uint64_t kernel = (uint64_t(kernelTime.dwHighDateTime) << 32) | kernelTime.dwLowDateTime;
+    uint64_t user = (uint64_t(userTime.dwHighDateTime) << 32) | userTime.dwLowDateTime;
+    // FILETIMEは100ナノ秒単位
+    return (kernel + user) / 10000.0;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+uint32_t getIterations(const BenchmarkOptions& options, vk::DeviceSize payloadSize)
+{
+    if (options.iterations != 0)
+    {
+        return options.iterations;
+    }
+    return uint32_t(std::clamp<vk::DeviceSize>(targetBytesPerPayload / payloadSize, minIterations, maxIterations));
+}
+
+// uploadはGPUでのコピーの完了まで待ってから戻るものとする
+// 最初の1回は初回だけの確保などが入るので計測に含めない
+BenchmarkResult measureUpload(const std::string& path, vk::DeviceSize payloadSize, uint32_t iterations, const std::function<void()>& upload)
+{
+    upload();
+
+    BenchmarkResult result;
+    result.path = path;
+    result.payloadSize = payloadSize;
+    result.iterations = iterations;
+    result.minMs = std::numeric_limits<double>::max();
+
+    double totalMs = 0.0;
+    double totalCpuMs = 0.0;
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        double cpuBegin = getThreadCpuTimeMs();
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        upload();
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        double cpuEnd = getThreadCpuTimeMs();
+
+        double ms = std::chrono::duration<double, std::milli>(end - begin).count();
+        totalMs += ms;
+        totalCpuMs += cpuEnd - cpuBegin;
+        result.minMs = std::min(result.minMs, ms);
+        result.maxMs = std::max(result.maxMs, ms);
+    }
+    result.averageMs = totalMs / iterations;
+    result.cpuMs = totalCpuMs / iterations;
+    return result;
+}
+
+void printBenchmarkHeader(const BenchmarkOptions& options)
+{
+    if (options.csv)
+    {
+        std::cout << "path,bytes,iterations,mb_per_s,latency_avg_ms,latency_min_ms,latency_max_ms,cpu_ms\n";
+        return;
+    }
+    std::cout << std::left << std::setw(20) << "path" << std::right
+        << std::setw(12) << "size" << std::setw(7) << "iter" << std::setw(12) << "MB/s"
+        << std::setw(12) << "avg ms" << std::setw(12) << "min ms" << std::setw(12) << "max ms" << std::setw(12) << "cpu ms" << "\n";
+}
+
+void printBenchmarkResult(const BenchmarkOptions& options, const BenchmarkResult& result)
+{
+    double mbPerSecond = result.payloadSize / 1000000.0 / (result.averageMs / 1000.0);
+    if (options.csv)
+    {
+        std::cout << result.path << "," << result.payloadSize << "," << result.iterations << "," << mbPerSecond << ","
+            << result.averageMs << "," << result.minMs << "," << result.maxMs << "," << result.cpuMs << "\n";
+        return;
+    }
+
+    std::string size = result.payloadSize >= 1024 * 1024 ? std::to_string(result.payloadSize / (1024 * 1024)) + " MB" : std::to_string(result.payloadSize / 1024) + " KB";
+    std::cout << std::left << std::setw(20) << result.path << std::right << std::fixed << std::setprecision(3)
+        << std::setw(12) << size << std::setw(7) << result.iterations << std::setw(12) << std::setprecision(1) << mbPerSecond
+        << std::setprecision(3) << std::setw(12) << result.averageMs << std::setw(12) << result.minMs << std::setw(12) << result.maxMs
+        << std::setw(12) << result.cpuMs << "\n";
+}
+
+// テクスチャと同じRGBA8のイメージ
+// payloadSizeのバイト数になるように、幅は4096までにして残りを高さにする
+// 高さがmaxDimensionを超える場合は、超えなくなるまで幅を広げる
+vk::ImageCreateInfo getBenchmarkImageCreateInfo(vk::DeviceSize payloadSize, uint32_t maxDimension, vk::ImageUsageFlags additionalUsage)
+{
+    uint32_t texelCount = uint32_t(payloadSize / 4);
+    uint32_t width = std::min<uint32_t>(texelCount, 4096);
+    while (texelCount / width > maxDimension && width * 2 <= maxDimension)
+    {
+        width *= 2;
+    }
+
+    vk::ImageCreateInfo imgCreateInfo;
+    imgCreateInfo.imageType = vk::ImageType::e2D;
+    imgCreateInfo.extent = vk::Extent3D(width, texelCount / width, 1);
+    imgCreateInfo.mipLevels = 1;
+    imgCreateInfo.arrayLayers = 1;
+    imgCreateInfo.format = vk::Format::eR8G8B8A8Unorm;
+    imgCreateInfo.tiling = vk::ImageTiling::eOptimal;
+    imgCreateInfo.initialLayout = vk::ImageLayout::eUndefined;
+    imgCreateInfo.usage = vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eSampled | additionalUsage;
+    imgCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+    imgCreateInfo.samples = vk::SampleCountFlagBits::e1;
+    return imgCreateInfo;
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkOptions options;
+    if (!parseBenchmarkOptions(argc, argv, options))
+    {
+        return EXIT_FAILURE;
+    }
+
+    std::shared_ptr<vk::ApplicationInfo> appInfo = getAppInfo();
+    // サーフェスを作らないので、インスタンスの拡張機能は有効化しない
+    std::shared_ptr<vk::UniqueInstance> instance = getInstance(*appInfo, {});
+
+    std::shared_ptr<std::vector<vk::PhysicalDevice>> physicalDevices = getPhysicalDevices(*instance);
+    if (options.deviceIndex >= physicalDevices->size())
+    {
+        LOGERR("Physical device " << options.deviceIndex << " is not available. (" << physicalDevices->size() << " devices)");
+        return EXIT_FAILURE;
+    }
+    vk::PhysicalDevice physicalDevice = (*physicalDevices)[options.deviceIndex];
+    uint32_t queueFamilyIndex = findGraphicsQueueFamilyIndex(physicalDevice);
+    LOG("device: " << physicalDevice.getProperties().deviceName.data());
+
+    // アプリと同じく、転送専用のキューファミリがあればそちらで送る
+    // コピーしたものは描画に使わないので、所有権は移さずに転送側で完結させる
+    std::optional<uint32_t> transferQueueFamilyIndex = findTransferQueueFamilyIndex(physicalDevice, queueFamilyIndex);
+    std::shared_ptr<vk::UniqueDevice> device = getHeadlessDevice(physicalDevice, queueFamilyIndex, transferQueueFamilyIndex);
+    uint32_t uploadQueueFamilyIndex = transferQueueFamilyIndex.value_or(queueFamilyIndex);
+    vk::Queue uploadQueue = device->get().getQueue(uploadQueueFamilyIndex, 0);
+    LOG("upload queue family: " << uploadQueueFamilyIndex);
+
+    std::shared_ptr<MemoryAllocator> memoryAllocator = getMemoryAllocator(*device, physicalDevice);
+    std::shared_ptr<StagingRing> stagingRing = getStagingRing(*device, uploadQueue, uploadQueueFamilyIndex, uploadQueueFamilyIndex, *memoryAllocator, stagingCapacity);
+    std::shared_ptr<HostMemoryImporter> hostMemoryImporter = getHostMemoryImporter(*device, physicalDevice);
+    std::shared_ptr<HostImageCopier> hostImageCopier = getHostImageCopier(*device, physicalDevice);
+    bool timelineSemaphoreSupported = isTimelineSemaphoreSupported(physicalDevice);
+
+    // 送るデータ
+    // 取り込みも試せるように、デコードした画像データと同じくページの境界に揃えて確保する
+    void* pSrcData = allocateImageData(options.maxPayloadSize);
+    if (pSrcData == nullptr)
+    {
+        LOGERR("Failed to allocate " << options.maxPayloadSize << " bytes of source data.");
+        return EXIT_FAILURE;
+    }
+    for (vk::DeviceSize i = 0; i < options.maxPayloadSize; i++)
+    {
+        static_cast<unsigned char*>(pSrcData)[i] = static_cast<unsigned char>(i * 31);
+    }
+
+    // 頂点バッファやインデックスバッファと同じく、DEVICE_LOCALなバッファに送る
+    vk::BufferCreateInfo dstBufferCreateInfo;
+    dstBufferCreateInfo.size = options.maxPayloadSize;
+    dstBufferCreateInfo.usage = vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst;
+    dstBufferCreateInfo.sharingMode = vk::SharingMode::eExclusive;
+    vk::UniqueBuffer dstBuffer = device->get().createBufferUnique(dstBufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+    vk::MemoryRequirements dstBufferMemReq = device->get().getBufferMemoryRequirements(dstBuffer.get());
+    std::shared_ptr<MemoryAllocation> dstBufferMem = memoryAllocator->allocate(dstBufferMemReq, deviceLocalMemoryRequest(), true);
+    device->get().bindBufferMemory(dstBuffer.get(), dstBufferMem->memory, dstBufferMem->offset);
+
+    // DEVICE_LOCALなメモリに直接書き込める環境では、アプリはステージングを経由せずmemcpyで書き込む
+    vk::UniqueBuffer directBuffer;
+    std::shared_ptr<MemoryAllocation> directBufferMem;
+    if (memoryAllocator->canUploadDirectly(dstBufferMemReq.memoryTypeBits))
+    {
+        directBuffer = device->get().createBufferUnique(dstBufferCreateInfo, getAllocationCallbacks(vk::ObjectType::eBuffer));
+        directBufferMem = memoryAllocator->allocate(device->get().getBufferMemoryRequirements(directBuffer.get()), directUploadMemoryRequest(), true);
+        device->get().bindBufferMemory(directBuffer.get(), directBufferMem->memory, directBufferMem->offset);
+    }
+
+    uint32_t maxImageDimension = physicalDevice.getProperties().limits.maxImageDimension2D;
+    vk::DeviceSize maxImageSize = vk::DeviceSize(maxImageDimension) * maxImageDimension * 4;
+
+    // コピーしたものは転送のキューの中でしか使わないので、転送のステージで待つ
+    vk::PipelineStageFlags dstStages = vk::PipelineStageFlagBits::eTransfer;
+    vk::AccessFlags dstAccess = vk::AccessFlagBits::eTransferRead;
+
+    printBenchmarkHeader(options);
+    for (vk::DeviceSize payloadSize = minPayloadSize; payloadSize <= options.maxPayloadSize; payloadSize *= 2)
+    {
+        uint32_t iterations = getIterations(options, payloadSize);
+        std::vector<BenchmarkResult> results;
+
+        // uploadVertexBufferなどと同じく、ステージングリングに書き込んでcopyBufferで送る
+        results.push_back(measureUpload("staging buffer", payloadSize, iterations, [&]()
+        {
+            UploadBatch uploadBatch(*stagingRing);
+            for (vk::DeviceSize offset = 0; offset < payloadSize; offset += stagingChunkSize)
+            {
+                vk::DeviceSize size = std::min(stagingChunkSize, payloadSize - offset);
+                uploadBatch.addBufferCopy(static_cast<char*>(pSrcData) + offset, size, dstBuffer.get(), offset, dstStages, dstAccess);
+            }
+            uploadBatch.submit().wait();
+        }));
+
+        // writeVertexBufferなどと同じく、マップしたメモリにmemcpyしてflushする
+        if (directBufferMem)
+        {
+            results.push_back(measureUpload("direct write", payloadSize, iterations, [&]()
+            {
+                std::memcpy(directBufferMem->pMapped, pSrcData, payloadSize);
+                flushMemoryAllocation(*directBufferMem, 0, payloadSize);
+            }));
+        }
+
+        // アップロードサービスに積み、最後のハンドルの完了を待つ
+        // サービスのスレッドはステージングリングを使うので、この計測の間だけ立てる
+        if (timelineSemaphoreSupported)
+        {
+            std::shared_ptr<UploadService> uploadService = getUploadService(*device, stagingRing);
+            results.push_back(measureUpload("upload service", payloadSize, iterations, [&]()
+            {
+                UploadHandle handle;
+                for (vk::DeviceSize offset = 0; offset < payloadSize; offset += stagingChunkSize)
+                {
+                    vk::DeviceSize size = std::min(stagingChunkSize, payloadSize - offset);
+                    handle = uploadService->enqueueBuffer(static_cast<char*>(pSrcData) + offset, size, dstBuffer.get(), offset, dstStages, dstAccess);
+                }
+                uploadService->wait(handle);
+                // 所有権を移さないのでバリアは記録されず、送信済みのバッチを手放すだけになる
+                vk::PipelineStageFlags waitStages;
+                uploadService->acquire(vk::CommandBuffer(), waitStages);
+            }));
+        }
+
+        // テクスチャの経路はイメージの縦横の上限に収まる大きさまで
+        // ステージングリングに入りきらないイメージは、addImageCopyが行ごとに分けて送る
+        if (payloadSize <= maxImageSize)
+        {
+            vk::ImageCreateInfo imgCreateInfo = getBenchmarkImageCreateInfo(payloadSize, maxImageDimension, vk::ImageUsageFlags());
+            vk::UniqueImage image = device->get().createImageUnique(imgCreateInfo, getAllocationCallbacks(vk::ObjectType::eImage));
+            std::shared_ptr<MemoryAllocation> imageMem = memoryAllocator->allocateForImage(image.get(), deviceLocalMemoryRequest());
+            device->get().bindImageMemory(image.get(), imageMem->memory, imageMem->offset);
+
+            // uploadImageBufferと同じく、ステージングリングに書き込んでcopyBufferToImageで送る
+            results.push_back(measureUpload("staging image", payloadSize, iterations, [&]()
+            {
+                UploadBatch uploadBatch(*stagingRing);
+                uploadBatch.addImageCopy(pSrcData, payloadSize, image.get(), imgCreateInfo.extent, 4, vk::ImageAspectFlagBits::eColor,
+                    vk::ImageLayout::eShaderReadOnlyOptimal, dstStages, dstAccess);
+                uploadBatch.submit().wait();
+            }));
+
+            // uploadImageDataと同じく、データをデバイスメモリとして取り込んでそこから直接コピーする
+            // 取り込みにかかる時間も含める
+            // 取り込んだものが破棄されても、送るデータはこちらが持っているので解放しない
+            if (hostMemoryImporter->isAvailable() && payloadSize % hostMemoryImporter->getAlignment() == 0)
+            {
+                results.push_back(measureUpload("host import image", payloadSize, iterations, [&]()
+                {
+                    std::shared_ptr<ImportedHostBuffer> imported = hostMemoryImporter->import(pSrcData, payloadSize, [](void*) {});
+                    if (!imported)
+                    {
+                        LOGERR("Failed to import host memory.");
+                        exit(EXIT_FAILURE);
+                    }
+                    UploadBatch uploadBatch(*stagingRing);
+                    uploadBatch.addImageCopy(imported->buffer.get(), 0, payloadSize, imported, image.get(), imgCreateInfo.extent, vk::ImageAspectFlagBits::eColor,
+                        vk::ImageLayout::eShaderReadOnlyOptimal, dstStages, dstAccess);
+                    uploadBatch.submit().wait();
+                    stagingRing->collect();
+                }));
+            }
+
+            // copyImageDataと同じく、VK_EXT_host_image_copyでCPUから直接書き込む
+            if (hostImageCopier->isSupported(imgCreateInfo))
+            {
+                vk::ImageCreateInfo hostImgCreateInfo = getBenchmarkImageCreateInfo(payloadSize, maxImageDimension, hostImageCopier->getImageUsage());
+                vk::UniqueImage hostImage = device->get().createImageUnique(hostImgCreateInfo, getAllocationCallbacks(vk::ObjectType::eImage));
+                std::shared_ptr<MemoryAllocation> hostImageMem = memoryAllocator->allocateForImage(hostImage.get(), deviceLocalMemoryRequest());
+                device->get().bindImageMemory(hostImage.get(), hostImageMem->memory, hostImageMem->offset);
+
+                results.push_back(measureUpload("host image copy", payloadSize, iterations, [&]()
+                {
+                    hostImageCopier->copy(pSrcData, payloadSize, hostImage.get(), hostImgCreateInfo.extent, vk::ImageAspectFlagBits::eColor, vk::ImageLayout::eShaderReadOnlyOptimal);
+                }));
+                hostImage.reset();
+            }
+
+            image.reset();
+        }
+
+        for (const BenchmarkResult& result : results)
+        {
+            printBenchmarkResult(options, result);
+        }
+    }
+
+    stagingRing->wait();
+    debugStagingRing(*stagingRing);
+    debugMemoryAllocatorStats(*memoryAllocator);
+
+    directBuffer.reset();
+    dstBuffer.reset();
+    freeImageData(pSrcData);
+
+    return EXIT_SUCCESS;
+}